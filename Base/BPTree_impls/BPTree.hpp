@@ -6,6 +6,10 @@
 #define BASE_BPTREE_HPP
 
 #include <cassert>
+#include <algorithm>
+#include <vector>
+#include <optional>
+#include <unordered_set>
 #include <utility>
 #include "tinyBackend/Base/Detail/config.hpp"
 
@@ -17,6 +21,16 @@
  *                   set_begin_block(Iter) 将 Iter 指向的节点设置为根节点。
  *                   create_index_block() / create_data_block() 创建一个 IndexBlock / DataBlock 节点。
  *                   erase_block(Iter) 删除 Iter 指向的节点（当 Iter 所依赖的节点对象被销毁时，将会传入被销毁对象的 self_iter()）。
+ *                   以下由 compact 使用:
+ *                   live_blocks() / total_blocks() 返回树中的块数（包括头块） / 文件的块数。
+ *                   take_free_block() 取出一个空闲块的块号（没有时返回 0），add_free_block(index) 将块号放回空闲块中。
+ *                   block_iter(index) 返回指向 index 块中节点的 Iter（不是节点时无效）。
+ *                   held_free_blocks() 返回 compact 在多次调用之间保留的空闲块（vector 的引用）。
+ *                   move_block(from, to) 将 from 节点移动到空闲的 to 块并返回指向 to 的 Iter。
+ *                   truncate(blocks) 截断文件尾部的空闲块，无法截断时返回 false。
+ *                   以下由 snapshot / read_snapshot 使用:
+ *                   snapshot() 返回树当前状态的快照。
+ *                   snapshot_scope(snapshot) 返回一个对象，其存在期间当前线程对这棵树的读取（包括 begin_block）都发生在快照上。
  *
  * Key: 能够通过 Iter 解应用、要求存在默认构造函数、复制构造函数、> < == != 比较方法。
  *
@@ -35,6 +49,7 @@
  *                   insert(Iter-location, Key Value) 在 location 之前的位置插入键值。
  *                   update(Iter Value) 更新 Iter 位置的 Value，返回 true 表示更新成功。
  *                   erase(Iter) 删除 Iter 位置的键值，返回 true 表示不需要调整该节点键值数量。
+ *                   can_erase(Iter) 返回删除 Iter 位置的键值时 erase(Iter) 的返回值，不修改节点（ConcurrentBPTree 使用）。
  *                   erase(Iter begin, Iter end) 删除 [begin, end) 范围的键值。
  *                   split(DataBlock& other, Key, Value) 当一个节点无法插入键值时使用，期望在插入键值的同时，
  *                      将原节点内的键值均分给 other一半，并且两个节点的键维持有序（other 中所有键均大于本节点）。
@@ -43,6 +58,8 @@
  *                   merge_keep_average(DataBlock&) 返回值大于0,两个节点会进行合并，等于0维持原状，小于0进行均分操作。
  *                   to_prev() to_next() 将本对象变为上一个 / 下一个节点。
  *                   have_prev() have_next() 判断是否有上一个 / 下一个节点。
+ *                   can_fill(Value, fill_factor) 返回 true 表示插入值后节点的占用比例不超过 fill_factor（bulk_load 使用）。
+ *                   link_next(DataBlock& next) 将 next 链接为本节点的下一个节点（bulk_load 使用）。
  *
  * indexBlock: B+树的索引节点，要求存在右值构造函数，能够通过 Iter.index_block(Impl &) 构造。
  *      需要调用的函数: begin() end() 返回 Iter 对象用来迭代该节点所拥有的键。
@@ -58,6 +75,8 @@
  *                   average(DataBlock& other) 与 other 均分键值（other 中所有键均大于本节点）。
  *                   merge(DataBlock& other) 将 other 的所有键合并到本节点中。
  *                   merge_keep_average(DataBlock&) 返回值大于0,两个节点会进行合并，等于0维持原状，小于0进行均分操作。
+ *                   can_fill(fill_factor) 返回 true 表示插入键后节点的占用比例不超过 fill_factor（bulk_load 使用）。
+ *                   update_target(Iter pos, Iter target) 将 pos 指向的子节点改为 target（compact 使用）。
  *
  * Iter: 迭代器，要求存在默认构造函数（表无效），复制函数。
  *      需要调用的函数: valid() true 表示该迭代器有效。
@@ -67,6 +86,7 @@
  *                   is_data_block(Impl&) 用于判断所指向的节点是否为 DataBlock。
  *                   data_block(Impl&) 返回指向的 DataBlock 对象。
  *                   index_block(Impl&) 返回指向的 IndexBlock 对象。
+ *                   index() 返回指向的节点的块号（compact 使用）。
  *
  * IterKey: 迭代器与值的集合，用来解决节点失效后保存其位置和需要的标识键。要求存在默认构造函数（无效时使用）。
  *
@@ -74,6 +94,9 @@
 
 namespace Base {
 
+    template <typename Impl>
+    class ConcurrentBPTree;
+
     template <typename Impl>
     class BPTree {
     public:
@@ -93,6 +116,8 @@ namespace Base {
         template <typename... Args>
         explicit BPTree(Args&&... args) : _impl(std::forward<Args>(args)...) {};
 
+        class Cursor;
+
         /// 查找对应值。
         Result find(const Key& key);
 
@@ -117,6 +142,24 @@ namespace Base {
         /// 从尾部开始查找，limit 为限制大小。
         ResultSet search_from_end(uint64 limit = MAX_ULLONG);
 
+        /// 返回指向第一个大于等于 key 的键值的游标。
+        Cursor seek(const Key& key);
+
+        /// 返回指向第一个键值的游标。
+        Cursor seek_first();
+
+        /// 返回指向最后一个键值的游标。
+        Cursor seek_last();
+
+        /// 按键升序遍历 [begin, end) 中满足 pred(key, value) 的键值并传入 fun(key, value)，
+        /// fun 返回 false 时提前结束，返回传入 fun 的数量。pred 直接作用于块中的数据，不满足的键值不会被复制。
+        template <typename Pred, typename Fun>
+        uint64 scan(const Key& begin, const Key& end, Pred pred, Fun fun);
+
+        /// 与 scan 相同，按键降序遍历。
+        template <typename Pred, typename Fun>
+        uint64 reverse_scan(const Key& begin, const Key& end, Pred pred, Fun fun);
+
         /// 更新对应键的值，键不存在或值长度过大会导致更新失败。
         bool update(const Key& key, const Value& value);
 
@@ -127,17 +170,52 @@ namespace Base {
         /// 插入对应键值，键已存在或 value 长度过大会导致插入失败。
         bool insert(const Key& key, const Value& value);
 
+        /// 批量插入 [begin, end) 中的 (Key, Value) 对，返回成功插入的数量，键已存在或值长度过大的会被跳过。
+        /// 落在同一个数据块中的连续键只查找一次路径并直接插入该块，需要分裂或更新索引键时才逐个插入，
+        /// 因此输入按键升序排列时效果最好（可以先用 parallel_sort 排序），无序的输入同样能够正确插入。
+        template <typename Iterator>
+        uint64 insert_batch(Iterator begin, Iterator end);
+
+        /// 从按键升序排列的 [begin, end) 中的 (Key, Value) 对构建空树，返回载入的数量，树不为空时返回 0。
+        /// 从左到右依次填满叶节点（占用比例不超过 fill_factor），再自底向上逐层构建索引节点，
+        /// 每个节点只创建并写入一次。不大于前一个键的键与长度过大的值会被跳过。
+        template <typename Iterator>
+        uint64 bulk_load(Iterator begin, Iterator end, double fill_factor = 1.0);
+
         /// 删除对应键值，键不存在删除失败。
         bool erase(const Key& key);
 
         /// 删除 [begin, end) 范围内的键值，范围内不存在元素会导致删除失败。
         bool erase(const Key& begin, const Key& end);
 
+        /// 树的层数（包括数据块所在的一层），空树为 0。
+        uint32 height();
+
+        /// 从文件尾部向前最多处理 max_blocks 个块（检查的节点与从空闲块链表中取出的块）：
+        /// 树中的节点移动到前面的空闲块中，其余的块确认空闲，然后截断文件尾部的空闲块。
+        /// 每个块只需要从根节点查找一次，I/O 与 max_blocks 成正比，可以分多次调用（见 BPTreeCompactor）。
+        /// 返回处理的块数，文件已经紧凑时不读取任何块，直接返回 0；尾部是记录空闲块的块或者前面没有空闲块时也返回 0。
+        /// 有快照时不截断文件，只移动节点并返回移动的节点数。
+        uint32 compact(uint32 max_blocks = MAX_UINT);
+
+        /// 创建树当前状态的快照（Impl::Snapshot），快照析构时释放。需要与修改操作互斥，但不需要等待其他快照上的读取。
+        auto snapshot() { return _impl.snapshot(); };
+
+        /// 在 snapshot 上执行只读操作 fun(BPTree&)，返回 fun 的返回值。
+        /// 可以与修改操作同时进行，fun 中看到的始终是创建快照时的树，fun 中只能查找，不能修改。
+        template <typename Snapshot, typename Fun>
+        auto read_snapshot(const Snapshot& snapshot, Fun fun) {
+            auto scope = _impl.snapshot_scope(snapshot);
+            return fun(*this);
+        };
+
         Impl& impl() { return _impl; };
 
         const Impl& impl() const { return _impl; };
 
     private:
+        friend class ConcurrentBPTree<Impl>;
+
         using DataBlock = typename Impl::DataBlock;
 
         using IndexBlock = typename Impl::IndexBlock;
@@ -148,6 +226,12 @@ namespace Base {
 
         Iter find_data(const Key& key);
 
+        /// 与 find_data 相同，upper 设为数据块之后第一个索引键（没有时不设置），数据块中的键都小于它。
+        Iter find_data(const Key& key, std::optional<Key>& upper);
+
+        /// 返回第一个（front 为 true）或最后一个数据块。
+        Iter edge_data(bool front);
+
         IterKey insert_impl(const Key& key, const Value& value,
                             Iter block_iter, State& state);
 
@@ -179,11 +263,57 @@ namespace Base {
 
         void erase_all_block(Iter begin, Iter end);
 
+        /// 用 node 的第一个键从根节点查找，node 在树中时返回 true，parent 设为其父节点（node 为根节点时无效）。
+        bool compact_locate(Iter node, Iter& parent);
+
     private:
         Impl _impl;
 
     };
 
+    /*
+     * 在数据块上移动的游标，同一时刻只引用一个 DataBlock，扫描任意长度的范围只占用常数内存。
+     * 游标存在期间不能修改这棵树（ConcurrentBPTree 中需要在 read 内使用）。
+     */
+    template <typename Impl>
+    class BPTree<Impl>::Cursor {
+    public:
+        Cursor() = default;
+
+        Cursor(Cursor&&) noexcept = default;
+
+        [[nodiscard]] bool valid() const { return _valid; };
+
+        const Key& key() const { return _iter.key(); };
+
+        const Value& value() const { return _iter.value(); };
+
+        Result get() const { return Result { _iter }; };
+
+        /// 移动到下一个键值，越过最后一个后游标失效。
+        void next();
+
+        /// 移动到上一个键值，越过第一个后游标失效。
+        void prev();
+
+    private:
+        std::optional<DataBlock> _block;
+
+        Iter _iter;
+
+        bool _valid = false;
+
+        friend class BPTree;
+
+        explicit Cursor(DataBlock&& block) : _valid(true) {
+            _block.emplace(std::move(block));
+        };
+
+        /// _iter 位于块尾时移动到下一个块的开头。
+        void settle();
+
+    };
+
 }
 
 namespace Base {
@@ -393,6 +523,71 @@ namespace Base {
         return results;
     }
 
+    template <typename Impl>
+    typename BPTree<Impl>::Cursor
+    BPTree<Impl>::seek(const Key& key) {
+        Iter iter = find_data(key);
+        if (!iter.valid()) return Cursor();
+        Cursor cursor(iter.data_block(_impl));
+        cursor._iter = cursor._block->lower_bound(key);
+        cursor.settle();
+        return cursor;
+    }
+
+    template <typename Impl>
+    typename BPTree<Impl>::Cursor
+    BPTree<Impl>::seek_first() {
+        Iter iter = edge_data(true);
+        if (!iter.valid()) return Cursor();
+        Cursor cursor(iter.data_block(_impl));
+        cursor._iter = cursor._block->begin();
+        cursor.settle();
+        return cursor;
+    }
+
+    template <typename Impl>
+    typename BPTree<Impl>::Cursor
+    BPTree<Impl>::seek_last() {
+        Iter iter = edge_data(false);
+        if (!iter.valid()) return Cursor();
+        Cursor cursor(iter.data_block(_impl));
+        cursor._iter = cursor._block->end();
+        cursor.prev();
+        return cursor;
+    }
+
+    template <typename Impl>
+    template <typename Pred, typename Fun>
+    uint64 BPTree<Impl>::scan(const Key& begin, const Key& end, Pred pred, Fun fun) {
+        uint64 count = 0;
+        if (!(begin < end)) return count;
+        for (Cursor cursor = seek(begin); cursor.valid() && cursor.key() < end; cursor.next()) {
+            if (!pred(cursor.key(), cursor.value())) continue;
+            ++count;
+            if (!fun(cursor.key(), cursor.value())) break;
+        }
+        return count;
+    }
+
+    template <typename Impl>
+    template <typename Pred, typename Fun>
+    uint64 BPTree<Impl>::reverse_scan(const Key& begin, const Key& end, Pred pred, Fun fun) {
+        uint64 count = 0;
+        if (!(begin < end)) return count;
+        Cursor cursor = [this, &end] {
+            Cursor last = seek(end);
+            if (!last.valid()) return seek_last();
+            last.prev();
+            return last;
+        }();
+        for (; cursor.valid() && !(cursor.key() < begin); cursor.prev()) {
+            if (!pred(cursor.key(), cursor.value())) continue;
+            ++count;
+            if (!fun(cursor.key(), cursor.value())) break;
+        }
+        return count;
+    }
+
     template <typename Impl>
     bool BPTree<Impl>::update(const Key& key, const Value& value) {
         if (!DataBlock::data_size_check(value))
@@ -452,6 +647,114 @@ namespace Base {
         return state == Success;
     }
 
+    template <typename Impl>
+    template <typename Iterator>
+    uint64 BPTree<Impl>::insert_batch(Iterator begin, Iterator end) {
+        uint64 inserted = 0;
+        while (begin != end) {
+            bool progress = false;
+            {
+                std::optional<Key> upper;
+                Iter iter = find_data((*begin).first, upper);
+                if (iter.valid()) {
+                    DataBlock data_block = iter.data_block(_impl);
+                    /// 小于块中第一个键的键需要更新索引键，交给 insert 处理。
+                    for (; begin != end; ++begin) {
+                        const auto& [key, value] = *begin;
+                        if (!(data_block.begin().key() < key) || (upper && !(key < *upper))) break;
+                        if (!DataBlock::data_size_check(value)) {
+                            progress = true;
+                            continue;
+                        }
+                        auto pos = data_block.lower_bound(key);
+                        if (pos != data_block.end() && pos.key() == key) {
+                            progress = true;
+                            continue;
+                        }
+                        if (!data_block.can_insert(value)) break;
+                        data_block.insert(pos, key, value);
+                        progress = true;
+                        ++inserted;
+                    }
+                }
+            }
+            if (!progress && begin != end) {
+                inserted += insert((*begin).first, (*begin).second);
+                ++begin;
+            }
+        }
+        return inserted;
+    }
+
+    template <typename Impl>
+    template <typename Iterator>
+    uint64 BPTree<Impl>::bulk_load(Iterator begin, Iterator end, double fill_factor) {
+        if (_impl.begin_block().valid()) return 0;
+        uint64 loaded = 0;
+        /// 当前层每个节点的第一个键与节点位置，即上一层的内容。
+        std::vector<std::pair<Key, Iter>> level;
+        {
+            /// 最后两个节点在结束时可能需要均分，它们的第一个键在此之前还不能确定。
+            std::optional<DataBlock> prev, cur;
+            Key last_key {};
+            for (; begin != end; ++begin) {
+                const auto& [key, value] = *begin;
+                if ((loaded > 0 && !(last_key < key)) || !DataBlock::data_size_check(value))
+                    continue;
+                if (!cur || (cur->begin() != cur->end() && !cur->can_fill(value, fill_factor))) {
+                    DataBlock next = _impl.create_data_block();
+                    if (cur) {
+                        cur->link_next(next);
+                        if (prev) level.emplace_back(prev->begin().key(), prev->self_iter());
+                        prev.reset();
+                        prev.emplace(std::move(*cur));
+                    }
+                    cur.reset();
+                    cur.emplace(std::move(next));
+                }
+                cur->insert(cur->end(), key, value);
+                last_key = key;
+                ++loaded;
+            }
+            if (!cur) return 0;
+            if (prev) {
+                if (prev->merge_keep_average(*cur) != 0) prev->average(*cur);
+                level.emplace_back(prev->begin().key(), prev->self_iter());
+            }
+            level.emplace_back(cur->begin().key(), cur->self_iter());
+        }
+
+        while (level.size() > 1) {
+            std::vector<std::pair<Key, Iter>> upper;
+            std::optional<IndexBlock> prev, cur;
+            uint32 cur_size = 0;
+            for (const auto& [key, iter] : level) {
+                /// 每个索引节点至少有两个子节点，保证每一层都在收缩。
+                if (!cur || (cur_size >= 2 && !cur->can_fill(fill_factor))) {
+                    IndexBlock next = _impl.create_index_block();
+                    if (cur) {
+                        if (prev) upper.emplace_back(prev->begin().key(), prev->self_iter());
+                        prev.reset();
+                        prev.emplace(std::move(*cur));
+                    }
+                    cur.reset();
+                    cur.emplace(std::move(next));
+                    cur_size = 0;
+                }
+                cur->insert(cur->end(), key, iter);
+                ++cur_size;
+            }
+            if (prev) {
+                if (prev->merge_keep_average(*cur) != 0) prev->average(*cur);
+                upper.emplace_back(prev->begin().key(), prev->self_iter());
+            }
+            upper.emplace_back(cur->begin().key(), cur->self_iter());
+            level.swap(upper);
+        }
+        _impl.set_begin_block(level.front().second);
+        return loaded;
+    }
+
     template <typename Impl>
     bool BPTree<Impl>::erase(const Key& key) {
         Iter iter = _impl.begin_block();
@@ -484,6 +787,165 @@ namespace Base {
         return state == Success;
     }
 
+    template <typename Impl>
+    uint32 BPTree<Impl>::height() {
+        Iter iter = _impl.begin_block();
+        if (!iter.valid()) return 0;
+        uint32 levels = 1;
+        if (iter.is_data_block(_impl)) return levels;
+        IndexBlock index_block = iter.index_block(_impl);
+        for (iter = index_block.begin(); !iter.is_data_block(_impl); iter = index_block.begin()) {
+            index_block = iter.index_block(_impl);
+            ++levels;
+        }
+        return levels + 1;
+    }
+
+    template <typename Impl>
+    uint32 BPTree<Impl>::compact(uint32 max_blocks) {
+        /// 不在树中也不在空闲块链表中的空闲块：之前的 compact 保留的、这次取出的与移动后留下的旧块。
+        /// 出现异常或者无法继续整理时全部放回链表。
+        struct Held {
+            Impl& impl;
+
+            std::vector<uint32> blocks;
+
+            /// 按降序放回，之后先分配块号小的块。
+            void restore() {
+                std::sort(blocks.begin(), blocks.end());
+                while (!blocks.empty()) {
+                    impl.add_free_block(blocks.back());
+                    blocks.pop_back();
+                }
+            };
+
+            ~Held() {
+                try {
+                    restore();
+                } catch (...) {}
+            };
+        } held { _impl, std::move(_impl.held_free_blocks()) };
+        _impl.held_free_blocks().clear();
+
+        uint32 target = _impl.live_blocks(), total = _impl.total_blocks();
+        if (total <= target || max_blocks == 0) return 0;
+
+        /// 块号不小于 target 的空闲块位于尾部，保留到被截断，前面的空闲块用于存放移动的节点。
+        /// 链表中的块没有顺序，可能需要多次调用才能取到前面的空闲块。
+        std::unordered_set<uint32> free_tail(held.blocks.begin(), held.blocks.end());
+        uint32 processed = 0, moves = 0;
+        auto take_destination = [&] () -> uint32 {
+            while (processed < max_blocks) {
+                uint32 index = _impl.take_free_block();
+                if (index == 0) return 0;
+                ++processed;
+                held.blocks.push_back(index);
+                if (index < target) return index;
+                free_tail.insert(index);
+            }
+            return 0;
+        };
+
+        /// [end, total) 中的块都已经空闲。
+        uint32 end = total;
+        while (end > target && processed < max_blocks) {
+            uint32 index = end - 1;
+            if (free_tail.count(index)) {
+                --end;
+                continue;
+            }
+            Iter node = _impl.block_iter(index);
+            if (!node.valid()) break;
+            Iter parent;
+            /// 不在树中的节点一定在空闲块链表中，截断之后它的块号失效（见 Impl::take_free_block）。
+            if (compact_locate(node, parent)) {
+                uint32 to = take_destination();
+                if (to == 0) break;
+                Iter iter = _impl.move_block(index, to);
+                held.blocks.back() = index;
+                ++moves;
+                if (!parent.valid()) {
+                    _impl.set_begin_block(iter);
+                } else {
+                    IndexBlock index_block = parent.index_block(_impl);
+                    for (Iter child = index_block.begin(); child != index_block.end(); ++child) {
+                        if (child.index() != index) continue;
+                        index_block.update_target(child, iter);
+                        break;
+                    }
+                }
+            }
+            ++processed;
+            --end;
+        }
+
+        /// 有快照时不截断，只移动节点。
+        if (end < total && !_impl.truncate(end)) {
+            held.restore();
+            return moves;
+        }
+        if (processed == 0) {
+            held.restore();
+            return 0;
+        }
+        std::vector<uint32> keep;
+        for (uint32 index : held.blocks) {
+            if (index >= end) continue;
+            if (index >= target) keep.push_back(index);
+            else _impl.add_free_block(index);
+        }
+        held.blocks.clear();
+        _impl.held_free_blocks() = std::move(keep);
+        return processed;
+    }
+
+    template <typename Impl>
+    bool BPTree<Impl>::compact_locate(Iter node, Iter& parent) {
+        Iter root = _impl.begin_block();
+        if (!root.valid()) return false;
+        if (root.index() == node.index()) {
+            parent = Iter();
+            return true;
+        }
+        /// 不是根节点的空节点不在树中（合并后被删除的节点）。
+        std::optional<Key> key;
+        if (node.is_data_block(_impl)) {
+            DataBlock block = node.data_block(_impl);
+            if (block.begin() != block.end()) key = block.begin().key();
+        } else {
+            IndexBlock block = node.index_block(_impl);
+            if (block.begin() != block.end()) key = block.begin().key();
+        }
+        if (!key || root.is_data_block(_impl)) return false;
+        IndexBlock index_block = root.index_block(_impl);
+        while (true) {
+            Iter iter = index_block.lower_bound(*key);
+            if (iter == index_block.end() ||
+            (iter != index_block.begin() && iter.key() > *key))
+                --iter;
+            if (iter.index() == node.index()) {
+                parent = index_block.self_iter();
+                return true;
+            }
+            if (iter.is_data_block(_impl)) return false;
+            index_block = iter.index_block(_impl);
+        }
+    }
+
+    template <typename Impl>
+    typename BPTree<Impl>::Iter
+    BPTree<Impl>::edge_data(bool front) {
+        Iter iter = _impl.begin_block();
+        if (!iter.valid() || iter.is_data_block(_impl)) return iter;
+        IndexBlock index_block = iter.index_block(_impl);
+        while (true) {
+            iter = front ? index_block.begin() : --index_block.end();
+            if (iter.is_data_block(_impl)) break;
+            index_block = iter.index_block(_impl);
+        }
+        return iter.data_block(_impl).self_iter();
+    }
+
     template <typename Impl>
     typename BPTree<Impl>::Iter
     BPTree<Impl>::find_data(const Key& key) {
@@ -506,6 +968,27 @@ namespace Base {
         return data_block.self_iter();
     }
 
+    template <typename Impl>
+    typename BPTree<Impl>::Iter
+    BPTree<Impl>::find_data(const Key& key, std::optional<Key>& upper) {
+        Iter iter = _impl.begin_block();
+        if (!iter.valid() || iter.is_data_block(_impl)) return iter;
+        IndexBlock index_block = iter.index_block(_impl);
+        while (true) {
+            iter = index_block.lower_bound(key);
+            if (iter == index_block.end() ||
+            (iter != index_block.begin() && iter.key() > key))
+                --iter;
+            /// 越靠下的索引键越接近，覆盖上层的结果。
+            Iter next = iter;
+            if (++next != index_block.end()) upper = next.key();
+            if (iter.is_data_block(_impl)) break;
+            index_block = iter.index_block(_impl);
+        }
+        DataBlock data_block = iter.data_block(_impl);
+        return data_block.self_iter();
+    }
+
     template <typename Impl>
     typename BPTree<Impl>::IterKey
     BPTree<Impl>::insert_impl(const Key& key, const Value& value,
@@ -824,6 +1307,36 @@ namespace Base {
         }
     }
 
+    template <typename Impl>
+    void BPTree<Impl>::Cursor::next() {
+        ++_iter;
+        settle();
+    }
+
+    template <typename Impl>
+    void BPTree<Impl>::Cursor::prev() {
+        if (_iter == _block->begin()) {
+            if (!_block->have_prev()) {
+                _valid = false;
+                return;
+            }
+            _block->to_prev();
+            _iter = _block->end();
+        }
+        --_iter;
+    }
+
+    template <typename Impl>
+    void BPTree<Impl>::Cursor::settle() {
+        if (_iter != _block->end()) return;
+        if (!_block->have_next()) {
+            _valid = false;
+            return;
+        }
+        _block->to_next();
+        _iter = _block->begin();
+    }
+
 }
 
 #endif
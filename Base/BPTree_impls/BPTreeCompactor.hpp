@@ -0,0 +1,58 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#ifndef BASE_BPTREECOMPACTOR_HPP
+#define BASE_BPTREECOMPACTOR_HPP
+
+#ifdef BASE_BPTREECOMPACTOR_HPP
+
+#include <functional>
+#include "tinyBackend/Base/ScheduledThread.hpp"
+
+namespace Base {
+
+    /*
+     * 在 ScheduledThread 上逐步整理 B+树文件（见 BPTree::compact）。
+     *
+     * 每个刷新周期调用一次 compact(blocks_per_step)，每次处理的块数不超过 blocks_per_step，
+     * 以此限制整理占用的 I/O，前台操作最多等待一次 compact。文件紧凑时 compact 不读取任何块。
+     * compact 需要自行保证线程安全，例如 ConcurrentBPTree::compact，或在外部互斥锁的保护下调用 BPTree::compact。
+     */
+    class BPTreeCompactor : public Scheduler {
+    public:
+        using Compact = std::function<uint32(uint32)>;
+
+        static std::shared_ptr<BPTreeCompactor> start(ScheduledThread& thread, Compact compact,
+                                                      uint32 blocks_per_step);
+
+        BPTreeCompactor(ScheduledThread& thread, Compact compact, uint32 blocks_per_step);
+
+        /// 返回之后 compact 不会再被调用，在 compact 引用的树销毁之前调用。
+        void stop();
+
+        /// 已经处理的块数（compact 返回值之和）。
+        [[nodiscard]] uint64 processed_blocks() const { return _processed.load(std::memory_order_relaxed); };
+
+        void invoke(void *arg) override;
+
+        void force_invoke() override;
+
+    private:
+        ScheduledThread *_thread;
+
+        Mutex _mutex;
+
+        Compact _compact;
+
+        uint32 _blocks_per_step;
+
+        std::atomic<uint64> _processed = 0;
+
+    };
+
+}
+
+#endif
+
+#endif //BASE_BPTREECOMPACTOR_HPP
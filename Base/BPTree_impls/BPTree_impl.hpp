@@ -7,6 +7,7 @@
 
 #ifdef BASE_BPTREE_IMPL_HPP
 
+#include <algorithm>
 #include "ResultSet_Impl.hpp"
 #include "DataBlock_Impl.hpp"
 #include "IndexBlock_Impl.hpp"
@@ -19,7 +20,8 @@ namespace Base {
     template <typename K, typename V>
     class BPTree_impl {
     public:
-        BPTree_impl(ScheduledThread& scheduled_thread, const char *filename, uint64 memory_size);
+        BPTree_impl(ScheduledThread& scheduled_thread, const char *filename, uint64 memory_size,
+                    BlockFile::Backend backend = BlockFile::Stdio);
 
         BPTree_impl(ScheduledThread& scheduled_thread, BlockFile&& _file, uint64 memory_size);
 
@@ -27,8 +29,33 @@ namespace Base {
 
         void flush() const { _scheduler->force_invoke(); };
 
-        static BlockFile open_file(const char *filename) {
-            return BlockFile(filename, true, true, Interpreter::BLOCK_SIZE);
+        /// 将头块、删除记录块与其他所有脏块写回并落盘，调用时不能有其他线程在操作这棵树。
+        void checkpoint();
+
+        /// 见 Impl_Scheduler::set_log。
+        void set_log(WriteAheadLog *log) { _scheduler->set_log(log); };
+
+        /// 见 Impl_Scheduler::set_prefetch。
+        void set_prefetch(uint32 depth) { _scheduler->set_prefetch(depth); };
+
+        [[nodiscard]] uint64 file_blocks() const { return _scheduler->file_blocks(); };
+
+        class Snapshot;
+
+        /// 创建树当前状态的快照，需要与修改操作互斥（见 BPTree::snapshot）。
+        Snapshot snapshot();
+
+        /// 返回的对象存在期间当前线程在 snapshot 上读取这棵树（见 BPTree::read_snapshot）。
+        Impl_Scheduler::SnapshotScope snapshot_scope(const Snapshot& snapshot);
+
+        /// 树中的块数（包括头块），紧凑的文件只包含这些块。
+        [[nodiscard]] uint32 live_blocks() const { return *_header.valid_blocks_size() + 1; };
+
+        /// 已经分配的块数，可能大于 file_blocks()（新的块尚未写回）。
+        [[nodiscard]] uint32 total_blocks() const { return _scheduler->total_blocks(); };
+
+        static BlockFile open_file(const char *filename, BlockFile::Backend backend = BlockFile::Stdio) {
+            return BlockFile(filename, true, true, Interpreter::BLOCK_SIZE, backend);
         };
 
         struct HeaderMessage {
@@ -94,6 +121,30 @@ namespace Base {
 
         void erase_block(Iter iter);
 
+        /// 以下用于 BPTree::compact。
+
+        /// 从空闲块链表中取出一个块，没有时返回 0。
+        /// 截断文件时仍在链表中的块号不小于文件的块数，已经失效，取出时直接丢弃。
+        /// 只有链表为空时文件才会变长，因此失效的块号不会与之后新增的块混淆。
+        uint32 take_free_block();
+
+        /// 返回 index 块中的节点（不一定在树中），是头块或记录空闲块的块时返回无效的 Iter。
+        Iter block_iter(uint32 index);
+
+        /// 将 from 块的内容移动到空闲的 to 块，数据块会同时修改相邻块的链接，返回指向 to 块的 Iter。
+        /// 指向 from 块的索引需要由调用者修改。
+        Iter move_block(uint32 from, uint32 to);
+
+        /// 截断文件尾部的 [blocks, total_blocks()) 块，这些块必须是空闲的，仍在空闲块链表中的块号之后被丢弃。
+        /// 有快照时快照可能还在读取这些块，不截断并返回 false。
+        bool truncate(uint32 blocks);
+
+        /// 将 index 加入空闲块链表，之后先分配后加入的块。
+        void add_free_block(uint32 index);
+
+        /// compact 在多次调用之间保留的、从空闲块链表中取出的尾部空闲块，析构时放回链表。
+        std::vector<uint32>& held_free_blocks() { return _held_free; };
+
         DataBlock create_data_block();
 
         IndexBlock create_index_block();
@@ -111,6 +162,9 @@ namespace Base {
 
         uint32 _deleted_record_index = 0;
 
+        /// 异常退出时这些块不在树中也不在空闲块链表中，它们位于文件尾部，之后的 compact 会将其截断。
+        std::vector<uint32> _held_free;
+
         bool _head_need_update = false, _deleted_record_need_update = false;
 
         void init();
@@ -119,10 +173,48 @@ namespace Base {
 
     };
 
+    /// 快照的句柄，析构时释放快照。
+    template <typename K, typename V>
+    class BPTree_impl<K, V>::Snapshot : NoCopy {
+    public:
+        Snapshot() = default;
+
+        Snapshot(Snapshot&& other) noexcept :
+            _scheduler(std::move(other._scheduler)), _epoch(other._epoch), _root(other._root) {};
+
+        Snapshot& operator=(Snapshot&& other) noexcept {
+            release();
+            _scheduler = std::move(other._scheduler);
+            _epoch = other._epoch;
+            _root = other._root;
+            return *this;
+        };
+
+        ~Snapshot() { release(); };
+
+        [[nodiscard]] bool valid() const { return _scheduler != nullptr; };
+
+        void release() {
+            if (_scheduler) _scheduler->release_snapshot(_epoch);
+            _scheduler.reset();
+        };
+
+    private:
+        friend class BPTree_impl;
+
+        std::shared_ptr<Impl_Scheduler> _scheduler;
+
+        uint64 _epoch = 0;
+
+        uint32 _root = 0;
+
+    };
+
     template <typename K, typename V>
     BPTree_impl<K, V>::BPTree_impl(ScheduledThread& scheduled_thread,
-                                   const char *filename, uint64 memory_size) :
-        _scheduler(std::make_shared<Impl_Scheduler>(scheduled_thread, filename, memory_size)) {
+                                   const char *filename, uint64 memory_size,
+                                   BlockFile::Backend backend) :
+        _scheduler(std::make_shared<Impl_Scheduler>(scheduled_thread, filename, memory_size, backend)) {
         init();
     }
 
@@ -134,6 +226,9 @@ namespace Base {
     }
 
     template <typename K, typename V> BPTree_impl<K, V>::~BPTree_impl() {
+        std::sort(_held_free.begin(), _held_free.end());
+        for (auto iter = _held_free.rbegin(); iter != _held_free.rend(); ++iter)
+            add_free_block(*iter);
         _scheduler->put_block(0, _head_need_update);
         if (_deleted_record_index != 0) {
             _scheduler->put_block(_deleted_record_index, _deleted_record_need_update);
@@ -142,9 +237,39 @@ namespace Base {
         _scheduler->_thread->remove_scheduler(_scheduler);
     }
 
+    template <typename K, typename V>
+    void BPTree_impl<K, V>::checkpoint() {
+        /// 头块与删除记录块一直被引用，invoke 不会写回，这里先归还再重新获取。
+        _scheduler->put_block(0, _head_need_update);
+        if (_deleted_record_index != 0)
+            _scheduler->put_block(_deleted_record_index, _deleted_record_need_update);
+        _head_need_update = _deleted_record_need_update = false;
+        _scheduler->invoke(nullptr);
+        _header.buffer = _scheduler->get_block(0, true);
+        if (_deleted_record_index != 0)
+            _deleted_record.buffer = _scheduler->get_block(_deleted_record_index, true);
+    }
+
+    template <typename K, typename V>
+    typename BPTree_impl<K, V>::Snapshot BPTree_impl<K, V>::snapshot() {
+        Snapshot snapshot;
+        snapshot._epoch = _scheduler->create_snapshot();
+        snapshot._root = *_header.begin_block_index();
+        snapshot._scheduler = _scheduler;
+        return snapshot;
+    }
+
+    template <typename K, typename V>
+    Impl_Scheduler::SnapshotScope BPTree_impl<K, V>::snapshot_scope(const Snapshot& snapshot) {
+        if (unlikely(snapshot._scheduler != _scheduler))
+            throw BPTreeRuntimeError("Attempting to read a snapshot of another BPTree.");
+        return Impl_Scheduler::SnapshotScope(*_scheduler, snapshot._epoch, snapshot._root);
+    }
+
     template <typename K, typename V>
     typename BPTree_impl<K, V>::Iter BPTree_impl<K, V>::begin_block() {
-        uint32 index = *_header.begin_block_index();
+        auto scope = _scheduler->snapshot_scope();
+        uint32 index = scope ? scope->root() : *_header.begin_block_index();
         if (index == 0) return Iter();
         void *buf = _scheduler->get_block(index, true);
         bool is_data_block = Interpreter::is_data_block(buf);
@@ -165,24 +290,91 @@ namespace Base {
         if (iter.is_data_block(*this))
             DataBlock::erase_block(*_scheduler, iter.index());
         --*_header.valid_blocks_size();
+        add_free_block(iter.index());
+    }
 
+    template <typename K, typename V>
+    uint32 BPTree_impl<K, V>::take_free_block() {
+        while (*_header.deleted_blocks_size() > 0) {
+            uint32 index = get_new_block_index();
+            _head_need_update = true;
+            if (index < _scheduler->total_blocks()) return index;
+        }
+        return 0;
+    }
+
+    template <typename K, typename V>
+    typename BPTree_impl<K, V>::Iter BPTree_impl<K, V>::block_iter(uint32 index) {
+        void *buf = _scheduler->get_block(index, true);
+        bool is_data_block = Interpreter::is_data_block(buf), is_index_block = Interpreter::is_index_block(buf);
+        _scheduler->put_block(index, false);
+        if (!is_data_block && !is_index_block) return {};
+        return Iter { true, is_data_block, index, nullptr };
+    }
+
+    template <typename K, typename V>
+    typename BPTree_impl<K, V>::Iter BPTree_impl<K, V>::move_block(uint32 from, uint32 to) {
+        void *src = _scheduler->get_block(from, true);
+        void *dest = _scheduler->get_block(to, false);
+        std::memcpy(dest, src, Interpreter::BLOCK_SIZE);
+        _scheduler->put_block(from, false);
+        bool is_data_block = Interpreter::is_data_block(dest);
+        uint32 prev = 0, next = 0;
+        if (is_data_block) {
+            Interpreter::DataBlockHelper helper { dest };
+            prev = *helper.prev_index();
+            next = *helper.next_index();
+        }
+        _scheduler->put_block(to, true);
+        if (prev != 0) {
+            Interpreter::DataBlockHelper helper { _scheduler->get_block(prev, true) };
+            _scheduler->before_update(prev, helper.buffer);
+            *helper.next_index() = to;
+            _scheduler->put_block(prev, true);
+        }
+        if (next != 0) {
+            Interpreter::DataBlockHelper helper { _scheduler->get_block(next, true) };
+            _scheduler->before_update(next, helper.buffer);
+            *helper.prev_index() = to;
+            _scheduler->put_block(next, true);
+        }
+        return Iter { true, is_data_block, to, nullptr };
+    }
+
+    template <typename K, typename V>
+    bool BPTree_impl<K, V>::truncate(uint32 blocks) {
+        if (_scheduler->has_snapshots()) return false;
+        _scheduler->truncate(blocks);
+        return true;
+    }
+
+    template <typename K, typename V>
+    void BPTree_impl<K, V>::add_free_block(uint32 index) {
+        /// 新的记录块使用最后一个空闲块，它在截断文件时失效的话直接用 index 替换。
         if (_deleted_record.buffer) {
+            if (!_deleted_record.can_add_deleted_block()
+                && _deleted_record.get_new_record_block_index() >= _scheduler->total_blocks()) {
+                *_deleted_record.get_pos_deleted_block(*_deleted_record.deleted_size() - 1) = index;
+                _deleted_record_need_update = true;
+                return;
+            }
             if (!_deleted_record.can_add_deleted_block()) {
                 uint32 new_record = _deleted_record.get_new_record_block_index();
-                if (_deleted_record_need_update)
-                    _scheduler->put_block(_deleted_record_index, true);
+                _scheduler->put_block(_deleted_record_index, _deleted_record_need_update);
                 _deleted_record.buffer = _scheduler->get_block(new_record, false);
                 _deleted_record.set_to_record_deleted_block();
                 *_deleted_record.last_index() = _deleted_record_index;
                 _deleted_record_index = new_record;
                 *_header.begin_record_block_index() = new_record;
             }
-            _deleted_record.add_deleted_block(iter.index());
+            _deleted_record.add_deleted_block(index);
             _deleted_record_need_update = true;
             ++*_header.deleted_blocks_size();
         } else {
             if (_header.can_add_deleted_block()) {
-                _header.add_deleted_block(iter.index());
+                _header.add_deleted_block(index);
+            } else if (_header.get_new_record_block_index() >= _scheduler->total_blocks()) {
+                *_header.get_pos_deleted_block(*_header.deleted_blocks_size() - 1) = index;
             } else {
                 uint32 new_record = _header.get_new_record_block_index();
                 _deleted_record.buffer = _scheduler->get_block(new_record, false);
@@ -190,7 +382,7 @@ namespace Base {
                 *_deleted_record.last_index() = 0;
                 _deleted_record_index = new_record;
                 *_header.begin_record_block_index() = new_record;
-                _deleted_record.add_deleted_block(iter.index());
+                _deleted_record.add_deleted_block(index);
                 _deleted_record_need_update = true;
                 ++*_header.deleted_blocks_size();
             }
@@ -202,9 +394,8 @@ namespace Base {
     typename BPTree_impl<K, V>::DataBlock BPTree_impl<K, V>::create_data_block() {
         ++*_header.valid_blocks_size();
         _head_need_update = true;
-        if (*_header.deleted_blocks_size() == 0)
-            return DataBlock(*_scheduler);
-        uint32 index = get_new_block_index();
+        uint32 index = take_free_block();
+        if (index == 0) return DataBlock(*_scheduler);
         void *buf = _scheduler->get_block(index, false);
         return DataBlock(*_scheduler, index, buf);
     }
@@ -214,9 +405,8 @@ namespace Base {
     BPTree_impl<K, V>::create_index_block() {
         ++*_header.valid_blocks_size();
         _head_need_update = true;
-        if (*_header.deleted_blocks_size() == 0)
-            return IndexBlock(*_scheduler);
-        uint32 index = get_new_block_index();
+        uint32 index = take_free_block();
+        if (index == 0) return IndexBlock(*_scheduler);
         void *buf = _scheduler->get_block(index, false);
         return IndexBlock(*_scheduler, index, buf);
     }
@@ -257,6 +447,7 @@ namespace Base {
             uint32 last = *_deleted_record.last_index();
             _scheduler->put_block(_deleted_record_index, false);
             _deleted_record_index = last;
+            *_header.begin_record_block_index() = last;
             if (last == 0) {
                 _deleted_record.buffer = nullptr;
             } else {
@@ -0,0 +1,516 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#ifndef BASE_CONCURRENTBPTREE_HPP
+#define BASE_CONCURRENTBPTREE_HPP
+
+#ifdef BASE_CONCURRENTBPTREE_HPP
+
+#include <memory>
+#include "BPTree.hpp"
+#include "tinyBackend/Base/Mutex.hpp"
+
+namespace Base {
+
+    /*
+     * 可以被多个线程同时访问的 BPTree。
+     *
+     * 两级锁存器：
+     *      结构锁存器（整棵树一个）保护根节点与所有索引节点。索引节点只在结构修改
+     *      （分裂、合并、更新索引键、根节点变化）时被修改，查找与只修改数据块的操作持有共享的结构锁存器，
+     *      从根节点向下查找时路径上的索引节点都不会变化，不需要在每个索引节点上再获取锁存器。
+     *      数据块锁存器（按块号分为 LATCH_STRIPES 组）保护数据块的内容：查找持有共享锁存器，
+     *      update、不需要分裂的 insert 与不需要合并的 erase 持有独占锁存器，修改不同数据块的线程互不阻塞。
+     * 数据块上的修改需要分裂、合并或者更新索引键时（键小于块中第一个键、删除块中第一个键、块将不足半满），
+     * 释放所有锁存器，在独占的结构锁存器下由 BPTree 重新执行。
+     *
+     * 数据块之间的链接只在结构修改时改变，范围查找沿链接移动时先释放当前块的锁存器再获取下一个块的，
+     * 每个线程同时最多持有一个数据块锁存器，正向与反向的范围查找不会死锁。
+     * 范围查找不是原子的，沿链接移动时其他线程可能已经修改了之后的数据块。
+     * scan / reverse_scan 的 fun 在持有锁存器时调用，不能修改这棵树。
+     *
+     * Impl 的块缓存需要能够被多个线程同时访问（例如 BPTree_impl 使用的 Impl_Scheduler），
+     * DataBlock 需要提供 can_erase(Iter)。
+     */
+    template <typename Impl>
+    class ConcurrentBPTree : NoCopy {
+    public:
+        using Tree = BPTree<Impl>;
+
+        using Key = typename Tree::Key;
+
+        using Value = typename Tree::Value;
+
+        using Result = typename Tree::Result;
+
+        using ResultSet = typename Tree::ResultSet;
+
+        static constexpr uint32 LATCH_STRIPES = 1024;
+
+        template <typename... Args>
+        explicit ConcurrentBPTree(Args&&... args) :
+            _tree(std::forward<Args>(args)...), _latches(new Latch[LATCH_STRIPES]) {};
+
+        Result find(const Key& key);
+
+        ResultSet find(const Key& begin, const Key& end, uint64 limit = MAX_ULLONG);
+
+        Result lower_bound(const Key& key);
+
+        Result upper_bound(const Key& key);
+
+        ResultSet above_or_equal(const Key& key, uint64 limit = MAX_ULLONG);
+
+        ResultSet below(const Key& key, uint64 limit = MAX_ULLONG);
+
+        ResultSet search_from_begin(uint64 limit = MAX_ULLONG);
+
+        ResultSet search_from_end(uint64 limit = MAX_ULLONG);
+
+        template <typename Pred, typename Fun>
+        uint64 scan(const Key& begin, const Key& end, Pred pred, Fun fun);
+
+        template <typename Pred, typename Fun>
+        uint64 reverse_scan(const Key& begin, const Key& end, Pred pred, Fun fun);
+
+        bool update(const Key& key, const Value& value);
+
+        template <typename Fun>
+        bool find_for_update(const Key& key, const Fun& fun);
+
+        bool insert(const Key& key, const Value& value);
+
+        /// 与 BPTree::insert_batch 相同，落在同一个数据块中的连续键只持有一次该块的独占锁存器。
+        template <typename Iterator>
+        uint64 insert_batch(Iterator begin, Iterator end);
+
+        bool erase(const Key& key);
+
+        template <typename Iterator>
+        uint64 bulk_load(Iterator begin, Iterator end, double fill_factor = 1.0) {
+            Lock l(_structure);
+            return _tree.bulk_load(begin, end, fill_factor);
+        };
+
+        bool erase(const Key& begin, const Key& end) {
+            Lock l(_structure);
+            return _tree.erase(begin, end);
+        };
+
+        uint32 compact(uint32 max_blocks = MAX_UINT) {
+            Lock l(_structure);
+            return _tree.compact(max_blocks);
+        };
+
+        /// 在独占的结构锁存器下执行只读操作 fun(Tree&)，例如使用 Tree::Cursor 遍历，期间其他操作都会等待。
+        /// 长时间的遍历应当在快照上进行。
+        template <typename Fun>
+        auto read(Fun fun) {
+            Lock l(_structure);
+            return fun(_tree);
+        };
+
+        /// 创建树当前状态的快照（见 BPTree::snapshot）。
+        auto snapshot() {
+            Lock l(_structure);
+            return _tree.snapshot();
+        };
+
+        /// 在快照上执行只读操作 fun(Tree&)，不持有树的锁存器，长时间的扫描不会阻塞修改操作。
+        template <typename Snapshot, typename Fun>
+        auto read(const Snapshot& snapshot, Fun fun) {
+            return _tree.read_snapshot(snapshot, fun);
+        };
+
+        /// 在独占的结构锁存器下执行 fun(Tree&)。
+        template <typename Fun>
+        auto write(Fun fun) {
+            Lock l(_structure);
+            return fun(_tree);
+        };
+
+    private:
+        using DataBlock = typename Tree::DataBlock;
+
+        using Iter = typename Tree::Iter;
+
+        struct alignas(64) Latch {
+            SharedMutex mutex;
+        };
+
+        /// 持有一个数据块的锁存器。
+        class LeafLatch : NoCopy {
+        public:
+            LeafLatch(ConcurrentBPTree& tree, const Iter& iter, bool exclusive) :
+                _tree(tree), _exclusive(exclusive) {
+                acquire(iter.index());
+            };
+
+            ~LeafLatch() { release(); };
+
+            /// 移动到相邻的数据块，先释放当前块的锁存器。
+            void move(DataBlock& block, bool forward) {
+                release();
+                forward ? block.to_next() : block.to_prev();
+                acquire(block.self_iter().index());
+            };
+
+        private:
+            ConcurrentBPTree& _tree;
+
+            SharedMutex *_latch = nullptr;
+
+            bool _exclusive;
+
+            void acquire(uint32 index) {
+                _latch = &_tree._latches[index % LATCH_STRIPES].mutex;
+                _exclusive ? _latch->lock() : _latch->lock_shared();
+            };
+
+            void release() {
+                _exclusive ? _latch->unlock() : _latch->unlock_shared();
+            };
+
+        };
+
+        SharedMutex _structure;
+
+        Tree _tree;
+
+        std::unique_ptr<Latch[]> _latches;
+
+    };
+
+}
+
+namespace Base {
+
+    template <typename Impl>
+    typename ConcurrentBPTree<Impl>::Result
+    ConcurrentBPTree<Impl>::find(const Key& key) {
+        SharedLock s(_structure);
+        Iter iter = _tree.find_data(key);
+        if (!iter.valid()) return Result {};
+        LeafLatch latch(*this, iter, false);
+        DataBlock data_block = iter.data_block(_tree.impl());
+        auto data_iter = data_block.lower_bound(key);
+        if (data_iter == data_block.end() || data_iter.key() > key)
+            return Result {};
+        return Result { data_iter };
+    }
+
+    template <typename Impl>
+    typename ConcurrentBPTree<Impl>::ResultSet
+    ConcurrentBPTree<Impl>::find(const Key& begin, const Key& end, uint64 limit) {
+        ResultSet results;
+        if (!(begin < end)) return results;
+        SharedLock s(_structure);
+        Iter iter = _tree.find_data(begin);
+        if (!iter.valid()) return results;
+        LeafLatch latch(*this, iter, false);
+        DataBlock data_block = iter.data_block(_tree.impl());
+        auto data_iter = data_block.lower_bound(begin);
+        while (limit > 0) {
+            if (data_iter == data_block.end()) {
+                if (!data_block.have_next()) break;
+                latch.move(data_block, true);
+                data_iter = data_block.begin();
+            }
+            if (!(data_iter.key() < end)) break;
+            results.add(data_iter);
+            ++data_iter;
+            --limit;
+        }
+        return results;
+    }
+
+    template <typename Impl>
+    typename ConcurrentBPTree<Impl>::Result
+    ConcurrentBPTree<Impl>::lower_bound(const Key& key) {
+        SharedLock s(_structure);
+        Iter iter = _tree.find_data(key);
+        if (!iter.valid()) return Result {};
+        LeafLatch latch(*this, iter, false);
+        DataBlock data_block = iter.data_block(_tree.impl());
+        auto data_iter = data_block.lower_bound(key);
+        if (data_iter == data_block.end()) {
+            if (!data_block.have_next()) return Result {};
+            latch.move(data_block, true);
+            data_iter = data_block.begin();
+        }
+        return Result { data_iter };
+    }
+
+    template <typename Impl>
+    typename ConcurrentBPTree<Impl>::Result
+    ConcurrentBPTree<Impl>::upper_bound(const Key& key) {
+        SharedLock s(_structure);
+        Iter iter = _tree.find_data(key);
+        if (!iter.valid()) return Result {};
+        LeafLatch latch(*this, iter, false);
+        DataBlock data_block = iter.data_block(_tree.impl());
+        auto data_iter = data_block.lower_bound(key);
+        while (true) {
+            if (data_iter == data_block.end()) {
+                if (!data_block.have_next()) return Result {};
+                latch.move(data_block, true);
+                data_iter = data_block.begin();
+            }
+            if (data_iter.key() > key) break;
+            ++data_iter;
+        }
+        return Result { data_iter };
+    }
+
+    template <typename Impl>
+    typename ConcurrentBPTree<Impl>::ResultSet
+    ConcurrentBPTree<Impl>::above_or_equal(const Key& key, uint64 limit) {
+        ResultSet results;
+        SharedLock s(_structure);
+        Iter iter = _tree.find_data(key);
+        if (!iter.valid()) return results;
+        LeafLatch latch(*this, iter, false);
+        DataBlock data_block = iter.data_block(_tree.impl());
+        for (auto data_iter = data_block.lower_bound(key); limit > 0; ++data_iter, --limit) {
+            if (data_iter == data_block.end()) {
+                if (!data_block.have_next()) break;
+                latch.move(data_block, true);
+                data_iter = data_block.begin();
+            }
+            results.add(data_iter);
+        }
+        return results;
+    }
+
+    template <typename Impl>
+    typename ConcurrentBPTree<Impl>::ResultSet
+    ConcurrentBPTree<Impl>::below(const Key& key, uint64 limit) {
+        ResultSet results;
+        SharedLock s(_structure);
+        Iter iter = _tree.edge_data(true);
+        if (!iter.valid()) return results;
+        LeafLatch latch(*this, iter, false);
+        DataBlock data_block = iter.data_block(_tree.impl());
+        for (auto data_iter = data_block.begin(); limit > 0; ++data_iter, --limit) {
+            if (data_iter == data_block.end()) {
+                if (!data_block.have_next()) break;
+                latch.move(data_block, true);
+                data_iter = data_block.begin();
+            }
+            if (!(data_iter.key() < key)) break;
+            results.add(data_iter);
+        }
+        return results;
+    }
+
+    template <typename Impl>
+    typename ConcurrentBPTree<Impl>::ResultSet
+    ConcurrentBPTree<Impl>::search_from_begin(uint64 limit) {
+        ResultSet results;
+        SharedLock s(_structure);
+        Iter iter = _tree.edge_data(true);
+        if (!iter.valid()) return results;
+        LeafLatch latch(*this, iter, false);
+        DataBlock data_block = iter.data_block(_tree.impl());
+        for (auto data_iter = data_block.begin(); limit > 0; ++data_iter, --limit) {
+            if (data_iter == data_block.end()) {
+                if (!data_block.have_next()) break;
+                latch.move(data_block, true);
+                data_iter = data_block.begin();
+            }
+            results.add(data_iter);
+        }
+        return results;
+    }
+
+    template <typename Impl>
+    typename ConcurrentBPTree<Impl>::ResultSet
+    ConcurrentBPTree<Impl>::search_from_end(uint64 limit) {
+        ResultSet results;
+        SharedLock s(_structure);
+        Iter iter = _tree.edge_data(false);
+        if (!iter.valid()) return results;
+        LeafLatch latch(*this, iter, false);
+        DataBlock data_block = iter.data_block(_tree.impl());
+        for (auto data_iter = data_block.end(); limit > 0; --limit) {
+            if (data_iter == data_block.begin()) {
+                if (!data_block.have_prev()) break;
+                latch.move(data_block, false);
+                data_iter = data_block.end();
+            }
+            results.add(--data_iter);
+        }
+        return results;
+    }
+
+    template <typename Impl>
+    template <typename Pred, typename Fun>
+    uint64 ConcurrentBPTree<Impl>::scan(const Key& begin, const Key& end, Pred pred, Fun fun) {
+        uint64 count = 0;
+        if (!(begin < end)) return count;
+        SharedLock s(_structure);
+        Iter iter = _tree.find_data(begin);
+        if (!iter.valid()) return count;
+        LeafLatch latch(*this, iter, false);
+        DataBlock data_block = iter.data_block(_tree.impl());
+        for (auto data_iter = data_block.lower_bound(begin);; ++data_iter) {
+            if (data_iter == data_block.end()) {
+                if (!data_block.have_next()) break;
+                latch.move(data_block, true);
+                data_iter = data_block.begin();
+            }
+            if (!(data_iter.key() < end)) break;
+            if (!pred(data_iter.key(), data_iter.value())) continue;
+            ++count;
+            if (!fun(data_iter.key(), data_iter.value())) break;
+        }
+        return count;
+    }
+
+    template <typename Impl>
+    template <typename Pred, typename Fun>
+    uint64 ConcurrentBPTree<Impl>::reverse_scan(const Key& begin, const Key& end, Pred pred, Fun fun) {
+        uint64 count = 0;
+        if (!(begin < end)) return count;
+        SharedLock s(_structure);
+        /// end 所在的数据块之前的块中的键都小于 end。
+        Iter iter = _tree.find_data(end);
+        if (!iter.valid()) return count;
+        LeafLatch latch(*this, iter, false);
+        DataBlock data_block = iter.data_block(_tree.impl());
+        for (auto data_iter = data_block.lower_bound(end);;) {
+            if (data_iter == data_block.begin()) {
+                if (!data_block.have_prev()) break;
+                latch.move(data_block, false);
+                data_iter = data_block.end();
+            }
+            --data_iter;
+            if (data_iter.key() < begin) break;
+            if (!pred(data_iter.key(), data_iter.value())) continue;
+            ++count;
+            if (!fun(data_iter.key(), data_iter.value())) break;
+        }
+        return count;
+    }
+
+    template <typename Impl>
+    bool ConcurrentBPTree<Impl>::update(const Key& key, const Value& value) {
+        if (!DataBlock::data_size_check(value))
+            return false;
+        SharedLock s(_structure);
+        Iter iter = _tree.find_data(key);
+        if (!iter.valid()) return false;
+        LeafLatch latch(*this, iter, true);
+        DataBlock data_block = iter.data_block(_tree.impl());
+        auto data_iter = data_block.lower_bound(key);
+        if (data_iter == data_block.end() || data_iter.key() != key) return false;
+        return data_block.update(data_iter, value);
+    }
+
+    template <typename Impl>
+    template <typename Fun>
+    bool ConcurrentBPTree<Impl>::find_for_update(const Key& key, const Fun& fun) {
+        SharedLock s(_structure);
+        Iter iter = _tree.find_data(key);
+        if (!iter.valid()) return false;
+        LeafLatch latch(*this, iter, true);
+        DataBlock data_block = iter.data_block(_tree.impl());
+        auto data_iter = data_block.lower_bound(key);
+        if (data_iter == data_block.end() || data_iter.key() != key) return false;
+        Value old_value = data_iter.value();
+        Value new_value = fun(old_value);
+        if (!DataBlock::data_size_check(new_value))
+            return false;
+        return data_block.update(data_iter, new_value);
+    }
+
+    template <typename Impl>
+    bool ConcurrentBPTree<Impl>::insert(const Key& key, const Value& value) {
+        if (!DataBlock::data_size_check(value))
+            return false;
+        {
+            SharedLock s(_structure);
+            Iter iter = _tree.find_data(key);
+            if (iter.valid()) {
+                LeafLatch latch(*this, iter, true);
+                DataBlock data_block = iter.data_block(_tree.impl());
+                auto pos = data_block.lower_bound(key);
+                if (pos != data_block.end() && pos.key() == key) return false;
+                /// 小于块中第一个键的键可能需要更新索引键。
+                if (data_block.begin() != data_block.end() && data_block.begin().key() < key
+                    && data_block.can_insert(value)) {
+                    data_block.insert(pos, key, value);
+                    return true;
+                }
+            }
+        }
+        Lock l(_structure);
+        return _tree.insert(key, value);
+    }
+
+    template <typename Impl>
+    template <typename Iterator>
+    uint64 ConcurrentBPTree<Impl>::insert_batch(Iterator begin, Iterator end) {
+        uint64 inserted = 0;
+        while (begin != end) {
+            bool progress = false;
+            {
+                SharedLock s(_structure);
+                std::optional<Key> upper;
+                Iter iter = _tree.find_data((*begin).first, upper);
+                if (iter.valid()) {
+                    LeafLatch latch(*this, iter, true);
+                    DataBlock data_block = iter.data_block(_tree.impl());
+                    for (; begin != end; ++begin) {
+                        const auto& [key, value] = *begin;
+                        if (!(data_block.begin().key() < key) || (upper && !(key < *upper))) break;
+                        if (!DataBlock::data_size_check(value)) {
+                            progress = true;
+                            continue;
+                        }
+                        auto pos = data_block.lower_bound(key);
+                        if (pos != data_block.end() && pos.key() == key) {
+                            progress = true;
+                            continue;
+                        }
+                        if (!data_block.can_insert(value)) break;
+                        data_block.insert(pos, key, value);
+                        progress = true;
+                        ++inserted;
+                    }
+                }
+            }
+            if (!progress && begin != end) {
+                inserted += insert((*begin).first, (*begin).second);
+                ++begin;
+            }
+        }
+        return inserted;
+    }
+
+    template <typename Impl>
+    bool ConcurrentBPTree<Impl>::erase(const Key& key) {
+        {
+            SharedLock s(_structure);
+            Iter iter = _tree.find_data(key);
+            if (!iter.valid()) return false;
+            LeafLatch latch(*this, iter, true);
+            DataBlock data_block = iter.data_block(_tree.impl());
+            auto pos = data_block.lower_bound(key);
+            if (pos == data_block.end() || pos.key() != key) return false;
+            /// 删除第一个键需要更新索引键，块不足半满时需要与相邻的块合并或均分。
+            if (pos != data_block.begin() && data_block.can_erase(pos)) {
+                data_block.erase(pos);
+                return true;
+            }
+        }
+        Lock l(_structure);
+        return _tree.erase(key);
+    }
+
+}
+
+#endif
+
+#endif //BASE_CONCURRENTBPTREE_HPP
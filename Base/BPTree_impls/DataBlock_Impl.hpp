@@ -38,6 +38,8 @@ namespace Base {
 
         bool erase(const Iter& iter);
 
+        [[nodiscard]] bool can_erase(const Iter& iter) const;
+
         void erase(const Iter& begin, const Iter& end);
 
         void merge(const DataBlock_Impl& other);
@@ -64,6 +66,10 @@ namespace Base {
 
         [[nodiscard]] bool can_insert(const Value& value) const;
 
+        [[nodiscard]] bool can_fill(const Value& value, double fill_factor) const;
+
+        void link_next(DataBlock_Impl& next);
+
         [[nodiscard]] bool have_prev() const;
 
         [[nodiscard]] bool have_next() const;
@@ -96,6 +102,13 @@ namespace Base {
                 throw BPTreeRuntimeError("Attempting to transform non-DataBlock to DataBlock.");
         };
 
+        /// 第一次修改块之前调用，有快照时 Impl_Scheduler 会先保存块的旧内容。
+        void mark_update() {
+            if (_need_update) return;
+            _impl->before_update(_index, _helper.buffer);
+            _need_update = true;
+        };
+
         static void move_other_block_data(DataBlock_Impl& dest, uint32 dest_pos,
                                           DataBlock_Impl& src, uint32 src_pos, uint32 size);
 
@@ -142,7 +155,7 @@ namespace Base {
 
     template <typename Key, typename Value>
     void DataBlock_Impl<Key, Value>::insert(const Iter& pos, const Key& key, const Value& value) {
-        _need_update = true;
+        mark_update();
         uint32 value_size = ValueChecker::get_size(value);
         auto dest = Interpreter::move_ptr(_helper.buffer, pos._index_or_offset);
         uint32 behind_size = *_helper.get_size() + DataBlockHelper::BeginPos - pos._index_or_offset;
@@ -159,20 +172,21 @@ namespace Base {
         if (new_size != old_size) {
             if (new_size - old_size > Interpreter::BLOCK_SIZE - *_helper.get_size() - DataBlockHelper::BeginPos)
                 return false;
+            mark_update();
             auto dest = Interpreter::move_ptr(val, new_size);
             uint32 behind_size = *_helper.get_size() + DataBlockHelper::BeginPos
                 - pos._index_or_offset - KeySize - old_size;
             std::memmove(dest, Interpreter::move_ptr(val, old_size), behind_size);
             *_helper.get_size() += new_size - old_size;
         }
-        _need_update = true;
+        mark_update();
         ValueChecker::write_to(val, value);
         return true;
     }
 
     template <typename Key, typename Value>
     bool DataBlock_Impl<Key, Value>::erase(const Iter& iter) {
-        _need_update = true;
+        mark_update();
         uint32 pair_size = KeySize + ValueChecker::get_size(iter.value());
         auto dest = Interpreter::move_ptr(_helper.buffer, iter._index_or_offset);
         uint32 behind_size = *_helper.get_size() + DataBlockHelper::BeginPos
@@ -182,9 +196,15 @@ namespace Base {
         return *_helper.get_size() > (Interpreter::BLOCK_SIZE - DataBlockHelper::BeginPos) / 2;
     }
 
+    template <typename Key, typename Value>
+    bool DataBlock_Impl<Key, Value>::can_erase(const Iter& iter) const {
+        uint32 pair_size = KeySize + ValueChecker::get_size(iter.value());
+        return *_helper.get_size() - pair_size > (Interpreter::BLOCK_SIZE - DataBlockHelper::BeginPos) / 2;
+    }
+
     template <typename Key, typename Value>
     void DataBlock_Impl<Key, Value>::erase(const Iter& begin, const Iter& end) {
-        _need_update = true;
+        mark_update();
         auto dest = Interpreter::move_ptr(_helper.buffer, begin._index_or_offset),
              src = Interpreter::move_ptr(_helper.buffer, end._index_or_offset);
         uint32 behind_size = *_helper.get_size() + DataBlockHelper::BeginPos - end._index_or_offset;
@@ -194,7 +214,8 @@ namespace Base {
 
     template <typename Key, typename Value>
     void DataBlock_Impl<Key, Value>::merge(const DataBlock_Impl& other) {
-        _need_update = true;
+        mark_update();
+        if (!other._need_update) _impl->before_update(other._index, other._helper.buffer);
         auto dest = Interpreter::move_ptr(_helper.buffer, *_helper.get_size()
                                           + DataBlockHelper::BeginPos);
         auto src = Interpreter::move_ptr(other._helper.buffer, DataBlockHelper::BeginPos);
@@ -205,8 +226,8 @@ namespace Base {
 
     template <typename Key, typename Value>
     void DataBlock_Impl<Key, Value>::split(DataBlock_Impl& new_block, const Key& key, const Value& value) {
-        _need_update = true;
-        new_block._need_update = true;
+        mark_update();
+        new_block.mark_update();
         if constexpr (ValueChecker::is_fixed) {
             constexpr uint32 pair_size = KeySize + size_helper<Value>::size;
             uint32 this_size = *_helper.get_size();
@@ -252,6 +273,7 @@ namespace Base {
         *new_block._helper.next_index() = *_helper.next_index();
         if (*_helper.next_index() > 0) {
             DataBlockHelper next { _impl->get_block(*_helper.next_index(), true) };
+            _impl->before_update(*_helper.next_index(), next.buffer);
             *next.prev_index() = new_block._index;
             _impl->put_block(*_helper.next_index(), true);
         }
@@ -316,17 +338,9 @@ namespace Base {
         uint32 begin = DataBlockHelper::BeginPos, end = begin + *_helper.get_size();
         if constexpr (ValueChecker::is_fixed) {
             constexpr uint32 len = KeySize + size_helper<Value>::size;
-            for (auto size = (end - begin) / len; size > 0; size = (end - begin) / len) {
-                auto mid = begin + (size / 2) * len;
-                if (*get_key(_helper.buffer, mid) < key) {
-                    begin = mid + len;
-                    continue;
-                }
-                end = mid;
-                if (*get_key(_helper.buffer, mid) == key)
-                    break;
-            }
-            return Iter(false, true, end, _helper.buffer);
+            uint32 pos = Interpreter::lower_bound(Interpreter::move_ptr(_helper.buffer, begin),
+                                                  (end - begin) / len, len, key);
+            return Iter(false, true, begin + pos * len, _helper.buffer);
         } else {
             while (begin < end && *get_key(_helper.buffer, begin) < key) {
                 begin += KeySize + ValueChecker::get_size(*get_value(_helper.buffer, begin));
@@ -343,6 +357,7 @@ namespace Base {
             _impl->put_block(old_index, _need_update);
         _need_put_back = true;
         _need_update = false;
+        _impl->prefetch(_index, false);
         _helper.buffer = _impl->get_block(_index, true);
         check_is_DataBlock(_helper.buffer);
     }
@@ -355,6 +370,7 @@ namespace Base {
             _impl->put_block(old_index, _need_update);
         _need_put_back = true;
         _need_update = false;
+        _impl->prefetch(_index, true);
         _helper.buffer = _impl->get_block(_index, true);
         check_is_DataBlock(_helper.buffer);
     }
@@ -380,6 +396,21 @@ namespace Base {
         return *_helper.get_size() + size + DataBlockHelper::BeginPos <= Interpreter::BLOCK_SIZE;
     }
 
+    template <typename Key, typename Value>
+    bool DataBlock_Impl<Key, Value>::can_fill(const Value& value, double fill_factor) const {
+        uint32 size = KeySize + ValueChecker::get_size(value);
+        return *_helper.get_size() + size <= (Interpreter::BLOCK_SIZE - DataBlockHelper::BeginPos) * fill_factor;
+    }
+
+    template <typename Key, typename Value>
+    void DataBlock_Impl<Key, Value>::link_next(DataBlock_Impl& next) {
+        mark_update();
+        next.mark_update();
+        *next._helper.prev_index() = _index;
+        *next._helper.next_index() = *_helper.next_index();
+        *_helper.next_index() = next._index;
+    }
+
     template <typename Key, typename Value>
     bool DataBlock_Impl<Key, Value>::have_prev() const {
         return *_helper.prev_index() != 0;
@@ -466,31 +497,31 @@ namespace Base {
         uint32 prev_index = *data._helper.prev_index(), next_index = *data._helper.next_index();
         if (prev_index != 0) {
             DataBlock_Impl prev(impl, prev_index);
+            prev.mark_update();
             *prev._helper.next_index() = next_index;
-            prev._need_update = true;
         }
         if (next_index != 0) {
             DataBlock_Impl next(impl, next_index);
+            next.mark_update();
             *next._helper.prev_index() = prev_index;
-            next._need_update = true;
         }
     }
 
     template <typename Key, typename Value>
     void DataBlock_Impl<Key, Value>::move_other_block_data(DataBlock_Impl& dest, uint32 dest_pos,
                                                            DataBlock_Impl& src, uint32 src_pos, uint32 size) {
+        dest.mark_update();
+        src.mark_update();
         uint32 dest_behind = *dest._helper.get_size() + DataBlockHelper::BeginPos - dest_pos;
         std::memmove(Interpreter::move_ptr(dest._helper.buffer, dest_pos + size),
                      Interpreter::move_ptr(dest._helper.buffer, dest_pos), dest_behind);
         std::memcpy(Interpreter::move_ptr(dest._helper.buffer, dest_pos),
                     Interpreter::move_ptr(src._helper.buffer, src_pos), size);
         *dest._helper.get_size() += size;
-        dest._need_update = true;
         uint32 src_behind = *src._helper.get_size() + DataBlockHelper::BeginPos - src_pos - size;
         std::memmove(Interpreter::move_ptr(src._helper.buffer, src_pos),
                      Interpreter::move_ptr(src._helper.buffer, src_pos + size), src_behind);
         *src._helper.get_size() -= size;
-        src._need_update = true;
     }
 
 }
@@ -0,0 +1,230 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#ifndef BASE_DURABLEBPTREE_HPP
+#define BASE_DURABLEBPTREE_HPP
+
+#ifdef BASE_DURABLEBPTREE_HPP
+
+#include <cstring>
+#include "BPTree.hpp"
+#include "BPTree_impl.hpp"
+#include "WriteAheadLog.hpp"
+
+namespace Base {
+
+    /*
+     * 带重做日志的 BPTree<BPTree_impl<K, V>>，修改操作先作用于树，再将逻辑记录追加到 filename.wal。
+     *
+     * sync 为 true 时操作返回前记录已经落盘，多个线程同时提交时共享一次落盘（组提交）；
+     * 为 false 时由之后的 sync() 或其他线程的提交一并完成。
+     * 日志超过 checkpoint_size 时进行检查点：写回所有脏块后切换日志头并清空日志。
+     * 打开时将树文件恢复到最后一个检查点，并重放之后的记录。
+     *
+     * 修改操作由一把读写锁的独占锁串行化，查找只持有共享锁，Key 与 Value 需要能够直接复制。
+     */
+    template <typename K, typename V>
+    class DurableBPTree : NoCopy {
+    public:
+        using Impl = BPTree_impl<K, V>;
+
+        using Tree = BPTree<Impl>;
+
+        using Key = K;
+
+        using Value = V;
+
+        using Result = typename Tree::Result;
+
+        using ResultSet = typename Tree::ResultSet;
+
+        static_assert(std::is_trivially_copyable_v<Key> && std::is_trivially_copyable_v<Value>,
+                      "DurableBPTree requires trivially copyable Key and Value");
+
+        DurableBPTree(ScheduledThread& scheduled_thread, const char *filename, uint64 memory_size,
+                      BlockFile::Backend backend = BlockFile::Stdio, uint64 checkpoint_size = 1 << 26);
+
+        ~DurableBPTree();
+
+        bool insert(const Key& key, const Value& value, bool sync = true);
+
+        bool update(const Key& key, const Value& value, bool sync = true);
+
+        bool erase(const Key& key, bool sync = true);
+
+        bool erase(const Key& begin, const Key& end, bool sync = true);
+
+        Result find(const Key& key) {
+            SharedLock l(_mutex);
+            return _tree.find(key);
+        };
+
+        /// 在锁的保护下执行只读操作 fun(Tree&)，修改不会被记录。
+        template <typename Fun>
+        auto read(Fun fun) {
+            SharedLock l(_mutex);
+            return fun(_tree);
+        };
+
+        /// 等待此前所有的修改落盘。
+        void sync() { _log.commit_all(); };
+
+        void checkpoint();
+
+        /// 打开时重放的记录数量。
+        [[nodiscard]] uint64 replayed_records() const { return _replayed; };
+
+    private:
+        enum Operation : uint8 { Insert, Update, Erase, EraseRange };
+
+        SharedMutex _mutex;
+
+        WriteAheadLog _log;
+
+        Tree _tree;
+
+        uint64 _checkpoint_size;
+
+        uint64 _replayed = 0;
+
+        static constexpr uint32 MAX_RECORD = 1 + sizeof(Key) +
+            (sizeof(Key) > sizeof(Value) ? sizeof(Key) : sizeof(Value));
+
+        static BlockFile restore_file(WriteAheadLog& log, const char *filename, BlockFile::Backend backend) {
+            BlockFile file = Impl::open_file(filename, backend);
+            log.restore(file);
+            return file;
+        };
+
+        template <typename Fun>
+        bool logged(Operation op, const Key& key, const void *arg, uint32 arg_size, bool sync, Fun fun);
+
+        void replay(const char *data, uint32 size);
+
+        void checkpoint_locked();
+
+    };
+
+    template <typename K, typename V>
+    DurableBPTree<K, V>::DurableBPTree(ScheduledThread& scheduled_thread, const char *filename,
+                                       uint64 memory_size, BlockFile::Backend backend,
+                                       uint64 checkpoint_size) :
+        _log(std::string(filename) + ".wal"),
+        _tree(scheduled_thread, restore_file(_log, filename, backend), memory_size),
+        _checkpoint_size(checkpoint_size) {
+        _tree.impl().set_log(&_log);
+        Lock l(_mutex);
+        _replayed = _log.replay([this] (uint64, const char *data, uint32 size) {
+            replay(data, size);
+        });
+        if (_replayed != 0) checkpoint_locked();
+    }
+
+    template <typename K, typename V>
+    DurableBPTree<K, V>::~DurableBPTree() {
+        Lock l(_mutex);
+        checkpoint_locked();
+    }
+
+    template <typename K, typename V>
+    bool DurableBPTree<K, V>::insert(const Key& key, const Value& value, bool sync) {
+        return logged(Insert, key, &value, sizeof(Value), sync, [&] {
+            return _tree.insert(key, value);
+        });
+    }
+
+    template <typename K, typename V>
+    bool DurableBPTree<K, V>::update(const Key& key, const Value& value, bool sync) {
+        return logged(Update, key, &value, sizeof(Value), sync, [&] {
+            return _tree.update(key, value);
+        });
+    }
+
+    template <typename K, typename V>
+    bool DurableBPTree<K, V>::erase(const Key& key, bool sync) {
+        return logged(Erase, key, nullptr, 0, sync, [&] {
+            return _tree.erase(key);
+        });
+    }
+
+    template <typename K, typename V>
+    bool DurableBPTree<K, V>::erase(const Key& begin, const Key& end, bool sync) {
+        return logged(EraseRange, begin, &end, sizeof(Key), sync, [&] {
+            return _tree.erase(begin, end);
+        });
+    }
+
+    template <typename K, typename V>
+    void DurableBPTree<K, V>::checkpoint() {
+        Lock l(_mutex);
+        checkpoint_locked();
+    }
+
+    template <typename K, typename V> template <typename Fun>
+    bool DurableBPTree<K, V>::logged(Operation op, const Key& key, const void *arg,
+                                     uint32 arg_size, bool sync, Fun fun) {
+        uint64 lsn;
+        {
+            Lock l(_mutex);
+            if (!fun()) return false;
+            char record[MAX_RECORD];
+            record[0] = op;
+            std::memcpy(record + 1, &key, sizeof(Key));
+            if (arg_size != 0)
+                std::memcpy(record + 1 + sizeof(Key), arg, arg_size);
+            lsn = _log.append(record, 1 + sizeof(Key) + arg_size);
+            /// 检查点之后此前的记录都已经体现在树文件中，commit 会直接返回。
+            if (_log.log_size() >= _checkpoint_size)
+                checkpoint_locked();
+        }
+        /// 等待落盘时不持有树的锁，其他线程可以继续修改并加入同一次落盘。
+        if (sync) _log.commit(lsn);
+        return true;
+    }
+
+    template <typename K, typename V>
+    void DurableBPTree<K, V>::replay(const char *data, uint32 size) {
+        if (size < 1 + sizeof(Key))
+            throw BPTreeFileError("Corrupted write ahead log record");
+        Key key;
+        std::memcpy(&key, data + 1, sizeof(Key));
+        const char *arg = data + 1 + sizeof(Key);
+        switch (data[0]) {
+            case Insert: {
+                Value value;
+                std::memcpy(&value, arg, sizeof(Value));
+                _tree.insert(key, value);
+                break;
+            }
+            case Update: {
+                Value value;
+                std::memcpy(&value, arg, sizeof(Value));
+                _tree.update(key, value);
+                break;
+            }
+            case Erase:
+                _tree.erase(key);
+                break;
+            case EraseRange: {
+                Key end;
+                std::memcpy(&end, arg, sizeof(Key));
+                _tree.erase(key, end);
+                break;
+            }
+            default:
+                throw BPTreeFileError("Corrupted write ahead log record");
+        }
+    }
+
+    template <typename K, typename V>
+    void DurableBPTree<K, V>::checkpoint_locked() {
+        _tree.impl().checkpoint();
+        _log.checkpoint(_tree.impl().file_blocks());
+    }
+
+}
+
+#endif
+
+#endif //BASE_DURABLEBPTREE_HPP
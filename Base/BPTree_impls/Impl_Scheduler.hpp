@@ -7,9 +7,15 @@
 
 #ifdef BASE_IMPL_SCHEDULER_HPP
 
+#include <map>
+#include <set>
+#include <memory>
+#include <unordered_map>
 #include "Interpreter.hpp"
 #include "BPTreeErrors.hpp"
-#include "tinyBackend/Base/LRUCache.hpp"
+#include "WriteAheadLog.hpp"
+#include "tinyBackend/Base/Thread.hpp"
+#include "tinyBackend/Base/ConcurrentLRUCache.hpp"
 #include "tinyBackend/Base/ScheduledThread.hpp"
 #include "tinyBackend/Base/Detail/BlockFile.hpp"
 #include "tinyBackend/Base/Buffer/BufferPool.hpp"
@@ -17,31 +23,106 @@
 
 namespace Base {
 
+    /// 块缓存，get_block / put_block 可以被多个线程同时调用（命中时只持有缓存分片的共享锁）。
     class Impl_Scheduler : public Scheduler {
     public:
         using Buffer = BufferPool::Buffer;
 
-        Impl_Scheduler(ScheduledThread &scheduled_thread, const char* filename, uint64 memory_size);
+        Impl_Scheduler(ScheduledThread &scheduled_thread, const char* filename, uint64 memory_size,
+                       BlockFile::Backend backend = BlockFile::Stdio);
 
         Impl_Scheduler(ScheduledThread &scheduled_thread, BlockFile &&file, uint64 memory_size);
 
-        ~Impl_Scheduler() override = default;
+        ~Impl_Scheduler() override;
 
         void invoke(void* arg) override;
 
         void force_invoke() override;
 
-        Mutex _mutex;
-
         ScheduledThread* _thread;
 
+        class SnapshotScope;
+
         std::pair<uint32, void *> get_block();
 
+        /// read_data 为 false 时块的内容将被整个覆盖，有快照时仍然会读入并保存旧内容。
+        /// 当前线程处于 SnapshotScope 中时返回块在快照中的内容的副本。
         void* get_block(uint32 index, bool read_data);
 
         void put_block(uint32 index, bool need_update);
 
-        uint32 total_blocks() const { return _cache._helper._total_blocks; };
+        /*
+         * 快照：写线程第一次修改一个块之前调用 before_update，有快照时先保存块的旧内容（每个快照之后每个块最多保存一次），
+         * 读线程在 SnapshotScope 中读取时，块在快照之后被修改过则使用保存的旧内容，否则复制当前的内容，
+         * 因此读线程不持有树的锁，看到的始终是创建快照时的树。
+         * 保存的旧内容在最早的快照之前的部分不再被使用，释放快照时回收。
+         */
+
+        /// 创建快照，返回快照的 epoch，需要与修改操作互斥。
+        uint64 create_snapshot();
+
+        void release_snapshot(uint64 epoch);
+
+        [[nodiscard]] bool has_snapshots() const { return _snapshot_count.load(std::memory_order_acquire) > 0; };
+
+        /// 即将修改 index 块（buf 为其当前内容），有快照时先保存旧内容。
+        void before_update(uint32 index, const void *buf);
+
+        /// 当前线程正在读取这个 Impl_Scheduler 的快照时返回对应的 SnapshotScope，否则返回 nullptr。
+        [[nodiscard]] const SnapshotScope* snapshot_scope() const {
+            return current_snapshot && current_snapshot->_scheduler == this ? current_snapshot : nullptr;
+        };
+
+        uint32 total_blocks() const { return _cache.helper()._total_blocks.load(std::memory_order_acquire); };
+
+        /// 设置后，块在检查点之后第一次原地覆盖前会先将旧内容写入 log。
+        void set_log(WriteAheadLog *log);
+
+        /// 当前树文件的块数。
+        uint64 file_blocks();
+
+        /// 丢弃 [blocks, total_blocks()) 中的块（不写回）并截断文件，这些块不能正在被引用。
+        /// 设置了 log 时先保存其中检查点之前已经存在的块的旧内容。
+        void truncate(uint32 blocks);
+
+        /// depth 大于 0 时启动预读线程，DataBlock 沿链接移动到相邻的块时，
+        /// 由预读线程沿同一方向读入之后的 depth 个块，顺序扫描时读文件与处理数据重叠进行。
+        /// 文件中相邻的块一次读入（bulk_load 构建的树中数据块是连续的）。
+        void set_prefetch(uint32 depth);
+
+        [[nodiscard]] uint32 prefetch_depth() const { return _prefetch_depth.load(std::memory_order_relaxed); };
+
+        /// 即将沿 forward 方向访问 index 块，index 不在缓存中时在当前线程一次读入之后的连续块，
+        /// 否则请求预读线程继续向后预读。只是提示，请求过多时较早的请求会被丢弃。
+        void prefetch(uint32 index, bool forward);
+
+        /// 在 [构造, 析构) 期间当前线程的 get_block 读取 epoch 快照中的块，期间只能读取，不能修改。
+        /// root 由调用者保存（快照时的根节点）。
+        class SnapshotScope : NoCopy {
+        public:
+            SnapshotScope(Impl_Scheduler& scheduler, uint64 epoch, uint32 root);
+
+            ~SnapshotScope();
+
+            [[nodiscard]] uint32 root() const { return _root; };
+
+        private:
+            friend class Impl_Scheduler;
+
+            Impl_Scheduler *_scheduler;
+
+            uint64 _epoch;
+
+            uint32 _root;
+
+            SnapshotScope *_outer;
+
+            /// 正在使用的块的副本与引用计数，引用归零的副本放入 _free 复用。
+            std::unordered_map<uint32, std::pair<std::unique_ptr<char[]>, uint32>> _blocks;
+
+            std::vector<std::unique_ptr<char[]>> _free;
+
+        };
 
     private:
         struct BlockMessage {
@@ -55,30 +136,117 @@ namespace Base {
             using Key = uint32;
             using Value = BufferPool::Buffer;
 
-            LRU_Helper(const char* filename, uint64 memory_size);
+            LRU_Helper(const char* filename, uint64 memory_size, BlockFile::Backend backend);
 
             LRU_Helper(BlockFile &&file, uint64 memory_size);
 
+            ~LRU_Helper();
+
+            /// 由 get 与 load 转发给 create。
+            struct CreateHint {
+                /// 是否需要块原有的内容
+                bool read = false;
+
+                /// 不为空时从这里复制块的内容而不读取文件（预读时一次读入的连续块），
+                /// 读入之后文件被写过（_write_count 与 write_count 不同）时仍然读取文件。
+                const char *copy_from = nullptr;
+
+                uint64 write_count = 0;
+            };
+
             [[nodiscard]] bool can_create(Key) const;
 
-            Value create(Key index);
+            Value create(Key index, const CreateHint &hint);
 
             void update(Key index, Value &buffer);
 
         private:
+            /// 旧内容还没有落盘的块最多暂存的数量，达到时一次落盘后写回。
+            static constexpr uint32 MAX_DEFERRED = 64;
+
+            void write_block(Key index, const void *data);
+
+            /// 保存 indexes 中需要保存的块的旧内容，sync 为 false 时不落盘，返回是否保存了旧内容。
+            bool save_before_images(const std::vector<Key> &indexes, bool sync = true);
+
+            /// 将旧内容落盘，然后写回暂存的块。
+            void flush_deferred();
+
             BufferPool _memory_pool;
 
             BlockFile _file;
 
-            uint32 _total_blocks = 0;
+            std::atomic<uint32> _total_blocks = 0;
+
+            uint64 _write_count = 0;
+
+            WriteAheadLog *_log = nullptr;
 
-            bool need_read_from_file = false;
+            /// 有旧内容还没有落盘
+            bool _unsynced = false;
+
+            /// 淘汰时旧内容还没有落盘的块，不能先于旧内容写入树文件，暂存到 flush_deferred。
+            std::map<Key, std::string> _deferred;
 
             friend class Impl_Scheduler;
 
         };
 
-        LRUCache<LRU_Helper> _cache;
+        ConcurrentLRUCache<LRU_Helper> _cache;
+
+        static constexpr uint32 MAX_PREFETCH_REQUESTS = 8;
+
+        std::atomic<uint32> _prefetch_depth = 0, _prefetch_calls = 0;
+
+        Mutex _prefetch_mutex;
+
+        Condition _prefetch_condition;
+
+        std::vector<std::pair<uint32, bool>> _prefetch_requests;
+
+        bool _prefetch_stop = false;
+
+        Thread _prefetch_thread;
+
+        Mutex _links_mutex;
+
+        /// 预读时从文件中读到的数据块的 { prev, next }，用于越过已经在缓存中的块。
+        /// 块之间的链接之后可能改变，因此只用于预读。
+        std::unordered_map<uint32, std::pair<uint32, uint32>> _prefetch_links;
+
+        void prefetch_chain(uint32 index, bool forward, uint32 depth);
+
+        void stop_prefetch();
+
+        struct BlockVersion {
+            /// 保存时的 epoch，大于该 epoch 之前创建的快照。
+            uint64 epoch;
+            std::unique_ptr<char[]> data;
+        };
+
+        Mutex _versions_mutex;
+
+        /// 块在各个快照之后第一次修改之前的内容，按 epoch 升序。
+        std::unordered_map<uint32, std::vector<BlockVersion>> _versions;
+
+        /// 未释放的快照的 epoch。
+        std::multiset<uint64> _snapshots;
+
+        uint64 _epoch = 1;
+
+        /// 最新的快照创建时的块数，之后分配的块不在任何快照中。
+        uint32 _snapshot_blocks = 0;
+
+        std::atomic<uint32> _snapshot_count = 0;
+
+        static thread_local SnapshotScope *current_snapshot;
+
+        void* snapshot_block(SnapshotScope& scope, uint32 index);
+
+        void snapshot_put_block(SnapshotScope& scope, uint32 index);
+
+        /// 将 index 块在 epoch 快照中的旧内容复制到 dest，快照之后块没有被修改过时返回 false。
+        bool copy_version(uint32 index, uint64 epoch, void *dest);
     };
 }
 
@@ -40,6 +40,9 @@ namespace Base {
 
         void update(const Iter& pos, const Key& key);
 
+        /// 将 pos 指向的子节点改为 target。
+        void update_target(const Iter& pos, const Iter& target);
+
         bool erase(const Iter& iter);
 
         void erase(const Iter& begin, const Iter& end);
@@ -64,6 +67,8 @@ namespace Base {
 
         [[nodiscard]] bool can_insert() const;
 
+        [[nodiscard]] bool can_fill(double fill_factor) const;
+
         static Key* get_key(void *buf, uint32 offset);
 
         static uint32* get_index(void *buf, uint32 offset);
@@ -88,6 +93,13 @@ namespace Base {
                 throw BPTreeRuntimeError("Attempting to transform non-IndexBlock to IndexBlock.");
         };
 
+        /// 第一次修改块之前调用，有快照时 Impl_Scheduler 会先保存块的旧内容。
+        void mark_update() {
+            if (_need_update) return;
+            _impl->before_update(_index, _helper.buffer);
+            _need_update = true;
+        };
+
         static void move_other_block_data(IndexBlock_Impl& dest, uint32 dest_pos,
                                           IndexBlock_Impl& src, uint32 src_pos, uint32 size);
     };
@@ -145,7 +157,7 @@ namespace Base {
 
     template <typename Key, typename Value>
     void IndexBlock_Impl<Key, Value>::insert(const Iter& pos, const Key& key, const Iter& target) {
-        _need_update = true;
+        mark_update();
         auto dest = Interpreter::move_ptr(_helper.buffer, pos._index_or_offset);
         uint32 behind_size = *_helper.get_size() + IndexBlockHelper::BeginPos - pos._index_or_offset;
         std::memmove(Interpreter::move_ptr(dest, PairSize), dest, behind_size);
@@ -156,13 +168,19 @@ namespace Base {
 
     template <typename Key, typename Value>
     void IndexBlock_Impl<Key, Value>::update(const Iter& pos, const Key& key) {
-        _need_update = true;
+        mark_update();
         KeyChecker::write_to(get_key(_helper.buffer, pos._index_or_offset), key);
     }
 
+    template <typename Key, typename Value>
+    void IndexBlock_Impl<Key, Value>::update_target(const Iter& pos, const Iter& target) {
+        mark_update();
+        *get_index(_helper.buffer, pos._index_or_offset) = target.index();
+    }
+
     template <typename Key, typename Value>
     bool IndexBlock_Impl<Key, Value>::erase(const Iter& iter) {
-        _need_update = true;
+        mark_update();
         auto dest = Interpreter::move_ptr(_helper.buffer, iter._index_or_offset);
         uint32 behind_size = *_helper.get_size() + IndexBlockHelper::BeginPos
             - iter._index_or_offset - PairSize;
@@ -173,7 +191,7 @@ namespace Base {
 
     template <typename Key, typename Value>
     void IndexBlock_Impl<Key, Value>::erase(const Iter& begin, const Iter& end) {
-        _need_update = true;
+        mark_update();
         auto dest = Interpreter::move_ptr(_helper.buffer, begin._index_or_offset),
              src = Interpreter::move_ptr(_helper.buffer, end._index_or_offset);
         uint32 behind_size = *_helper.get_size() + IndexBlockHelper::BeginPos - end._index_or_offset;
@@ -183,7 +201,8 @@ namespace Base {
 
     template <typename Key, typename Value>
     void IndexBlock_Impl<Key, Value>::merge(const IndexBlock_Impl& other) {
-        _need_update = true;
+        mark_update();
+        if (!other._need_update) _impl->before_update(other._index, other._helper.buffer);
         auto dest = Interpreter::move_ptr(_helper.buffer, *_helper.get_size()
                                           + IndexBlockHelper::BeginPos);
         auto src = Interpreter::move_ptr(other._helper.buffer, IndexBlockHelper::BeginPos);
@@ -242,19 +261,10 @@ namespace Base {
     template <typename Key, typename Value>
     typename IndexBlock_Impl<Key, Value>::Iter
     IndexBlock_Impl<Key, Value>::lower_bound(const Key& key) const {
-        uint32 begin = IndexBlockHelper::BeginPos, end = begin + *_helper.get_size();
-        for (auto size = (end - begin) / PairSize; size > 0; size = (end - begin) / PairSize) {
-            auto mid = begin + (size / 2) * PairSize;
-            if (*get_key(_helper.buffer, mid) < key) {
-                begin = mid + PairSize;
-                continue;
-            }
-            end = mid;
-            Key k = *get_key(_helper.buffer, mid);
-            if (*get_key(_helper.buffer, mid) == key)
-                break;
-        }
-        return Iter(false, false, end, _helper.buffer);
+        uint32 begin = IndexBlockHelper::BeginPos;
+        uint32 pos = Interpreter::lower_bound(Interpreter::move_ptr(_helper.buffer, begin),
+                                              *_helper.get_size() / PairSize, PairSize, key);
+        return Iter(false, false, begin + pos * PairSize, _helper.buffer);
     }
 
     template <typename Key, typename Value>
@@ -277,6 +287,11 @@ namespace Base {
         return *_helper.get_size() + PairSize + IndexBlockHelper::BeginPos <= Interpreter::BLOCK_SIZE;
     }
 
+    template <typename Key, typename Value>
+    bool IndexBlock_Impl<Key, Value>::can_fill(double fill_factor) const {
+        return *_helper.get_size() + PairSize <= (Interpreter::BLOCK_SIZE - IndexBlockHelper::BeginPos) * fill_factor;
+    }
+
     template <typename Key, typename Value>
     Key* IndexBlock_Impl<Key, Value>::get_key(void *buf, uint32 offset) {
         check_is_IndexBlock(buf);
@@ -312,18 +327,18 @@ namespace Base {
     template <typename Key, typename Value>
     void IndexBlock_Impl<Key, Value>::move_other_block_data(IndexBlock_Impl& dest, uint32 dest_pos,
                                                             IndexBlock_Impl& src, uint32 src_pos, uint32 size) {
+        dest.mark_update();
+        src.mark_update();
         uint32 dest_behind = *dest._helper.get_size() + IndexBlockHelper::BeginPos - dest_pos;
         std::memmove(Interpreter::move_ptr(dest._helper.buffer, dest_pos + size),
                      Interpreter::move_ptr(dest._helper.buffer, dest_pos), dest_behind);
         std::memcpy(Interpreter::move_ptr(dest._helper.buffer, dest_pos),
                     Interpreter::move_ptr(src._helper.buffer, src_pos), size);
         *dest._helper.get_size() += size;
-        dest._need_update = true;
         uint32 src_behind = *src._helper.get_size() + IndexBlockHelper::BeginPos - src_pos - size;
         std::memmove(Interpreter::move_ptr(src._helper.buffer, src_pos),
                      Interpreter::move_ptr(src._helper.buffer, src_pos + size), src_behind);
         *src._helper.get_size() -= size;
-        src._need_update = true;
     }
 
 }
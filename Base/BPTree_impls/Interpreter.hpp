@@ -99,6 +99,29 @@ namespace Base {
             *(uint32 *) pos = ptr;
         };
 
+        /// 在从 first 开始、间隔为 stride 的 count 个有序键中查找第一个不小于 key 的序号。
+        /// 无分支的二分查找（比较结果只决定下一步的位置），并预取下一步可能访问的两个键；
+        /// 剩余的键不超过 LINEAR_SEARCH 个时顺序计数，这些键通常位于相邻的一两个缓存行中。
+        template <typename Key>
+        static uint32 lower_bound(const void* first, uint32 count, uint32 stride, const Key& key) {
+            constexpr uint32 LINEAR_SEARCH = 8;
+            auto base = static_cast<const char *>(first);
+            auto key_at = [stride] (const char *ptr, uint32 n) -> const Key& {
+                return *(const Key *) (ptr + n * stride);
+            };
+            while (count > LINEAR_SEARCH) {
+                uint32 half = count / 2, next_half = (count - half) / 2;
+                __builtin_prefetch(base + next_half * stride);
+                __builtin_prefetch(base + (half + next_half) * stride);
+                base = key_at(base, half) < key ? base + half * stride : base;
+                count -= half;
+            }
+            uint32 pos = 0;
+            for (uint32 i = 0; i < count; ++i)
+                pos += key_at(base, i) < key;
+            return (base - static_cast<const char *>(first)) / stride + pos;
+        };
+
         static bool is_head_block(const void* buffer) {
             return (*(const uint8 *) buffer & 3) == 0;
         };
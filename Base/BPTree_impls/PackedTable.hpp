@@ -0,0 +1,431 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#ifndef BASE_PACKEDTABLE_HPP
+#define BASE_PACKEDTABLE_HPP
+
+#ifdef BASE_PACKEDTABLE_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "BPTreeErrors.hpp"
+#include "ResultSet_Impl.hpp"
+#include "tinyBackend/Base/Time/TimeInterval.hpp"
+#include "tinyBackend/Base/Detail/ioFile.hpp"
+#include "tinyBackend/Base/Detail/Checksum.hpp"
+#include "tinyBackend/Base/Detail/Compression.hpp"
+
+namespace Base {
+
+    /// PackedTable 中键相对于块内前一个键的编码，默认保存与前一个键相同的前导字节数与剩余的字节。
+    template <typename Key, typename = void>
+    struct PackedKeyCodec {
+        static void encode(std::string& dest, const Key& prev, const Key& key) {
+            auto left = (const char *) &prev, right = (const char *) &key;
+            uint32 shared = 0;
+            while (shared < sizeof(Key) && left[shared] == right[shared]) ++shared;
+            char buf[10];
+            dest.append(buf, put_varint(buf, shared));
+            dest.append(right + shared, sizeof(Key) - shared);
+        };
+
+        /// key 初始为前一个键。
+        static const char* decode(const char *ptr, const char *end, Key& key) {
+            uint64 shared;
+            ptr = get_varint(ptr, end, shared);
+            if (!ptr || shared > sizeof(Key) || (uint64) (end - ptr) < sizeof(Key) - shared)
+                return nullptr;
+            std::memcpy((char *) &key + shared, ptr, sizeof(Key) - shared);
+            return ptr + sizeof(Key) - shared;
+        };
+    };
+
+    /// 整数键保存与前一个键的差值（zigzag 变长整数），单调或接近单调的键通常只需要一两个字节。
+    template <typename Key>
+    struct PackedKeyCodec<Key, std::enable_if_t<std::is_integral_v<Key>>> {
+        static void encode(std::string& dest, const Key& prev, const Key& key) {
+            char buf[10];
+            dest.append(buf, put_varint(buf, zigzag_encode((int64) ((uint64) key - (uint64) prev))));
+        };
+
+        static const char* decode(const char *ptr, const char *end, Key& key) {
+            uint64 delta;
+            ptr = get_varint(ptr, end, delta);
+            if (ptr) key = (Key) ((uint64) key + (uint64) zigzag_decode(delta));
+            return ptr;
+        };
+    };
+
+    template <>
+    struct PackedKeyCodec<TimeInterval> {
+        static void encode(std::string& dest, const TimeInterval& prev, const TimeInterval& key) {
+            PackedKeyCodec<int64>::encode(dest, prev.nanoseconds, key.nanoseconds);
+        };
+
+        static const char* decode(const char *ptr, const char *end, TimeInterval& key) {
+            return PackedKeyCodec<int64>::decode(ptr, end, key.nanoseconds);
+        };
+    };
+
+    /*
+     * 只读的压缩有序表，用于不再修改的冷数据（例如不再写入的 BPTree 文件）。
+     *
+     * 文件: [Head][数据块...][BlockEntry * blocks][每个块的第一个键 * blocks]
+     * 数据块: 记录依次为 [相对于前一个键编码的键][Value]，整块再经过 lz_compress（压缩后不更小时保存原文）。
+     *
+     * 打开时将每个块的第一个键读入内存，查找只需要二分这些键并读取、解码一个块；
+     * Cursor 每次只解码一个块，顺序扫描任意长度的范围只占用一个块的内存。
+     */
+    template <typename K, typename V>
+    class PackedTable : NoCopy {
+    public:
+        using Key = K;
+
+        using Value = V;
+
+        using Result = Result_Impl<Key, Value>;
+
+        static_assert(std::is_trivially_copyable_v<Key> && std::is_trivially_copyable_v<Value>,
+                      "PackedTable requires trivially copyable Key and Value");
+
+        class Builder;
+
+        class Cursor;
+
+        explicit PackedTable(const std::string& path);
+
+        /// 将按键升序排列的 [begin, end) 中的 (Key, Value) 对写入 path，返回写入的数量，
+        /// 键不是严格升序时抛出 BPTreeRuntimeError（写入一半的文件没有有效的文件头）。
+        template <typename Iterator>
+        static uint64 build(const std::string& path, Iterator begin, Iterator end, uint32 block_size = 4096);
+
+        Result find(const Key& key) const;
+
+        Result lower_bound(const Key& key) const;
+
+        Cursor seek(const Key& key) const;
+
+        Cursor seek_first() const;
+
+        /// 与 BPTree::scan 相同。
+        template <typename Pred, typename Fun>
+        uint64 scan(const Key& begin, const Key& end, Pred pred, Fun fun) const;
+
+        [[nodiscard]] uint64 size() const { return _head.records; };
+
+        [[nodiscard]] uint32 blocks() const { return _head.blocks; };
+
+        [[nodiscard]] uint64 file_size() const;
+
+    private:
+        struct Head {
+            uint32 magic = MAGIC;
+            uint32 blocks = 0;
+            uint64 records = 0;
+            uint64 index_offset = 0;
+            uint32 key_size = sizeof(Key);
+            uint32 value_size = sizeof(Value);
+            uint32 index_crc = 0;
+            uint32 crc = 0;
+        };
+
+        struct BlockEntry {
+            uint64 offset;
+            uint32 stored_size;
+            uint32 raw_size;
+            uint32 records;
+            uint32 crc;
+        };
+
+        static constexpr uint32 MAGIC = 0x50544231;
+
+        ioFile _file;
+
+        Head _head;
+
+        std::vector<BlockEntry> _entries;
+
+        std::vector<Key> _first_keys;
+
+        static uint32 head_crc(const Head& head) {
+            return crc32(&head, offsetof(Head, crc));
+        };
+
+        /// 读取并解压第 block 个块到 raw。
+        void load_block(uint32 block, std::string& raw, std::string& stored) const;
+
+    };
+
+    /// 依次添加升序的键值，结束时需要调用 finish。
+    template <typename K, typename V>
+    class PackedTable<K, V>::Builder : NoCopy {
+    public:
+        /// block_size 为数据块解压后的目标大小。
+        explicit Builder(const std::string& path, uint32 block_size = 4096);
+
+        /// 键不大于前一个键时返回 false。
+        bool add(const Key& key, const Value& value);
+
+        /// 写入剩余的块、块索引与文件头并落盘，返回写入的数量。
+        uint64 finish();
+
+    private:
+        ioFile _file;
+
+        uint32 _block_size;
+
+        Head _head;
+
+        std::string _raw, _stored;
+
+        Key _last {};
+
+        uint32 _block_records = 0;
+
+        std::vector<BlockEntry> _entries;
+
+        std::vector<Key> _first_keys;
+
+        void flush_block();
+
+        void write(const void *data, uint64 size) {
+            if (_file.write(data, size) != size)
+                throw BPTreeFileError("Failed to write " + _file.get_path());
+        };
+
+    };
+
+    template <typename K, typename V>
+    class PackedTable<K, V>::Cursor {
+    public:
+        Cursor() = default;
+
+        [[nodiscard]] bool valid() const { return _valid; };
+
+        const Key& key() const { return _key; };
+
+        const Value& value() const { return _value; };
+
+        Result get() const { return Result { _key, _value }; };
+
+        void next();
+
+    private:
+        const PackedTable *_table = nullptr;
+
+        uint32 _block = 0, _left = 0;
+
+        std::string _raw, _stored;
+
+        /// 下一条记录在 _raw 中的偏移，Cursor 被复制或移动后仍然有效。
+        uint64 _pos = 0;
+
+        Key _key {};
+
+        Value _value {};
+
+        bool _valid = false;
+
+        friend class PackedTable;
+
+        void load(uint32 block);
+
+    };
+
+    template <typename K, typename V>
+    PackedTable<K, V>::PackedTable(const std::string& path) : _file(path.c_str(), true, true) {
+        if (!_file.is_open())
+            throw BPTreeFileError("Failed to open " + path);
+        if (!_file.seek_beg(0) || _file.read(sizeof(Head), &_head) != sizeof(Head)
+            || _head.magic != MAGIC || _head.crc != head_crc(_head))
+            throw BPTreeFileError("Invalid packed table " + path);
+        if (_head.key_size != sizeof(Key) || _head.value_size != sizeof(Value))
+            throw BPTreeFileError("Key or value size mismatch in " + path);
+        _entries.resize(_head.blocks);
+        _first_keys.resize(_head.blocks);
+        uint64 entries_size = _head.blocks * sizeof(BlockEntry), keys_size = _head.blocks * sizeof(Key);
+        if (!_file.seek_beg(_head.index_offset)
+            || _file.read(entries_size, _entries.data()) != entries_size
+            || _file.read(keys_size, _first_keys.data()) != keys_size
+            || crc32(_first_keys.data(), keys_size, crc32(_entries.data(), entries_size)) != _head.index_crc)
+            throw BPTreeFileError("Corrupted block index in " + path);
+    }
+
+    template <typename K, typename V>
+    template <typename Iterator>
+    uint64 PackedTable<K, V>::build(const std::string& path, Iterator begin, Iterator end, uint32 block_size) {
+        Builder builder(path, block_size);
+        for (; begin != end; ++begin) {
+            const auto& [key, value] = *begin;
+            if (!builder.add(key, value))
+                throw BPTreeRuntimeError("PackedTable::build: keys are not in ascending order in " + path);
+        }
+        return builder.finish();
+    }
+
+    template <typename K, typename V>
+    typename PackedTable<K, V>::Result PackedTable<K, V>::find(const Key& key) const {
+        Cursor cursor = seek(key);
+        if (!cursor.valid() || key < cursor.key()) return Result {};
+        return cursor.get();
+    }
+
+    template <typename K, typename V>
+    typename PackedTable<K, V>::Result PackedTable<K, V>::lower_bound(const Key& key) const {
+        Cursor cursor = seek(key);
+        if (!cursor.valid()) return Result {};
+        return cursor.get();
+    }
+
+    template <typename K, typename V>
+    typename PackedTable<K, V>::Cursor PackedTable<K, V>::seek(const Key& key) const {
+        Cursor cursor;
+        cursor._table = this;
+        if (_head.blocks == 0) return cursor;
+        /// 最后一个第一个键不大于 key 的块，之后的块都大于 key，最多需要进入下一个块的第一个键。
+        auto iter = std::upper_bound(_first_keys.begin(), _first_keys.end(), key);
+        cursor.load(iter == _first_keys.begin() ? 0 : iter - _first_keys.begin() - 1);
+        while (cursor.valid() && cursor.key() < key)
+            cursor.next();
+        return cursor;
+    }
+
+    template <typename K, typename V>
+    typename PackedTable<K, V>::Cursor PackedTable<K, V>::seek_first() const {
+        Cursor cursor;
+        cursor._table = this;
+        if (_head.blocks != 0) cursor.load(0);
+        return cursor;
+    }
+
+    template <typename K, typename V>
+    template <typename Pred, typename Fun>
+    uint64 PackedTable<K, V>::scan(const Key& begin, const Key& end, Pred pred, Fun fun) const {
+        uint64 count = 0;
+        if (!(begin < end)) return count;
+        for (Cursor cursor = seek(begin); cursor.valid() && cursor.key() < end; cursor.next()) {
+            if (!pred(cursor.key(), cursor.value())) continue;
+            ++count;
+            if (!fun(cursor.key(), cursor.value())) break;
+        }
+        return count;
+    }
+
+    template <typename K, typename V>
+    uint64 PackedTable<K, V>::file_size() const {
+        struct stat st {};
+        if (!_file.get_stat(&st)) return 0;
+        return st.st_size;
+    }
+
+    template <typename K, typename V>
+    void PackedTable<K, V>::load_block(uint32 block, std::string& raw, std::string& stored) const {
+        const BlockEntry& entry = _entries[block];
+        stored.resize(entry.stored_size);
+        /// pread 不移动文件位置，多个 Cursor 可以同时读取。
+        if (::pread(_file.get_fd(), stored.data(), entry.stored_size, entry.offset) != entry.stored_size
+            || crc32(stored.data(), stored.size()) != entry.crc)
+            throw BPTreeFileError("Corrupted block " + std::to_string(block) + " in " + _file.get_path());
+        if (entry.stored_size == entry.raw_size) {
+            raw.swap(stored);
+            return;
+        }
+        raw.resize(entry.raw_size);
+        if (!lz_decompress(stored.data(), stored.size(), raw.data(), raw.size()))
+            throw BPTreeFileError("Corrupted block " + std::to_string(block) + " in " + _file.get_path());
+    }
+
+    template <typename K, typename V>
+    PackedTable<K, V>::Builder::Builder(const std::string& path, uint32 block_size) :
+        _file(path.c_str(), false, true), _block_size(block_size) {
+        if (!_file.is_open())
+            throw BPTreeFileError("Failed to create " + path);
+        /// 文件头在 finish 时写入，未完成的文件不会被当作有效的表。
+        Head empty {};
+        empty.magic = 0;
+        write(&empty, sizeof(Head));
+        _head.index_offset = sizeof(Head);
+    }
+
+    template <typename K, typename V>
+    bool PackedTable<K, V>::Builder::add(const Key& key, const Value& value) {
+        if (_head.records > 0 && !(_last < key)) return false;
+        if (_block_records == 0) {
+            _first_keys.push_back(key);
+            _last = key;
+        }
+        PackedKeyCodec<Key>::encode(_raw, _last, key);
+        _raw.append((const char *) &value, sizeof(Value));
+        _last = key;
+        ++_block_records;
+        ++_head.records;
+        if (_raw.size() >= _block_size) flush_block();
+        return true;
+    }
+
+    template <typename K, typename V>
+    uint64 PackedTable<K, V>::Builder::finish() {
+        if (_block_records > 0) flush_block();
+        _head.blocks = _entries.size();
+        uint64 entries_size = _entries.size() * sizeof(BlockEntry), keys_size = _first_keys.size() * sizeof(Key);
+        write(_entries.data(), entries_size);
+        write(_first_keys.data(), keys_size);
+        _head.index_crc = crc32(_first_keys.data(), keys_size, crc32(_entries.data(), entries_size));
+        _head.crc = head_crc(_head);
+        _file.flush_to_disk();
+        if (!_file.seek_beg(0)) throw BPTreeFileError("Failed to seek " + _file.get_path());
+        write(&_head, sizeof(Head));
+        _file.flush_to_disk();
+        return _head.records;
+    }
+
+    template <typename K, typename V>
+    void PackedTable<K, V>::Builder::flush_block() {
+        _stored.clear();
+        lz_compress(_raw.data(), _raw.size(), _stored);
+        std::string& data = _stored.size() < _raw.size() ? _stored : _raw;
+        BlockEntry entry { _head.index_offset, (uint32) data.size(), (uint32) _raw.size(),
+                           _block_records, crc32(data.data(), data.size()) };
+        write(data.data(), data.size());
+        _entries.push_back(entry);
+        _head.index_offset += data.size();
+        _raw.clear();
+        _block_records = 0;
+    }
+
+    template <typename K, typename V>
+    void PackedTable<K, V>::Cursor::next() {
+        if (_left == 0) {
+            if (_block + 1 < _table->_head.blocks) load(_block + 1);
+            else _valid = false;
+            return;
+        }
+        const char *end = _raw.data() + _raw.size();
+        const char *ptr = PackedKeyCodec<Key>::decode(_raw.data() + _pos, end, _key);
+        if (!ptr || (uint64) (end - ptr) < sizeof(Value))
+            throw BPTreeFileError("Corrupted block " + std::to_string(_block) + " in " + _table->_file.get_path());
+        std::memcpy(&_value, ptr, sizeof(Value));
+        _pos = ptr + sizeof(Value) - _raw.data();
+        --_left;
+    }
+
+    template <typename K, typename V>
+    void PackedTable<K, V>::Cursor::load(uint32 block) {
+        _table->load_block(block, _raw, _stored);
+        _block = block;
+        _left = _table->_entries[block].records;
+        _pos = 0;
+        _key = _table->_first_keys[block];
+        _valid = true;
+        next();
+    }
+
+}
+
+#endif
+
+#endif //BASE_PACKEDTABLE_HPP
@@ -0,0 +1,148 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#ifndef BASE_WRITEAHEADLOG_HPP
+#define BASE_WRITEAHEADLOG_HPP
+
+#ifdef BASE_WRITEAHEADLOG_HPP
+
+#include <string>
+#include <vector>
+#include "BPTreeErrors.hpp"
+#include "tinyBackend/Base/Condition.hpp"
+#include "tinyBackend/Base/Detail/ioFile.hpp"
+#include "tinyBackend/Base/Detail/BlockFile.hpp"
+
+namespace Base {
+
+    /*
+     * B+树文件的重做日志与检查点。
+     *
+     * path 文件: 前 HEAD_AREA 字节为两个交替写入的检查点头（seq 较大且校验通过的有效），
+     *           之后为重做记录 [size][crc][lsn][payload]，内容由调用者定义。
+     * path.dwb 文件: 当前检查点之后第一次被原地覆盖的块的旧内容（before-image），
+     *           块在覆盖前必须先将旧内容写入并落盘。
+     *
+     * 恢复时先用 dwb 中属于当前检查点的旧内容覆盖树文件并截断到检查点时的块数，
+     * 使树文件回到检查点的状态（不论之后发生了多少次原地写或写到一半的块），再重放 lsn 大于检查点的记录。
+     *
+     * commit 为组提交：同一时刻只有一个线程写入并落盘，期间其他线程追加的记录由下一次落盘一并完成。
+     */
+    class WriteAheadLog : NoCopy {
+    public:
+        static constexpr uint64 HEAD_AREA = 1 << 12;
+
+        explicit WriteAheadLog(const std::string& path);
+
+        /// 将树文件恢复到检查点的状态，需要在打开树之前调用。
+        void restore(BlockFile& file);
+
+        /// 追加一条记录，返回其 lsn，记录只有在 commit 之后才保证持久化。
+        uint64 append(const void *data, uint32 size);
+
+        /// 等待 lsn 及之前的所有记录落盘。
+        void commit(uint64 lsn);
+
+        /// 等待所有已追加的记录落盘。
+        void commit_all();
+
+        /// 依次传入 lsn 大于检查点的记录 fun(lsn, data, size)，返回记录数量。
+        template <typename Fun>
+        uint64 replay(Fun fun);
+
+        /// 调用者需要保证此前追加的记录都已经体现在落盘的树文件中，tree_blocks 为此时树文件的块数。
+        void checkpoint(uint64 tree_blocks);
+
+        /// 树文件的 index 块在原地覆盖前是否需要先保存旧内容。
+        bool need_before_image(uint32 index);
+
+        void add_before_image(uint32 index, const void *block, uint32 size);
+
+        /// 将已添加的旧内容落盘。
+        void sync_before_images();
+
+        [[nodiscard]] uint64 checkpoint_lsn() const { return _head.checkpoint_lsn; };
+
+        /// 日志文件的大小（包括尚未写入的记录）。
+        [[nodiscard]] uint64 log_size();
+
+    private:
+        struct Head {
+            uint64 seq = 0;
+            uint64 checkpoint_lsn = 0;
+            uint64 tree_blocks = 0;
+        };
+
+        struct RecordHead {
+            uint32 size;
+            uint32 crc;
+            uint64 lsn;
+        };
+
+        struct ImageHead {
+            uint32 index;
+            uint32 crc;
+            uint64 seq;
+        };
+
+        static constexpr uint32 HEAD_MAGIC = 0x48574C42;
+
+        Mutex _mutex;
+
+        Condition _flushed;
+
+        ioFile _file;
+
+        Head _head;
+
+        /// 已追加但未写入文件的记录
+        std::string _buffer;
+
+        uint64 _end_offset = HEAD_AREA;
+
+        uint64 _next_lsn = 1, _durable_lsn = 0;
+
+        bool _flushing = false;
+
+        Mutex _image_mutex;
+
+        ioFile _images;
+
+        /// 当前检查点之后已经保存旧内容的块
+        std::vector<bool> _saved;
+
+        bool read_head();
+
+        void write_head(const Head& head);
+
+        /// 扫描重做记录，截断末尾不完整的记录。
+        void scan_records();
+
+        /// 读取 offset 处的记录，记录超出 limit（文件的末尾）或校验失败时返回 false。
+        bool read_record(uint64 offset, uint64 limit, RecordHead& head, std::string& payload);
+
+        void write_records(const std::string& data, uint64 offset);
+
+    };
+
+    template <typename Fun>
+    uint64 WriteAheadLog::replay(Fun fun) {
+        Lock l(_mutex);
+        uint64 count = 0;
+        RecordHead head {};
+        std::string payload;
+        for (uint64 offset = HEAD_AREA; offset < _end_offset; offset += sizeof(RecordHead) + head.size) {
+            if (!read_record(offset, _end_offset, head, payload)) break;
+            if (head.lsn <= _head.checkpoint_lsn) continue;
+            fun(head.lsn, payload.data(), head.size);
+            ++count;
+        }
+        return count;
+    }
+
+}
+
+#endif
+
+#endif //BASE_WRITEAHEADLOG_HPP
@@ -0,0 +1,43 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#include "../BPTreeCompactor.hpp"
+#include "tinyBackend/Base/Exception.hpp"
+
+using namespace Base;
+
+std::shared_ptr<BPTreeCompactor> BPTreeCompactor::start(ScheduledThread& thread, Compact compact,
+                                                        uint32 blocks_per_step) {
+    auto compactor = std::make_shared<BPTreeCompactor>(thread, std::move(compact), blocks_per_step);
+    thread.add_scheduler(compactor);
+    return compactor;
+}
+
+BPTreeCompactor::BPTreeCompactor(ScheduledThread& thread, Compact compact, uint32 blocks_per_step) :
+    _thread(&thread), _compact(std::move(compact)), _blocks_per_step(blocks_per_step) {}
+
+void BPTreeCompactor::stop() {
+    {
+        Lock l(_mutex);
+        if (!_compact) return;
+        _compact = nullptr;
+    }
+    _thread->remove_scheduler(shared_from_this());
+}
+
+void BPTreeCompactor::invoke(void *) {
+    force_invoke();
+}
+
+void BPTreeCompactor::force_invoke() {
+    Lock l(_mutex);
+    if (!_compact) return;
+    try {
+        _processed.fetch_add(_compact(_blocks_per_step), std::memory_order_relaxed);
+    } catch (const Exception& e) {
+        /// 不让异常离开 ScheduledThread，出错后不再整理。
+        CurrentThread::print_error_message(std::string("BPTreeCompactor stopped: ") + e.what());
+        _compact = nullptr;
+    }
+}
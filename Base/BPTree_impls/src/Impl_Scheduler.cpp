@@ -3,21 +3,37 @@
 //
 
 #include "../Impl_Scheduler.hpp"
+#include <algorithm>
 
 using namespace Base;
 
 Impl_Scheduler::Impl_Scheduler(ScheduledThread& scheduled_thread,
-                               const char *filename, uint64 memory_size) :
-    _thread(&scheduled_thread), _cache(filename, memory_size) {}
+                               const char *filename, uint64 memory_size, BlockFile::Backend backend) :
+    _thread(&scheduled_thread), _cache(filename, memory_size, backend) {}
 
 Impl_Scheduler::Impl_Scheduler(ScheduledThread& scheduled_thread,
                                BlockFile&& file, uint64 memory_size) :
     _thread(&scheduled_thread), _cache(std::move(file), memory_size) {}
 
+Impl_Scheduler::~Impl_Scheduler() {
+    stop_prefetch();
+}
+
+thread_local Impl_Scheduler::SnapshotScope *Impl_Scheduler::current_snapshot = nullptr;
+
 void Impl_Scheduler::invoke(void *arg) {
-    Lock l(_mutex);
+    if (_cache.with_helper([] (LRU_Helper& helper) { return helper._log != nullptr; })) {
+        /// 先将所有需要写回的块的旧内容一次落盘，之后的写回不需要再逐块落盘。
+        auto indexes = _cache.need_update_keys();
+        _cache.with_helper([&indexes] (LRU_Helper& helper) {
+            helper.save_before_images(indexes);
+        });
+    }
     _cache.update_all_with_order(std::less<>());
-    _cache._helper._file.flush_to_disk();
+    _cache.with_helper([] (LRU_Helper& helper) {
+        helper.flush_deferred();
+        helper._file.flush_to_disk();
+    });
 }
 
 void Impl_Scheduler::force_invoke() {
@@ -25,28 +41,264 @@ void Impl_Scheduler::force_invoke() {
 }
 
 std::pair<uint32, void *> Impl_Scheduler::get_block() {
-    Lock l(_mutex);
-    _cache._helper.need_read_from_file = false;
-    Buffer *ptr = _cache.get(_cache._helper._total_blocks);
-    return { _cache._helper._total_blocks++, ptr->data() };
+    uint32 index = _cache.with_helper([] (LRU_Helper& helper) {
+        return helper._total_blocks.fetch_add(1, std::memory_order_acq_rel);
+    });
+    Buffer *ptr = _cache.get(index, LRU_Helper::CreateHint { false });
+    return { index, ptr->data() };
 }
 
 void* Impl_Scheduler::get_block(uint32 index, bool read_data) {
-    assert(index < _cache._helper._total_blocks);
-    Lock l(_mutex);
-    _cache._helper.need_read_from_file = read_data;
-    Buffer *ptr = _cache.get(index);
+    assert(index < total_blocks());
+    if (unlikely(current_snapshot && current_snapshot->_scheduler == this))
+        return snapshot_block(*current_snapshot, index);
+    /// 被重新使用的块可能还在快照中，需要读入旧内容并保存。
+    bool save = !read_data && has_snapshots();
+    Buffer *ptr = _cache.get(index, LRU_Helper::CreateHint { read_data || save });
+    if (save) before_update(index, ptr->data());
     return ptr->data();
 }
 
+void Impl_Scheduler::set_log(WriteAheadLog *log) {
+    _cache.with_helper([log] (LRU_Helper& helper) { helper._log = log; });
+}
+
+uint64 Impl_Scheduler::file_blocks() {
+    return _cache.with_helper([] (LRU_Helper& helper) { return helper._file.total_blocks(); });
+}
+
+void Impl_Scheduler::truncate(uint32 blocks) {
+    uint32 total = total_blocks();
+    if (blocks >= total) return;
+    for (uint32 index = blocks; index < total; ++index)
+        _cache.erase(index);
+    _cache.with_helper([blocks, total] (LRU_Helper& helper) {
+        if (helper._log) {
+            std::vector<uint32> indexes;
+            for (uint32 index = blocks; index < total; ++index)
+                indexes.push_back(index);
+            helper.save_before_images(indexes);
+        }
+        helper.flush_deferred();
+        /// 预读线程已经读入的内容不能再使用。
+        ++helper._write_count;
+        helper._total_blocks.store(blocks, std::memory_order_release);
+        if (helper._file.total_blocks() > blocks && !helper._file.resize_file_total_blocks(blocks)) {
+            throw BPTreeRuntimeError("Failed to truncate file " + helper._file.get_path()
+                + " to " + std::to_string(blocks) + " blocks");
+        }
+    });
+}
+
+void Impl_Scheduler::set_prefetch(uint32 depth) {
+    Lock l(_prefetch_mutex);
+    _prefetch_depth.store(depth, std::memory_order_relaxed);
+    if (depth == 0 || _prefetch_thread.valid()) return;
+    _prefetch_thread = Thread(string("Impl_Scheduler_prefetch"), [this] {
+        std::vector<std::pair<uint32, bool>> requests;
+        while (true) {
+            {
+                Lock lock(_prefetch_mutex);
+                _prefetch_condition.wait(lock, [this] {
+                    return _prefetch_stop || !_prefetch_requests.empty();
+                });
+                if (_prefetch_stop) return;
+                requests.swap(_prefetch_requests);
+            }
+            for (auto [index, forward] : requests)
+                prefetch_chain(index, forward, prefetch_depth());
+            requests.clear();
+        }
+    });
+    _prefetch_thread.start();
+}
+
+void Impl_Scheduler::prefetch(uint32 index, bool forward) {
+    uint32 depth = prefetch_depth();
+    if (index == 0 || depth == 0) return;
+    if (!_cache.contains(index)) {
+        /// 即将访问的块还没有被预读时在当前线程一次读入，之后的块仍然交给预读线程。
+        prefetch_chain(index, forward, depth);
+        return;
+    }
+    /// 预读线程一次会读入之后的 depth 个块，不需要每访问一个块都唤醒它。
+    if (_prefetch_calls.fetch_add(1, std::memory_order_relaxed) % (depth / 4 + 1) != 0) return;
+    Lock l(_prefetch_mutex);
+    if (_prefetch_requests.size() == MAX_PREFETCH_REQUESTS)
+        _prefetch_requests.erase(_prefetch_requests.begin());
+    _prefetch_requests.emplace_back(index, forward);
+    _prefetch_condition.notify_one();
+}
+
+void Impl_Scheduler::prefetch_chain(uint32 index, bool forward, uint32 depth) {
+    {
+        /// 链接信息只是提示，表过大时直接清空。
+        Lock l(_links_mutex);
+        if (_prefetch_links.size() > (1 << 16)) _prefetch_links.clear();
+    }
+    /// 当前一次读入的连续块 [first, first + count)。
+    std::vector<char> run;
+    uint32 first = 0, count = 0;
+    uint64 write_count = 0;
+    for (; index != 0 && depth > 0; --depth) {
+        if (index >= total_blocks()) return;
+        if ((index < first || index >= first + count) && !_cache.contains(index)) {
+            /// 沿链接的相邻块通常在文件中也是相邻的（例如 bulk_load 构建的树），一次读入之后的 depth 个块。
+            /// Positional 与 Direct 可以与其他线程的读写并发，在 Helper 的锁外读取，不阻塞其他线程的未命中。
+            bool concurrent = false;
+            uint64 end = 0;
+            _cache.with_helper([&] (LRU_Helper& helper) {
+                end = std::min<uint64>(helper._file.total_blocks(), forward ? index + depth : index + 1);
+                if (forward) first = index;
+                else first = index < depth ? 1 : index + 1 - depth;
+                count = 0;
+                write_count = helper._write_count;
+                concurrent = helper._file.backend() == BlockFile::Positional
+                    || helper._file.backend() == BlockFile::Direct;
+                if (first >= end || concurrent) return;
+                run.resize((end - first) * Interpreter::BLOCK_SIZE);
+                count = helper._file.read(run.data(), first, end - first) / Interpreter::BLOCK_SIZE;
+            });
+            if (concurrent && first < end) {
+                run.resize((end - first) * Interpreter::BLOCK_SIZE);
+                count = _cache.helper()._file.concurrent_read(run.data(), first, end - first)
+                    / Interpreter::BLOCK_SIZE;
+            }
+        }
+        LRU_Helper::CreateHint hint { true };
+        if (index >= first && index < first + count) {
+            hint.copy_from = run.data() + (uint64) (index - first) * Interpreter::BLOCK_SIZE;
+            hint.write_count = write_count;
+        }
+        try {
+            _cache.load(index, [this, index] (const Buffer& buffer) {
+                if (!Interpreter::is_data_block(buffer.data())) return;
+                Interpreter::DataBlockHelper helper { (void *) buffer.data() };
+                Lock l(_links_mutex);
+                _prefetch_links[index] = { *helper.prev_index(), *helper.next_index() };
+            }, hint);
+        } catch (const Exception&) {
+            /// 块可能已经被删除或者缓存已满，放弃这次预读。
+            return;
+        }
+        Lock l(_links_mutex);
+        auto iter = _prefetch_links.find(index);
+        if (iter == _prefetch_links.end()) return;
+        index = forward ? iter->second.second : iter->second.first;
+    }
+}
+
+void Impl_Scheduler::stop_prefetch() {
+    {
+        Lock l(_prefetch_mutex);
+        _prefetch_stop = true;
+        _prefetch_condition.notify_one();
+    }
+    _prefetch_thread.join();
+}
+
 void Impl_Scheduler::put_block(uint32 index, bool need_update) {
-    assert(index < _cache._helper._total_blocks);
-    Lock l(_mutex);
+    if (unlikely(current_snapshot && current_snapshot->_scheduler == this)) {
+        snapshot_put_block(*current_snapshot, index);
+        return;
+    }
+    assert(index < total_blocks());
     _cache.put(index, need_update);
 }
 
-Impl_Scheduler::LRU_Helper::LRU_Helper(const char *filename, uint64 memory_size) :
-    _memory_pool(memory_size), _file(filename, true, true, Interpreter::BLOCK_SIZE) {
+uint64 Impl_Scheduler::create_snapshot() {
+    Lock l(_versions_mutex);
+    uint64 epoch = _epoch++;
+    _snapshots.insert(epoch);
+    _snapshot_blocks = total_blocks();
+    _snapshot_count.store(_snapshots.size(), std::memory_order_release);
+    return epoch;
+}
+
+void Impl_Scheduler::release_snapshot(uint64 epoch) {
+    Lock l(_versions_mutex);
+    auto iter = _snapshots.find(epoch);
+    assert(iter != _snapshots.end());
+    _snapshots.erase(iter);
+    _snapshot_count.store(_snapshots.size(), std::memory_order_release);
+    if (_snapshots.empty()) {
+        _versions.clear();
+        return;
+    }
+    /// epoch 不大于最早的快照的旧内容不再被任何快照使用。
+    uint64 oldest = *_snapshots.begin();
+    for (auto block = _versions.begin(); block != _versions.end();) {
+        auto& list = block->second;
+        auto end = std::find_if(list.begin(), list.end(), [oldest] (const BlockVersion& version) {
+            return version.epoch > oldest;
+        });
+        list.erase(list.begin(), end);
+        if (list.empty()) block = _versions.erase(block);
+        else ++block;
+    }
+}
+
+void Impl_Scheduler::before_update(uint32 index, const void *buf) {
+    if (likely(!has_snapshots())) return;
+    Lock l(_versions_mutex);
+    if (_snapshots.empty() || index >= _snapshot_blocks) return;
+    auto& list = _versions[index];
+    if (!list.empty() && list.back().epoch == _epoch) return;
+    list.push_back({ _epoch, std::make_unique<char[]>(Interpreter::BLOCK_SIZE) });
+    std::memcpy(list.back().data.get(), buf, Interpreter::BLOCK_SIZE);
+}
+
+void* Impl_Scheduler::snapshot_block(SnapshotScope& scope, uint32 index) {
+    auto& [data, refs] = scope._blocks[index];
+    if (refs++ > 0) return data.get();
+    if (!scope._free.empty()) {
+        data = std::move(scope._free.back());
+        scope._free.pop_back();
+    } else {
+        data = std::make_unique<char[]>(Interpreter::BLOCK_SIZE);
+    }
+    if (copy_version(index, scope._epoch, data.get())) return data.get();
+    Buffer *ptr = _cache.get(index, LRU_Helper::CreateHint { true });
+    std::memcpy(data.get(), ptr->data(), Interpreter::BLOCK_SIZE);
+    _cache.put(index, false);
+    /// 写线程总是先保存旧内容再修改，复制期间块被修改过时一定已经保存了旧内容，改用旧内容。
+    copy_version(index, scope._epoch, data.get());
+    return data.get();
+}
+
+void Impl_Scheduler::snapshot_put_block(SnapshotScope& scope, uint32 index) {
+    auto iter = scope._blocks.find(index);
+    assert(iter != scope._blocks.end());
+    if (--iter->second.second > 0) return;
+    scope._free.push_back(std::move(iter->second.first));
+    scope._blocks.erase(iter);
+}
+
+bool Impl_Scheduler::copy_version(uint32 index, uint64 epoch, void *dest) {
+    Lock l(_versions_mutex);
+    auto block = _versions.find(index);
+    if (block == _versions.end()) return false;
+    for (auto& version : block->second) {
+        if (version.epoch <= epoch) continue;
+        std::memcpy(dest, version.data.get(), Interpreter::BLOCK_SIZE);
+        return true;
+    }
+    return false;
+}
+
+Impl_Scheduler::SnapshotScope::SnapshotScope(Impl_Scheduler& scheduler, uint64 epoch, uint32 root) :
+    _scheduler(&scheduler), _epoch(epoch), _root(root), _outer(current_snapshot) {
+    current_snapshot = this;
+}
+
+Impl_Scheduler::SnapshotScope::~SnapshotScope() {
+    assert(current_snapshot == this);
+    current_snapshot = _outer;
+}
+
+Impl_Scheduler::LRU_Helper::LRU_Helper(const char *filename, uint64 memory_size,
+                                       BlockFile::Backend backend) :
+    _memory_pool(memory_size), _file(filename, true, true, Interpreter::BLOCK_SIZE, backend) {
     if (!_file.is_open())
         throw BPTreeFileError("Failed to open file " + std::string(filename));
     _total_blocks = _file.total_blocks();
@@ -61,14 +313,27 @@ Impl_Scheduler::LRU_Helper::LRU_Helper(BlockFile&& file, uint64 memory_size) :
     _total_blocks = _file.total_blocks();
 }
 
+Impl_Scheduler::LRU_Helper::~LRU_Helper() {
+    try {
+        flush_deferred();
+    } catch (const Exception& e) {
+        CurrentThread::print_error_message(e.what());
+    }
+}
+
 bool Impl_Scheduler::LRU_Helper::can_create(Key) const {
     return _memory_pool.max_block() >= Interpreter::BLOCK_SIZE;
 }
 
 Impl_Scheduler::LRU_Helper::Value
-Impl_Scheduler::LRU_Helper::create(Key index) {
+Impl_Scheduler::LRU_Helper::create(Key index, const CreateHint& hint) {
     Value buffer = _memory_pool.get(Interpreter::BLOCK_SIZE);
-    if (need_read_from_file) {
+    auto deferred = hint.read ? _deferred.find(index) : _deferred.end();
+    if (deferred != _deferred.end()) {
+        std::memcpy(buffer.data(), deferred->second.data(), Interpreter::BLOCK_SIZE);
+    } else if (hint.read && hint.copy_from && hint.write_count == _write_count) {
+        std::memcpy(buffer.data(), hint.copy_from, Interpreter::BLOCK_SIZE);
+    } else if (hint.read) {
         auto read_size = _file.read(buffer.data(), index);
         if (unlikely(read_size != Interpreter::BLOCK_SIZE)) {
             throw BPTreeRuntimeError("Failed to read block " + std::to_string(index)
@@ -79,6 +344,18 @@ Impl_Scheduler::LRU_Helper::create(Key index) {
 }
 
 void Impl_Scheduler::LRU_Helper::update(Key index, Value& buffer) {
+    /// 已经暂存的块的旧内容同样还没有落盘，新的内容继续暂存。
+    if (_log && (save_before_images({ index }, false) || _deferred.count(index))) {
+        _deferred[index].assign(buffer.data(), Interpreter::BLOCK_SIZE);
+        /// 预读线程此前从文件中读到的内容不能再使用。
+        ++_write_count;
+        if (_deferred.size() >= MAX_DEFERRED) flush_deferred();
+        return;
+    }
+    write_block(index, buffer.data());
+}
+
+void Impl_Scheduler::LRU_Helper::write_block(Key index, const void *data) {
     if (index >= _file.total_blocks()) {
         bool resize_success = _file.resize_file_total_blocks(_total_blocks);
         if (unlikely(!resize_success)) {
@@ -87,9 +364,42 @@ void Impl_Scheduler::LRU_Helper::update(Key index, Value& buffer) {
         }
     }
     assert(index <= _file.total_blocks());
-    auto update_size = _file.update(buffer.data(), Interpreter::BLOCK_SIZE, index);
+    ++_write_count;
+    auto update_size = _file.update(data, Interpreter::BLOCK_SIZE, index);
     if (unlikely(update_size != Interpreter::BLOCK_SIZE)) {
         throw BPTreeRuntimeError("Failed to update block " + std::to_string(index)
             + " from file " + _file.get_path());
     }
 }
+
+bool Impl_Scheduler::LRU_Helper::save_before_images(const std::vector<Key>& indexes, bool sync) {
+    /// 淘汰时内存池可能已经没有空闲的块，这里不从内存池中申请。
+    std::vector<char> old;
+    for (auto index : indexes) {
+        if (index >= _file.total_blocks() || !_log->need_before_image(index)) continue;
+        old.resize(Interpreter::BLOCK_SIZE);
+        if (unlikely(_file.read(old.data(), index) != Interpreter::BLOCK_SIZE)) {
+            throw BPTreeRuntimeError("Failed to read block " + std::to_string(index)
+                + " from file " + _file.get_path());
+        }
+        _log->add_before_image(index, old.data(), Interpreter::BLOCK_SIZE);
+    }
+    _unsynced = _unsynced || !old.empty();
+    if (sync && _unsynced) {
+        _log->sync_before_images();
+        _unsynced = false;
+    }
+    return !old.empty();
+}
+
+void Impl_Scheduler::LRU_Helper::flush_deferred() {
+    if (_unsynced) {
+        _log->sync_before_images();
+        _unsynced = false;
+    }
+    for (auto& [index, data] : _deferred) {
+        if (index < _total_blocks.load(std::memory_order_acquire))
+            write_block(index, data.data());
+    }
+    _deferred.clear();
+}
@@ -0,0 +1,217 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#include "../WriteAheadLog.hpp"
+
+#include <cstring>
+#include "tinyBackend/Base/Detail/Checksum.hpp"
+
+using namespace Base;
+
+
+WriteAheadLog::WriteAheadLog(const std::string& path) :
+    _file(path.c_str(), true, true), _images((path + ".dwb").c_str(), true, true) {
+    if (!_file.is_open() || !_images.is_open())
+        throw BPTreeFileError("Failed to open write ahead log " + path);
+    if (!read_head()) {
+        /// 新建的日志，以树文件当前的状态作为第一个检查点（块数在 restore 时确定）。
+        if (!_file.resize_file(0) || !_file.resize_file(HEAD_AREA))
+            throw BPTreeFileError("Failed to initialize write ahead log " + path);
+        _head = Head();
+    }
+    scan_records();
+}
+
+void WriteAheadLog::restore(BlockFile& file) {
+    Lock l(_image_mutex);
+    if (_head.seq == 0) {
+        write_head({ 1, 0, file.total_blocks() });
+    } else {
+        std::string block(file.block_size(), '\0');
+        ImageHead head {};
+        _images.seek_beg(0);
+        while (_images.read(sizeof(ImageHead), &head) == sizeof(ImageHead)
+            && _images.read(block.size(), block.data()) == block.size()) {
+            uint32 crc = crc32(&head.seq, sizeof(head.seq), crc32(&head.index, sizeof(head.index)));
+            if (crc32(block.data(), block.size(), crc) != head.crc) break;
+            if (head.seq != _head.seq || head.index >= _head.tree_blocks) continue;
+            if (file.update(block.data(), block.size(), head.index) != block.size())
+                throw BPTreeFileError("Failed to restore block " + std::to_string(head.index)
+                    + " of " + file.get_path());
+        }
+        if (file.total_blocks() > _head.tree_blocks
+            && !file.resize_file_total_blocks(_head.tree_blocks))
+            throw BPTreeFileError("Failed to truncate " + file.get_path());
+        file.flush_to_disk();
+    }
+    if (!_images.resize_file(0))
+        throw BPTreeFileError("Failed to reset " + _images.get_path());
+    _images.seek_beg(0);
+    _saved.assign(_head.tree_blocks, false);
+}
+
+uint64 WriteAheadLog::append(const void *data, uint32 size) {
+    Lock l(_mutex);
+    RecordHead head { size, 0, _next_lsn++ };
+    head.crc = crc32(data, size, crc32(&head.lsn, sizeof(head.lsn)));
+    _buffer.append((const char *) &head, sizeof(head));
+    _buffer.append((const char *) data, size);
+    return head.lsn;
+}
+
+void WriteAheadLog::commit(uint64 lsn) {
+    while (true) {
+        std::string batch;
+        uint64 target, offset;
+        {
+            Lock l(_mutex);
+            _flushed.wait(l, [this, lsn] { return _durable_lsn >= lsn || !_flushing; });
+            if (_durable_lsn >= lsn) return;
+            /// 成为本轮的写入者，带走此前所有线程追加的记录。
+            _flushing = true;
+            batch.swap(_buffer);
+            target = _next_lsn - 1;
+            offset = _end_offset;
+            _end_offset += batch.size();
+        }
+        bool success = true;
+        try {
+            write_records(batch, offset);
+        } catch (...) {
+            success = false;
+        }
+        Lock l(_mutex);
+        _flushing = false;
+        if (success) {
+            _durable_lsn = target;
+        } else {
+            /// 记录放回缓冲区，下一次提交时重试。
+            _end_offset = offset;
+            _buffer.insert(0, batch);
+        }
+        _flushed.notify_all();
+        if (!success)
+            throw BPTreeRuntimeError("Failed to write " + _file.get_path());
+    }
+}
+
+void WriteAheadLog::commit_all() {
+    uint64 lsn;
+    {
+        Lock l(_mutex);
+        lsn = _next_lsn - 1;
+    }
+    commit(lsn);
+}
+
+void WriteAheadLog::checkpoint(uint64 tree_blocks) {
+    Lock l(_mutex);
+    _flushed.wait(l, [this] { return !_flushing; });
+    /// 新的检查点头落盘之后，之前的记录与旧内容都不再需要。
+    Head head { _head.seq + 1, _next_lsn - 1, tree_blocks };
+    write_head(head);
+    _buffer.clear();
+    _end_offset = HEAD_AREA;
+    _durable_lsn = _next_lsn - 1;
+    if (!_file.resize_file(HEAD_AREA))
+        throw BPTreeFileError("Failed to truncate " + _file.get_path());
+
+    Lock i(_image_mutex);
+    if (!_images.resize_file(0))
+        throw BPTreeFileError("Failed to reset " + _images.get_path());
+    _images.seek_beg(0);
+    _saved.assign(tree_blocks, false);
+}
+
+uint64 WriteAheadLog::log_size() {
+    Lock l(_mutex);
+    return _end_offset + _buffer.size();
+}
+
+bool WriteAheadLog::need_before_image(uint32 index) {
+    Lock l(_image_mutex);
+    return index < _saved.size() && !_saved[index];
+}
+
+void WriteAheadLog::add_before_image(uint32 index, const void *block, uint32 size) {
+    Lock l(_image_mutex);
+    if (index >= _saved.size() || _saved[index]) return;
+    ImageHead head { index, 0, _head.seq };
+    uint32 crc = crc32(&head.seq, sizeof(head.seq), crc32(&head.index, sizeof(head.index)));
+    head.crc = crc32(block, size, crc);
+    if (_images.write(&head, sizeof(head)) != sizeof(head) || _images.write(block, size) != size)
+        throw BPTreeRuntimeError("Failed to write " + _images.get_path());
+    _saved[index] = true;
+}
+
+void WriteAheadLog::sync_before_images() {
+    Lock l(_image_mutex);
+    _images.flush_to_disk();
+}
+
+bool WriteAheadLog::read_head() {
+    struct stat st {};
+    if (!_file.get_stat(&st) || st.st_size < (int64) HEAD_AREA) return false;
+    bool found = false;
+    for (uint64 slot = 0; slot < 2; ++slot) {
+        uint32 magic, crc;
+        Head head;
+        _file.seek_beg(slot * HEAD_AREA / 2);
+        if (_file.read(sizeof(magic), &magic) != sizeof(magic) || magic != HEAD_MAGIC
+            || _file.read(sizeof(crc), &crc) != sizeof(crc)
+            || _file.read(sizeof(head), &head) != sizeof(head)
+            || crc32(&head, sizeof(head)) != crc)
+            continue;
+        if (!found || head.seq > _head.seq) _head = head;
+        found = true;
+    }
+    return found;
+}
+
+void WriteAheadLog::write_head(const Head& head) {
+    uint32 magic = HEAD_MAGIC, crc = crc32(&head, sizeof(head));
+    /// 两个槽交替写入，写到一半的头不会覆盖仍然有效的另一个。
+    if (!_file.seek_beg(head.seq % 2 * HEAD_AREA / 2)
+        || _file.write(&magic, sizeof(magic)) != sizeof(magic)
+        || _file.write(&crc, sizeof(crc)) != sizeof(crc)
+        || _file.write(&head, sizeof(head)) != sizeof(head))
+        throw BPTreeFileError("Failed to write head of " + _file.get_path());
+    _file.flush_to_disk();
+    _head = head;
+}
+
+void WriteAheadLog::scan_records() {
+    struct stat st {};
+    if (!_file.get_stat(&st))
+        throw BPTreeFileError("Could not get stat from: " + _file.get_path());
+    uint64 offset = HEAD_AREA;
+    RecordHead head {};
+    std::string payload;
+    while (offset < (uint64) st.st_size && read_record(offset, st.st_size, head, payload)) {
+        offset += sizeof(RecordHead) + head.size;
+        _next_lsn = head.lsn + 1;
+    }
+    if (offset < (uint64) st.st_size && !_file.resize_file(offset))
+        throw BPTreeFileError("Failed to truncate " + _file.get_path());
+    if (_next_lsn <= _head.checkpoint_lsn) _next_lsn = _head.checkpoint_lsn + 1;
+    _end_offset = offset;
+    _durable_lsn = _next_lsn - 1;
+}
+
+bool WriteAheadLog::read_record(uint64 offset, uint64 limit, RecordHead& head, std::string& payload) {
+    if (limit < offset + sizeof(head) || !_file.seek_beg(offset)
+        || _file.read(sizeof(head), &head) != sizeof(head))
+        return false;
+    /// 写到一半或损坏的记录头中的长度不可信，超出文件末尾时视为日志结束。
+    if (head.size > limit - offset - sizeof(head)) return false;
+    payload.resize(head.size);
+    if (_file.read(head.size, payload.data()) != head.size) return false;
+    return crc32(payload.data(), head.size, crc32(&head.lsn, sizeof(head.lsn))) == head.crc;
+}
+
+void WriteAheadLog::write_records(const std::string& data, uint64 offset) {
+    if (!_file.seek_beg(offset) || _file.write(data.data(), data.size()) != data.size())
+        throw BPTreeRuntimeError("Failed to write " + _file.get_path());
+    _file.flush_to_disk();
+}
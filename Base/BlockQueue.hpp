@@ -70,7 +70,7 @@ namespace Base {
             return [this] { return !_run || _size < _limit; };
         };
 
-        Type* take_node() {
+        Type take_node() {
             Node *t = head;
             head = head->next;
             if (!head) tail = nullptr;
@@ -118,7 +118,7 @@ namespace Base {
     bool BlockQueue<Type>::put(Type&& val) {
         if (!_run) return false;
         Lock l(_mutex);
-        _put.wait_for(l, joinable());
+        _put.wait(l, joinable());
         if (!_run) return false;
         to_tail(new Node(std::move(val)));
         _take.notify_one();
@@ -129,7 +129,7 @@ namespace Base {
     bool BlockQueue<Type>::put(const Type& val) {
         if (!_run) return false;
         Lock l(_mutex);
-        _put.wait_for(l, joinable());
+        _put.wait(l, joinable());
         if (!_run) return false;
         to_tail(new Node(val));
         _take.notify_one();
@@ -140,7 +140,7 @@ namespace Base {
     bool BlockQueue<Type>::put_to_top(Type&& val) {
         if (!_run) return false;
         Lock l(_mutex);
-        _put.wait_for(l, joinable());
+        _put.wait(l, joinable());
         if (!_run) return false;
         to_top(new Node(std::move(val)));
         _take.notify_one();
@@ -151,7 +151,7 @@ namespace Base {
     bool BlockQueue<Type>::put_to_top(const Type& val) {
         if (!_run) return false;
         Lock l(_mutex);
-        _put.wait_for(l, joinable());
+        _put.wait(l, joinable());
         if (!_run) return false;
         to_top(new Node(val));
         _take.notify_one();
@@ -174,12 +174,14 @@ namespace Base {
     void BlockQueue<Type>::start() {
         Lock l(_mutex);
         _run = true;
+        _take.notify_all();
     }
 
     template <typename Type>
     void BlockQueue<Type>::stop() {
         Lock l(_mutex);
         _run = false;
+        _put.notify_all();
     }
 
     template <typename Type>
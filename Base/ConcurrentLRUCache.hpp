@@ -0,0 +1,441 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#ifndef BASE_CONCURRENTLRUCACHE_HPP
+#define BASE_CONCURRENTLRUCACHE_HPP
+
+#ifdef BASE_CONCURRENTLRUCACHE_HPP
+
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include "tinyBackend/Base/Mutex.hpp"
+#include "tinyBackend/Base/Exception.hpp"
+
+namespace Base {
+
+    /*
+     * 线程安全的 LRUCache，Helper 接口与 LRUCache 相同（can_create create update，可选 release erase）。
+     *
+     * 键按哈希分到 2^ShardBits 个分片，每个分片有独立的读写锁、哈希表与 CLOCK 环。
+     * 命中时只持有分片的共享锁：引用计数（instantiated_size）与访问位都是原子变量，
+     * 不需要像 LRUCache 那样在每次访问时移动链表节点。
+     * 未命中、淘汰、删除时先获取 Helper 的互斥锁再获取分片的独占锁（Helper 的所有调用由该锁串行化，
+     * Helper 自身无需线程安全），等待 Helper 的线程不会持有分片锁，因此不会阻塞其他线程的命中路径。
+     *
+     * get 返回的指针在对应的 put 之前一直有效（被引用的节点不会被淘汰）；
+     * 多个线程同时修改同一个 Value 需要调用者自行同步。
+     * update_all_with_order 不持有分片锁写回，正在写回的节点被命中时 get 等待写回结束再返回。
+     */
+    template <typename Helper, uint32 ShardBits = 4>
+    class ConcurrentLRUCache : NoCopy {
+    public:
+        using Key = typename Helper::Key;
+
+        using Value = typename Helper::Value;
+
+        static constexpr uint32 SHARDS = 1 << ShardBits;
+
+        template <typename... Args>
+        explicit ConcurrentLRUCache(Args&&... args) : _helper(std::forward<Args>(args)...) {};
+
+        ~ConcurrentLRUCache();
+
+        /// 未命中时 args 会被转发给 Helper::create。
+        template <typename... Args>
+        Value* get(const Key& key, Args&&... args);
+
+        void put(const Key& key, bool need_update);
+
+        [[nodiscard]] bool contains(const Key& key) {
+            Shard& shard = shard_of(key);
+            SharedLock l(shard.mutex);
+            return shard.map.find(key) != shard.map.end();
+        };
+
+        /// key 不在缓存中时创建其值但不引用（用于预读），并在锁内调用 fun(const Value&)，返回是否创建。
+        template <typename Fun, typename... Args>
+        bool load(const Key& key, Fun fun, Args&&... args);
+
+        /// 将所有未被引用且需要更新的值写回。
+        void update_all();
+
+        /// 按 cmp 排序后写回所有未被引用且需要更新的值。
+        template <typename Cmp>
+        void update_all_with_order(Cmp cmp);
+
+        /// 返回当前需要更新的键（不包括正在被引用的）。
+        std::vector<Key> need_update_keys();
+
+        void remove(const Key& key);
+
+        void erase(const Key& key);
+
+        /// Helper 的调用需要在该锁的保护下进行。
+        template <typename Fun>
+        auto with_helper(Fun fun) {
+            Lock l(_helper_mutex);
+            return fun(_helper);
+        };
+
+        /// 不加锁访问 Helper，只能用于其线程安全的成员。
+        [[nodiscard]] const Helper& helper() const { return _helper; };
+
+        [[nodiscard]] uint32 need_update_size() const { return _dirty_size.load(std::memory_order_relaxed); };
+
+        [[nodiscard]] uint32 total_size() const { return _total_size.load(std::memory_order_relaxed); };
+
+    private:
+        struct Node {
+            Value value;
+
+            std::atomic<uint32> instantiated_size = 0;
+
+            std::atomic<bool> referenced = true;
+
+            std::atomic<bool> need_update = false;
+
+            /// update_all_with_order 正在不持有分片锁写回该节点
+            std::atomic<bool> writing = false;
+
+            /// 在 CLOCK 环中的位置
+            uint32 ring_index = 0;
+
+            explicit Node(Value&& v) : value(std::move(v)) {};
+        };
+
+        using Map = std::unordered_map<Key, Node>;
+
+        using MapIter = typename Map::iterator;
+
+        struct alignas(64) Shard {
+            SharedMutex mutex;
+
+            Map map;
+
+            std::vector<MapIter> ring;
+
+            uint32 hand = 0;
+        };
+
+        Helper _helper;
+
+        Mutex _helper_mutex;
+
+        Shard _shards[SHARDS];
+
+        std::atomic<uint32> _total_size = 0, _dirty_size = 0;
+
+        /// 整数的 std::hash 是其本身，乘法散列后取高位，使连续的键（例如顺序预读的块）分散到不同的分片。
+        Shard& shard_of(const Key& key) {
+            uint64 hash = (uint64) std::hash<Key> {}(key) * 0x9E3779B97F4A7C15ull;
+            return _shards[hash >> (64 - ShardBits)];
+        };
+
+        /// 腾出空间并创建 key 对应的值，需要持有 _helper_mutex 与 shard 的独占锁。
+        template <typename... Args>
+        Value create_value(Shard& shard, const Key& key, Args&&... args);
+
+        /// 在 shard 中用 CLOCK 算法淘汰一个节点，需要持有 _helper_mutex 与 shard 的独占锁。
+        bool evict_one(Shard& shard);
+
+        /// 需要持有 _helper_mutex 与 shard 的独占锁。
+        void drop(Shard& shard, MapIter iter, bool write_back);
+
+        void mark_clean(Node& node) {
+            if (node.need_update.exchange(false, std::memory_order_acq_rel))
+                _dirty_size.fetch_sub(1, std::memory_order_relaxed);
+        };
+
+        struct FunChecker {
+        private:
+            template <typename U>
+            static auto release_test(int) ->
+                decltype(std::declval<U>().release(std::declval<Key>(), std::declval<Value&>()),
+                    std::true_type());
+
+            template <typename U>
+            static std::false_type release_test(...);
+
+            template <typename U>
+            static auto erase_test(int) ->
+                decltype(std::declval<U>().erase(std::declval<Key>()), std::true_type());
+
+            template <typename U>
+            static std::false_type erase_test(...);
+
+        public:
+            static constexpr bool has_release_callable =
+                decltype(release_test<Helper>(0))::value;
+
+            static constexpr bool has_erase_callable =
+                decltype(erase_test<Helper>(0))::value;
+
+        };
+
+    };
+
+}
+
+namespace Base {
+
+    template <typename Helper, uint32 ShardBits>
+    ConcurrentLRUCache<Helper, ShardBits>::~ConcurrentLRUCache() {
+        for (auto& shard : _shards) {
+            for (auto& [key, node] : shard.map) {
+                if (node.instantiated_size.load() != 0) {
+                    std::fprintf(stderr, "ConcurrentLRUCache might be cause invalid reference.");
+                    std::terminate();
+                }
+                if (node.need_update.load())
+                    _helper.update(key, node.value);
+                if constexpr (FunChecker::has_release_callable) {
+                    _helper.release(key, node.value);
+                }
+            }
+        }
+    }
+
+    template <typename Helper, uint32 ShardBits>
+    template <typename... Args>
+    typename ConcurrentLRUCache<Helper, ShardBits>::Value*
+    ConcurrentLRUCache<Helper, ShardBits>::get(const Key& key, Args&&... args) {
+        Shard& shard = shard_of(key);
+        Node *hit = nullptr;
+        {
+            SharedLock l(shard.mutex);
+            if (auto iter = shard.map.find(key); iter != shard.map.end()) {
+                hit = &iter->second;
+                hit->instantiated_size.fetch_add(1, std::memory_order_acq_rel);
+                if (!hit->referenced.load(std::memory_order_relaxed))
+                    hit->referenced.store(true, std::memory_order_relaxed);
+            }
+        }
+        if (hit) {
+            /// writing 在分片的独占锁下设置，这里一定能看到；已经引用的节点不会被释放，可以在锁外等待
+            while (hit->writing.load(std::memory_order_acquire))
+                CurrentThread::yield_this_thread();
+            return &hit->value;
+        }
+
+        Lock h(_helper_mutex);
+        Lock l(shard.mutex);
+        if (auto iter = shard.map.find(key); iter != shard.map.end()) {
+            Node& node = iter->second;
+            node.instantiated_size.fetch_add(1, std::memory_order_acq_rel);
+            node.referenced.store(true, std::memory_order_relaxed);
+            return &node.value;
+        }
+        auto [iter, success] = shard.map.try_emplace(key, create_value(shard, key, std::forward<Args>(args)...));
+        assert(success);
+        Node& node = iter->second;
+        node.instantiated_size.store(1, std::memory_order_relaxed);
+        node.ring_index = shard.ring.size();
+        shard.ring.push_back(iter);
+        _total_size.fetch_add(1, std::memory_order_relaxed);
+        return &node.value;
+    }
+
+    template <typename Helper, uint32 ShardBits>
+    template <typename Fun, typename... Args>
+    bool ConcurrentLRUCache<Helper, ShardBits>::load(const Key& key, Fun fun, Args&&... args) {
+        Shard& shard = shard_of(key);
+        {
+            SharedLock l(shard.mutex);
+            if (shard.map.find(key) != shard.map.end()) return false;
+        }
+
+        Lock h(_helper_mutex);
+        Lock l(shard.mutex);
+        if (shard.map.find(key) != shard.map.end()) return false;
+        auto [iter, success] = shard.map.try_emplace(key, create_value(shard, key, std::forward<Args>(args)...));
+        assert(success);
+        Node& node = iter->second;
+        node.ring_index = shard.ring.size();
+        shard.ring.push_back(iter);
+        _total_size.fetch_add(1, std::memory_order_relaxed);
+        fun(static_cast<const Value&>(node.value));
+        return true;
+    }
+
+    template <typename Helper, uint32 ShardBits>
+    void ConcurrentLRUCache<Helper, ShardBits>::put(const Key& key, bool need_update) {
+        Shard& shard = shard_of(key);
+        SharedLock l(shard.mutex);
+        auto iter = shard.map.find(key);
+        assert(iter != shard.map.end());
+        Node& node = iter->second;
+        if (need_update && !node.need_update.exchange(true, std::memory_order_acq_rel))
+            _dirty_size.fetch_add(1, std::memory_order_relaxed);
+        node.instantiated_size.fetch_sub(1, std::memory_order_acq_rel);
+    }
+
+    template <typename Helper, uint32 ShardBits>
+    void ConcurrentLRUCache<Helper, ShardBits>::update_all() {
+        for (auto& shard : _shards) {
+            Lock h(_helper_mutex);
+            Lock l(shard.mutex);
+            for (auto& [key, node] : shard.map) {
+                if (node.instantiated_size.load(std::memory_order_acquire) != 0
+                    || !node.need_update.load(std::memory_order_acquire))
+                    continue;
+                _helper.update(key, node.value);
+                mark_clean(node);
+            }
+        }
+    }
+
+    template <typename Helper, uint32 ShardBits>
+    template <typename Cmp>
+    void ConcurrentLRUCache<Helper, ShardBits>::update_all_with_order(Cmp cmp) {
+        /*
+         * 收集脏节点时逐个持有分片的独占锁并把节点标记为 writing，写回时只持有 _helper_mutex：
+         * 淘汰、remove、erase 都需要 _helper_mutex，写回期间节点不会被释放；
+         * 命中路径不会被 I/O 阻塞，只有命中正在写回的节点时才等待，写回期间节点不会被修改。
+         * 写回成功后才清除脏标记，Helper::update 抛出异常时未写回的节点保持脏标记。
+         */
+        Lock h(_helper_mutex);
+        std::vector<std::pair<const Key *, Node *>> dirty;
+        dirty.reserve(need_update_size());
+        for (auto& shard : _shards) {
+            Lock l(shard.mutex);
+            for (auto& [key, node] : shard.map) {
+                if (node.instantiated_size.load(std::memory_order_acquire) == 0
+                    && node.need_update.load(std::memory_order_acquire)) {
+                    node.writing.store(true, std::memory_order_relaxed);
+                    dirty.emplace_back(&key, &node);
+                }
+            }
+        }
+        std::sort(dirty.begin(), dirty.end(), [&cmp] (const auto& a, const auto& b) {
+            return cmp(*a.first, *b.first);
+        });
+        uint64 i = 0;
+        try {
+            for (; i < dirty.size(); ++i) {
+                auto [key, node] = dirty[i];
+                _helper.update(*key, node->value);
+                mark_clean(*node);
+                node->writing.store(false, std::memory_order_release);
+            }
+        } catch (...) {
+            for (; i < dirty.size(); ++i)
+                dirty[i].second->writing.store(false, std::memory_order_release);
+            throw;
+        }
+    }
+
+    template <typename Helper, uint32 ShardBits>
+    std::vector<typename ConcurrentLRUCache<Helper, ShardBits>::Key>
+    ConcurrentLRUCache<Helper, ShardBits>::need_update_keys() {
+        std::vector<Key> keys;
+        keys.reserve(need_update_size());
+        for (auto& shard : _shards) {
+            SharedLock l(shard.mutex);
+            for (auto& [key, node] : shard.map) {
+                if (node.instantiated_size.load(std::memory_order_acquire) == 0
+                    && node.need_update.load(std::memory_order_acquire))
+                    keys.push_back(key);
+            }
+        }
+        return keys;
+    }
+
+    template <typename Helper, uint32 ShardBits>
+    void ConcurrentLRUCache<Helper, ShardBits>::remove(const Key& key) {
+        Shard& shard = shard_of(key);
+        Lock h(_helper_mutex);
+        Lock l(shard.mutex);
+        auto iter = shard.map.find(key);
+        if (iter == shard.map.end())
+            throw Exception("ConcurrentLRUCache: key not found.");
+        assert(iter->second.instantiated_size.load() == 0);
+        drop(shard, iter, true);
+    }
+
+    template <typename Helper, uint32 ShardBits>
+    void ConcurrentLRUCache<Helper, ShardBits>::erase(const Key& key) {
+        Shard& shard = shard_of(key);
+        Lock h(_helper_mutex);
+        Lock l(shard.mutex);
+        auto iter = shard.map.find(key);
+        if (iter != shard.map.end()) {
+            assert(iter->second.instantiated_size.load() == 0);
+            drop(shard, iter, false);
+        }
+        if constexpr (FunChecker::has_erase_callable) {
+            _helper.erase(key);
+        }
+    }
+
+    template <typename Helper, uint32 ShardBits>
+    template <typename... Args>
+    typename ConcurrentLRUCache<Helper, ShardBits>::Value
+    ConcurrentLRUCache<Helper, ShardBits>::create_value(Shard& shard, const Key& key, Args&&... args) {
+        if (_helper.can_create(key)) return _helper.create(key, std::forward<Args>(args)...);
+
+        /// 优先在本分片中淘汰，不够时尝试其他分片（只尝试加锁，避免与其他线程形成死锁）。
+        while (!_helper.can_create(key) && evict_one(shard)) {}
+        for (auto& other : _shards) {
+            if (&other == &shard || _helper.can_create(key)) continue;
+            if (!other.mutex.try_lock()) continue;
+            while (!_helper.can_create(key) && evict_one(other)) {}
+            other.mutex.unlock();
+        }
+
+        if (!_helper.can_create(key))
+            throw Exception("ConcurrentLRUCache: can't create key because space is not enough.");
+        return _helper.create(key, std::forward<Args>(args)...);
+    }
+
+    template <typename Helper, uint32 ShardBits>
+    bool ConcurrentLRUCache<Helper, ShardBits>::evict_one(Shard& shard) {
+        uint32 size = shard.ring.size();
+        /// 最多转两圈：第一圈清除访问位，第二圈一定能找到未被引用的节点（如果存在）。
+        for (uint32 i = 0; i < size * 2; ++i) {
+            if (shard.hand >= shard.ring.size()) shard.hand = 0;
+            MapIter iter = shard.ring[shard.hand];
+            Node& node = iter->second;
+            if (node.instantiated_size.load(std::memory_order_acquire) != 0) {
+                ++shard.hand;
+                continue;
+            }
+            if (node.referenced.exchange(false, std::memory_order_relaxed)) {
+                ++shard.hand;
+                continue;
+            }
+            drop(shard, iter, true);
+            return true;
+        }
+        return false;
+    }
+
+    template <typename Helper, uint32 ShardBits>
+    void ConcurrentLRUCache<Helper, ShardBits>::drop(Shard& shard, MapIter iter, bool write_back) {
+        auto& [key, node] = *iter;
+        if (node.need_update.load(std::memory_order_acquire)) {
+            if (write_back) _helper.update(key, node.value);
+            mark_clean(node);
+        }
+        if constexpr (FunChecker::has_release_callable) {
+            _helper.release(key, node.value);
+        }
+        uint32 index = node.ring_index;
+        if (index + 1 != shard.ring.size()) {
+            shard.ring[index] = shard.ring.back();
+            shard.ring[index]->second.ring_index = index;
+        }
+        shard.ring.pop_back();
+        shard.map.erase(iter);
+        _total_size.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+}
+
+#endif
+
+#endif //BASE_CONCURRENTLRUCACHE_HPP
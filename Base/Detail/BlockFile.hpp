@@ -8,24 +8,42 @@
 #ifdef LOGSYSTEM_BLOCKFILE_HPP
 
 #include "ioFile.hpp"
+#include "DioFile.hpp"
 
 namespace Base {
 
+    /*
+     * 以块为单位读写的文件，支持以下后端:
+     *      Stdio: FILE* + fseek，读写都会移动文件位置，不能并发使用。
+     *      Positional: pread / pwrite，不维护文件位置，多个线程可以同时读取（以及更新不同的块）。
+     *      Direct: 与 Positional 相同，但通过 DioFile 以 O_DIRECT 打开，绕过页缓存；
+     *              地址未按 block_size 对齐的读写会经过一次额外的拷贝。
+     *      Mmap: 将文件映射到内存，读写即 memcpy，flush_to_disk 时 msync；
+     *            文件增长时可能重新映射，此时不能与读写并发。
+     */
     class BlockFile {
     public:
+        enum Backend : uint8 { Stdio, Positional, Direct, Mmap };
+
         BlockFile() = default;
 
-        explicit BlockFile(const char *path, bool append,
-                           bool binary = true, uint64 block_size = (1 << 12));
+        explicit BlockFile(const char *path, bool append, bool binary = true,
+                           uint64 block_size = (1 << 12), Backend backend = Stdio);
 
         BlockFile(BlockFile&& other) noexcept;
 
+        ~BlockFile();
+
         bool open(const char *path, bool append, bool binary);
 
         bool close();
 
         uint64 read(void *dest, uint64 index, uint64 count = 1);
 
+        /// 与 read 相同，但不检查也不读取当前的块数，Positional 与 Direct 后端可以在其他线程改变文件大小时调用，
+        /// 调用者需要保证 [index, index + count) 在文件中。
+        uint64 concurrent_read(void *dest, uint64 index, uint64 count = 1) const;
+
         uint64 write_to_back(const void *data, uint64 size);
 
         uint64 update(const void *data, uint64 size, uint64 index);
@@ -34,19 +52,21 @@ namespace Base {
 
         bool resize_file_total_blocks(uint64 new_block_size);
 
-        void flush() const { _file.flush(); };
+        void flush() const;
 
-        void flush_to_disk() const { _file.flush_to_disk(); };
+        void flush_to_disk() const;
 
-        bool delete_file() { return _file.delete_file(); };
+        bool delete_file();
 
         [[nodiscard]] uint64 block_size() const { return _block_size; };
 
         [[nodiscard]] uint64 total_blocks() const { return _total_blocks; };
 
-        [[nodiscard]] bool is_open() const { return _file.is_open(); };
+        [[nodiscard]] Backend backend() const { return _backend; };
 
-        [[nodiscard]] const std::string& get_path() const { return _file.get_path(); };
+        [[nodiscard]] bool is_open() const;
+
+        [[nodiscard]] const std::string& get_path() const { return _path; };
 
     private:
         bool locating(uint64 index);
@@ -55,14 +75,40 @@ namespace Base {
 
         bool write_error_handle();
 
+        [[nodiscard]] int get_fd() const;
+
+        /// 以下用于 Stdio 以外的后端。
+
+        bool open_fd(const char *path, bool append);
+
+        bool resize_fd(uint64 blocks);
+
+        uint64 positional_read(void *dest, uint64 index, uint64 count) const;
+
+        uint64 positional_write(const void *data, uint64 size, uint64 index) const;
+
+        bool remap(uint64 blocks);
+
         ioFile _file;
 
+        DioFile _dio;
+
+        int _fd = -1;
+
+        char *_map = nullptr;
+
+        uint64 _map_size = 0;
+
         int64 _offset = 0;
 
         uint64 _total_blocks = 0;
 
         uint64 _block_size = 0;
 
+        Backend _backend = Stdio;
+
+        std::string _path;
+
     };
 
 }
@@ -0,0 +1,61 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#ifndef BASE_CHECKSUM_HPP
+#define BASE_CHECKSUM_HPP
+
+#ifdef BASE_CHECKSUM_HPP
+
+#include <array>
+#include <cstring>
+#include "config.hpp"
+
+namespace Base {
+
+    namespace Detail {
+
+        /// slicing-by-8 查找表，tables[k][i] 为字节 i 之后再经过 k 个零字节的结果。
+        constexpr std::array<std::array<uint32, 256>, 8> make_crc32_tables() {
+            std::array<std::array<uint32, 256>, 8> tables {};
+            for (uint32 i = 0; i < 256; ++i) {
+                uint32 c = i;
+                for (int k = 0; k < 8; ++k)
+                    c = c & 1 ? 0x82F63B78u ^ c >> 1 : c >> 1;
+                tables[0][i] = c;
+            }
+            for (uint32 k = 1; k < 8; ++k) {
+                for (uint32 i = 0; i < 256; ++i)
+                    tables[k][i] = tables[0][tables[k - 1][i] & 0xFF] ^ tables[k - 1][i] >> 8;
+            }
+            return tables;
+        }
+
+        inline constexpr std::array<std::array<uint32, 256>, 8> crc32_tables = make_crc32_tables();
+
+    }
+
+    /// CRC-32C，用于检测文件中被截断或损坏的记录。crc 传入上一段的结果以分段计算。
+    /// 每次处理 8 字节（按小端序读取）。
+    inline uint32 crc32(const void *data, uint64 size, uint32 crc = 0) {
+        const auto& t = Detail::crc32_tables;
+        auto ptr = static_cast<const uint8 *>(data);
+        crc = ~crc;
+        for (; size >= 8; size -= 8, ptr += 8) {
+            uint64 word;
+            std::memcpy(&word, ptr, sizeof(word));
+            word ^= crc;
+            crc = t[7][word & 0xFF] ^ t[6][word >> 8 & 0xFF] ^ t[5][word >> 16 & 0xFF]
+                ^ t[4][word >> 24 & 0xFF] ^ t[3][word >> 32 & 0xFF] ^ t[2][word >> 40 & 0xFF]
+                ^ t[1][word >> 48 & 0xFF] ^ t[0][word >> 56];
+        }
+        for (; size > 0; --size)
+            crc = t[0][(crc ^ *ptr++) & 0xFF] ^ crc >> 8;
+        return ~crc;
+    }
+
+}
+
+#endif
+
+#endif //BASE_CHECKSUM_HPP
@@ -0,0 +1,62 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#ifndef BASE_COMPRESSION_HPP
+#define BASE_COMPRESSION_HPP
+
+#ifdef BASE_COMPRESSION_HPP
+
+#include <string>
+#include "config.hpp"
+
+namespace Base {
+
+    /// 将 value 以 7 位一组的变长整数写入 dest，返回写入的字节数（最多 10 字节）。
+    inline uint32 put_varint(char *dest, uint64 value) {
+        uint32 size = 0;
+        while (value >= 0x80) {
+            dest[size++] = (char) (value | 0x80);
+            value >>= 7;
+        }
+        dest[size++] = (char) value;
+        return size;
+    }
+
+    /// 从 [ptr, end) 中读取变长整数，返回读取之后的位置，数据不完整时返回 nullptr。
+    inline const char* get_varint(const char *ptr, const char *end, uint64& value) {
+        value = 0;
+        for (uint32 shift = 0; ptr < end && shift < 64; shift += 7) {
+            auto byte = (uint8) *ptr++;
+            value |= (uint64) (byte & 0x7F) << shift;
+            if (!(byte & 0x80)) return ptr;
+        }
+        return nullptr;
+    }
+
+    /// 将有符号的差值映射为较小的无符号数，使绝对值小的负数也只占用很少的字节。
+    inline uint64 zigzag_encode(int64 value) {
+        return (uint64) value << 1 ^ (uint64) (value >> 63);
+    }
+
+    inline int64 zigzag_decode(uint64 value) {
+        return (int64) (value >> 1) ^ -(int64) (value & 1);
+    }
+
+    /*
+     * LZ4 块格式的压缩，用于压缩较冷的数据块。
+     * 每个序列为 [token][字面量长度扩展][字面量][offset(2B)][匹配长度扩展]，最后一个序列只有字面量。
+     * 匹配通过 4 字节的哈希表查找，窗口为 64KB。
+     */
+
+    /// 将 [src, src + size) 压缩后追加到 dest，返回追加的字节数。
+    uint64 lz_compress(const void *src, uint64 size, std::string& dest);
+
+    /// 解压 [src, src + size) 到 dest，解压后的大小必须恰好为 raw_size，数据损坏时返回 false。
+    bool lz_decompress(const void *src, uint64 size, void *dest, uint64 raw_size);
+
+}
+
+#endif
+
+#endif //BASE_COMPRESSION_HPP
@@ -19,13 +19,19 @@ namespace Base {
     class CurrentThread {
     public:
         /// 判断当前线程是否为主线程。
-        static bool is_main_thread() { return main_thread_id == thread_tid; };
+        static bool is_main_thread() { return main_thread_id == tid(); };
 
         /// 进程id
-        static pid_t pid() { return thread_pid; };
+        static pid_t pid() {
+            if (__builtin_expect(thread_pid == 0, 0)) cache_id();
+            return thread_pid;
+        };
 
         /// 线程id
-        static pthread_t tid() { return thread_tid; };
+        static pthread_t tid() {
+            if (__builtin_expect(thread_tid == 0, 0)) cache_id();
+            return thread_tid;
+        };
 
         /// 线程名
         static string& thread_name() { return this_thread_name; };
@@ -79,9 +85,11 @@ namespace Base {
 
         static const pthread_t main_thread_id;
 
-        static const thread_local pid_t thread_pid;
+        /// 常量初始化为 0，首次访问时缓存。动态初始化的 thread_local 在其他编译单元中
+        /// 经由 TLS 包装函数访问，优化后可能在初始化之前被读取。
+        static thread_local pid_t thread_pid;
 
-        static const thread_local pthread_t thread_tid;
+        static thread_local pthread_t thread_tid;
 
         static thread_local string this_thread_name;
 
@@ -91,6 +99,8 @@ namespace Base {
 
         static void terminal();
 
+        static void cache_id();
+
     };
 
 }
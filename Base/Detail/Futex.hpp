@@ -0,0 +1,46 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#ifndef BASE_FUTEX_HPP
+#define BASE_FUTEX_HPP
+
+#ifdef BASE_FUTEX_HPP
+
+#include <atomic>
+#include <climits>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "config.hpp"
+
+namespace Base::Detail {
+
+    static_assert(sizeof(std::atomic<uint32>) == sizeof(uint32));
+
+    /// 当 *addr == expected 时休眠，直到被唤醒、超时或被信号中断。timeout 为 nullptr 时不超时。
+    inline void futex_wait(std::atomic<uint32>& addr, uint32 expected, const timespec *timeout = nullptr) {
+        syscall(SYS_futex, reinterpret_cast<uint32 *>(&addr), FUTEX_WAIT_PRIVATE,
+                expected, timeout, nullptr, 0);
+    }
+
+    /// 唤醒最多 count 个等待 addr 的线程。
+    inline void futex_wake(std::atomic<uint32>& addr, int32 count = INT_MAX) {
+        syscall(SYS_futex, reinterpret_cast<uint32 *>(&addr), FUTEX_WAKE_PRIVATE,
+                count, nullptr, nullptr, 0);
+    }
+
+    /// 自旋等待时的 CPU 提示。
+    inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield" ::: "memory");
+#endif
+    }
+
+}
+
+#endif
+
+#endif //BASE_FUTEX_HPP
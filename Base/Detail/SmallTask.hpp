@@ -0,0 +1,83 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#ifndef BASE_SMALLTASK_HPP
+#define BASE_SMALLTASK_HPP
+
+#ifdef BASE_SMALLTASK_HPP
+
+#include <new>
+#include <cstddef>
+#include <utility>
+#include <type_traits>
+#include "NoCopy.hpp"
+
+namespace Base::Detail {
+
+    /// 带小对象缓冲的一次性任务，可调用对象签名为 void(bool kill)。
+    /// 可调用对象不超过 INLINE_SIZE 时直接构造在内部缓冲中，否则退化为堆分配。
+    /// 调用一次后对象即被析构，可以重新 assign。
+    class SmallTask : NoCopy {
+    public:
+        static constexpr unsigned INLINE_SIZE = 96;
+
+        SmallTask() = default;
+
+        ~SmallTask() { if (_invoke) _invoke(this, true); };
+
+        template <typename Fun>
+        void assign(Fun&& fun) {
+            using Type = std::decay_t<Fun>;
+            if constexpr (sizeof(Type) <= INLINE_SIZE
+                && alignof(Type) <= alignof(std::max_align_t)) {
+                new(_storage) Type(std::forward<Fun>(fun));
+                _invoke = [] (SmallTask *self, bool kill) {
+                    auto *target = std::launder(reinterpret_cast<Type *>(self->_storage));
+                    self->_invoke = nullptr;
+                    try {
+                        (*target)(kill);
+                    } catch (...) {
+                        target->~Type();
+                        throw;
+                    }
+                    target->~Type();
+                };
+            } else {
+                *reinterpret_cast<Type **>(_storage) = new Type(std::forward<Fun>(fun));
+                _invoke = [] (SmallTask *self, bool kill) {
+                    auto *target = *reinterpret_cast<Type **>(self->_storage);
+                    self->_invoke = nullptr;
+                    try {
+                        (*target)(kill);
+                    } catch (...) {
+                        delete target;
+                        throw;
+                    }
+                    delete target;
+                };
+            }
+        };
+
+        /// kill 为 true 时任务应放弃执行（如设置 future 异常）。
+        void operator()(bool kill) { _invoke(this, kill); };
+
+        [[nodiscard]] bool empty() const { return !_invoke; };
+
+        /// 供对象池串联空闲任务。
+        SmallTask *next = nullptr;
+
+    private:
+        using Invoker = void(*)(SmallTask *, bool);
+
+        Invoker _invoke = nullptr;
+
+        alignas(std::max_align_t) unsigned char _storage[INLINE_SIZE] {};
+
+    };
+
+}
+
+#endif
+
+#endif //BASE_SMALLTASK_HPP
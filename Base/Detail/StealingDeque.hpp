@@ -0,0 +1,100 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#ifndef BASE_STEALINGDEQUE_HPP
+#define BASE_STEALINGDEQUE_HPP
+
+#ifdef BASE_STEALINGDEQUE_HPP
+
+#include <atomic>
+#include <memory>
+#include "config.hpp"
+#include "NoCopy.hpp"
+
+namespace Base::Detail {
+
+    /// Chase-Lev 工作窃取双端队列（有界）。
+    /// push/pop 只能由所有者线程调用，在底部进行（LIFO）；steal 可由任意线程调用，在顶部进行（FIFO）。
+    /// Type 需要是指针等可以原子存取的类型，队列满时 push 返回 false。
+    template <typename Type>
+    class StealingDeque : NoCopy {
+    public:
+        static_assert(std::is_trivially_copyable_v<Type>);
+
+        /// capacity 会被向上取整为 2 的幂。
+        explicit StealingDeque(uint32 capacity) {
+            uint64 size = 2;
+            while (size < capacity) size <<= 1;
+            _mask = (int64) size - 1;
+            _array = std::make_unique<std::atomic<Type>[]>(size);
+        };
+
+        bool push(Type value) {
+            int64 b = _bottom.load(std::memory_order_relaxed);
+            int64 t = _top.load(std::memory_order_acquire);
+            if (b - t > _mask) return false;
+            _array[b & _mask].store(value, std::memory_order_relaxed);
+            _bottom.store(b + 1, std::memory_order_release);
+            return true;
+        };
+
+        bool pop(Type& dest) {
+            int64 b = _bottom.load(std::memory_order_relaxed) - 1;
+            _bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64 t = _top.load(std::memory_order_relaxed);
+            if (t > b) {
+                _bottom.store(b + 1, std::memory_order_relaxed);
+                return false;
+            }
+            dest = _array[b & _mask].load(std::memory_order_relaxed);
+            if (t == b) {
+                /// 只剩最后一个元素，需要与窃取者竞争。
+                bool success = _top.compare_exchange_strong(t, t + 1,
+                                                            std::memory_order_seq_cst,
+                                                            std::memory_order_relaxed);
+                _bottom.store(b + 1, std::memory_order_relaxed);
+                return success;
+            }
+            return true;
+        };
+
+        bool steal(Type& dest) {
+            int64 t = _top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64 b = _bottom.load(std::memory_order_acquire);
+            if (t >= b) return false;
+            dest = _array[t & _mask].load(std::memory_order_relaxed);
+            return _top.compare_exchange_strong(t, t + 1,
+                                                std::memory_order_seq_cst,
+                                                std::memory_order_relaxed);
+        };
+
+        /// 近似值，仅供统计使用。
+        [[nodiscard]] uint32 size() const {
+            int64 b = _bottom.load(std::memory_order_relaxed);
+            int64 t = _top.load(std::memory_order_relaxed);
+            return b > t ? (uint32) (b - t) : 0;
+        };
+
+        [[nodiscard]] bool empty() const { return size() == 0; };
+
+        [[nodiscard]] uint32 capacity() const { return (uint32) _mask + 1; };
+
+    private:
+        alignas(64) std::atomic<int64> _top = 0;
+
+        alignas(64) std::atomic<int64> _bottom = 0;
+
+        alignas(64) int64 _mask = 0;
+
+        std::unique_ptr<std::atomic<Type>[]> _array;
+
+    };
+
+}
+
+#endif
+
+#endif //BASE_STEALINGDEQUE_HPP
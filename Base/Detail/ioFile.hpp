@@ -86,7 +86,7 @@ namespace Base {
         open(path, append, binary);
     }
 
-    inline ioFile::ioFile(ioFile&& other) noexcept : _file(other._file) {
+    inline ioFile::ioFile(ioFile&& other) noexcept : _file(other._file), _path(std::move(other._path)) {
         other._file = nullptr;
     }
 
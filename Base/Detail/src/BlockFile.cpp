@@ -3,6 +3,11 @@
 //
 
 #include <bits/move.h>
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
 #include "../BlockFile.hpp"
 #include "tinyBackend/Base/Exception.hpp"
 
@@ -10,48 +15,71 @@
 using namespace Base;
 
 BlockFile::BlockFile(const char *path, bool append,
-                     bool binary, uint64 block_size) :
-    _file(path, append, binary), _block_size(block_size) {
-    if (_file.is_open()) {
-        struct stat st {};
-        if (!_file.get_stat(&st))
-            throw Exception("Could not get stat from: " + std::string(path));
-        if (st.st_size % block_size != 0)
-            throw Exception("Block file size is not a multiple of block size.");
-        _total_blocks = st.st_size / _block_size;
-    }
+                     bool binary, uint64 block_size, Backend backend) :
+    _block_size(block_size), _backend(backend) {
+    if (!open(path, append, binary)) return;
+    struct stat st {};
+    if (fstat(get_fd(), &st) != 0)
+        throw Exception("Could not get stat from: " + std::string(path));
+    if (st.st_size % block_size != 0)
+        throw Exception("Block file size is not a multiple of block size.");
 }
 
 BlockFile::BlockFile(BlockFile&& other) noexcept :
-    _file(std::move(other._file)), _offset(other._offset),
-    _total_blocks(other._total_blocks), _block_size(other._block_size) {
-    other._total_blocks = 0;
+    _file(std::move(other._file)), _dio(std::move(other._dio)), _fd(other._fd),
+    _map(other._map), _map_size(other._map_size), _offset(other._offset),
+    _total_blocks(other._total_blocks), _block_size(other._block_size),
+    _backend(other._backend), _path(std::move(other._path)) {
+    other._fd = -1;
+    other._map = nullptr;
+    other._map_size = 0;
     other._offset = 0;
     other._total_blocks = 0;
     other._block_size = 0;
 }
 
+BlockFile::~BlockFile() {
+    close();
+}
+
 bool BlockFile::open(const char *path, bool append, bool binary) {
-    _offset = 0;
-    _total_blocks = 0;
-    if (!_file.open(path, append, binary)) return false;
+    close();
+    bool success = _backend == Stdio ? _file.open(path, append, binary) : open_fd(path, append);
+    if (!success) return false;
+    _path = path;
     struct stat st {};
-    if (!_file.get_stat(&st)) {
-        _file.close();
+    if (fstat(get_fd(), &st) != 0) {
+        close();
         return false;
     }
     _total_blocks = st.st_size / _block_size;
+    if (_backend == Mmap && _total_blocks > 0 && !remap(_total_blocks)) {
+        close();
+        return false;
+    }
     return true;
 }
 
 bool BlockFile::close() {
     _offset = 0;
     _total_blocks = 0;
-    return _file.close();
+    _path.clear();
+    if (_map) {
+        munmap(_map, _map_size);
+        _map = nullptr;
+        _map_size = 0;
+    }
+    if (_fd >= 0) {
+        if (::close(_fd) != 0) return false;
+        _fd = -1;
+    }
+    return _file.close() && _dio.close();
 }
 
 uint64 BlockFile::read(void *dest, uint64 index, uint64 count) {
-    if (index + count > _total_blocks || !locating(index)) return 0;
+    if (index + count > _total_blocks) return 0;
+    if (_backend != Stdio) return positional_read(dest, index, count);
+    if (!locating(index)) return 0;
     auto _dest = (char *) dest;
     for (uint64 rs = _block_size; count > 0 && rs == _block_size; --count) {
         rs = _file.read(_block_size, _dest);
@@ -61,7 +89,27 @@ uint64 BlockFile::read(void *dest, uint64 index, uint64 count) {
     return _dest - (char *) dest;
 }
 
+uint64 BlockFile::concurrent_read(void *dest, uint64 index, uint64 count) const {
+    assert(_backend == Positional || _backend == Direct);
+    return positional_read(dest, index, count);
+}
+
 uint64 BlockFile::write_to_back(const void *data, uint64 size) {
+    if (_backend != Stdio) {
+        uint64 blocks = (size + _block_size - 1) / _block_size;
+        uint64 old_blocks = _total_blocks;
+        if (!resize_fd(old_blocks + blocks)) return 0;
+        auto _data = (const char *) data;
+        for (uint64 index = old_blocks, s; size > 0; size -= s, ++index) {
+            s = size > _block_size ? _block_size : size;
+            if (unlikely(positional_write(_data, s, index) != _block_size)) {
+                resize_fd(index);
+                return _data - (const char *) data;
+            }
+            _data += s;
+        }
+        return _data - (const char *) data;
+    }
     if (!locating(_total_blocks)) return 0;
     auto _data = (const char *) data;
     for (uint64 s, written; size > 0; size -= s) {
@@ -79,13 +127,16 @@ uint64 BlockFile::write_to_back(const void *data, uint64 size) {
 }
 
 uint64 BlockFile::update(const void *data, uint64 size, uint64 index) {
-    if (index >= _total_blocks || !locating(index)) return 0;
+    if (index >= _total_blocks) return 0;
     if (size > _block_size) size = _block_size;
+    if (_backend != Stdio) return positional_write(data, size, index);
+    if (!locating(index)) return 0;
     return padding_write(data, size);
 }
 
 bool BlockFile::erase_back_blocks(uint64 count) {
     if (count > _total_blocks) return false;
+    if (_backend != Stdio) return resize_fd(_total_blocks - count);
     uint64 after_size = (_total_blocks - count) * _block_size;
     if (_offset > after_size)
         locating(_total_blocks - count);
@@ -98,11 +149,51 @@ bool BlockFile::erase_back_blocks(uint64 count) {
 }
 
 bool BlockFile::resize_file_total_blocks(uint64 new_block_size) {
+    if (_backend != Stdio) return resize_fd(new_block_size);
     if (!_file.resize_file(new_block_size * _block_size)) return false;
     _total_blocks = new_block_size;
     return true;
 }
 
+void BlockFile::flush() const {
+    if (_backend == Stdio) _file.flush();
+}
+
+void BlockFile::flush_to_disk() const {
+    switch (_backend) {
+        case Stdio:
+            _file.flush_to_disk();
+            break;
+        case Mmap:
+            if (_map) msync(_map, _total_blocks * _block_size, MS_SYNC);
+            [[fallthrough]];
+        default:
+            if (get_fd() >= 0) fsync(get_fd());
+    }
+}
+
+bool BlockFile::delete_file() {
+    if (!is_open()) return false;
+    std::string path = _path;
+    if (!close()) return false;
+    return remove(path.c_str()) == 0;
+}
+
+bool BlockFile::is_open() const {
+    return get_fd() >= 0;
+}
+
+int BlockFile::get_fd() const {
+    switch (_backend) {
+        case Stdio:
+            return _file.get_fd();
+        case Direct:
+            return _dio.get_fd();
+        default:
+            return _fd;
+    }
+}
+
 bool BlockFile::locating(uint64 index) {
     if (index > _total_blocks) return false;
     int64 offset = index * _block_size - _offset;
@@ -132,3 +223,92 @@ bool BlockFile::write_error_handle() {
         _offset = _total_blocks * _block_size;
     return success;
 }
+
+bool BlockFile::open_fd(const char *path, bool append) {
+    if (_backend == Direct) {
+        if (!_dio.open(path)) return false;
+        if (!append && !_dio.resize_file(0)) {
+            _dio.close();
+            return false;
+        }
+        return true;
+    }
+    _fd = ::open(path, O_RDWR | O_CREAT | (append ? 0 : O_TRUNC), 0644);
+    return _fd >= 0;
+}
+
+bool BlockFile::resize_fd(uint64 blocks) {
+    if (ftruncate(get_fd(), blocks * _block_size) != 0) return false;
+    if (_backend == Mmap && blocks * _block_size > _map_size && !remap(blocks)) {
+        ftruncate(get_fd(), _total_blocks * _block_size);
+        return false;
+    }
+    _total_blocks = blocks;
+    return true;
+}
+
+uint64 BlockFile::positional_read(void *dest, uint64 index, uint64 count) const {
+    uint64 size = count * _block_size, offset = index * _block_size;
+    if (_backend == Mmap) {
+        std::memcpy(dest, _map + offset, size);
+        return size;
+    }
+    char *target = (char *) dest, *bounce = nullptr;
+    if (_backend == Direct && ((uint64) dest % _block_size != 0)) {
+        if (posix_memalign((void **) &bounce, _block_size, size) != 0) return 0;
+        target = bounce;
+    }
+    uint64 done = 0;
+    while (done < size) {
+        int64 rs = ::pread(get_fd(), target + done, size - done, (off_t) (offset + done));
+        if (rs < 0 && errno == EINTR) continue;
+        if (rs <= 0) break;
+        done += rs;
+    }
+    /// 只返回完整的块。
+    done -= done % _block_size;
+    if (bounce) {
+        std::memcpy(dest, bounce, done);
+        std::free(bounce);
+    }
+    return done;
+}
+
+uint64 BlockFile::positional_write(const void *data, uint64 size, uint64 index) const {
+    uint64 offset = index * _block_size;
+    if (_backend == Mmap) {
+        std::memcpy(_map + offset, data, size);
+        if (size != _block_size)
+            std::memset(_map + offset + size, 0, _block_size - size);
+        return _block_size;
+    }
+    auto source = (const char *) data;
+    char *bounce = nullptr;
+    if (size != _block_size || (_backend == Direct && (uint64) data % _block_size != 0)) {
+        if (posix_memalign((void **) &bounce, _block_size, _block_size) != 0) return 0;
+        std::memcpy(bounce, data, size);
+        std::memset(bounce + size, 0, _block_size - size);
+        source = bounce;
+    }
+    uint64 done = 0;
+    while (done < _block_size) {
+        int64 ws = ::pwrite(get_fd(), source + done, _block_size - done, (off_t) (offset + done));
+        if (ws < 0 && errno == EINTR) continue;
+        if (ws <= 0) break;
+        done += ws;
+    }
+    std::free(bounce);
+    return done;
+}
+
+bool BlockFile::remap(uint64 blocks) {
+    uint64 size = blocks * _block_size;
+    /// 按两倍增长，减少文件持续增长时的重新映射次数（映射超出文件的部分不会被访问）。
+    if (_map_size != 0 && size < _map_size * 2) size = _map_size * 2;
+    void *ptr = _map ? mremap(_map, _map_size, size, MREMAP_MAYMOVE)
+                    : mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (ptr == MAP_FAILED) return false;
+    _map = (char *) ptr;
+    _map_size = size;
+    return true;
+}
@@ -0,0 +1,120 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#include "../Compression.hpp"
+
+#include <cstring>
+#include <vector>
+
+using namespace Base;
+
+namespace {
+
+    constexpr uint32 MIN_MATCH = 4;
+
+    constexpr uint32 MAX_OFFSET = 65535;
+
+    constexpr uint32 HASH_BITS = 12;
+
+    uint32 read32(const uint8 *ptr) {
+        uint32 value;
+        std::memcpy(&value, ptr, sizeof(value));
+        return value;
+    }
+
+    uint32 hash32(uint32 value) {
+        return value * 2654435761u >> (32 - HASH_BITS);
+    }
+
+    void put_length(std::string& dest, uint64 length) {
+        for (; length >= 255; length -= 255)
+            dest.push_back((char) 255);
+        dest.push_back((char) length);
+    }
+
+    void put_sequence(std::string& dest, const uint8 *literal, uint64 literal_size,
+                      uint32 offset, uint64 match_size) {
+        uint8 token = (uint8) ((literal_size < 15 ? literal_size : 15) << 4);
+        if (offset != 0) {
+            uint64 extra = match_size - MIN_MATCH;
+            token |= extra < 15 ? extra : 15;
+        }
+        dest.push_back((char) token);
+        if (literal_size >= 15) put_length(dest, literal_size - 15);
+        dest.append((const char *) literal, literal_size);
+        if (offset == 0) return;
+        dest.push_back((char) (offset & 0xFF));
+        dest.push_back((char) (offset >> 8));
+        if (match_size - MIN_MATCH >= 15) put_length(dest, match_size - MIN_MATCH - 15);
+    }
+
+    bool get_length(const uint8 *& ptr, const uint8 *end, uint64& length) {
+        while (true) {
+            if (ptr == end) return false;
+            uint8 byte = *ptr++;
+            length += byte;
+            if (byte != 255) return true;
+        }
+    }
+
+}
+
+uint64 Base::lz_compress(const void *src, uint64 size, std::string& dest) {
+    auto begin = static_cast<const uint8 *>(src);
+    uint64 old_size = dest.size(), anchor = 0, pos = 0;
+    /// 保存位置加一，0 表示空。
+    std::vector<uint32> table(1 << HASH_BITS, 0);
+    while (pos + MIN_MATCH <= size) {
+        uint32 value = read32(begin + pos), &slot = table[hash32(value)];
+        uint64 candidate = slot;
+        slot = pos + 1;
+        if (candidate == 0 || pos + 1 - candidate > MAX_OFFSET || read32(begin + candidate - 1) != value) {
+            ++pos;
+            continue;
+        }
+        --candidate;
+        uint64 match = MIN_MATCH;
+        while (pos + match < size && begin[candidate + match] == begin[pos + match])
+            ++match;
+        put_sequence(dest, begin + anchor, pos - anchor, pos - candidate, match);
+        pos += match;
+        anchor = pos;
+    }
+    put_sequence(dest, begin + anchor, size - anchor, 0, 0);
+    return dest.size() - old_size;
+}
+
+bool Base::lz_decompress(const void *src, uint64 size, void *dest, uint64 raw_size) {
+    auto ptr = static_cast<const uint8 *>(src), end = ptr + size;
+    auto out = static_cast<uint8 *>(dest);
+    uint64 written = 0;
+    while (ptr < end) {
+        uint8 token = *ptr++;
+        uint64 literal = token >> 4;
+        if (literal == 15 && !get_length(ptr, end, literal)) return false;
+        if (literal > (uint64) (end - ptr) || literal > raw_size - written) return false;
+        std::memcpy(out + written, ptr, literal);
+        ptr += literal;
+        written += literal;
+        if (ptr == end) break;
+
+        if (end - ptr < 2) return false;
+        uint32 offset = ptr[0] | (uint32) ptr[1] << 8;
+        ptr += 2;
+        uint64 match = token & 15;
+        if (match == 15 && !get_length(ptr, end, match)) return false;
+        match += MIN_MATCH;
+        if (offset == 0 || offset > written || match > raw_size - written) return false;
+        const uint8 *from = out + written - offset;
+        if (offset >= match) {
+            std::memcpy(out + written, from, match);
+        } else {
+            /// 匹配与输出重叠（offset 小于长度）时逐字节复制，重复之前的内容。
+            for (uint64 i = 0; i < match; ++i)
+                out[written + i] = from[i];
+        }
+        written += match;
+    }
+    return written == raw_size;
+}
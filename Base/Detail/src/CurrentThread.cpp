@@ -23,9 +23,9 @@ const pthread_t CurrentThread::main_thread_id = [] {
     return syscall(SYS_gettid);
 }();
 
-const thread_local pid_t CurrentThread::thread_pid = getpid();
+thread_local pid_t CurrentThread::thread_pid = 0;
 
-const thread_local pthread_t CurrentThread::thread_tid = syscall(SYS_gettid);
+thread_local pthread_t CurrentThread::thread_tid = 0;
 
 thread_local string CurrentThread::this_thread_name = [] {
     if (!is_main_thread()) {
@@ -120,6 +120,11 @@ void CurrentThread::set_error_message_file(FILE *file) {
     setvbuf(file, nullptr, _IONBF, 0);
 }
 
+void CurrentThread::cache_id() {
+    thread_pid = getpid();
+    thread_tid = syscall(SYS_gettid);
+}
+
 void CurrentThread::terminal() {
     auto eptr = std::current_exception();
     if (eptr && error_message_file) {
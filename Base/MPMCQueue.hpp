@@ -0,0 +1,377 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#ifndef BASE_MPMCQUEUE_HPP
+#define BASE_MPMCQUEUE_HPP
+
+#ifdef BASE_MPMCQUEUE_HPP
+
+#include <new>
+#include <memory>
+#include <thread>
+#include <utility>
+#include "Detail/Futex.hpp"
+#include "Detail/NoCopy.hpp"
+
+namespace Base {
+
+    /// 基于数组的有界多生产者多消费者队列（Vyukov 算法），每个槽位独占一条缓存行。
+    /// try_* 接口不阻塞；put/take 在队列满/空时先自旋 SPIN_TIMES 次，之后通过 futex 休眠。
+    /// stop() 之后 put 类接口直接返回 false/0，take 类接口返回 false/0 并唤醒所有等待者，
+    /// start() 恢复正常，队列中已有的元素不受影响。
+    template <typename Type>
+    class MPMCQueue : NoCopy {
+    public:
+        static constexpr uint32 SPIN_TIMES = 128;
+
+        /// capacity 会被向上取整为 2 的幂。
+        explicit MPMCQueue(uint32 capacity);
+
+        MPMCQueue(MPMCQueue&&) = delete;
+
+        ~MPMCQueue();
+
+        bool try_put(Type&& val) { return try_emplace(std::move(val)); };
+
+        bool try_put(const Type& val) { return try_emplace(val); };
+
+        bool try_take(Type& dest);
+
+        bool put(Type&& val);
+
+        bool put(const Type& val);
+
+        bool take(Type& dest);
+
+        /// 尽量放入 [begin, begin + n) 中的元素，返回放入的个数，不阻塞。
+        template <typename Iter>
+        uint32 try_put_n(Iter begin, uint32 n);
+
+        /// 放入全部 n 个元素，队列满时阻塞，返回放入的个数（只有 stop 时小于 n）。
+        template <typename Iter>
+        uint32 put_n(Iter begin, uint32 n);
+
+        /// 取出最多 n 个元素写入 dest，返回取出的个数，不阻塞。
+        template <typename Iter>
+        uint32 try_take_n(Iter dest, uint32 n);
+
+        /// 至少取出一个元素，最多 n 个，队列空时阻塞，stop 时返回 0。
+        template <typename Iter>
+        uint32 take_n(Iter dest, uint32 n);
+
+        void clear();
+
+        void start();
+
+        void stop();
+
+        [[nodiscard]] uint32 limit_size() const { return _mask + 1; };
+
+        /// 近似值。
+        [[nodiscard]] uint32 size() const {
+            uint64 put = _put_pos.load(std::memory_order_relaxed);
+            uint64 take = _take_pos.load(std::memory_order_relaxed);
+            return put > take ? put - take : 0;
+        };
+
+        [[nodiscard]] bool stopping() const { return !_run.load(std::memory_order_acquire); };
+
+    private:
+        struct alignas(64) Slot {
+            std::atomic<uint64> sequence;
+
+            alignas(Type) unsigned char storage[sizeof(Type)];
+
+            Type* value() { return std::launder(reinterpret_cast<Type *>(storage)); };
+        };
+
+        uint64 _mask;
+
+        std::unique_ptr<Slot[]> _slots;
+
+        alignas(64) std::atomic<uint64> _put_pos = 0;
+
+        alignas(64) std::atomic<uint64> _take_pos = 0;
+
+        /// 一侧（等待放入或等待取出）的休眠状态。
+        struct alignas(64) WaitSide {
+            /// 事件计数器作为 futex 字，每次对侧操作后递增。
+            std::atomic<uint32> event = 0;
+
+            std::atomic<uint32> waiters = 0;
+
+            /// 已发出唤醒但被唤醒者尚未运行，期间不再重复进行系统调用。
+            std::atomic<bool> signaled = false;
+        };
+
+        WaitSide _put_side, _take_side;
+
+        std::atomic<bool> _run = true;
+
+        template <typename Arg>
+        bool try_emplace(Arg&& val);
+
+        template <typename Arg>
+        bool emplace(Arg&& val);
+
+        /// 为放入预留 [pos, pos + n)，返回实际预留的数量。
+        uint32 claim_put(uint64& pos, uint32 n);
+
+        uint32 claim_take(uint64& pos, uint32 n);
+
+        /// 自旋后在 side 上休眠，直到 fun() 返回 true 或者停止。
+        /// 被唤醒并成功后，如果 remain() 表明还有剩余资源，继续唤醒下一个等待者。
+        template <typename Fun, typename Remain>
+        bool wait_for(WaitSide& side, Fun fun, Remain remain);
+
+        static void notify(WaitSide& side, bool all = false);
+
+        auto readable() const { return [this] { return size() > 0; }; };
+
+        auto writable() const { return [this] { return size() < limit_size(); }; };
+
+    };
+
+}
+
+namespace Base {
+
+    template <typename Type>
+    MPMCQueue<Type>::MPMCQueue(uint32 capacity) {
+        uint64 size = 2;
+        while (size < capacity) size <<= 1;
+        _mask = size - 1;
+        _slots = std::make_unique<Slot[]>(size);
+        for (uint64 i = 0; i < size; ++i)
+            _slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    template <typename Type>
+    MPMCQueue<Type>::~MPMCQueue() {
+        stop();
+        clear();
+    }
+
+    template <typename Type>
+    bool MPMCQueue<Type>::try_take(Type& dest) {
+        return try_take_n(&dest, 1) == 1;
+    }
+
+    template <typename Type>
+    bool MPMCQueue<Type>::put(Type&& val) {
+        return emplace(std::move(val));
+    }
+
+    template <typename Type>
+    bool MPMCQueue<Type>::put(const Type& val) {
+        return emplace(val);
+    }
+
+    template <typename Type>
+    bool MPMCQueue<Type>::take(Type& dest) {
+        return take_n(&dest, 1) == 1;
+    }
+
+    template <typename Type>
+    template <typename Iter>
+    uint32 MPMCQueue<Type>::try_put_n(Iter begin, uint32 n) {
+        if (stopping() || n == 0) return 0;
+        uint64 pos;
+        uint32 size = claim_put(pos, n);
+        for (uint32 i = 0; i < size; ++i, ++begin) {
+            Slot& slot = _slots[(pos + i) & _mask];
+            new(slot.storage) Type(std::move(*begin));
+            slot.sequence.store(pos + i + 1, std::memory_order_release);
+        }
+        if (size) notify(_take_side);
+        return size;
+    }
+
+    template <typename Type>
+    template <typename Iter>
+    uint32 MPMCQueue<Type>::put_n(Iter begin, uint32 n) {
+        uint32 total = 0;
+        while (total < n) {
+            uint32 size = 0;
+            bool running = wait_for(_put_side, [&] {
+                size = try_put_n(begin, n - total);
+                return size > 0;
+            }, writable());
+            if (!running) break;
+            std::advance(begin, size);
+            total += size;
+        }
+        return total;
+    }
+
+    template <typename Type>
+    template <typename Iter>
+    uint32 MPMCQueue<Type>::try_take_n(Iter dest, uint32 n) {
+        if (stopping() || n == 0) return 0;
+        uint64 pos;
+        uint32 size = claim_take(pos, n);
+        for (uint32 i = 0; i < size; ++i, ++dest) {
+            Slot& slot = _slots[(pos + i) & _mask];
+            Type *value = slot.value();
+            *dest = std::move(*value);
+            value->~Type();
+            slot.sequence.store(pos + i + _mask + 1, std::memory_order_release);
+        }
+        if (size) notify(_put_side);
+        return size;
+    }
+
+    template <typename Type>
+    template <typename Iter>
+    uint32 MPMCQueue<Type>::take_n(Iter dest, uint32 n) {
+        uint32 size = 0;
+        wait_for(_take_side, [&] {
+            size = try_take_n(dest, n);
+            return size > 0;
+        }, readable());
+        return size;
+    }
+
+    template <typename Type>
+    void MPMCQueue<Type>::clear() {
+        uint64 pos;
+        while (claim_take(pos, 1)) {
+            Slot& slot = _slots[pos & _mask];
+            slot.value()->~Type();
+            slot.sequence.store(pos + _mask + 1, std::memory_order_release);
+        }
+        notify(_put_side, true);
+    }
+
+    template <typename Type>
+    void MPMCQueue<Type>::start() {
+        _run.store(true, std::memory_order_release);
+    }
+
+    template <typename Type>
+    void MPMCQueue<Type>::stop() {
+        _run.store(false, std::memory_order_seq_cst);
+        notify(_put_side, true);
+        notify(_take_side, true);
+    }
+
+    template <typename Type>
+    template <typename Arg>
+    bool MPMCQueue<Type>::try_emplace(Arg&& val) {
+        if (stopping()) return false;
+        uint64 pos;
+        if (!claim_put(pos, 1)) return false;
+        Slot& slot = _slots[pos & _mask];
+        new(slot.storage) Type(std::forward<Arg>(val));
+        slot.sequence.store(pos + 1, std::memory_order_release);
+        notify(_take_side);
+        return true;
+    }
+
+    template <typename Type>
+    template <typename Arg>
+    bool MPMCQueue<Type>::emplace(Arg&& val) {
+        return wait_for(_put_side, [&] {
+            return try_emplace(std::forward<Arg>(val));
+        }, writable());
+    }
+
+    template <typename Type>
+    uint32 MPMCQueue<Type>::claim_put(uint64& pos, uint32 n) {
+        pos = _put_pos.load(std::memory_order_relaxed);
+        while (true) {
+            uint32 size = 0;
+            while (size < n) {
+                uint64 seq = _slots[(pos + size) & _mask].sequence.load(std::memory_order_acquire);
+                if (seq != pos + size) break;
+                ++size;
+            }
+            if (size == 0) {
+                /// 槽位序号落后说明队列已满，否则是被其他生产者抢先，重新读取位置。
+                uint64 seq = _slots[pos & _mask].sequence.load(std::memory_order_acquire);
+                if ((int64) (seq - pos) < 0) return 0;
+                pos = _put_pos.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (_put_pos.compare_exchange_weak(pos, pos + size, std::memory_order_relaxed))
+                return size;
+        }
+    }
+
+    template <typename Type>
+    uint32 MPMCQueue<Type>::claim_take(uint64& pos, uint32 n) {
+        pos = _take_pos.load(std::memory_order_relaxed);
+        while (true) {
+            uint32 size = 0;
+            while (size < n) {
+                uint64 seq = _slots[(pos + size) & _mask].sequence.load(std::memory_order_acquire);
+                if (seq != pos + size + 1) break;
+                ++size;
+            }
+            if (size == 0) {
+                uint64 seq = _slots[pos & _mask].sequence.load(std::memory_order_acquire);
+                if ((int64) (seq - (pos + 1)) < 0) return 0;
+                pos = _take_pos.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (_take_pos.compare_exchange_weak(pos, pos + size, std::memory_order_relaxed))
+                return size;
+        }
+    }
+
+    template <typename Type>
+    template <typename Fun, typename Remain>
+    bool MPMCQueue<Type>::wait_for(WaitSide& side, Fun fun, Remain remain) {
+        /// 单核机器上自旋没有意义，只会推迟对方线程的运行。
+        static const uint32 spin_times = std::thread::hardware_concurrency() > 1 ? SPIN_TIMES : 0;
+        for (uint32 i = 0; i < spin_times; ++i) {
+            if (stopping()) return false;
+            if (fun()) return true;
+            Detail::cpu_relax();
+        }
+        while (true) {
+            /// 先读取事件号并登记等待，再重试一次，与 notify 中先递增事件号再检查等待者配对。
+            uint32 current = side.event.load(std::memory_order_seq_cst);
+            side.waiters.fetch_add(1, std::memory_order_seq_cst);
+            if (stopping()) {
+                side.waiters.fetch_sub(1, std::memory_order_relaxed);
+                return false;
+            }
+            if (fun()) {
+                side.waiters.fetch_sub(1, std::memory_order_relaxed);
+                /// 登记后可能已有通知者置位 signaled，必须复位，否则之后的通知都会被跳过。
+                side.signaled.store(false, std::memory_order_release);
+                return true;
+            }
+            Detail::futex_wait(side.event, current);
+            side.waiters.fetch_sub(1, std::memory_order_relaxed);
+            /// 与 notify 中的 exchange 同步，保证能看到唤醒前放入/取出的结果。
+            side.signaled.exchange(false, std::memory_order_acq_rel);
+            if (stopping()) return false;
+            if (fun()) {
+                /// 唤醒期间跳过的通知由被唤醒者接力补上。
+                if (remain() && side.waiters.load(std::memory_order_seq_cst) != 0)
+                    notify(side);
+                return true;
+            }
+        }
+    }
+
+    template <typename Type>
+    void MPMCQueue<Type>::notify(WaitSide& side, bool all) {
+        side.event.fetch_add(1, std::memory_order_seq_cst);
+        if (side.waiters.load(std::memory_order_seq_cst) == 0) return;
+        if (all) {
+            side.signaled.store(true, std::memory_order_release);
+            Detail::futex_wake(side.event);
+        } else if (!side.signaled.exchange(true, std::memory_order_acq_rel)) {
+            Detail::futex_wake(side.event, 1);
+        }
+    }
+
+}
+
+#endif
+
+#endif //BASE_MPMCQUEUE_HPP
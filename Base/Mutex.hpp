@@ -166,6 +166,66 @@ namespace Base {
 
     };
 
+    /// 读写锁，写者优先，避免大量读者时写者饥饿。
+    class SharedMutex : NoCopy {
+    public:
+        SharedMutex() {
+            pthread_rwlockattr_t attr;
+            CAPI_CHECK(pthread_rwlockattr_init(&attr))
+            CAPI_CHECK(pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP))
+            CAPI_CHECK(pthread_rwlock_init(&_lock, &attr))
+            CAPI_CHECK(pthread_rwlockattr_destroy(&attr))
+        };
+
+        ~SharedMutex() {
+            CAPI_CHECK(pthread_rwlock_destroy(&_lock))
+        };
+
+        void lock() {
+            CAPI_CHECK(pthread_rwlock_wrlock(&_lock))
+        };
+
+        bool try_lock() {
+            return pthread_rwlock_trywrlock(&_lock) == 0;
+        };
+
+        void unlock() {
+            CAPI_CHECK(pthread_rwlock_unlock(&_lock))
+        };
+
+        void lock_shared() {
+            CAPI_CHECK(pthread_rwlock_rdlock(&_lock))
+        };
+
+        bool try_lock_shared() {
+            return pthread_rwlock_tryrdlock(&_lock) == 0;
+        };
+
+        void unlock_shared() {
+            CAPI_CHECK(pthread_rwlock_unlock(&_lock))
+        };
+
+    private:
+        pthread_rwlock_t _lock {};
+
+    };
+
+    template <typename Mutex>
+    class SharedLock : NoCopy {
+    public:
+        explicit SharedLock(Mutex& lock) : _lock(lock) {
+            _lock.lock_shared();
+        };
+
+        ~SharedLock() {
+            _lock.unlock_shared();
+        };
+
+    private:
+        Mutex& _lock;
+
+    };
+
     template <typename Mutex>
     class ReentrantMutex : Mutex {
     public:
@@ -0,0 +1,266 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#ifndef BASE_PARALLELALGORITHM_HPP
+#define BASE_PARALLELALGORITHM_HPP
+
+#ifdef BASE_PARALLELALGORITHM_HPP
+
+#include <vector>
+#include <atomic>
+#include <utility>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include "Mutex.hpp"
+#include "Exception.hpp"
+
+/*
+ * 数据并行算法，Pool 可以是 ThreadPool 或 WorkStealingPool，要求存在:
+ *      submit(Fun) 提交任务，stolen_a_task() 当前线程执行池中的一个任务，
+ *      joinable() 能否继续提交，get_core_threads() 工作线程数量。
+ *
+ * 所有算法在返回前由调用线程参与执行（调用线程在池内时同样如此），不会阻塞等待，
+ * 因此可以在池内任务中嵌套使用。grain 为 0 时根据线程数自动选择粒度。
+ * 子任务抛出的第一个异常会在所有子任务结束后由调用线程重新抛出。
+ * 线程池清除任务或关闭时被丢弃的子任务视为抛出了 Exception("... interrupted")。
+ */
+
+namespace Base {
+
+    namespace Detail {
+
+        /// 一组并行子任务：计数、异常收集与协作等待。
+        class ParallelGroup : NoCopy {
+        public:
+            ParallelGroup() = default;
+
+            template <typename Pool, typename Fun>
+            void run(Pool& pool, Fun fun) {
+                _pending.fetch_add(1, std::memory_order_relaxed);
+                Task<Fun> task(this, std::move(fun));
+                if (pool.joinable()) {
+                    try {
+                        pool.submit(std::move(task));
+                        return;
+                    } catch (Exception&) {}
+                }
+                /// 线程池无法接收任务时直接在当前线程执行，任务已经交给线程池时由其负责结束计数。
+                if (task.armed()) task();
+            };
+
+            template <typename Pool>
+            void wait(Pool& pool) {
+                while (_pending.load(std::memory_order_acquire) != 0) {
+                    if (!pool.stolen_a_task())
+                        CurrentThread::yield_this_thread();
+                }
+                if (_error) std::rethrow_exception(_error);
+            };
+
+        private:
+            /// 提交给线程池的子任务，没有执行就被销毁时（线程池清除任务或关闭）记录中断并结束计数。
+            template <typename Fun>
+            class Task {
+            public:
+                Task(ParallelGroup *group, Fun fun) : _group(group), _fun(std::move(fun)) {};
+
+                Task(Task&& other) noexcept :
+                    _group(std::exchange(other._group, nullptr)), _fun(std::move(other._fun)) {};
+
+                Task& operator=(Task&&) = delete;
+
+                ~Task() { if (_group) _group->interrupt(); };
+
+                [[nodiscard]] bool armed() const { return _group != nullptr; };
+
+                void operator()() { std::exchange(_group, nullptr)->execute(_fun); };
+
+            private:
+                ParallelGroup *_group;
+
+                Fun _fun;
+            };
+
+            std::atomic<uint64> _pending = 0;
+
+            std::atomic<bool> _failed = false;
+
+            std::exception_ptr _error;
+
+            template <typename Fun>
+            void execute(Fun& fun) {
+                if (!_failed.load(std::memory_order_relaxed)) {
+                    try {
+                        fun();
+                    } catch (...) {
+                        if (!_failed.exchange(true, std::memory_order_acq_rel))
+                            _error = std::current_exception();
+                    }
+                }
+                /// 之后不能再访问 this，等待者可能已经返回。
+                _pending.fetch_sub(1, std::memory_order_release);
+            };
+
+            void interrupt() {
+                if (!_failed.exchange(true, std::memory_order_acq_rel))
+                    _error = std::make_exception_ptr(Exception("ParallelGroup: task was interrupted"));
+                _pending.fetch_sub(1, std::memory_order_release);
+            };
+
+        };
+
+        template <typename Pool>
+        uint64 parallel_grain(Pool& pool, uint64 size, uint64 grain, uint64 min_grain = 1) {
+            if (grain != 0) return grain;
+            uint64 threads = pool.get_core_threads() + 1;
+            grain = size / (threads * 4);
+            return grain < min_grain ? min_grain : grain;
+        }
+
+    }
+
+    /// 将 [begin, end) 切分为若干段，fun(range_begin, range_end) 并行处理每一段。
+    template <typename Pool, typename Index, typename Fun>
+    void parallel_for_range(Pool& pool, Index begin, Index end, Fun fun, uint64 grain = 0) {
+        if (!(begin < end)) return;
+        uint64 size = end - begin;
+        grain = Detail::parallel_grain(pool, size, grain);
+        if (size <= grain) {
+            fun(begin, end);
+            return;
+        }
+        Detail::ParallelGroup group;
+        Index first = begin;
+        Index last = begin + grain;
+        /// 第一段留给当前线程执行。
+        for (Index b = last; b < end;) {
+            Index e = end - b > grain ? b + grain : end;
+            group.run(pool, [&fun, b, e] { fun(b, e); });
+            b = e;
+        }
+        try {
+            fun(first, last);
+        } catch (...) {
+            group.wait(pool);
+            throw;
+        }
+        group.wait(pool);
+    }
+
+    /// 对 [begin, end) 中的每个下标（或迭代器）调用 fun(i)。
+    template <typename Pool, typename Index, typename Fun>
+    void parallel_for(Pool& pool, Index begin, Index end, Fun fun, uint64 grain = 0) {
+        parallel_for_range(pool, begin, end, [&fun] (Index b, Index e) {
+            for (; b != e; ++b) fun(b);
+        }, grain);
+    }
+
+    /// 返回 reduce(identity, map(begin), ..., map(end - 1))，reduce 需要满足结合律。
+    template <typename Pool, typename Index, typename Type, typename Map, typename Reduce>
+    Type parallel_reduce(Pool& pool, Index begin, Index end, Type identity,
+                         Map map, Reduce reduce, uint64 grain = 0) {
+        if (!(begin < end)) return identity;
+        uint64 size = end - begin;
+        grain = Detail::parallel_grain(pool, size, grain);
+        uint64 chunks = (size + grain - 1) / grain;
+        std::vector<Type> partial(chunks, identity);
+        parallel_for(pool, (uint64) 0, chunks, [&] (uint64 chunk) {
+            Index b = begin + chunk * grain;
+            Index e = chunk + 1 == chunks ? end : b + grain;
+            Type value = identity;
+            for (; b != e; ++b)
+                value = reduce(std::move(value), map(b));
+            partial[chunk] = std::move(value);
+        }, 1);
+        Type result = std::move(identity);
+        for (auto& value : partial)
+            result = reduce(std::move(result), std::move(value));
+        return result;
+    }
+
+    /// 分段并行排序后两两并行归并，需要额外 O(n) 空间，排序不稳定。
+    template <typename Pool, typename RandomIter, typename Compare = std::less<>>
+    void parallel_sort(Pool& pool, RandomIter first, RandomIter last,
+                       Compare comp = Compare(), uint64 grain = 0) {
+        using Type = typename std::iterator_traits<RandomIter>::value_type;
+        uint64 size = last - first;
+        grain = Detail::parallel_grain(pool, size, grain, 1 << 12);
+        if (size <= grain) {
+            std::sort(first, last, comp);
+            return;
+        }
+        uint64 chunks = (size + grain - 1) / grain;
+        parallel_for(pool, (uint64) 0, chunks, [&] (uint64 chunk) {
+            uint64 b = chunk * grain, e = std::min(size, b + grain);
+            std::sort(first + b, first + e, comp);
+        }, 1);
+
+        std::vector<Type> buffer(std::make_move_iterator(first), std::make_move_iterator(last));
+        bool in_buffer = true;
+        for (uint64 width = grain; width < size; width <<= 1) {
+            uint64 pairs = (size + 2 * width - 1) / (2 * width);
+            auto merge = [&] (auto src, auto dest) {
+                parallel_for(pool, (uint64) 0, pairs, [&] (uint64 pair) {
+                    uint64 b = pair * 2 * width;
+                    uint64 m = std::min(size, b + width), e = std::min(size, b + 2 * width);
+                    std::merge(std::make_move_iterator(src + b), std::make_move_iterator(src + m),
+                               std::make_move_iterator(src + m), std::make_move_iterator(src + e),
+                               dest + b, comp);
+                }, 1);
+            };
+            if (in_buffer) merge(buffer.begin(), first);
+            else merge(first, buffer.begin());
+            in_buffer = !in_buffer;
+        }
+        if (in_buffer) {
+            parallel_for_range(pool, (uint64) 0, size, [&] (uint64 b, uint64 e) {
+                std::move(buffer.begin() + b, buffer.begin() + e, first + b);
+            });
+        }
+    }
+
+    /// 包含式前缀扫描：*(dest + i) = op(init, *first, ..., *(first + i))，op 需要满足结合律。
+    /// 返回最后一个结果（区间为空时返回 init）。
+    template <typename Pool, typename InputIter, typename OutputIter, typename Type, typename Op>
+    Type parallel_scan(Pool& pool, InputIter first, InputIter last, OutputIter dest,
+                       Type init, Op op, uint64 grain = 0) {
+        uint64 size = last - first;
+        if (size == 0) return init;
+        grain = Detail::parallel_grain(pool, size, grain, 1 << 10);
+        uint64 chunks = (size + grain - 1) / grain;
+
+        /// 1. 各段求和（最后一段不需要）。
+        std::vector<Type> offsets(chunks, init);
+        parallel_for(pool, (uint64) 0, chunks - 1, [&] (uint64 chunk) {
+            auto b = first + chunk * grain, e = b + grain;
+            Type sum = *b;
+            for (++b; b != e; ++b)
+                sum = op(std::move(sum), *b);
+            offsets[chunk + 1] = std::move(sum);
+        }, 1);
+
+        /// 2. 段间前缀。
+        for (uint64 chunk = 1; chunk < chunks; ++chunk)
+            offsets[chunk] = op(offsets[chunk - 1], offsets[chunk]);
+
+        /// 3. 各段以前缀为起点扫描。
+        Type last_value = init;
+        parallel_for(pool, (uint64) 0, chunks, [&] (uint64 chunk) {
+            uint64 b = chunk * grain, e = std::min(size, b + grain);
+            Type sum = offsets[chunk];
+            for (uint64 i = b; i < e; ++i) {
+                sum = op(std::move(sum), *(first + i));
+                *(dest + i) = sum;
+            }
+            if (chunk + 1 == chunks) last_value = std::move(sum);
+        }, 1);
+        return last_value;
+    }
+
+}
+
+#endif
+
+#endif //BASE_PARALLELALGORITHM_HPP
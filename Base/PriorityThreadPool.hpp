@@ -0,0 +1,222 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#ifndef BASE_PRIORITYTHREADPOOL_HPP
+#define BASE_PRIORITYTHREADPOOL_HPP
+
+#ifdef BASE_PRIORITYTHREADPOOL_HPP
+
+#include <map>
+#include <vector>
+#include "Thread.hpp"
+#include "Condition.hpp"
+#include "Detail/AsyncFun.hpp"
+
+namespace Base {
+
+    /// 多级优先级线程池。
+    /// level 越小优先级越高；同一级别内按截止时间最早优先（EDF），截止时间相同按提交顺序。
+    /// 为防止低优先级任务饿死，任务每等待 aging_interval，其有效级别提升一级；
+    /// 级别内最早提交的任务已经提升时先于 EDF 的队首执行。
+    /// 每个级别可以设置同时运行的任务数上限，达到上限时该级别的任务暂不调度。
+    class PriorityThreadPool : NoCopy {
+    public:
+        struct ClassMetrics {
+            /// 排队中的任务数
+            uint32 queue_depth = 0;
+            /// 正在运行的任务数
+            uint32 running = 0;
+            /// 同时运行的任务数上限
+            uint32 max_running = MAX_UINT;
+
+            uint64 submitted = 0;
+
+            uint64 completed = 0;
+            /// 已超过截止时间才开始执行的任务数
+            uint64 missed_deadline = 0;
+            /// 从提交到开始执行的等待时间
+            TimeInterval total_wait;
+
+            TimeInterval max_wait;
+
+            [[nodiscard]] TimeInterval average_wait() const {
+                uint64 started = completed + running;
+                return started ? TimeInterval(total_wait.nanoseconds / (int64) started) : TimeInterval();
+            };
+        };
+
+        /// default_deadline 为未指定截止时间的任务使用的相对截止时间。
+        PriorityThreadPool(uint32 threads_size, uint32 max_tasks_size, uint32 levels,
+                           TimeInterval aging_interval = TimeInterval(100 * MS_),
+                           TimeInterval default_deadline = TimeInterval(SEC_));
+
+        ~PriorityThreadPool();
+
+        template <typename Fun_, typename... Args>
+        void submit(uint32 level, Fun_&& fun, Args&&... args);
+
+        template <typename Fun_, typename... Args>
+        auto submit_with_future(uint32 level, Fun_&& fun, Args&&... args);
+
+        /// deadline 为绝对时间（与 Unix_to_now() 同一时钟）。
+        template <typename Fun_, typename... Args>
+        void submit_with_deadline(uint32 level, TimeInterval deadline, Fun_&& fun, Args&&... args);
+
+        template <typename Fun_, typename... Args>
+        auto submit_with_deadline_future(uint32 level, TimeInterval deadline, Fun_&& fun, Args&&... args);
+
+        /// 设置 level 级别同时运行的任务数上限，0 视为 1。
+        void set_class_limit(uint32 level, uint32 max_running);
+
+        [[nodiscard]] ClassMetrics get_metrics(uint32 level);
+
+        void reset_metrics();
+
+        void stop();
+
+        void start();
+
+        void clear_task();
+
+        void shutdown();
+
+        [[nodiscard]] uint32 get_levels() const { return _classes.size(); };
+
+        [[nodiscard]] uint32 get_max_queues() const { return _max_tasks; };
+
+        [[nodiscard]] uint32 get_core_threads() const { return _threads.size(); };
+
+        [[nodiscard]] uint32 get_free_tasks() const { return _total_tasks.load(std::memory_order_relaxed); };
+
+        [[nodiscard]] bool stopping() const { return _state.load(std::memory_order_consume) > RUNNING; };
+
+        [[nodiscard]] bool joinable() const {
+            return _state.load(std::memory_order_consume) == RUNNING
+                && _total_tasks.load(std::memory_order_relaxed) < _max_tasks;
+        };
+
+    private:
+        using State = std::atomic<uint32>;
+        using Fun = std::function<void(bool)>;
+
+        enum { RUNNING, STOP, SHUTTING, TERMINATED };
+
+        struct Task {
+            TimeInterval deadline;
+
+            TimeInterval submit_time;
+
+            uint64 sequence;
+
+            Fun fun;
+        };
+
+        using TaskKey = std::pair<TimeInterval, uint64>;
+
+        struct Class {
+            /// 按 (deadline, sequence) 排列
+            std::map<TaskKey, Task> tasks;
+
+            /// 按提交顺序排列的 sequence 与 deadline，用于找出等待最久的任务
+            std::map<uint64, TimeInterval> fifo;
+
+            ClassMetrics metrics;
+        };
+
+        Mutex _lock;
+
+        Condition _consume, _submit;
+
+        State _state = RUNNING;
+
+        uint32 _max_tasks;
+
+        std::atomic<uint32> _total_tasks = 0;
+
+        uint64 _sequence = 0;
+
+        TimeInterval _aging_interval, _default_deadline;
+
+        std::vector<Class> _classes;
+
+        std::vector<Thread> _threads;
+
+        void thread_loop();
+
+        void push_task(uint32 level, TimeInterval deadline, Fun fun);
+
+        /// 选出下一个可以执行的级别，没有时返回 MAX_UINT。
+        [[nodiscard]] uint32 select_class(TimeInterval now) const;
+
+        Task pop_task(uint32 level, TimeInterval now);
+
+        /// 级别内下一个执行的任务及其提升的级数，c 不能为空。
+        [[nodiscard]] std::pair<TaskKey, int64> next_task(const Class& c, TimeInterval now) const;
+
+        void kill_all_tasks();
+
+        template <typename Fun_, typename... Args>
+        static Fun create_fun(Fun_&& fun, Args&&... args);
+
+        template <typename Fun_, typename... Args>
+        static auto create_fun_with_future(Fun_&& fun, Args&&... args);
+
+    };
+
+}
+
+namespace Base {
+
+    template <typename Fun_, typename... Args>
+    void PriorityThreadPool::submit(uint32 level, Fun_&& fun, Args&&... args) {
+        submit_with_deadline(level, Unix_to_now() + _default_deadline,
+                             std::forward<Fun_>(fun), std::forward<Args>(args)...);
+    }
+
+    template <typename Fun_, typename... Args>
+    auto PriorityThreadPool::submit_with_future(uint32 level, Fun_&& fun, Args&&... args) {
+        return submit_with_deadline_future(level, Unix_to_now() + _default_deadline,
+                                           std::forward<Fun_>(fun), std::forward<Args>(args)...);
+    }
+
+    template <typename Fun_, typename... Args>
+    void PriorityThreadPool::submit_with_deadline(uint32 level, TimeInterval deadline,
+                                                  Fun_&& fun, Args&&... args) {
+        push_task(level, deadline, create_fun(std::forward<Fun_>(fun), std::forward<Args>(args)...));
+    }
+
+    template <typename Fun_, typename... Args>
+    auto PriorityThreadPool::submit_with_deadline_future(uint32 level, TimeInterval deadline,
+                                                         Fun_&& fun, Args&&... args) {
+        auto [f, future] = create_fun_with_future(std::forward<Fun_>(fun), std::forward<Args>(args)...);
+        push_task(level, deadline, std::move(f));
+        return std::move(future);
+    }
+
+    template <typename Fun_, typename... Args>
+    PriorityThreadPool::Fun PriorityThreadPool::create_fun(Fun_&& fun, Args&&... args) {
+        return [f = std::function<void()>(std::bind(std::forward<Fun_>(fun), std::forward<Args>(args)...))]
+            (bool kill) {
+                if (!kill && f) f();
+            };
+    }
+
+    template <typename Fun_, typename... Args>
+    auto PriorityThreadPool::create_fun_with_future(Fun_&& fun, Args&&... args) {
+        using Result_Type = std::result_of_t<Fun_(Args...)>;
+        auto ptr = std::make_shared<Detail::AsyncFun<Result_Type, Fun_, Args...>>(
+            std::forward<Fun_>(fun), std::forward<Args>(args)...);
+        auto future = ptr->get_future();
+        Fun f = [ptr] (bool kill) {
+            if (kill) ptr->kill_task();
+            else (*ptr)();
+        };
+        return std::make_pair(std::move(f), std::move(future));
+    }
+
+}
+
+#endif
+
+#endif //BASE_PRIORITYTHREADPOOL_HPP
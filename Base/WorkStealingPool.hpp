@@ -0,0 +1,194 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#ifndef BASE_WORKSTEALINGPOOL_HPP
+#define BASE_WORKSTEALINGPOOL_HPP
+
+#ifdef BASE_WORKSTEALINGPOOL_HPP
+
+#include <deque>
+#include <future>
+#include <vector>
+#include <memory>
+#include "Thread.hpp"
+#include "Condition.hpp"
+#include "Exception.hpp"
+#include "Detail/SmallTask.hpp"
+#include "Detail/StealingDeque.hpp"
+
+namespace Base {
+
+    /// 工作窃取线程池：每个工作线程持有一个 Chase-Lev 双端队列。
+    /// 池内线程提交的任务压入自己队列的底部（LIFO，缓存友好），空闲线程从随机选择的其他线程顶部窃取；
+    /// 池外线程提交的任务进入共享队列。任务对象带小对象缓冲并在执行它的线程本地复用，
+    /// 池内提交在稳定状态下不分配内存；池外线程的缓存得不到回收的任务，每次提交仍会分配。
+    /// 适合 fork-join 型的递归并行任务，等待子任务时应使用 help_until 而不是阻塞。
+    /// 任务抛出的异常会被打印后忽略，需要结果的任务使用 submit_with_future。
+    class WorkStealingPool : NoCopy {
+    public:
+        /// local_queue_size 为每个工作线程队列的容量，队列满时任务进入共享队列。
+        explicit WorkStealingPool(uint32 threads_size, uint32 max_tasks_size = MAX_UINT,
+                                  uint32 local_queue_size = 4096);
+
+        ~WorkStealingPool();
+
+        template <typename Fun_, typename... Args>
+        void submit(Fun_&& fun, Args&&... args);
+
+        template <typename Fun_, typename... Args>
+        auto submit_with_future(Fun_&& fun, Args&&... args);
+
+        /// 当前线程从池中取出一个任务并执行，没有任务时返回 false。
+        bool stolen_a_task();
+
+        /// 在 fun() 返回 true 之前不断帮助执行池中的任务，shutdown 期间改为取消取到的任务。
+        template <typename Fun>
+        void help_until(Fun fun);
+
+        void stop();
+
+        void start();
+
+        void clear_task();
+
+        void shutdown();
+
+        [[nodiscard]] uint32 get_max_queues() const { return _max_tasks; };
+
+        [[nodiscard]] uint32 get_core_threads() const { return _workers.size(); };
+
+        [[nodiscard]] uint32 get_free_tasks() const { return _queued.load(std::memory_order_relaxed); };
+
+        [[nodiscard]] bool stopping() const { return _state.load(std::memory_order_consume) > RUNNING; };
+
+        [[nodiscard]] bool joinable() const {
+            return _state.load(std::memory_order_consume) == RUNNING
+                && _queued.load(std::memory_order_relaxed) < _max_tasks;
+        };
+
+        [[nodiscard]] bool current_thread_in_this_pool() const;
+
+    private:
+        using Task = Detail::SmallTask;
+        using State = std::atomic<uint32>;
+
+        enum { RUNNING, STOP, SHUTTING, TERMINATED };
+
+        struct alignas(64) Worker {
+            explicit Worker(uint32 queue_size, uint32 seed) : queue(queue_size), seed(seed) {};
+
+            Detail::StealingDeque<Task *> queue;
+
+            Thread thread;
+
+            uint32 seed;
+        };
+
+        Mutex _lock;
+
+        Condition _consume, _submit;
+
+        State _state = RUNNING;
+
+        uint32 _max_tasks;
+
+        std::atomic<uint32> _queued = 0, _sleeping = 0, _shared_size = 0;
+
+        std::deque<Task *> _shared;
+
+        std::vector<std::unique_ptr<Worker>> _workers;
+
+        void thread_loop(Worker& self);
+
+        void push_task(Task *task);
+
+        Task* take_task(Worker *self);
+
+        Task* steal_task(Worker *self);
+
+        void run_task(Task *task);
+
+        void notify_sleeping();
+
+        static Worker*& local_worker();
+
+        static Task* allocate_task();
+
+        static void recycle_task(Task *task);
+
+        template <typename Fun_, typename... Args>
+        static auto bind_fun(Fun_&& fun, Args&&... args);
+
+    };
+
+}
+
+namespace Base {
+
+    template <typename Fun_, typename... Args>
+    void WorkStealingPool::submit(Fun_&& fun, Args&&... args) {
+        if (stopping())
+            throw Exception("This Task have been interrupted");
+        Task *task = allocate_task();
+        task->assign([f = bind_fun(std::forward<Fun_>(fun), std::forward<Args>(args)...)]
+            (bool kill) mutable {
+                if (!kill) f();
+            });
+        push_task(task);
+    }
+
+    template <typename Fun_, typename... Args>
+    auto WorkStealingPool::submit_with_future(Fun_&& fun, Args&&... args) {
+        using Result_Type = std::invoke_result_t<std::decay_t<Fun_>, std::decay_t<Args>...>;
+        if (stopping())
+            throw Exception("This Task have been interrupted");
+        std::promise<Result_Type> promise;
+        auto future = promise.get_future();
+        Task *task = allocate_task();
+        task->assign([f = bind_fun(std::forward<Fun_>(fun), std::forward<Args>(args)...),
+                p = std::move(promise)] (bool kill) mutable {
+                if (kill) {
+                    p.set_exception(std::make_exception_ptr(Exception("This Task have been interrupted")));
+                    return;
+                }
+                try {
+                    if constexpr (std::is_same_v<Result_Type, void>) {
+                        f();
+                        p.set_value();
+                    } else {
+                        p.set_value(f());
+                    }
+                } catch (...) {
+                    p.set_exception(std::current_exception());
+                }
+            });
+        push_task(task);
+        return future;
+    }
+
+    template <typename Fun>
+    void WorkStealingPool::help_until(Fun fun) {
+        while (!fun()) {
+            if (!stolen_a_task())
+                CurrentThread::yield_this_thread();
+        }
+    }
+
+    template <typename Fun_, typename... Args>
+    auto WorkStealingPool::bind_fun(Fun_&& fun, Args&&... args) {
+        if constexpr (sizeof...(Args) == 0) {
+            return std::forward<Fun_>(fun);
+        } else {
+            return [fun = std::forward<Fun_>(fun),
+                    args = std::make_tuple(std::forward<Args>(args)...)] () mutable {
+                return std::apply(fun, std::move(args));
+            };
+        }
+    }
+
+}
+
+#endif
+
+#endif //BASE_WORKSTEALINGPOOL_HPP
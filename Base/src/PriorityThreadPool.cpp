@@ -0,0 +1,203 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#include "../PriorityThreadPool.hpp"
+
+using namespace Base;
+
+
+PriorityThreadPool::PriorityThreadPool(uint32 threads_size, uint32 max_tasks_size, uint32 levels,
+                                       TimeInterval aging_interval, TimeInterval default_deadline) :
+    _max_tasks(max_tasks_size), _aging_interval(aging_interval),
+    _default_deadline(default_deadline), _classes(levels ? levels : 1) {
+    if (_aging_interval.nanoseconds <= 0) _aging_interval = TimeInterval(MS_);
+    _threads.reserve(threads_size);
+    for (uint32 i = 0; i < threads_size; ++i) {
+        _threads.emplace_back([this] { thread_loop(); });
+        _threads.back().start();
+    }
+}
+
+PriorityThreadPool::~PriorityThreadPool() {
+    shutdown();
+}
+
+void PriorityThreadPool::set_class_limit(uint32 level, uint32 max_running) {
+    Lock l(_lock);
+    if (level >= _classes.size())
+        throw Exception("PriorityThreadPool: level out of range");
+    _classes[level].metrics.max_running = max_running ? max_running : 1;
+    _consume.notify_all();
+}
+
+PriorityThreadPool::ClassMetrics PriorityThreadPool::get_metrics(uint32 level) {
+    Lock l(_lock);
+    if (level >= _classes.size())
+        throw Exception("PriorityThreadPool: level out of range");
+    ClassMetrics result = _classes[level].metrics;
+    result.queue_depth = _classes[level].tasks.size();
+    return result;
+}
+
+void PriorityThreadPool::reset_metrics() {
+    Lock l(_lock);
+    for (auto& c : _classes) {
+        auto& m = c.metrics;
+        m.submitted = m.completed = m.missed_deadline = 0;
+        m.total_wait = m.max_wait = TimeInterval();
+    }
+}
+
+void PriorityThreadPool::stop() {
+    if (_state.load(std::memory_order_consume) == RUNNING) {
+        Lock l(_lock);
+        _state.store(STOP, std::memory_order_release);
+        _submit.notify_all();
+    }
+}
+
+void PriorityThreadPool::start() {
+    if (_state.load(std::memory_order_consume) == STOP) {
+        Lock l(_lock);
+        _state.store(RUNNING, std::memory_order_release);
+        _submit.notify_all();
+        _consume.notify_all();
+    }
+}
+
+void PriorityThreadPool::clear_task() {
+    Lock l(_lock);
+    kill_all_tasks();
+    _submit.notify_all();
+}
+
+void PriorityThreadPool::shutdown() {
+    {
+        Lock l(_lock);
+        if (_state.load(std::memory_order_acquire) > STOP) return;
+        _state.store(SHUTTING, std::memory_order_release);
+        kill_all_tasks();
+        _consume.notify_all();
+        _submit.notify_all();
+    }
+    for (auto& thread : _threads)
+        thread.join();
+    _state.store(TERMINATED, std::memory_order_release);
+}
+
+void PriorityThreadPool::thread_loop() {
+    CurrentThread::thread_name().append("(priority pool)");
+    while (true) {
+        uint32 level;
+        Task task;
+        {
+            Lock l(_lock);
+            _consume.wait(l, [this, &level] {
+                uint32 state = _state.load(std::memory_order_acquire);
+                if (state >= SHUTTING) return true;
+                if (state == STOP) return false;
+                level = select_class(Unix_to_now());
+                return level != MAX_UINT;
+            });
+            if (_state.load(std::memory_order_acquire) >= SHUTTING) break;
+            task = pop_task(level, Unix_to_now());
+            _submit.notify_one();
+        }
+
+        try {
+            task.fun(false);
+        } catch (...) {
+            Lock l(_lock);
+            auto& metrics = _classes[level].metrics;
+            --metrics.running;
+            ++metrics.completed;
+            _consume.notify_one();
+            throw;
+        }
+
+        Lock l(_lock);
+        auto& metrics = _classes[level].metrics;
+        --metrics.running;
+        ++metrics.completed;
+        /// 该级别可能因为并发上限而有任务被挂起，唤醒一个线程重新选择。
+        if (!_classes[level].tasks.empty())
+            _consume.notify_one();
+    }
+}
+
+void PriorityThreadPool::push_task(uint32 level, TimeInterval deadline, Fun fun) {
+    if (level >= _classes.size())
+        throw Exception("PriorityThreadPool: level out of range");
+    Lock l(_lock);
+    _submit.wait(l, [this] {
+        return stopping() || _total_tasks.load(std::memory_order_relaxed) < _max_tasks;
+    });
+    if (stopping()) {
+        fun(true);
+        throw Exception("This Task have been interrupted");
+    }
+    auto& c = _classes[level];
+    uint64 sequence = _sequence++;
+    c.tasks.emplace(TaskKey(deadline, sequence), Task { deadline, Unix_to_now(), sequence, std::move(fun) });
+    c.fifo.emplace(sequence, deadline);
+    ++c.metrics.submitted;
+    _total_tasks.fetch_add(1, std::memory_order_relaxed);
+    _consume.notify_one();
+}
+
+uint32 PriorityThreadPool::select_class(TimeInterval now) const {
+    uint32 result = MAX_UINT;
+    int64 best_level = 0;
+    TimeInterval best_deadline;
+    for (uint32 i = 0; i < _classes.size(); ++i) {
+        const auto& c = _classes[i];
+        if (c.tasks.empty() || c.metrics.running >= c.metrics.max_running) continue;
+        auto [key, aged] = next_task(c, now);
+        int64 effective = (int64) i - aged;
+        if (result == MAX_UINT || effective < best_level
+            || (effective == best_level && key.first < best_deadline)) {
+            result = i;
+            best_level = effective;
+            best_deadline = key.first;
+        }
+    }
+    return result;
+}
+
+PriorityThreadPool::Task PriorityThreadPool::pop_task(uint32 level, TimeInterval now) {
+    auto& c = _classes[level];
+    auto iter = c.tasks.find(next_task(c, now).first);
+    Task task = std::move(iter->second);
+    c.tasks.erase(iter);
+    c.fifo.erase(task.sequence);
+    _total_tasks.fetch_sub(1, std::memory_order_relaxed);
+
+    auto& metrics = c.metrics;
+    TimeInterval wait = now - task.submit_time;
+    metrics.total_wait = metrics.total_wait + wait;
+    if (wait > metrics.max_wait) metrics.max_wait = wait;
+    if (now > task.deadline) ++metrics.missed_deadline;
+    ++metrics.running;
+    return task;
+}
+
+void PriorityThreadPool::kill_all_tasks() {
+    for (auto& c : _classes) {
+        for (auto& [key, task] : c.tasks)
+            task.fun(true);
+        c.tasks.clear();
+        c.fifo.clear();
+    }
+    _total_tasks.store(0, std::memory_order_relaxed);
+}
+
+std::pair<PriorityThreadPool::TaskKey, int64>
+PriorityThreadPool::next_task(const Class& c, TimeInterval now) const {
+    /// 最早提交的任务等待最久，只有它提升了级别时才打破 EDF 的顺序。
+    auto [sequence, deadline] = *c.fifo.begin();
+    TaskKey oldest(deadline, sequence);
+    int64 aged = (now - c.tasks.at(oldest).submit_time).nanoseconds / _aging_interval.nanoseconds;
+    if (aged > 0) return { oldest, aged };
+    return { c.tasks.begin()->first, 0 };
+}
@@ -0,0 +1,271 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#include "../WorkStealingPool.hpp"
+
+using namespace Base;
+
+namespace {
+
+    /// 线程本地的空闲任务链表，避免每次提交都分配内存。
+    struct TaskCache {
+        static constexpr uint32 MAX_CACHED = 1024;
+
+        Detail::SmallTask *head = nullptr;
+
+        uint32 size = 0;
+
+        ~TaskCache() {
+            while (head) {
+                auto *next = head->next;
+                delete head;
+                head = next;
+            }
+        };
+    };
+
+    thread_local TaskCache task_cache;
+
+    uint32 next_random(uint32& seed) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+}
+
+WorkStealingPool::WorkStealingPool(uint32 threads_size, uint32 max_tasks_size,
+                                   uint32 local_queue_size) :
+    _max_tasks(max_tasks_size) {
+    if (threads_size == 0) threads_size = 1;
+    _workers.reserve(threads_size);
+    for (uint32 i = 0; i < threads_size; ++i)
+        _workers.emplace_back(std::make_unique<Worker>(local_queue_size, i * 2654435761u + 1));
+    for (auto& worker : _workers) {
+        Worker *ptr = worker.get();
+        worker->thread = Thread([this, ptr] { thread_loop(*ptr); });
+        worker->thread.start();
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    shutdown();
+}
+
+bool WorkStealingPool::stolen_a_task() {
+    uint32 state = _state.load(std::memory_order_acquire);
+    if (state == STOP || state == TERMINATED) return false;
+    Worker *self = current_thread_in_this_pool() ? local_worker() : nullptr;
+    Task *task = take_task(self);
+    if (!task) return false;
+    if (state == RUNNING) {
+        run_task(task);
+    } else {
+        /// 关闭过程中取消任务，使 help_until 等待的 future 就绪，否则 shutdown 会一直等待该线程。
+        (*task)(true);
+        recycle_task(task);
+    }
+    return true;
+}
+
+void WorkStealingPool::stop() {
+    if (_state.load(std::memory_order_consume) == RUNNING) {
+        Lock l(_lock);
+        _state.store(STOP, std::memory_order_release);
+        _submit.notify_all();
+    }
+}
+
+void WorkStealingPool::start() {
+    if (_state.load(std::memory_order_consume) == STOP) {
+        Lock l(_lock);
+        _state.store(RUNNING, std::memory_order_release);
+        _submit.notify_all();
+        _consume.notify_all();
+    }
+}
+
+void WorkStealingPool::clear_task() {
+    Worker *self = current_thread_in_this_pool() ? local_worker() : nullptr;
+    while (Task *task = take_task(self)) {
+        (*task)(true);
+        recycle_task(task);
+    }
+    Lock l(_lock);
+    _submit.notify_all();
+}
+
+void WorkStealingPool::shutdown() {
+    {
+        Lock l(_lock);
+        if (_state.load(std::memory_order_acquire) > STOP) return;
+        _state.store(SHUTTING, std::memory_order_release);
+        _consume.notify_all();
+        _submit.notify_all();
+    }
+    for (auto& worker : _workers)
+        worker->thread.join();
+
+    /// 所有工作线程退出后，剩余任务只会被当前线程访问。
+    Task *task;
+    for (auto& worker : _workers) {
+        while (worker->queue.pop(task)) {
+            (*task)(true);
+            recycle_task(task);
+        }
+    }
+    for (auto t : _shared) {
+        (*t)(true);
+        recycle_task(t);
+    }
+    _shared.clear();
+    _shared_size.store(0, std::memory_order_release);
+    _queued.store(0, std::memory_order_release);
+    _state.store(TERMINATED, std::memory_order_release);
+}
+
+bool WorkStealingPool::current_thread_in_this_pool() const {
+    return this == CurrentThread::thread_mark_ptr();
+}
+
+void WorkStealingPool::thread_loop(Worker& self) {
+    CurrentThread::thread_name().append("(stealing pool)");
+    CurrentThread::thread_mark_ptr() = this;
+    local_worker() = &self;
+    while (true) {
+        if (_state.load(std::memory_order_acquire) == RUNNING) {
+            if (Task *task = take_task(&self)) {
+                run_task(task);
+                continue;
+            }
+        }
+        Lock l(_lock);
+        /// 先登记休眠再检查任务数，与 push_task 中先增加任务数再检查休眠数配对，避免丢失唤醒。
+        _sleeping.fetch_add(1, std::memory_order_seq_cst);
+        _consume.wait(l, [this] {
+            uint32 state = _state.load(std::memory_order_seq_cst);
+            return state >= SHUTTING
+                || (state == RUNNING && _queued.load(std::memory_order_seq_cst) > 0);
+        });
+        _sleeping.fetch_sub(1, std::memory_order_relaxed);
+        if (_state.load(std::memory_order_acquire) >= SHUTTING) break;
+    }
+    local_worker() = nullptr;
+}
+
+void WorkStealingPool::push_task(Task *task) {
+    Worker *self = current_thread_in_this_pool() ? local_worker() : nullptr;
+    if (self) {
+        /// 池内提交不受 _max_tasks 限制，否则 fork-join 任务可能互相等待而死锁。
+        /// 先增加计数再入队，保证 _queued 不会因窃取者先取走任务而下溢。
+        _queued.fetch_add(1, std::memory_order_seq_cst);
+        if (self->queue.push(task)) {
+            notify_sleeping();
+            return;
+        }
+        Lock l(_lock);
+        _shared.push_back(task);
+        _shared_size.fetch_add(1, std::memory_order_release);
+        _consume.notify_one();
+        return;
+    }
+
+    Lock l(_lock);
+    _submit.wait(l, [this] {
+        return stopping() || _queued.load(std::memory_order_relaxed) < _max_tasks;
+    });
+    if (stopping()) {
+        (*task)(true);
+        recycle_task(task);
+        throw Exception("This Task have been interrupted");
+    }
+    _shared.push_back(task);
+    _shared_size.fetch_add(1, std::memory_order_release);
+    _queued.fetch_add(1, std::memory_order_seq_cst);
+    _consume.notify_one();
+}
+
+WorkStealingPool::Task* WorkStealingPool::take_task(Worker *self) {
+    Task *task = nullptr;
+    if (self && self->queue.pop(task)) {
+        _queued.fetch_sub(1, std::memory_order_relaxed);
+        return task;
+    }
+    if (_shared_size.load(std::memory_order_acquire) > 0) {
+        Lock l(_lock);
+        if (!_shared.empty()) {
+            /// 共享队列按提交顺序取出。
+            task = _shared.front();
+            _shared.pop_front();
+            _shared_size.fetch_sub(1, std::memory_order_relaxed);
+            _queued.fetch_sub(1, std::memory_order_relaxed);
+            _submit.notify_one();
+            return task;
+        }
+    }
+    return steal_task(self);
+}
+
+WorkStealingPool::Task* WorkStealingPool::steal_task(Worker *self) {
+    uint32 size = _workers.size();
+    static thread_local uint32 outside_seed = (uint32) (uint64) &outside_seed | 1;
+    uint32& seed = self ? self->seed : outside_seed;
+    Task *task = nullptr;
+    for (uint32 round = 0; round < 2; ++round) {
+        uint32 begin = next_random(seed) % size;
+        for (uint32 i = 0; i < size; ++i) {
+            Worker *victim = _workers[(begin + i) % size].get();
+            if (victim == self) continue;
+            if (victim->queue.steal(task)) {
+                _queued.fetch_sub(1, std::memory_order_relaxed);
+                return task;
+            }
+        }
+    }
+    return nullptr;
+}
+
+void WorkStealingPool::run_task(Task *task) {
+    /// 异常不能离开工作线程，也不能传给在 help_until 中顺带执行该任务的线程。
+    try {
+        (*task)(false);
+    } catch (...) {
+        CurrentThread::print_error_message("WorkStealingPool task throw error in "
+            + CurrentThread::thread_name());
+    }
+    recycle_task(task);
+}
+
+void WorkStealingPool::notify_sleeping() {
+    if (_sleeping.load(std::memory_order_seq_cst) > 0) {
+        Lock l(_lock);
+        _consume.notify_one();
+    }
+}
+
+WorkStealingPool::Worker*& WorkStealingPool::local_worker() {
+    static thread_local Worker *worker = nullptr;
+    return worker;
+}
+
+WorkStealingPool::Task* WorkStealingPool::allocate_task() {
+    if (Task *task = task_cache.head) {
+        task_cache.head = task->next;
+        --task_cache.size;
+        task->next = nullptr;
+        return task;
+    }
+    return new Task();
+}
+
+void WorkStealingPool::recycle_task(Task *task) {
+    if (task_cache.size >= TaskCache::MAX_CACHED) {
+        delete task;
+        return;
+    }
+    task->next = task_cache.head;
+    task_cache.head = task;
+    ++task_cache.size;
+}
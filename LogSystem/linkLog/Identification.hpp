@@ -178,6 +178,13 @@ namespace LogSystem {
 
 namespace std {
 
+    template <>
+    struct hash<LogSystem::LinkServiceID> {
+        std::size_t operator()(const LogSystem::LinkServiceID& id) const noexcept {
+            return _Hash_impl::hash(id.data(), LogSystem::SERVICE_ID_SIZE);
+        }
+    };
+
     template <>
     struct hash<LogSystem::Identification> {
         std::size_t operator()(const LogSystem::Identification& id) const noexcept {
@@ -9,6 +9,8 @@
 
 #include "LinkLogHandler.hpp"
 #include "LinkLogInterpreter.hpp"
+#include "LinkTraceSampler.hpp"
+#include "tinyBackend/Base/MPMCQueue.hpp"
 #include "tinyBackend/Net/reactor/Reactor.hpp"
 #include "tinyBackend/Net/InetAddress.hpp"
 
@@ -16,6 +18,10 @@ namespace Net {
     class MessageAgent;
 }
 
+namespace Base {
+    class WorkStealingPool;
+}
+
 namespace LogSystem {
 
     class LinkLogCenter {
@@ -36,10 +42,31 @@ namespace LogSystem {
 
         static constexpr int32 GET_ACTIVE_TIMEOUT = SERVER_TIMEOUT.to_ms();
 
+        /// 每个分区等待处理的批次数量上限，分区线程跟不上时 reactor 线程在放入时等待。
+        static constexpr uint32 PARTITION_QUEUE_SIZE = 1 << 6;
+
+        /// reactor 线程为一个分区累积的记录达到该大小时立即交给分区线程。
+        static constexpr uint32 PARTITION_BATCH_SIZE = 1 << 20;
+
+        /// read_compact_log 遇到无法解析的压缩日志时的返回值，连接上的数据已经不可信。
+        static constexpr uint32 MALFORMED_RECORD = MAX_UINT;
+
         using LogHandlerPtr = std::shared_ptr<LinkLogCenterHandler>;
 
+        /*
+         * partitions 大于 1 时按 LinkServiceID 的哈希将写入分到多个分区，每个分区在 dictionary_path/partition_<i>/
+         * 下拥有独立的日志文件与索引，并由自己的线程写入；reactor 线程只负责解码连接上的数据并分发。
+         * 此时 handler 会被多个分区线程同时调用，需要自行保证线程安全。
+         * 同一个服务的查询只访问一个分区，跨服务的查询访问所有分区并按时间归并结果。
+         *
+         * secondary_indexes 为 true 时维护 search_logs 与 search_slow_links 使用的二级索引，写入开销更大，默认关闭。
+         *
+         * sampling.sample_rate 小于 1 时每个分区按 LinkTraceSampler 的规则决定链路是否写入文件，
+         * 未决定的链路的记录先缓存起来，交给 handler 的时间推迟到链路被保留时，被丢弃的链路不会交给 handler。
+         */
         explicit LinkLogCenter(LogHandlerPtr handler, std::string dictionary_path,
-                               Base::ScheduledThread& thread);
+                               Base::ScheduledThread& thread, bool secondary_indexes = false,
+                               uint32 partitions = 1, const LinkSamplingPolicy& sampling = LinkSamplingPolicy());
 
         bool add_server(const Address& server_address);
 
@@ -48,12 +75,40 @@ namespace LogSystem {
         void search_link(const ServiceID& service, LinkLogSearchHandler& handler,
                          uint32 buffer_size = (1 << 16));
 
+        /// 在 pool 上并行扫描可能包含这些节点日志的文件，按文件从旧到新、文件内按时间的顺序
+        /// 将日志交给 handler，最多返回 limit 条，返回交给 handler 的日志数量。
+        /// handler 只在调用线程上被调用。
+        uint64 search_link(Base::WorkStealingPool& pool, const ServiceID& service,
+                           LinkLogSearchHandler& handler, uint64 limit = MAX_ULLONG);
+
+        /// 通过等级索引查找所有服务中 [begin, end] 内等级不低于 rank 的日志，handler.node_filter 不会被调用。
+        /// 需要在构造时开启 secondary_indexes。
+        void search_logs(LogRank rank, Base::TimeInterval begin, Base::TimeInterval end,
+                         LinkLogSearchHandler& handler, uint32 buffer_size = (1 << 16));
+
+        /// 通过持续时间索引查找持续时间不少于 min_duration 的已结束节点的日志。
+        void search_slow_links(Base::TimeInterval min_duration, LinkLogSearchHandler& handler,
+                               uint32 buffer_size = (1 << 16));
+
         void flush();
 
         void delete_oldest_files(uint32 size);
 
+        /// 所有分区的链路保留与丢弃数量，没有开启采样时全部为 0。
+        [[nodiscard]] LinkSamplingStats sampling_stats() const;
+
         static uint64 replay_history(LinkLogReplayHandler& handler, const char *file_path);
 
+        /// 在 pool 上并行回放多个文件，单个文件内的记录按顺序回放，返回读取的总字节数。
+        /// handler 会被多个线程同时调用，需要自行保证线程安全。
+        static uint64 replay_history(Base::WorkStealingPool& pool, LinkLogReplayHandler& handler,
+                                     const std::vector<std::string>& file_paths);
+
+        /// 在 pool 上并行回放所有分区中 begin 之后的记录，通过文件名索引跳过更早结束的文件。
+        /// 同样会在多个线程上调用 handler，返回读取的总字节数。
+        uint64 replay_history(Base::WorkStealingPool& pool, LinkLogReplayHandler& handler,
+                              Base::TimeInterval begin);
+
     private:
         struct NodeData {
             Net::Channel channel;
@@ -62,7 +117,16 @@ namespace LogSystem {
                 channel(std::move(ch)) {};
         };
 
-        using NodeMap = std::map<Address, int>;
+        struct ServerData {
+            int fd;
+
+            /// 由 server 发送的 Node_Define 定义的节点句柄
+            std::vector<Index_Key> nodes;
+
+            explicit ServerData(int fd) : fd(fd) {};
+        };
+
+        using NodeMap = std::map<Address, ServerData>;
 
         using NodeMapIter = NodeMap::iterator;
 
@@ -119,16 +183,50 @@ namespace LogSystem {
 
         using TimerQueue = std::priority_queue<TimerData>;
 
-        NodeMap _nodes;
+        /// reactor 线程交给分区线程的一组完整记录，压缩日志已展开为 LinkLog，空批次表示检查超时。
+        struct IngestBatch {
+            Address address;
+            std::string data;
+        };
+
+        using BatchPtr = std::unique_ptr<IngestBatch>;
+
+        struct Partition {
+            CheckMap check;
+
+            TimerQueue timers;
+
+            LinkLogStorage storage;
 
-        CheckMap _check;
+            Base::MPMCQueue<BatchPtr> queue;
 
-        TimerQueue _timers;
+            Base::Thread thread;
+
+            std::unique_ptr<LinkTraceSampler> sampler;
+
+            Partition(std::string dictionary_path, Base::ScheduledThread& scheduled_thread,
+                      bool secondary_indexes, const LinkSamplingPolicy& sampling) :
+                storage(std::move(dictionary_path), scheduled_thread, secondary_indexes),
+                queue(PARTITION_QUEUE_SIZE) {
+                if (sampling.sample_rate < 1)
+                    sampler = std::make_unique<LinkTraceSampler>(sampling);
+            };
+
+            /// 放入空指针通知分区线程处理完队列中的批次后退出。
+            ~Partition() {
+                if (!thread.valid()) return;
+                queue.put(nullptr);
+                thread.join();
+            };
+        };
+
+        NodeMap _nodes;
 
         LogHandlerPtr _handler;
 
-        LinkLogStorage _storage;
+        std::vector<std::unique_ptr<Partition>> _partitions;
 
+        /// 在 _partitions 之前析构，先停止分发再等待分区线程结束。
         Net::Reactor _reactor;
 
         void handle_read(Net::MessageAgent& agent);
@@ -139,29 +237,76 @@ namespace LogSystem {
 
         void check_timeout();
 
-        uint32 handle_register_logger(NodeMapIter iter, const Base::RingBuffer& buffer);
+        void check_timeout(Partition& part);
+
+        [[nodiscard]] uint32 partition_index(const ServiceID& service) const;
+
+        [[nodiscard]] Partition& partition_of(const ServiceID& service) const {
+            return *_partitions[partition_index(service)];
+        };
+
+        /// 多分区时 reactor 线程将 buffer 中的完整记录按服务分发到各个分区。
+        void dispatch_records(NodeMapIter iter, Net::MessageAgent& agent);
+
+        void submit_batch(Partition& part, const Address& address, std::string& data);
+
+        void run_partition(Partition& part);
+
+        /// 在 part 上处理一条与连接无关的记录，数据不完整时返回 0。
+        uint32 apply_record(Partition& part, const Address& address,
+                            OperationType type, const Base::RingBufferWrapper& buffer);
+
+        /// 先经过 part 的采样器再交给 apply_record，被缓存或丢弃的记录同样返回读取的字节数。
+        uint32 admit_record(Partition& part, const Address& address,
+                            OperationType type, const Base::RingBufferWrapper& buffer);
+
+        void apply_released(Partition& part, LinkTraceSampler::Released& released);
+
+        /// 将展开的压缩日志以 Link_Log_Header 加内容的形式追加到 dest。
+        static void append_log_record(std::string& dest, const Link_Log& log);
+
+        uint32 handle_register_logger(Partition& part, const Address& address,
+                                      const Base::RingBufferWrapper& buffer);
+
+        uint32 handle_create_logger(Partition& part, const Address& address,
+                                    const Base::RingBufferWrapper& buffer);
+
+        uint32 handle_end_logger(Partition& part, const Address& address,
+                                 const Base::RingBufferWrapper& buffer);
+
+        uint32 handle_log(Partition& part, const Address& address,
+                          const Base::RingBufferWrapper& buffer);
 
-        uint32 handle_create_logger(NodeMapIter iter, const Base::RingBuffer& buffer);
+        uint32 handle_error_logger(Partition& part, const Address& address,
+                                   const Base::RingBufferWrapper& buffer);
 
-        uint32 handle_end_logger(NodeMapIter iter, const Base::RingBuffer& buffer);
+        uint32 handle_node_define(NodeMapIter iter, const Base::RingBuffer& buffer);
 
-        uint32 handle_log(NodeMapIter iter, const Base::RingBuffer& buffer);
+        uint32 handle_compact_log(NodeMapIter iter, Net::MessageAgent& agent);
 
-        uint32 handle_error_logger(NodeMapIter iter, const Base::RingBuffer& buffer);
+        /// 丢弃连接上剩余的数据并关闭连接，返回 0。
+        uint32 reject_malformed(NodeMapIter iter, Net::MessageAgent& agent);
 
         uint32 handle_remove_server(NodeMapIter iter, Net::MessageAgent& agent);
 
-        static uint32 replay_register_logger(LinkLogReplayHandler& handler, Base::RingBuffer& buffer);
+        using QuerySource = std::pair<LinkLogStorage *, LinkLogStorage::QuerySet *>;
 
-        static uint32 replay_create_logger(LinkLogReplayHandler& handler, Base::RingBuffer& buffer);
+        /// 从多个分区的查询结果中每次取时间最晚的一条交给 handler。
+        void send_query_result(std::vector<QuerySource> sources, LinkLogSearchHandler& handler,
+                               uint32 buffer_size);
 
-        static uint32 replay_end_logger(LinkLogReplayHandler& handler, Base::RingBuffer& buffer);
+        static uint64 replay_file(LinkLogReplayHandler& handler, LinkLogMappedFile& file,
+                                  Base::TimeInterval begin);
 
-        static uint32 replay_log(LinkLogReplayHandler& handler, Base::RingBuffer& buffer);
+        /// 原地解析 [data, data + size) 中的记录，早于 begin 的记录被跳过，返回解析的字节数。
+        static uint64 replay_records(LinkLogReplayHandler& handler, std::vector<Index_Key>& nodes,
+                                     const char *data, uint64 size, Base::TimeInterval begin);
 
-        static uint32 replay_error_logger(LinkLogReplayHandler& handler, Base::RingBuffer& buffer);
+        static uint32 read_node_define(std::vector<Index_Key>& nodes, const Base::RingBuffer& buffer);
 
-        static uint32 replay_remove_server(Base::RingBuffer& buffer);
+        /// 数据不完整时返回 0，格式错误时返回 MALFORMED_RECORD。
+        static uint32 read_compact_log(const std::vector<Index_Key>& nodes, const Base::RingBuffer& buffer,
+                                       Link_Log& log);
 
     };
 
@@ -8,6 +8,7 @@
 #ifdef LOGSYSTEM_LINKLOGHANDLER_HPP
 
 #include <string>
+#include <string_view>
 #include "LinkLogMessage.hpp"
 #include "LinkLogOperation.hpp"
 #include "tinyBackend/Base/LogRank.hpp"
@@ -19,6 +20,21 @@ namespace LogSystem {
 
     class LinkLogCenter;
 
+    /// 回放时指向文件内容的日志，text 只在 receive_log_view 调用期间有效。
+    struct Link_Log_View {
+        LinkServiceID service;
+
+        Base::TimeInterval node_init_time;
+
+        LinkNodeID node;
+
+        LogRank rank = EMPTY;
+
+        Base::TimeInterval time;
+
+        std::string_view text;
+    };
+
     struct Link_Log {
         LinkServiceID service;
 
@@ -39,6 +55,11 @@ namespace LogSystem {
             node(header.node()), rank(header.rank()), time(header.time()),
             text(std::move(text)) {};
 
+        explicit Link_Log(const Link_Log_View& view) :
+            service(view.service), node_init_time(view.node_init_time),
+            node(view.node), rank(view.rank), time(view.time),
+            text(view.text) {};
+
     };
 
     class LinkLogServerHandler {
@@ -113,6 +134,9 @@ namespace LogSystem {
 
         virtual bool node_filter(Index_Key key, Index_Value val) = 0;
 
+        /// 返回 true 时结束查找。
+        virtual bool search_done() { return false; };
+
     };
 
     class LinkLogReplayHandler {
@@ -134,9 +158,15 @@ namespace LogSystem {
 
         virtual void receive_log(Link_Log log) = 0;
 
+        /// 回放时实际调用的接口，默认复制内容后交给 receive_log，只需要部分日志时可以重写以避免复制。
+        virtual void receive_log_view(const Link_Log_View& log) { receive_log(Link_Log(log)); };
+
         virtual void handling_error(LinkServiceID service, LinkNodeID node,
                                     Base::TimeInterval time, LinkErrorType type) = 0;
 
+        /// 返回 true 时结束回放，在读取每一帧之前检查。
+        virtual bool replay_done() { return false; };
+
     };
 
 }
@@ -9,11 +9,17 @@
 
 #include <functional>
 #include <queue>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "LinkLogOperation.hpp"
 #include "tinyBackend/Base/BPTree_impls/BPTree.hpp"
 #include "tinyBackend/Base/BPTree_impls/BPTree_impl.hpp"
+#include "tinyBackend/Base/BPTree_impls/BPTreeCompactor.hpp"
+#include "tinyBackend/Base/LRUCache.hpp"
 #include "tinyBackend/Base/Buffer/RingBuffer.hpp"
+#include "tinyBackend/Base/Detail/Checksum.hpp"
 #include "tinyBackend/Base/Detail/iFile.hpp"
 #include "tinyBackend/Base/Detail/oFile.hpp"
 
@@ -64,11 +70,22 @@ namespace LogSystem {
 
         uint32 write_to_file(const void *data, uint32 size);
 
+        /// 将 [data, data + size) 中的记录原地转换为发往 center 的紧凑格式，返回转换后的大小。
+        /// 每个节点在连接内第一次出现时发送 Node_Define，之后的日志只携带句柄与相对节点创建时间的时间差。
+        uint32 encode_for_center(char *data, uint32 size);
+
+        /// 与 center 的连接建立或断开时调用，之后的节点需要重新定义句柄。
+        void reset_center_nodes();
+
         void flush() const;
 
     private:
         uint64 _current_size = 0;
 
+        std::unordered_map<Index_Key, uint32> _center_nodes;
+
+        std::vector<uint32> _free_handles;
+
         RecordFile _record_file;
 
         std::string _dictionary_path;
@@ -82,6 +99,120 @@ namespace LogSystem {
     };
 
 
+    /*
+     * center 的日志文件以 LOG_FILE_MAGIC 开头，之后是独立压缩的帧，每一帧为 [Log_Frame_Header][数据]，
+     * 帧只在记录的边界切分。每个日志文件有一个帧索引文件，保存每一帧解压后的起始位置与在文件中的位置，
+     * Index_Value::latest_index 等位置均为解压后的位置。没有文件头的旧版本日志文件直接保存记录。
+     * 帧头带有覆盖帧头与数据的 CRC-32C，读取时先检查大小字段再分配缓冲区，校验失败的帧视为损坏。
+     */
+    class Log_Frame_Header {
+    public:
+        enum Codec : uint8 {
+            Stored,
+            LZ
+        };
+
+        static constexpr uint32 size =
+            sizeof(Codec) +
+            sizeof(uint32) +
+            sizeof(uint32) +
+            sizeof(uint32);
+
+        /// 帧在解压后的大小超过 LinkLogStorage::LOG_FRAME_SIZE 的那条记录之后切分，不会超过该值
+        static constexpr uint32 max_raw_size = 1 << 18;
+
+        Log_Frame_Header(Codec codec_, uint32 raw_size_, uint32 stored_size_) {
+            codec() = codec_;
+            raw_size() = raw_size_;
+            stored_size() = stored_size_;
+        };
+
+        Log_Frame_Header() = default;
+
+        Codec& codec() {
+            return *(Codec *) object.data();
+        };
+
+        uint32& raw_size() {
+            return *(uint32 *) (object.data() + sizeof(Codec));
+        };
+
+        uint32& stored_size() {
+            return *(uint32 *) (object.data() + sizeof(Codec) + sizeof(uint32));
+        };
+
+        uint32& checksum() {
+            return *(uint32 *) (object.data() + sizeof(Codec) + sizeof(uint32) + sizeof(uint32));
+        };
+
+        /// 大小字段是否合理，remain 为帧头之后文件中剩余的字节数。
+        bool sizes_valid(uint64 remain) {
+            if (raw_size() == 0 || raw_size() > max_raw_size || stored_size() > remain)
+                return false;
+            if (codec() == Stored) return stored_size() == raw_size();
+            return codec() == LZ && stored_size() < raw_size();
+        };
+
+        /// 计算帧头其余字段与 stored_size() 字节数据的校验和。
+        uint32 compute_checksum(const void *stored) {
+            return Base::crc32(object.data(), size - sizeof(uint32), Base::crc32(stored, stored_size()));
+        };
+
+        Mark<size> object;
+
+    };
+
+    /// 顺序读取一个日志文件中的记录，压缩的文件逐帧解压。
+    class LinkLogFileReader {
+    public:
+        /// 只读取文件中 limit 之前的帧，用于读取正在写入的文件。
+        explicit LinkLogFileReader(const char *path, uint64 limit = MAX_ULLONG);
+
+        [[nodiscard]] bool is_open() const { return _file.is_open(); };
+
+        /// 将之后的记录写入 buf，返回写入的字节数，文件结束时返回 0，出错时返回 -1。
+        int64 read(const Base::RingBuffer& buf);
+
+    private:
+        Base::iFile _file;
+
+        bool _compressed = false;
+
+        uint64 _limit;
+
+        std::string _frame;
+
+        uint32 _frame_pos = 0;
+
+    };
+
+    /*
+     * 以只读映射的方式顺序访问一个日志文件，每次取得一段只包含完整记录的数据。
+     * 未压缩的文件与不压缩的帧直接指向映射的内存，压缩的帧解压到同一块缓冲区。
+     */
+    class LinkLogMappedFile : Base::NoCopy {
+    public:
+        /// 只访问文件中 limit 之前的部分，用于读取正在写入的文件。
+        explicit LinkLogMappedFile(const char *path, uint64 limit = MAX_ULLONG);
+
+        ~LinkLogMappedFile();
+
+        [[nodiscard]] bool is_open() const { return _open; };
+
+        /// 取得下一段数据，在下一次调用之前有效。返回 1，文件结束时返回 0，数据不完整或损坏时返回 -1。
+        int next(const char *& data, uint64& size);
+
+    private:
+        const char *_map = nullptr;
+
+        uint64 _size = 0, _pos = 0;
+
+        bool _open = false, _compressed = false;
+
+        std::string _frame;
+
+    };
+
     class LinkLogStorage {
     public:
         using LinkLogReadFile = Base::iFile;
@@ -94,15 +225,49 @@ namespace LogSystem {
 
         using NodeDeletionFile = Base::BPTree<Base::BPTree_impl<Base::TimeInterval, Index_Key>>;
 
+        using RankIndexFile = Base::BPTree<Base::BPTree_impl<Rank_Key, Log_Location>>;
+
+        using DurationIndexFile = Base::BPTree<Base::BPTree_impl<Duration_Key, Base::TimeInterval>>;
+
         static constexpr uint32 FILENAME_BUFFER_POOL_SIZE = 1 << 16;
 
         static constexpr uint32 LINK_INDEX_BUFFER_POOL_SIZE = 1 << 22;
 
         static constexpr uint32 NODE_DELETION_BUFFER_POOL_SIZE = 1 << 16;
 
+        static constexpr uint32 RANK_INDEX_BUFFER_POOL_SIZE = 1 << 20;
+
+        static constexpr uint32 DURATION_INDEX_BUFFER_POOL_SIZE = 1 << 18;
+
+        /// 等级索引中每个节点在一个时间段内的每个等级只记录最后一条日志的位置
+        static constexpr Base::TimeInterval RANK_INDEX_BUCKET = Base::operator ""_s(1);
+
         static constexpr uint32 LOG_FILE_LIMIT_SIZE = 1 << 28;
 
-        explicit LinkLogStorage(std::string dictionary_path, Base::ScheduledThread& scheduled_thread);
+        static constexpr char LOG_FILE_MAGIC[8] { 'L', 'I', 'N', 'K', 'L', 'O', 'G', '2' };
+
+        /// 帧解压后的大小达到该值后压缩写入文件
+        static constexpr uint32 LOG_FRAME_SIZE = 1 << 16;
+
+        static_assert(LOG_FRAME_SIZE + sizeof(Link_Log_Header) + MAX_USHORT <= Log_Frame_Header::max_raw_size);
+
+        /// 未满的帧最多在内存中保留的时间
+        static constexpr Base::TimeInterval LOG_FRAME_FLUSH_TIME = Base::operator ""_s(1);
+
+        /// 单个日志文件中同时定义的节点句柄超过该数量后重新分配句柄
+        static constexpr uint32 FILE_NODE_HANDLE_LIMIT = 1 << 16;
+
+        /// 每个刷新周期后台整理索引文件时最多处理的块数
+        static constexpr uint32 COMPACT_BLOCKS_PER_STEP = 64;
+
+        /// 整理时每次持有 _mutex 最多处理的块数，写入最多等待这么多块的整理
+        static constexpr uint32 COMPACT_BLOCKS_PER_LOCK = 8;
+
+        /// secondary_indexes 为 true 时维护按等级与时间段、按节点持续时间的二级索引。
+        explicit LinkLogStorage(std::string dictionary_path, Base::ScheduledThread& scheduled_thread,
+                                bool secondary_indexes = false);
+
+        ~LinkLogStorage();
 
         bool create_logger(const LinkServiceID& service,
                            const LinkNodeID& node,
@@ -124,29 +289,54 @@ namespace LogSystem {
 
         void end_logger(const LinkServiceID& service,
                         const LinkNodeID& node,
-                        Base::TimeInterval node_init_time);
+                        Base::TimeInterval node_init_time,
+                        Base::TimeInterval end_time);
 
-        void add_record(uint32 size);
+        void add_record(const void *data, uint32 size);
 
-        void handle_a_log(Link_Log_Header& header, const Base::RingBuffer& buf);
+        /// 以 StoredLog 格式保存一条日志，并将其链接到该节点之前的日志。
+        void add_log(Index_Key key, Base::TimeInterval time, LogRank rank,
+                     const void *text, uint16 size);
 
-        uint32 write_to_file(const Base::RingBuffer& buf, uint32 size);
+        void write_to_file();
 
         void delete_oldest_files(uint32 size);
 
         class QuerySet {
             friend class LinkLogStorage;
 
-            using LocationSet = std::priority_queue<std::pair<Base::TimeInterval, uint32>>;
+            using Location = std::tuple<Base::TimeInterval, uint32, Index_Key>;
 
-            LinkLogReadFile _file;
+            using LocationSet = std::priority_queue<Location>;
 
-            int64 _pos = 0;
+            using FrameIndex = std::vector<std::pair<uint32, uint32>>;
+
+            LinkLogReadFile _file;
 
             LocationSet _log_location;
 
             Base::TimeInterval _current_file;
 
+            bool _compressed = false;
+
+            FrameIndex _frames;
+
+            /// 打开时文件的大小，限制最后一帧的读取范围
+            uint64 _file_size = 0;
+
+            uint32 _frame_begin = MAX_UINT;
+
+            std::string _frame;
+
+            /// 只返回满足条件的日志，早于 _begin 的日志之前的链不再读取。
+            LogRank _min_rank = TRACE;
+
+            Base::TimeInterval _begin { 0 }, _end { MAX_LLONG };
+
+            [[nodiscard]] bool accept(Link_Log_Header& header) const {
+                return header.rank() >= _min_rank && !(header.time() < _begin) && !(_end < header.time());
+            };
+
         };
 
         using NodeFilter = std::function<bool(const Index_Key&, const Index_Value&)>;
@@ -154,8 +344,36 @@ namespace LogSystem {
         QuerySet* get_query_set(const LinkServiceID& id,
                                 const NodeFilter& filter = NodeFilter());
 
+        /// 查找指定节点的日志，已被删除的节点会被忽略。
+        QuerySet* get_query_set(const std::vector<Index_Key>& nodes,
+                                const NodeFilter& filter = NodeFilter());
+
+        /// 通过等级索引查找 [begin, end] 内等级不低于 rank 的日志，未开启二级索引时返回 nullptr。
+        QuerySet* get_rank_query_set(LogRank rank, Base::TimeInterval begin, Base::TimeInterval end);
+
+        /// 通过持续时间索引查找持续时间不少于 min_duration 的已结束节点，按持续时间从短到长排列。
+        std::vector<std::pair<Index_Key, Base::TimeInterval>>
+        find_slow_nodes(Base::TimeInterval min_duration, uint64 limit = MAX_ULLONG);
+
+        /// 还在内存中未写入等级索引的条目数。
+        [[nodiscard]] uint64 rank_cache_size();
+
         static void destroy_query_set(void *set);
 
+        /// 按文件顺序扫描查找一组节点的日志时需要读取的文件。
+        struct SearchPlan {
+            std::unordered_set<Index_Key> nodes;
+
+            /// 文件路径与读取的上限，按时间从旧到新排列。
+            std::vector<std::pair<std::string, uint64>> files;
+        };
+
+        SearchPlan get_search_plan(const LinkServiceID& id,
+                                   const NodeFilter& filter = NodeFilter());
+
+        /// 可能含有 begin 之后日志的文件路径与读取的上限，按时间从旧到新排列。
+        std::vector<std::pair<std::string, uint64>> get_log_files(Base::TimeInterval begin);
+
         std::pair<uint32, QuerySet *> query(void *dest, uint32 limit, QuerySet *point);
 
         std::pair<uint32, QuerySet *> query(Base::RingBuffer& buf, QuerySet *point);
@@ -193,15 +411,19 @@ namespace LogSystem {
         };
 
         struct Record {
-            Base::TimeInterval file = Base::Unix_to_now(), latest_time = file;
-            uint32 index = 0, written = 0;
+            Base::TimeInterval file = Base::Unix_to_now(), latest_time = file, frame_time;
+            /// index 为文件解压后的总大小，frame_begin 为还在内存中的帧的起始位置
+            uint32 index = 0, frame_begin = 0, file_size = 0;
+            std::string frame;
+            QuerySet::FrameIndex frames;
+            std::unordered_map<Index_Key, uint32> nodes;
         };
 
         Base::Mutex _mutex;
 
-        LinkLogWriteFile _logs;
+        LinkLogWriteFile _logs, _frame_index;
 
-        std::vector<Record> _records;
+        Record _record;
 
         std::string _dictionary_path;
 
@@ -213,21 +435,65 @@ namespace LogSystem {
 
         Base::LRUCache<CacheHelper> _cache;
 
+        std::unique_ptr<RankIndexFile> _rank_index;
+
+        std::unique_ptr<DurationIndexFile> _duration_index;
+
+        /// 还未写入等级索引的位置
+        std::unordered_map<Rank_Key, Log_Location> _rank_cache;
+
+        /*
+         * _rank_bucket 为见到的最新的时间段，_rank_flushed 为 write_to_file 上一次写入的界限。
+         * 查询时 flush_cache 会把缓存全部写入，但不改变 _rank_flushed，之后的写入仍按时间段推进。
+         */
+        Base::TimeInterval _rank_bucket, _rank_flushed;
+
+        std::shared_ptr<Base::BPTreeCompactor> _compactor;
+
+        /// 删除旧文件之后（以及打开时）为 true，整理到所有索引文件都无法继续时置为 false，由 _mutex 保护
+        bool _compact_pending = true;
+
         void flush_cache();
 
+        void flush_rank_cache(Base::TimeInterval before);
+
+        Record& current_record();
+
+        LinkIndexFile::ResultSet find_service_nodes(const LinkServiceID& id);
+
+        void append_to_frame(const void *data, uint32 size);
+
+        void seal_frame();
+
+        void recover_log_file();
+
+        uint32 compact_files(uint32 max_blocks);
+
         [[nodiscard]] std::string filename_file_name() const;
 
         [[nodiscard]] std::string index_file_name() const;
 
         [[nodiscard]] std::string deletion_file_name() const;
 
+        [[nodiscard]] std::string rank_index_file_name() const;
+
+        [[nodiscard]] std::string duration_index_file_name() const;
+
         [[nodiscard]] LinkLogReadFile get_log_file(Base::TimeInterval file_init_time) const;
 
         [[nodiscard]] std::string get_log_name(Base::TimeInterval file_init_time) const;
 
-        void open_new_log_file(const Record& record, Base::TimeInterval end_time);
+        [[nodiscard]] std::string get_frame_index_name(Base::TimeInterval file_init_time) const;
+
+        void open_new_log_file(Base::TimeInterval end_time);
+
+        bool open_query_file(QuerySet *point, Base::TimeInterval file_name) const;
+
+        const char* query_data(QuerySet *point, uint32 index, uint32 size, uint32& got) const;
+
+        static void next_location(QuerySet *point, Link_Log_Header& header);
 
-        bool prepare_read_a_log(QuerySet *point, char *msg) const;
+        bool prepare_read_a_log(QuerySet *point, Link_Log_Header& header, const char *& text) const;
 
         int querying_a_log(QuerySet *point, char *ptr, uint32 limit, uint32& written) const;
 
@@ -42,8 +42,10 @@ namespace LogSystem {
 
         struct ClearBuffer_ {
             uint32 size = 0;
-            bool flushed = false;
+            bool flushed = false, encoded = false;
             uint32 begin = 0;
+            /// 编码时 center 连接的序号，编码结果引用该连接上定义的节点句柄
+            uint32 link = 0;
             void *buf_ptr = nullptr;
         };
 
@@ -7,8 +7,11 @@
 
 #ifdef LOGSYSTEM_LINKLOGOPERATION_HPP
 
+#include <cstring>
+#include <endian.h>
 #include "LinkLogErrors.hpp"
 #include "tinyBackend/Base/LogRank.hpp"
+#include "tinyBackend/Base/Detail/Compression.hpp"
 #include "tinyBackend/Base/Time/TimeInterval.hpp"
 
 
@@ -108,6 +111,123 @@ namespace LogSystem {
 
     };
 
+    /*
+     * 二级索引的键。时间以大端序保存，按字节比较即按 (等级, 时间段) 或 (持续时间) 排序，
+     * 因此可以在 B+ 树上按范围查找。
+     */
+
+    /// 某个节点在一个时间段内某一等级的日志。
+    class Rank_Key {
+    public:
+        static constexpr uint32 size =
+            sizeof(LogRank) +
+            sizeof(Base::TimeInterval) +
+            Index_Key::size;
+
+        Rank_Key(LogRank rank_, Base::TimeInterval bucket_, const Index_Key& key_) {
+            rank() = rank_;
+            *(uint64 *) (object.data() + sizeof(LogRank)) = htobe64(bucket_.nanoseconds);
+            key() = key_;
+        };
+
+        Rank_Key() = default;
+
+        LogRank& rank() {
+            return *(LogRank *) object.data();
+        };
+
+        [[nodiscard]] Base::TimeInterval bucket() const {
+            return Base::TimeInterval((int64) be64toh(*(const uint64 *) (object.data() + sizeof(LogRank))));
+        };
+
+        Index_Key& key() {
+            return *(Index_Key *) (object.data() + sizeof(LogRank) + sizeof(Base::TimeInterval));
+        };
+
+        friend bool operator==(const Rank_Key& lhs, const Rank_Key& rhs) {
+            return rhs.object == lhs.object;
+        };
+
+        friend bool operator!=(const Rank_Key& lhs, const Rank_Key& rhs) {
+            return lhs.object != rhs.object;
+        };
+
+        friend bool operator<(const Rank_Key& lhs, const Rank_Key& rhs) {
+            return lhs.object < rhs.object;
+        };
+
+        friend bool operator>(const Rank_Key& lhs, const Rank_Key& rhs) {
+            return lhs.object > rhs.object;
+        };
+
+        Mark<size> object;
+
+    };
+
+    /// 日志在文件中的位置（文件创建时间与解压后的偏移）。
+    class Log_Location {
+    public:
+        static constexpr uint32 size = sizeof(Base::TimeInterval) + sizeof(uint32);
+
+        Log_Location(Base::TimeInterval file_, uint32 index_) {
+            file() = file_;
+            index() = index_;
+        };
+
+        Log_Location() = default;
+
+        Base::TimeInterval& file() {
+            return *(Base::TimeInterval *) object.data();
+        };
+
+        uint32& index() {
+            return *(uint32 *) (object.data() + sizeof(Base::TimeInterval));
+        };
+
+        Mark<size> object;
+
+    };
+
+    /// 按持续时间排序的已结束节点。
+    class Duration_Key {
+    public:
+        static constexpr uint32 size = sizeof(Base::TimeInterval) + Index_Key::size;
+
+        Duration_Key(Base::TimeInterval duration_, const Index_Key& key_) {
+            *(uint64 *) object.data() = htobe64(duration_.nanoseconds < 0 ? 0 : duration_.nanoseconds);
+            key() = key_;
+        };
+
+        Duration_Key() = default;
+
+        [[nodiscard]] Base::TimeInterval duration() const {
+            return Base::TimeInterval((int64) be64toh(*(const uint64 *) object.data()));
+        };
+
+        Index_Key& key() {
+            return *(Index_Key *) (object.data() + sizeof(Base::TimeInterval));
+        };
+
+        friend bool operator==(const Duration_Key& lhs, const Duration_Key& rhs) {
+            return rhs.object == lhs.object;
+        };
+
+        friend bool operator!=(const Duration_Key& lhs, const Duration_Key& rhs) {
+            return lhs.object != rhs.object;
+        };
+
+        friend bool operator<(const Duration_Key& lhs, const Duration_Key& rhs) {
+            return lhs.object < rhs.object;
+        };
+
+        friend bool operator>(const Duration_Key& lhs, const Duration_Key& rhs) {
+            return lhs.object > rhs.object;
+        };
+
+        Mark<size> object;
+
+    };
+
     enum OperationType : uint8 {
         Null,
         RegisterLogger,
@@ -115,7 +235,10 @@ namespace LogSystem {
         EndLogger,
         LinkLog,
         ErrorLogger,
-        NodeOffline
+        NodeOffline,
+        NodeDefine,
+        CompactLog,
+        StoredLog
     };
 
     inline const char* getOperationTypeName(OperationType type) {
@@ -126,7 +249,10 @@ namespace LogSystem {
             "EndLogger",
             "LinkLog",
             "ErrorLogger",
-            "NodeOffline"
+            "NodeOffline",
+            "NodeDefine",
+            "CompactLog",
+            "StoredLog"
         };
         return name[type];
     };
@@ -425,6 +551,123 @@ namespace LogSystem {
 
     };
 
+    /*
+     * 紧凑格式中定义节点句柄，之后的 CompactLog / StoredLog 只携带句柄而不是完整的 Index_Key。
+     * 发往 center 的数据中句柄在每个连接内有效，center 的日志文件中句柄在每个文件内有效，
+     * 同一个句柄可以被之后的 Node_Define 重新定义。
+     */
+    class Node_Define {
+    public:
+        static constexpr uint32 size =
+            sizeof(uint32) +
+            sizeof(Index_Key);
+
+        Node_Define(uint32 handle_, const Index_Key& key_) {
+            handle() = handle_;
+            key() = key_;
+        };
+
+        Node_Define() = default;
+
+        uint32& handle() {
+            return *(uint32 *) object.data();
+        };
+
+        Index_Key& key() {
+            return *(Index_Key *) (object.data() + sizeof(uint32));
+        };
+
+        OperationType ot = NodeDefine;
+
+        Mark<size> object;
+
+    };
+
+    /*
+     * 不携带完整 Link_Log_Header 的日志头，handle、时间差与 log_size 均为变长整数：
+     * CompactLog: [ot][handle][zigzag(time - init_time)][rank][log_size][text]
+     * StoredLog:  [ot][handle][zigzag(time - init_time)][rank][log_size][latest][latest_file?][text]
+     * latest 为 0 表示该节点没有更早的日志，否则为 (latest_index << 1 | 位于其他文件) + 1，
+     * 位于其他文件时之后跟随 8 字节的 latest_file。
+     */
+    class Compact_Log {
+    public:
+        /// 句柄最多占用 4 字节
+        static constexpr uint32 max_handle = 1 << 28;
+
+        static constexpr uint32 max_size =
+            sizeof(OperationType) + 4 + 10 + sizeof(LogRank) + 3 + 10 + sizeof(Base::TimeInterval);
+
+        /// CompactLog 加上定义句柄的 Node_Define 不会超过 Link_Log_Header，发送时可以原地转换。
+        static constexpr uint32 max_compact_size = sizeof(OperationType) + 4 + 10 + sizeof(LogRank) + 3;
+
+        OperationType ot = CompactLog;
+
+        LogRank rank = EMPTY;
+
+        uint16 log_size = 0;
+
+        uint32 handle = 0;
+
+        Base::TimeInterval time_delta;
+
+        Base::TimeInterval latest_file;
+
+        uint32 latest_index = MAX_UINT;
+
+        /// 写入 dest，file 为该记录所在的文件（仅 StoredLog 使用），返回写入的字节数。
+        uint32 encode(char *dest, Base::TimeInterval file = Base::TimeInterval()) const {
+            uint32 size = 0;
+            dest[size++] = (char) ot;
+            size += Base::put_varint(dest + size, handle);
+            size += Base::put_varint(dest + size, Base::zigzag_encode(time_delta.nanoseconds));
+            dest[size++] = (char) rank;
+            size += Base::put_varint(dest + size, log_size);
+            if (ot != StoredLog) return size;
+            if (latest_index == MAX_UINT) {
+                dest[size++] = 0;
+                return size;
+            }
+            bool other_file = latest_file != file;
+            size += Base::put_varint(dest + size, ((uint64) latest_index << 1 | other_file) + 1);
+            if (other_file) {
+                std::memcpy(dest + size, &latest_file, sizeof(Base::TimeInterval));
+                size += sizeof(Base::TimeInterval);
+            }
+            return size;
+        };
+
+        /// 从 [ptr, end) 读取，file 为该记录所在的文件，数据不完整或格式错误时返回 0。
+        uint32 decode(const char *ptr, const char *end, Base::TimeInterval file = Base::TimeInterval()) {
+            const char *begin = ptr;
+            uint64 value;
+            if (ptr == end) return 0;
+            ot = (OperationType) *ptr++;
+            if (ot != CompactLog && ot != StoredLog) return 0;
+            if (!(ptr = Base::get_varint(ptr, end, value)) || value >= max_handle) return 0;
+            handle = value;
+            if (!(ptr = Base::get_varint(ptr, end, value))) return 0;
+            time_delta = Base::TimeInterval(Base::zigzag_decode(value));
+            if (ptr == end) return 0;
+            rank = (LogRank) *ptr++;
+            if (!(ptr = Base::get_varint(ptr, end, value)) || value > MAX_USHORT) return 0;
+            log_size = value;
+            latest_index = MAX_UINT;
+            if (ot != StoredLog) return ptr - begin;
+            if (!(ptr = Base::get_varint(ptr, end, value))) return 0;
+            if (value == 0) return ptr - begin;
+            latest_index = (value - 1) >> 1;
+            latest_file = file;
+            if ((value - 1) & 1) {
+                if (end - ptr < (int64) sizeof(Base::TimeInterval)) return 0;
+                std::memcpy(&latest_file, ptr, sizeof(Base::TimeInterval));
+                ptr += sizeof(Base::TimeInterval);
+            }
+            return ptr - begin;
+        };
+
+    };
+
 }
 
 namespace std {
@@ -436,6 +679,13 @@ namespace std {
         };
     };
 
+    template <>
+    struct hash<LogSystem::Rank_Key> {
+        size_t operator()(const LogSystem::Rank_Key& key) const noexcept {
+            return _Hash_impl::hash(&key, LogSystem::Rank_Key::size);
+        };
+    };
+
 }
 
 #endif
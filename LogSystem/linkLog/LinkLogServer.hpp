@@ -8,9 +8,12 @@
 #ifdef LOGSYSTEM_LINKLOGSERVERE_HPP
 
 #include <map>
+#include <deque>
+#include <atomic>
 #include "LinkLogErrors.hpp"
 #include "LinkLogHandler.hpp"
 #include "LinkLogInterpreter.hpp"
+#include "tinyBackend/Base/MPMCQueue.hpp"
 #include "tinyBackend/Net/Acceptor.hpp"
 #include "tinyBackend/Net/InetAddress.hpp"
 #include "tinyBackend/Net/TcpMessageAgent.hpp"
@@ -31,10 +34,6 @@ namespace LogSystem {
 
         static_assert(BLOCK_SIZE >= 1 << 16);
 
-        static constexpr uint32 LOCAL_SOCKET_INPUT_BUFFER_SIZE = 1 << 10;
-
-        static_assert(LOCAL_SOCKET_INPUT_BUFFER_SIZE >= sizeof(LinkLogMessage));
-
         static constexpr uint32 REMOTE_SOCKET_INPUT_BUFFER_SIZE = 1 << 8;
 
         static_assert(REMOTE_SOCKET_INPUT_BUFFER_SIZE >= sizeof(LinkLogMessage));
@@ -45,8 +44,17 @@ namespace LogSystem {
 
         static constexpr int32 GET_ACTIVE_TIMEOUT_MS = 500;
 
+        /// 缓冲区最长的刷新间隔，center 未连接或上传积压时使用。
         static constexpr Base::TimeInterval BUFFER_FLUSH_TIME = Base::operator ""_s(1);
 
+        /// center 上传通畅时缓冲区最短的刷新间隔。
+        static constexpr Base::TimeInterval MIN_FLUSH_TIME = Base::operator ""_ms(50);
+
+        /// 上传积压或 center 不可达时，缓冲区暂存到磁盘的默认上限。
+        static constexpr uint64 SPILL_FILE_LIMIT = 1 << 26;
+
+        static constexpr const char *SPILL_FILE_NAME = "center.spill";
+
         static_assert(GET_ACTIVE_TIMEOUT_MS > 0 && BUFFER_FLUSH_TIME.to_ms() > GET_ACTIVE_TIMEOUT_MS,
                       "Unable to refresh buffers in time");
 
@@ -68,7 +76,8 @@ namespace LogSystem {
         LinkLogServer(const Address& listen_address,
                       ServerHandlerPtr handler,
                       std::string dictionary_path,
-                      PartitionRank partition_rank = Level2);
+                      PartitionRank partition_rank = Level2,
+                      uint64 spill_limit = SPILL_FILE_LIMIT);
 
         ~LinkLogServer();
 
@@ -77,8 +86,16 @@ namespace LogSystem {
     private:
         friend class LinkLogger;
 
+        /*
+         * 写入线程通过 reserved 的 fetch_add 预留空间，在原地写入后增加 committed。
+         * reserved 的高 32 位为缓冲区的代数（最低位表示当前代是否有缓冲区），低 32 位为已预留的字节数。
+         * 预留跨过缓冲区末尾的线程（或刷新线程）持有 mutex，等待之前的预留全部提交后交出缓冲区并开始新的一代，
+         * 其余超出末尾的写入等待新的一代后重试。index 为交出的缓冲区中的数据大小。
+         */
         struct Buffer {
             Base::Mutex mutex;
+            std::atomic<uint64> reserved = 0;
+            std::atomic<uint32> committed = 0;
             uint32 index = 0;
             uint32 ref_count = 0;
             Base::BufferPool::Buffer buf;
@@ -152,7 +169,12 @@ namespace LogSystem {
 
         using TimerQueue = std::priority_queue<TimerData>;
 
-        using WaitQueue = std::queue<LinkLogMessage>;
+        using WaitQueue = std::deque<LinkLogMessage>;
+
+        struct Spill {
+            uint64 offset;
+            uint32 size;
+        };
 
         Base::Mutex _mutex;
 
@@ -164,9 +186,18 @@ namespace LogSystem {
 
         Net::Acceptor _acceptor;
 
-        Net::Socket _notifier;
+        /*
+         * 发往服务线程的本地消息通过进程内的队列传递，eventfd 作为门铃唤醒 poller。
+         * 每条消息都持有一个缓冲池的缓冲区，队列容量不小于缓冲池的块数，放入不会阻塞。
+         * 服务线程被唤醒之后、取空队列之前，放入消息不再重复写 eventfd。
+         */
+        Base::MPMCQueue<LinkLogMessage> _local_queue;
 
-        Net::TcpMessageAgent _receiver, _center;
+        Net::Socket _doorbell;
+
+        std::atomic<bool> _doorbell_rung = false;
+
+        Net::TcpMessageAgent _center;
 
         BufferQueue _buffers;
 
@@ -174,6 +205,28 @@ namespace LogSystem {
 
         LinkLogEncoder _encoder;
 
+        /*
+         * 等待上传的缓冲区过多（center 跟不上）或者 center 不可达时，将缓冲区的内容追加到 spill 文件并归还缓冲池，
+         * 写入线程不会因为缓冲池耗尽而阻塞。上传空闲后按顺序从 spill 文件读回并发送，文件取空后截断。
+         * spill 文件非空时之后交出的缓冲区也全部转存，排在已转存的数据之后，保证上传的顺序与写入的顺序一致。
+         * 文件作为环形缓冲区使用，写到 _spill_limit 之后回到开头，复用已经读回的空间。
+         */
+        Base::ioFile _spill_file;
+
+        uint64 _spill_limit;
+
+        std::deque<Spill> _spills;
+
+        uint64 _spill_end = 0;
+
+        /// center 连接的序号，每次断开时递增
+        uint32 _center_link = 0;
+
+        /// 上传的数据从写入输出缓冲区到全部发出所用时间的平滑值，据此调整刷新间隔。
+        Base::TimeInterval _upload_latency, _drain_begin;
+
+        Base::TimeInterval _flush_interval = BUFFER_FLUSH_TIME;
+
         TimerQueue _timers;
 
         Base::Thread _thread;
@@ -187,7 +240,10 @@ namespace LogSystem {
         void destroy_center_link(Net::Poller& poller);
 
 
-        [[nodiscard]] bool safe_notify(const LinkLogMessage& message) const;
+        [[nodiscard]] bool safe_notify(const LinkLogMessage& message);
+
+        /// 服务线程收到门铃后清空 eventfd 的计数，之后放入的消息会重新敲响门铃。
+        void reset_doorbell();
 
         void safe_write(BufferIter buf_iter, const void *data, uint32 size);
 
@@ -245,9 +301,37 @@ namespace LogSystem {
 
         void submit_buffer(Buffer& buf, Base::Lock<Base::Mutex>& lock);
 
+        /// 在 buf 中预留 size 字节，写入后需要调用 commit。
+        char* reserve(Buffer& buf, uint32 size);
+
+        static void commit(Buffer& buf, uint32 size) {
+            buf.committed.fetch_add(size, std::memory_order_release);
+        };
+
+        /// 持有 buf.mutex 时结束当前代，等待已预留的写入提交，返回数据大小，其他线程正在交出缓冲区时返回 MAX_UINT。
+        static uint32 seal_buffer(Buffer& buf);
+
+        /// 结束 seal_buffer 之后开始新的一代。
+        static void open_buffer(Buffer& buf);
+
 
         bool clear_buffer(LinkLogMessage& message, bool can_send);
 
+        /// 将未开始发送的 ClearBuffer 消息的内容写入 spill 文件并释放缓冲区，超出上限时丢弃。
+        void spill_buffer(LinkLogMessage& message);
+
+        /// 新交出的缓冲区在 spill 文件非空时转存到文件末尾，否则加入等待队列。
+        void queue_buffer(LinkLogMessage& message, WaitQueue& wait_queue);
+
+        /// spill 文件为空且持有缓冲区的消息超过在途缓冲区的一半时，从队尾开始转存到 spill 文件。
+        void spill_backlog(WaitQueue& wait_queue);
+
+        /// 等待队列较短时从 spill 文件读回缓冲区加入等待队列，队列中的缓冲区都早于 spill 文件中的数据。
+        void reload_spills(WaitQueue& wait_queue);
+
+        /// 根据输出缓冲区的排空时间更新 _upload_latency 与 _flush_interval。
+        void update_flush_interval(const WaitQueue& wait_queue);
+
         bool logger_timeout(const LinkLogMessage& message) const;
 
         bool node_offline(LinkLogMessage& message, Net::Poller& poller);
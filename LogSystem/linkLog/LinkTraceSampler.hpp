@@ -0,0 +1,168 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#ifndef LOGSYSTEM_LINKTRACESAMPLER_HPP
+#define LOGSYSTEM_LINKTRACESAMPLER_HPP
+
+#ifdef LOGSYSTEM_LINKTRACESAMPLER_HPP
+
+#include <atomic>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "LinkLogOperation.hpp"
+#include "tinyBackend/Base/Buffer/RingBufferWrapper.hpp"
+#include "tinyBackend/Base/Detail/NoCopy.hpp"
+#include "tinyBackend/Net/InetAddress.hpp"
+
+namespace LogSystem {
+
+    /// 链路的保留规则，sample_rate 不小于 1 时保留全部链路，不做任何缓存。
+    struct LinkSamplingPolicy {
+        /// 创建头节点时按服务 ID 的哈希直接保留的链路比例
+        double sample_rate = 1;
+
+        /// 头节点持续时间不少于该值的链路会被保留
+        Base::TimeInterval slow_threshold = Base::operator ""_s(1);
+
+        /// 等待头节点结束的最长时间，超时的链路按保留处理
+        Base::TimeInterval buffer_timeout = Base::operator ""_min(1);
+
+        /// 缓存的最大字节数，超过时最早的链路按保留处理
+        uint64 buffer_limit = 1 << 26;
+    };
+
+    /// 各种原因保留以及丢弃的链路数量。
+    struct LinkSamplingStats {
+        uint64 sampled = 0;
+
+        uint64 errored = 0;
+
+        uint64 slow = 0;
+
+        /// 因等待超时或缓存不足而保留
+        uint64 expired = 0;
+
+        uint64 dropped = 0;
+
+        /// 丢弃的记录字节数
+        uint64 dropped_bytes = 0;
+
+        [[nodiscard]] uint64 kept() const { return sampled + errored + slow + expired; };
+
+        [[nodiscard]] double keep_ratio() const {
+            uint64 total = kept() + dropped;
+            return total == 0 ? 1 : (double) kept() / total;
+        };
+
+        [[nodiscard]] double drop_ratio() const { return 1 - keep_ratio(); };
+
+        LinkSamplingStats& operator+=(const LinkSamplingStats& other);
+    };
+
+    /*
+     * 决定一条链路（同一个 LinkServiceID 的全部记录）是否写入 LinkLogStorage。
+     *
+     * 头节点创建时哈希命中 sample_rate 的链路直接保留；其余链路的记录先缓存起来，
+     * 出现 Error_Logger 或 ERROR 以上等级的日志时保留，头节点的 End_Logger 到达时
+     * 按持续时间决定保留还是丢弃。决定之后到达的记录沿用该决定，直到 buffer_timeout 内没有新的记录才遗忘。
+     * 非线程安全，只有 stats 可以在其他线程调用。
+     */
+    class LinkTraceSampler : Base::NoCopy {
+    public:
+        using Address = Net::InetAddress;
+
+        using ServiceID = LinkServiceID;
+
+        enum Verdict : uint8 {
+            Keep,
+            Hold,
+            Drop
+        };
+
+        /// 缓存中来自同一个连接的连续记录。
+        struct Segment {
+            Address address;
+
+            std::string data;
+        };
+
+        using Released = std::vector<Segment>;
+
+        explicit LinkTraceSampler(const LinkSamplingPolicy& policy) : _policy(policy) {};
+
+        /*
+         * 决定 buffer 开头的记录如何处理，记录不完整时返回 Keep 由调用者照常等待数据。
+         * Hold 与 Drop 时记录已经从 buffer 中取出。链路被决定保留时，之前缓存的记录追加到 released，
+         * 调用者需要在处理当前记录之前按顺序处理它们。
+         */
+        Verdict admit(const Address& address, const Base::RingBufferWrapper& buffer, Released& released);
+
+        /// 保留等待超时的链路，清理过期的决定。
+        void check_timeout(Released& released);
+
+        [[nodiscard]] LinkSamplingStats stats() const;
+
+    private:
+        enum State : uint8 {
+            Pending,
+            Kept,
+            Dropped
+        };
+
+        struct Trace {
+            State state = Pending;
+
+            bool has_head = false;
+
+            LinkNodeID head;
+
+            Base::TimeInterval expire_time;
+
+            /// 决定之后最后一条记录到达的时间，到期时据此推迟遗忘
+            Base::TimeInterval last_admit;
+
+            uint64 size = 0;
+
+            Released records;
+        };
+
+        using TraceMap = std::unordered_map<ServiceID, Trace>;
+
+        using TraceIter = TraceMap::iterator;
+
+        LinkSamplingPolicy _policy;
+
+        TraceMap _traces;
+
+        /// 按加入顺序排列，expire_time 与 Trace 中不一致的项已经失效
+        std::deque<std::pair<Base::TimeInterval, ServiceID>> _expire;
+
+        uint64 _buffered = 0;
+
+        std::atomic<uint64> _sampled { 0 }, _errored { 0 }, _slow { 0 }, _expired { 0 },
+            _dropped { 0 }, _dropped_bytes { 0 };
+
+        [[nodiscard]] bool sampled(const ServiceID& service) const;
+
+        void set_expire(TraceIter iter, Base::TimeInterval expire_time);
+
+        void keep(TraceIter iter, std::atomic<uint64>& reason, Released& released);
+
+        void drop(TraceIter iter);
+
+        void hold(Trace& trace, const Address& address, const Base::RingBufferWrapper& buffer, uint32 size);
+
+        void shrink(Released& released);
+
+        static uint32 record_size(OperationType type, const Base::RingBufferWrapper& buffer);
+
+    };
+
+}
+
+#endif
+
+#endif //LOGSYSTEM_LINKTRACESAMPLER_HPP
@@ -5,8 +5,13 @@
 #include "../LinkLogCenter.hpp"
 #include "tinyBackend/Net/InetAddress.hpp"
 #include "tinyBackend/Base/GlobalObject.hpp"
+#include "tinyBackend/Base/WorkStealingPool.hpp"
+#include "tinyBackend/Base/ParallelAlgorithm.hpp"
 #include "tinyBackend/Net/TcpMessageAgent.hpp"
 #include "tinyBackend/Net/error/error_mark.hpp"
+#include <deque>
+#include <future>
+#include <sys/stat.h>
 
 using namespace Base;
 
@@ -23,10 +28,25 @@ using namespace LogSystem;
 
 
 LinkLogCenter::LinkLogCenter(LogHandlerPtr handler, std::string dictionary_path,
-                             ScheduledThread& thread) :
-    _handler(std::move(handler)), _storage(std::move(dictionary_path), thread),
-    _reactor(SERVER_TIMEOUT) {
-    assert(_handler);
+                             ScheduledThread& thread, bool secondary_indexes, uint32 partitions,
+                             const LinkSamplingPolicy& sampling) :
+    _handler(std::move(handler)), _reactor(SERVER_TIMEOUT) {
+    assert(_handler && partitions > 0);
+    if (partitions == 1) {
+        _partitions.push_back(std::make_unique<Partition>(std::move(dictionary_path), thread,
+                                                          secondary_indexes, sampling));
+    } else {
+        if (dictionary_path.back() != '/') dictionary_path.push_back('/');
+        for (uint32 i = 0; i < partitions; ++i) {
+            std::string path = dictionary_path + "partition_" + std::to_string(i);
+            CHECK(mkdir(path.c_str(), 0755) == 0 || errno == EEXIST,)
+            _partitions.push_back(std::make_unique<Partition>(std::move(path), thread,
+                                                              secondary_indexes, sampling));
+            auto& part = *_partitions.back();
+            part.thread = Thread([this, &part] { run_partition(part); });
+            part.thread.start();
+        }
+    }
     _reactor.start(Reactor::EPOLL, GET_ACTIVE_TIMEOUT,
                    [this] { check_timeout(); });
 }
@@ -69,7 +89,7 @@ bool LinkLogCenter::add_server(const Address& server_address) {
 void LinkLogCenter::remove_server(const Address& server_address) {
     auto iter = _nodes.find(server_address);
     if (iter == _nodes.end()) return;
-    _reactor.weak_up_channel(iter->second,
+    _reactor.weak_up_channel(iter->second.fd,
                              [] (MessageAgent& agent, Channel&) {
                                  LinkLogMessage message(LinkLogMessage::CentralOffline);
                                  uint32 written = agent.output().fix_write(&message, sizeof(LinkLogMessage));
@@ -83,120 +103,468 @@ void LinkLogCenter::search_link(const ServiceID& service, LinkLogSearchHandler&
                                 uint32 buffer_size) {
     assert(buffer_size >= (1 << 16));
 
-    auto point = _storage.get_query_set(
+    auto& storage = partition_of(service).storage;
+    auto point = storage.get_query_set(
         service,
         [&handler] (const Index_Key& key, const Index_Value& val) {
             return handler.node_filter(key, val);
         });
-    char *buffer = new char[buffer_size];
-    char *now = buffer;
-    assert(buffer != nullptr);
-
-    uint32 rest = 0;
-    while (point || rest > 0) {
-        if (rest == 0) {
-            auto [written, ptr] = _storage.query(buffer, buffer_size, point);
-            now = buffer;
-            rest = written;
-            point = ptr;
+    send_query_result({ QuerySource(&storage, point) }, handler, buffer_size);
+}
+
+void LinkLogCenter::search_logs(LogRank rank, TimeInterval begin, TimeInterval end,
+                                LinkLogSearchHandler& handler, uint32 buffer_size) {
+    assert(buffer_size >= (1 << 16));
+    std::vector<QuerySource> sources;
+    for (auto& part : _partitions)
+        sources.emplace_back(&part->storage, part->storage.get_rank_query_set(rank, begin, end));
+    send_query_result(std::move(sources), handler, buffer_size);
+}
+
+void LinkLogCenter::search_slow_links(TimeInterval min_duration, LinkLogSearchHandler& handler,
+                                      uint32 buffer_size) {
+    assert(buffer_size >= (1 << 16));
+    std::vector<QuerySource> sources;
+    for (auto& part : _partitions) {
+        std::vector<Index_Key> nodes;
+        for (auto& [key, duration] : part->storage.find_slow_nodes(min_duration))
+            nodes.push_back(key);
+        auto point = part->storage.get_query_set(
+            nodes,
+            [&handler] (const Index_Key& key, const Index_Value& val) {
+                return handler.node_filter(key, val);
+            });
+        sources.emplace_back(&part->storage, point);
+    }
+    send_query_result(std::move(sources), handler, buffer_size);
+}
+
+void LinkLogCenter::send_query_result(std::vector<QuerySource> sources, LinkLogSearchHandler& handler,
+                                      uint32 buffer_size) {
+    struct Reading {
+        std::unique_ptr<char[]> buffer;
+        char *now = nullptr;
+        uint32 rest = 0;
+    };
+    std::vector<Reading> readings(sources.size());
+    for (auto& reading : readings) {
+        reading.buffer = std::make_unique<char[]>(buffer_size);
+        assert(reading.buffer != nullptr);
+    }
+
+    /// 每个分区的结果按时间从晚到早返回，每次取出当前时间最晚的一条。
+    auto fill = [&] (uint32 index) {
+        auto& [storage, point] = sources[index];
+        auto& reading = readings[index];
+        if (reading.rest == 0 && point) {
+            auto [written, ptr] = storage->query(reading.buffer.get(), buffer_size, point);
             assert(!(written == 0 && ptr != nullptr));
-            if (rest == 0) break;
+            reading.now = reading.buffer.get();
+            reading.rest = written;
+            point = ptr;
         }
-        auto header = reinterpret_cast<Link_Log_Header *>(now);
-        uint16 log_size = header->log_size();
-        assert(rest >= log_size + sizeof(Link_Log_Header));
-        std::string text(now + sizeof(Link_Log_Header), log_size);
-        handler.receive_log(Link_Log(*header, std::move(text)));
-        rest -= sizeof(Link_Log_Header) + log_size;
-        now += sizeof(Link_Log_Header) + log_size;
+        return reading.rest > 0;
+    };
+    while (!handler.search_done()) {
+        Link_Log_Header *latest = nullptr;
+        Reading *from = nullptr;
+        for (uint32 i = 0; i < sources.size(); ++i) {
+            if (!fill(i)) continue;
+            auto header = reinterpret_cast<Link_Log_Header *>(readings[i].now);
+            if (!latest || latest->time() < header->time()) {
+                latest = header;
+                from = &readings[i];
+            }
+        }
+        if (!latest) break;
+        uint16 log_size = latest->log_size();
+        assert(from->rest >= log_size + sizeof(Link_Log_Header));
+        std::string text(from->now + sizeof(Link_Log_Header), log_size);
+        handler.receive_log(Link_Log(*latest, std::move(text)));
+        from->rest -= sizeof(Link_Log_Header) + log_size;
+        from->now += sizeof(Link_Log_Header) + log_size;
     }
-    delete[] buffer;
+    for (auto& [storage, point] : sources)
+        if (point) LinkLogStorage::destroy_query_set(point);
 }
 
 void LinkLogCenter::flush() {
-    _storage.flush_log_file();
-    _storage.flush_index_file();
-    _storage.flush_deletion_file();
-    _storage.flush_file_name();
+    for (auto& part : _partitions) {
+        part->storage.flush_log_file();
+        part->storage.flush_index_file();
+        part->storage.flush_deletion_file();
+        part->storage.flush_file_name();
+    }
+}
+
+LinkSamplingStats LinkLogCenter::sampling_stats() const {
+    LinkSamplingStats stats;
+    for (auto& part : _partitions) {
+        if (part->sampler)
+            stats += part->sampler->stats();
+    }
+    return stats;
 }
 
 void LinkLogCenter::delete_oldest_files(uint32 size) {
-    _storage.delete_oldest_files(size);
+    for (auto& part : _partitions)
+        part->storage.delete_oldest_files(size);
+}
+
+namespace {
+
+    /// 从文件中挑出一组节点的日志。
+    class SearchScanner : public LinkLogReplayHandler {
+    public:
+        SearchScanner(const std::unordered_set<Index_Key>& nodes, const std::atomic<bool>& stop) :
+            nodes(nodes), stop(stop) {};
+
+        void create_head_logger(LinkServiceID, LinkNodeID, TimeInterval) override {};
+
+        void register_logger(LinkServiceID, LinkNodeID, LinkNodeID, LinkNodeType,
+                             TimeInterval, TimeInterval) override {};
+
+        void create_logger(LinkServiceID, LinkNodeID, TimeInterval) override {};
+
+        void logger_end(LinkServiceID, LinkNodeID, TimeInterval) override {};
+
+        void receive_log(Link_Log log) override {
+            if (nodes.count(Index_Key(log.service, log.node_init_time, log.node)))
+                logs.push_back(std::move(log));
+        };
+
+        /// 先按节点过滤，只复制需要的日志正文
+        void receive_log_view(const Link_Log_View& log) override {
+            if (nodes.count(Index_Key(log.service, log.node_init_time, log.node)))
+                logs.emplace_back(log);
+        };
+
+        void handling_error(LinkServiceID, LinkNodeID, TimeInterval, LinkErrorType) override {};
+
+        bool replay_done() override {
+            return stop.load(std::memory_order_relaxed);
+        };
+
+        const std::unordered_set<Index_Key>& nodes;
+
+        const std::atomic<bool>& stop;
+
+        std::vector<Link_Log> logs;
+
+    };
+
+}
+
+uint64 LinkLogCenter::search_link(WorkStealingPool& pool, const ServiceID& service,
+                                  LinkLogSearchHandler& handler, uint64 limit) {
+    auto plan = partition_of(service).storage.get_search_plan(
+        service,
+        [&handler] (const Index_Key& key, const Index_Value& val) {
+            return handler.node_filter(key, val);
+        });
+    if (plan.nodes.empty() || limit == 0) return 0;
+
+    std::atomic<bool> stop = false;
+    auto scan = [&plan, &stop] (uint64 index) {
+        auto& [path, end] = plan.files[index];
+        SearchScanner scanner(plan.nodes, stop);
+        LinkLogMappedFile file(path.c_str(), end);
+        if (file.is_open()) replay_file(scanner, file, TimeInterval(0));
+        std::stable_sort(scanner.logs.begin(), scanner.logs.end(),
+                         [] (const Link_Log& lhs, const Link_Log& rhs) {
+                             return lhs.time < rhs.time;
+                         });
+        return std::move(scanner.logs);
+    };
+
+    /// 同时读取的文件数量有限，按文件顺序取回结果，先读完的文件等待之前的文件。
+    std::deque<std::future<std::vector<Link_Log>>> reading;
+    uint64 next = 0, found = 0, window = pool.get_core_threads() + 1;
+    while (found < limit && !handler.search_done()) {
+        for (; next < plan.files.size() && reading.size() < window; ++next) {
+            if (pool.joinable()) {
+                try {
+                    reading.push_back(pool.submit_with_future(scan, next));
+                    continue;
+                } catch (Exception&) {}
+            }
+            std::promise<std::vector<Link_Log>> promise;
+            promise.set_value(scan(next));
+            reading.push_back(promise.get_future());
+        }
+        if (reading.empty()) break;
+        auto& future = reading.front();
+        pool.help_until([&future] {
+            return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        });
+        auto logs = future.get();
+        reading.pop_front();
+        for (auto& log : logs) {
+            handler.receive_log(std::move(log));
+            if (++found == limit || handler.search_done()) break;
+        }
+    }
+
+    /// 任务引用了 plan 与 stop，需要等待仍在读取的文件结束。
+    stop.store(true, std::memory_order_relaxed);
+    for (auto& future : reading) {
+        pool.help_until([&future] {
+            return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        });
+    }
+    return found;
 }
 
 uint64 LinkLogCenter::replay_history(LinkLogReplayHandler& handler, const char *file_path) {
-    iFile file(file_path, true);
-    CHECK(file, return 0;)
-    RingBuffer buffer(1 << 16);
-    CHECK(buffer.buffer_size() == (1 << 16), return 0;)
+    LinkLogMappedFile file(file_path);
+    CHECK(file.is_open(), return 0;)
+    return replay_file(handler, file, TimeInterval(0));
+}
+
+uint64 LinkLogCenter::replay_history(WorkStealingPool& pool, LinkLogReplayHandler& handler,
+                                     const std::vector<std::string>& file_paths) {
+    return parallel_reduce(pool, (uint64) 0, (uint64) file_paths.size(), (uint64) 0,
+                           [&handler, &file_paths] (uint64 index) {
+                               return replay_history(handler, file_paths[index].c_str());
+                           }, std::plus<>(), 1);
+}
+
+uint64 LinkLogCenter::replay_history(WorkStealingPool& pool, LinkLogReplayHandler& handler,
+                                     TimeInterval begin) {
+    std::vector<std::pair<std::string, uint64>> files;
+    for (auto& part : _partitions) {
+        auto part_files = part->storage.get_log_files(begin);
+        files.insert(files.end(), std::make_move_iterator(part_files.begin()),
+                     std::make_move_iterator(part_files.end()));
+    }
+    return parallel_reduce(pool, (uint64) 0, (uint64) files.size(), (uint64) 0,
+                           [&handler, &files, begin] (uint64 index) -> uint64 {
+                               auto& [path, end] = files[index];
+                               LinkLogMappedFile file(path.c_str(), end);
+                               CHECK(file.is_open(), return 0;)
+                               return replay_file(handler, file, begin);
+                           }, std::plus<>(), 1);
+}
+
+uint64 LinkLogCenter::replay_file(LinkLogReplayHandler& handler, LinkLogMappedFile& file, TimeInterval begin) {
+    /// 新版本的日志文件中每个文件独立定义节点句柄
+    std::vector<Index_Key> nodes;
     uint64 total_read = 0;
-    int64 file_read = 0;
-    while ((file_read = file.read(buffer.writable_array())) > 0) {
-        buffer.write_advance(file_read);
-        uint32 read = 1;
-        while (read != 0 && buffer.readable_len() > sizeof(OperationType)) {
-            OperationType ot;
-            buffer.try_read(&ot, sizeof(OperationType), 0);
-            switch (ot) {
-                case RegisterLogger:
-                    read = replay_register_logger(handler, buffer);
-                    break;
-                case CreateLogger:
-                    read = replay_create_logger(handler, buffer);
-                    break;
-                case EndLogger:
-                    read = replay_end_logger(handler, buffer);
-                    break;
-                case LinkLog:
-                    read = replay_log(handler, buffer);
-                    break;
-                case ErrorLogger:
-                    read = replay_error_logger(handler, buffer);
-                    break;
-                case NodeOffline:
-                    read = replay_remove_server(buffer);
-                    break;
-                default:
-                    ASSERT_WRONG_TYPE(ot)
+    const char *data;
+    uint64 size;
+    while (!handler.replay_done() && file.next(data, size) > 0)
+        total_read += replay_records(handler, nodes, data, size, begin);
+    return total_read;
+}
+
+uint64 LinkLogCenter::replay_records(LinkLogReplayHandler& handler, std::vector<Index_Key>& nodes,
+                                     const char *data, uint64 size, TimeInterval begin) {
+    const char *ptr = data, *end = data + size;
+    while (ptr < end) {
+        uint64 rest = end - ptr;
+        OperationType ot = (OperationType) *ptr;
+        switch (ot) {
+            case RegisterLogger: {
+                if (rest < sizeof(Register_Logger)) return ptr - data;
+                Register_Logger logger;
+                std::memcpy(&logger, ptr, sizeof(Register_Logger));
+                ptr += sizeof(Register_Logger);
+                if (logger.time() < begin) break;
+                handler.register_logger(logger.service(), logger.node(), logger.parent_node(),
+                                        logger.type(), logger.time(), logger.parent_init_time());
+                break;
+            }
+            case CreateLogger: {
+                if (rest < sizeof(Create_Logger)) return ptr - data;
+                Create_Logger logger;
+                std::memcpy(&logger, ptr, sizeof(Create_Logger));
+                ptr += sizeof(Create_Logger);
+                if (logger.init_time() < begin) break;
+                if (logger.type() == Head) {
+                    handler.create_head_logger(logger.service(), logger.node(), logger.init_time());
+                } else {
+                    handler.create_logger(logger.service(), logger.node(), logger.init_time());
+                }
+                break;
+            }
+            case EndLogger: {
+                if (rest < sizeof(End_Logger)) return ptr - data;
+                End_Logger logger;
+                std::memcpy(&logger, ptr, sizeof(End_Logger));
+                ptr += sizeof(End_Logger);
+                if (logger.end_time() < begin) break;
+                handler.logger_end(logger.service(), logger.node(), logger.end_time());
+                break;
+            }
+            case ErrorLogger: {
+                if (rest < sizeof(Error_Logger)) return ptr - data;
+                Error_Logger logger;
+                std::memcpy(&logger, ptr, sizeof(Error_Logger));
+                ptr += sizeof(Error_Logger);
+                if (logger.time() < begin) break;
+                handler.handling_error(logger.service(), logger.node(),
+                                       logger.time(), logger.error_type());
+                break;
+            }
+            case LinkLog: {
+                if (rest < sizeof(Link_Log_Header)) return ptr - data;
+                Link_Log_Header header;
+                std::memcpy(&header, ptr, sizeof(Link_Log_Header));
+                if (rest < sizeof(Link_Log_Header) + header.log_size()) return ptr - data;
+                ptr += sizeof(Link_Log_Header) + header.log_size();
+                if (header.time() < begin) break;
+                Link_Log_View view { header.service(), header.init_time(), header.node(), header.rank(),
+                                     header.time(), std::string_view(ptr - header.log_size(), header.log_size()) };
+                handler.receive_log_view(view);
+                break;
+            }
+            case NodeOffline:
+                if (rest < sizeof(Node_Offline)) return ptr - data;
+                ptr += sizeof(Node_Offline);
+                break;
+            case NodeDefine: {
+                if (rest < sizeof(Node_Define)) return ptr - data;
+                Node_Define define;
+                std::memcpy(&define, ptr, sizeof(Node_Define));
+                ptr += sizeof(Node_Define);
+                if (define.handle() >= nodes.size())
+                    nodes.resize(define.handle() + 1);
+                nodes[define.handle()] = define.key();
+                break;
+            }
+            case CompactLog:
+            case StoredLog: {
+                Compact_Log header;
+                uint32 header_size = header.decode(ptr, end);
+                if (header_size == 0 || rest < header_size + header.log_size) {
+                    CHECK(header_size != 0 || rest < Compact_Log::max_size,)
+                    return ptr - data;
+                }
+                ptr += header_size + header.log_size;
+                CHECK(header.handle < nodes.size(), break;)
+                auto& key = nodes[header.handle];
+                TimeInterval time(key.init_time().nanoseconds + header.time_delta.nanoseconds);
+                if (time < begin) break;
+                Link_Log_View view { key.service(), key.init_time(), key.node(), header.rank,
+                                     time, std::string_view(ptr - header.log_size, header.log_size) };
+                handler.receive_log_view(view);
+                break;
+            }
+            default:
+                ASSERT_WRONG_TYPE(ot)
 #ifdef GLOBAL_LOGGER
-                    Global_Logger.flush();
+                Global_Logger.flush();
 #endif
-                    CurrentThread::emergency_exit(__PRETTY_FUNCTION__);
-            }
-            total_read += read;
+                CurrentThread::emergency_exit(__PRETTY_FUNCTION__);
         }
     }
-    return total_read;
+    return ptr - data;
 }
 
 void LinkLogCenter::handle_read(MessageAgent& agent) {
     auto iter = agent.socket_event.get_extra_data<NodeMapIter>();
+    if (_partitions.size() > 1) {
+        dispatch_records(iter, agent);
+        return;
+    }
+    auto& part = *_partitions.front();
     auto& buffer = static_cast<const RingBuffer&>(agent.input());
 
     uint32 read = 1, total_read = 0;
+    while (read != 0 && buffer.readable_len() > sizeof(OperationType)) {
+        OperationType ot;
+        buffer.try_read(&ot, sizeof(OperationType), 0);
+        switch (ot) {
+            case NodeOffline:
+                read = handle_remove_server(iter, agent);
+                assert(buffer.readable_len() == 0 || read == 0);
+                break;
+            case NodeDefine:
+                read = handle_node_define(iter, buffer);
+                break;
+            case CompactLog:
+                read = handle_compact_log(iter, agent);
+                break;
+            default:
+                read = admit_record(part, iter->first, ot, buffer);
+        }
+        total_read += read;
+    }
+    if (total_read > 0)
+        part.storage.write_to_file();
+}
+
+void LinkLogCenter::dispatch_records(NodeMapIter iter, MessageAgent& agent) {
+    auto& buffer = static_cast<const RingBuffer&>(agent.input());
+    std::vector<std::string> batches(_partitions.size());
+    /// 将 buffer 开头 size 字节的记录移入服务对应分区的批次。
+    auto move_record = [&] (const ServiceID& service, uint32 size) {
+        uint32 index = partition_index(service);
+        auto& batch = batches[index];
+        uint64 old_size = batch.size();
+        batch.resize(old_size + size);
+        buffer.read(batch.data() + old_size, size);
+        if (batch.size() >= PARTITION_BATCH_SIZE)
+            submit_batch(*_partitions[index], iter->first, batch);
+        return size;
+    };
+    /// 取出 buffer 开头的定长记录 T，数据不完整时返回 0。
+    auto move_fixed = [&] (auto record) {
+        using T = decltype(record);
+        if (buffer.readable_len() < sizeof(T)) return (uint32) 0;
+        buffer.try_read(&record, sizeof(T), 0);
+        return move_record(record.service(), sizeof(T));
+    };
+
+    uint32 read = 1;
     while (read != 0 && buffer.readable_len() > sizeof(OperationType)) {
         OperationType ot;
         buffer.try_read(&ot, sizeof(OperationType), 0);
         switch (ot) {
             case RegisterLogger:
-                read = handle_register_logger(iter, buffer);
+                read = move_fixed(Register_Logger());
                 break;
             case CreateLogger:
-                read = handle_create_logger(iter, buffer);
+                read = move_fixed(Create_Logger());
                 break;
             case EndLogger:
-                read = handle_end_logger(iter, buffer);
-                break;
-            case LinkLog:
-                read = handle_log(iter, buffer);
+                read = move_fixed(End_Logger());
                 break;
             case ErrorLogger:
-                read = handle_error_logger(iter, buffer);
+                read = move_fixed(Error_Logger());
                 break;
-            case NodeOffline:
+            case LinkLog: {
+                read = 0;
+                Link_Log_Header header;
+                if (buffer.readable_len() < sizeof(Link_Log_Header)) break;
+                buffer.try_read(&header, sizeof(Link_Log_Header), 0);
+                if (buffer.readable_len() < sizeof(Link_Log_Header) + header.log_size()) break;
+                read = move_record(header.service(), sizeof(Link_Log_Header) + header.log_size());
+                break;
+            }
+            case CompactLog: {
+                /// 压缩日志依赖连接上的节点句柄，展开之后再交给分区
+                Link_Log log;
+                read = read_compact_log(iter->second.nodes, buffer, log);
+                if (read == MALFORMED_RECORD) read = reject_malformed(iter, agent);
+                if (read == 0 || log.rank == EMPTY) break;
+                append_log_record(batches[partition_index(log.service)], log);
+                break;
+            }
+            case NodeDefine:
+                read = handle_node_define(iter, buffer);
+                break;
+            case NodeOffline: {
+                read = 0;
+                Node_Offline offline;
+                if (buffer.readable_len() < sizeof(Node_Offline)) break;
+                buffer.try_read(&offline, sizeof(Node_Offline), 0);
                 read = handle_remove_server(iter, agent);
+                for (auto& batch : batches)
+                    batch.append((const char *) &offline, sizeof(Node_Offline));
                 assert(buffer.readable_len() == 0 || read == 0);
                 break;
+            }
             default:
                 ASSERT_WRONG_TYPE(ot)
 #ifdef GLOBAL_LOGGER
@@ -204,10 +572,102 @@ void LinkLogCenter::handle_read(MessageAgent& agent) {
 #endif
                 CurrentThread::emergency_exit(__PRETTY_FUNCTION__);
         }
-        total_read += read;
     }
-    buffer.read_back(total_read);
-    _storage.write_to_file(buffer, total_read);
+    for (uint32 i = 0; i < batches.size(); ++i) {
+        if (!batches[i].empty())
+            submit_batch(*_partitions[i], iter->first, batches[i]);
+    }
+}
+
+void LinkLogCenter::submit_batch(Partition& part, const Address& address, std::string& data) {
+    auto batch = std::make_unique<IngestBatch>();
+    batch->address = address;
+    batch->data.swap(data);
+    CHECK(part.queue.put(std::move(batch)),)
+}
+
+void LinkLogCenter::run_partition(Partition& part) {
+    BatchPtr batch;
+    while (part.queue.take(batch) && batch) {
+        if (batch->data.empty()) {
+            check_timeout(part);
+            continue;
+        }
+        /// 批次只包含完整的记录，直接在批次的数据上解析
+        auto& data = batch->data;
+        RingBufferWrapper records(data.data(), data.size());
+        records.write_advance(data.size());
+        uint32 read = 1;
+        while (read != 0 && records.readable_len() > sizeof(OperationType)) {
+            OperationType ot;
+            records.try_read(&ot, sizeof(OperationType), 0);
+            read = admit_record(part, batch->address, ot, records);
+        }
+        part.storage.write_to_file();
+    }
+}
+
+uint32 LinkLogCenter::apply_record(Partition& part, const Address& address,
+                                   OperationType type, const RingBufferWrapper& buffer) {
+    switch (type) {
+        case RegisterLogger:
+            return handle_register_logger(part, address, buffer);
+        case CreateLogger:
+            return handle_create_logger(part, address, buffer);
+        case EndLogger:
+            return handle_end_logger(part, address, buffer);
+        case LinkLog:
+            return handle_log(part, address, buffer);
+        case ErrorLogger:
+            return handle_error_logger(part, address, buffer);
+        case NodeOffline: {
+            /// 多分区时连接的下线由 reactor 线程处理，分区只记录
+            if (buffer.readable_len() < sizeof(Node_Offline)) return 0;
+            Node_Offline offline;
+            buffer.read(&offline, sizeof(Node_Offline));
+            part.storage.add_record(&offline, sizeof(Node_Offline));
+            return sizeof(Node_Offline);
+        }
+        default:
+            ASSERT_WRONG_TYPE(type)
+#ifdef GLOBAL_LOGGER
+            Global_Logger.flush();
+#endif
+            CurrentThread::emergency_exit(__PRETTY_FUNCTION__);
+            return 0;
+    }
+}
+
+uint32 LinkLogCenter::admit_record(Partition& part, const Address& address,
+                                   OperationType type, const RingBufferWrapper& buffer) {
+    if (!part.sampler)
+        return apply_record(part, address, type, buffer);
+    LinkTraceSampler::Released released;
+    uint32 readable = buffer.readable_len();
+    auto verdict = part.sampler->admit(address, buffer, released);
+    apply_released(part, released);
+    if (verdict == LinkTraceSampler::Keep)
+        return apply_record(part, address, type, buffer);
+    return readable - buffer.readable_len();
+}
+
+void LinkLogCenter::apply_released(Partition& part, LinkTraceSampler::Released& released) {
+    for (auto& [address, data] : released) {
+        RingBufferWrapper records(data.data(), data.size());
+        records.write_advance(data.size());
+        uint32 read = 1;
+        while (read != 0 && records.readable_len() > sizeof(OperationType)) {
+            OperationType ot;
+            records.try_read(&ot, sizeof(OperationType), 0);
+            read = apply_record(part, address, ot, records);
+        }
+    }
+    released.clear();
+}
+
+uint32 LinkLogCenter::partition_index(const ServiceID& service) const {
+    if (_partitions.size() == 1) return 0;
+    return std::hash<ServiceID>()(service) % _partitions.size();
 }
 
 bool LinkLogCenter::handle_error(MessageAgent& agent) const {
@@ -231,95 +691,117 @@ void LinkLogCenter::handle_close(MessageAgent& agent) {
 }
 
 void LinkLogCenter::check_timeout() {
+    if (_partitions.size() == 1) {
+        check_timeout(*_partitions.front());
+        return;
+    }
+    /// 空批次通知分区线程检查超时，分区忙碌时跳过这一次
+    for (auto& part : _partitions)
+        part->queue.try_put(std::make_unique<IngestBatch>());
+}
+
+void LinkLogCenter::check_timeout(Partition& part) {
+    if (part.sampler) {
+        LinkTraceSampler::Released released;
+        part.sampler->check_timeout(released);
+        apply_released(part, released);
+    }
     auto now = Unix_to_now();
-    while (!_timers.empty() && _timers.top().expire_time <= now) {
-        if (_timers.top().check_timeout()) {
-            auto& [expire_time, iter, ptr, address] = _timers.top();
+    auto& timers = part.timers;
+    while (!timers.empty() && timers.top().expire_time <= now) {
+        if (timers.top().check_timeout()) {
+            auto& [expire_time, iter, ptr, address] = timers.top();
             if (iter->second.type != RpcDecision) {
                 _handler->handling_error(address, iter->first.serviceID(),
                                          iter->first.nodeID(), expire_time,
                                          iter->second.type == BranchHead
                                              ? NotRegister : CreateTimeOut);
             }
-            _check.erase(iter);
+            part.check.erase(iter);
         }
-        _timers.pop();
+        timers.pop();
     }
+    /// 空闲时也要将未满的日志帧写入文件
+    part.storage.write_to_file();
 }
 
-uint32 LinkLogCenter::handle_register_logger(NodeMapIter iter, const RingBuffer& buffer) {
+uint32 LinkLogCenter::handle_register_logger(Partition& part, const Address& address,
+                                             const RingBufferWrapper& buffer) {
     if (buffer.readable_len() < sizeof(Register_Logger))
         return 0;
     Register_Logger logger;
     buffer.read(&logger, sizeof(Register_Logger));
     if (logger.type() > Decision) {
-        auto [new_iter, success] = _check.try_emplace(
+        auto [new_iter, success] = part.check.try_emplace(
             ID(logger.service(), logger.node()), logger);
         if (!success) {
-            _storage.update_logger(logger.service(), logger.node(), logger.parent_init_time(),
+            part.storage.update_logger(logger.service(), logger.node(), logger.parent_init_time(),
                                    logger.parent_node(), logger.type(), new_iter->second.init_time);
             new_iter->second.on_time();
-            _check.erase(new_iter);
+            part.check.erase(new_iter);
         } else {
             new_iter->second.create();
-            _timers.emplace(logger.expire_time(), new_iter, iter->first);
+            part.timers.emplace(logger.expire_time(), new_iter, address);
         }
     }
-    _handler->register_logger(iter->first, logger.service(), logger.node(), logger.parent_node(),
+    _handler->register_logger(address, logger.service(), logger.node(), logger.parent_node(),
                               logger.type(), logger.time(), logger.parent_init_time());
-    _storage.add_record(sizeof(Register_Logger));
+    part.storage.add_record(&logger, sizeof(Register_Logger));
     return sizeof(Register_Logger);
 }
 
-uint32 LinkLogCenter::handle_create_logger(NodeMapIter iter, const RingBuffer& buffer) {
+uint32 LinkLogCenter::handle_create_logger(Partition& part, const Address& address,
+                                           const RingBufferWrapper& buffer) {
     if (buffer.readable_len() < sizeof(Create_Logger))
         return 0;
     Create_Logger logger;
     buffer.read(&logger, sizeof(Create_Logger));
     if (logger.type() == BranchHead) {
-        auto [new_iter, success] = _check.try_emplace(
+        auto [new_iter, success] = part.check.try_emplace(
             ID(logger.service(), logger.node()), logger);
         if (!success) {
             logger.type() = new_iter->second.type;
             logger.parent_node() = new_iter->second.parent;
             logger.parent_init_time() = new_iter->second.parent_init_time;
             new_iter->second.on_time();
-            _check.erase(new_iter);
+            part.check.erase(new_iter);
         } else {
             new_iter->second.create();
-            _timers.emplace(Unix_to_now() + ILLEGAL_LOGGER_TIMOUT, new_iter, iter->first);
+            part.timers.emplace(Unix_to_now() + ILLEGAL_LOGGER_TIMOUT, new_iter, address);
         }
     }
-    bool success = _storage.create_logger(logger.service(), logger.node(), logger.parent_init_time(),
+    bool success = part.storage.create_logger(logger.service(), logger.node(), logger.parent_init_time(),
                                           logger.parent_node(), logger.type(), logger.init_time());
     if (likely(success)) {
         if (logger.type() == Head) {
-            _handler->create_head_logger(iter->first, logger.service(),
+            _handler->create_head_logger(address, logger.service(),
                                          logger.node(), logger.init_time());
         } else {
-            _handler->create_logger(iter->first, logger.service(),
+            _handler->create_logger(address, logger.service(),
                                     logger.node(), logger.init_time());
         }
     } else {
-        _handler->handling_error(iter->first, logger.service(), logger.node(), logger.init_time(),
+        _handler->handling_error(address, logger.service(), logger.node(), logger.init_time(),
                                  ConflictingNode);
     }
-    _storage.add_record(sizeof(Create_Logger));
+    part.storage.add_record(&logger, sizeof(Create_Logger));
     return sizeof(Create_Logger);
 }
 
-uint32 LinkLogCenter::handle_end_logger(NodeMapIter iter, const RingBuffer& buffer) {
+uint32 LinkLogCenter::handle_end_logger(Partition& part, const Address& address,
+                                        const RingBufferWrapper& buffer) {
     if (buffer.readable_len() < sizeof(End_Logger))
         return 0;
     End_Logger logger;
     buffer.read(&logger, sizeof(End_Logger));
-    _storage.end_logger(logger.service(), logger.node(), logger.init_time());
-    _handler->logger_end(iter->first, logger.service(), logger.node(), logger.end_time());
-    _storage.add_record(sizeof(End_Logger));
+    part.storage.end_logger(logger.service(), logger.node(), logger.init_time(), logger.end_time());
+    _handler->logger_end(address, logger.service(), logger.node(), logger.end_time());
+    part.storage.add_record(&logger, sizeof(End_Logger));
     return sizeof(End_Logger);
 }
 
-uint32 LinkLogCenter::handle_log(NodeMapIter iter, const RingBuffer& buffer) {
+uint32 LinkLogCenter::handle_log(Partition& part, const Address& address,
+                                 const RingBufferWrapper& buffer) {
     if (buffer.readable_len() < sizeof(Link_Log_Header))
         return 0;
     Link_Log_Header header;
@@ -327,27 +809,61 @@ uint32 LinkLogCenter::handle_log(NodeMapIter iter, const RingBuffer& buffer) {
     if (buffer.readable_len() < header.log_size() + sizeof(Link_Log_Header))
         return 0;
 
-    _storage.handle_a_log(header, buffer);
     buffer.read_advance(sizeof(Link_Log_Header));
     std::string text(header.log_size(), '\0');
     buffer.read(text.data(), header.log_size());
+    part.storage.add_log(*(Index_Key *) &header.service(), header.time(), header.rank(),
+                         text.data(), header.log_size());
     Link_Log log(header, std::move(text));
-    _handler->receive_log(iter->first, log);
-    _storage.add_record(sizeof(Link_Log_Header) + header.log_size());
+    _handler->receive_log(address, log);
     return sizeof(Link_Log_Header) + header.log_size();
 }
 
-uint32 LinkLogCenter::handle_error_logger(NodeMapIter iter, const RingBuffer& buffer) {
+uint32 LinkLogCenter::handle_error_logger(Partition& part, const Address& address,
+                                          const RingBufferWrapper& buffer) {
     if (buffer.readable_len() < sizeof(Error_Logger))
         return 0;
     Error_Logger logger;
     buffer.read(&logger, sizeof(Error_Logger));
-    _handler->handling_error(iter->first, logger.service(), logger.node(),
+    _handler->handling_error(address, logger.service(), logger.node(),
                              logger.time(), logger.error_type());
-    _storage.add_record(sizeof(Error_Logger));
+    part.storage.add_record(&logger, sizeof(Error_Logger));
     return sizeof(Error_Logger);
 }
 
+uint32 LinkLogCenter::handle_node_define(NodeMapIter iter, const RingBuffer& buffer) {
+    return read_node_define(iter->second.nodes, buffer);
+}
+
+uint32 LinkLogCenter::handle_compact_log(NodeMapIter iter, MessageAgent& agent) {
+    Link_Log log;
+    uint32 read = read_compact_log(iter->second.nodes, static_cast<const RingBuffer&>(agent.input()), log);
+    if (read == MALFORMED_RECORD) return reject_malformed(iter, agent);
+    if (read == 0 || log.rank == EMPTY) return read;
+    auto& part = partition_of(log.service);
+    if (part.sampler) {
+        /// 展开为 LinkLog 之后与其他记录一样经过采样器
+        std::string record;
+        append_log_record(record, log);
+        RingBufferWrapper records(record.data(), record.size());
+        records.write_advance(record.size());
+        admit_record(part, iter->first, LinkLog, records);
+        return read;
+    }
+    part.storage.add_log(Index_Key(log.service, log.node_init_time, log.node),
+                         log.time, log.rank, log.text.data(), log.text.size());
+    _handler->receive_log(iter->first, std::move(log));
+    return read;
+}
+
+uint32 LinkLogCenter::reject_malformed(NodeMapIter iter, MessageAgent& agent) {
+    G_ERROR << "LinkLogCenter: malformed compact log from " << iter->first.toIpPort()
+            << ", closing the connection.";
+    agent.input().clear_input();
+    agent.socket_event.set_HangUp();
+    return 0;
+}
+
 uint32 LinkLogCenter::handle_remove_server(NodeMapIter iter, MessageAgent& agent) {
     auto& buffer = agent.input();
     if (buffer.readable_len() < sizeof(Node_Offline))
@@ -356,73 +872,51 @@ uint32 LinkLogCenter::handle_remove_server(NodeMapIter iter, MessageAgent& agent
     buffer.read(&offline, sizeof(Node_Offline));
     agent.socket_event.set_HangUp();
     _handler->node_offline(iter->first, offline.time());
-    _storage.add_record(sizeof(Node_Offline));
+    if (_partitions.size() == 1)
+        _partitions.front()->storage.add_record(&offline, sizeof(Node_Offline));
     return sizeof(Node_Offline);
 }
 
-uint32 LinkLogCenter::replay_register_logger(LinkLogReplayHandler& handler,
-                                             RingBuffer& buffer) {
-    if (buffer.readable_len() < sizeof(Register_Logger))
-        return 0;
-    Register_Logger logger;
-    buffer.read(&logger, sizeof(Register_Logger));
-    handler.register_logger(logger.service(), logger.node(), logger.parent_node(),
-                            logger.type(), logger.time(), logger.parent_init_time());
-    return sizeof(Register_Logger);
-}
-
-uint32 LinkLogCenter::replay_create_logger(LinkLogReplayHandler& handler, RingBuffer& buffer) {
-    if (buffer.readable_len() < sizeof(Create_Logger))
-        return 0;
-    Create_Logger logger;
-    buffer.read(&logger, sizeof(Create_Logger));
-    if (logger.type() == Head) {
-        handler.create_head_logger(logger.service(), logger.node(), logger.init_time());
-    } else {
-        handler.create_logger(logger.service(), logger.node(), logger.init_time());
-    }
-    return sizeof(Create_Logger);
-}
-
-uint32 LinkLogCenter::replay_end_logger(LinkLogReplayHandler& handler, RingBuffer& buffer) {
-    if (buffer.readable_len() < sizeof(End_Logger))
-        return 0;
-    End_Logger logger;
-    buffer.read(&logger, sizeof(End_Logger));
-    handler.logger_end(logger.service(), logger.node(), logger.end_time());
-    return sizeof(End_Logger);
+void LinkLogCenter::append_log_record(std::string& dest, const Link_Log& log) {
+    Link_Log_Header header(log.text.size(), log.service, log.node_init_time,
+                           log.node, log.time, log.rank);
+    dest.append((const char *) &header, sizeof(Link_Log_Header));
+    dest.append(log.text);
 }
 
-uint32 LinkLogCenter::replay_log(LinkLogReplayHandler& handler, RingBuffer& buffer) {
-    if (buffer.readable_len() < sizeof(Link_Log_Header))
-        return 0;
-    Link_Log_Header header;
-    buffer.try_read(&header, sizeof(Link_Log_Header), 0);
-    if (buffer.readable_len() < header.log_size() + sizeof(Link_Log_Header))
+uint32 LinkLogCenter::read_node_define(std::vector<Index_Key>& nodes, const RingBuffer& buffer) {
+    if (buffer.readable_len() < sizeof(Node_Define))
         return 0;
-
-    buffer.read_advance(sizeof(Link_Log_Header));
-    std::string text(header.log_size(), '\0');
-    buffer.read(text.data(), header.log_size());
-    Link_Log log(header, std::move(text));
-    handler.receive_log(log);
-    return sizeof(Link_Log_Header) + header.log_size();
+    Node_Define define;
+    buffer.read(&define, sizeof(Node_Define));
+    if (define.handle() >= nodes.size())
+        nodes.resize(define.handle() + 1);
+    nodes[define.handle()] = define.key();
+    return sizeof(Node_Define);
 }
 
-uint32 LinkLogCenter::replay_error_logger(LinkLogReplayHandler& handler, RingBuffer& buffer) {
-    if (buffer.readable_len() < sizeof(Error_Logger))
+uint32 LinkLogCenter::read_compact_log(const std::vector<Index_Key>& nodes, const RingBuffer& buffer,
+                                       Link_Log& log) {
+    char msg[Compact_Log::max_size];
+    uint32 size = buffer.try_read(msg, std::min<uint32>(buffer.readable_len(), sizeof(msg)), 0);
+    Compact_Log header;
+    uint32 header_size = header.decode(msg, msg + size);
+    /// 缓冲区中的数据足够一个完整的头部却仍然无法解析，说明数据已经损坏。
+    if (header_size == 0)
+        return size < sizeof(msg) ? 0 : MALFORMED_RECORD;
+    if (buffer.readable_len() < header_size + header.log_size)
         return 0;
-    Error_Logger logger;
-    buffer.read(&logger, sizeof(Error_Logger));
-    handler.handling_error(logger.service(), logger.node(),
-                           logger.time(), logger.error_type());
-    return sizeof(Error_Logger);
-}
 
-uint32 LinkLogCenter::replay_remove_server(RingBuffer& buffer) {
-    if (buffer.readable_len() < sizeof(Node_Offline))
-        return 0;
-    Node_Offline offline;
-    buffer.read(&offline, sizeof(Node_Offline));
-    return sizeof(Node_Offline);
+    buffer.read_advance(header_size);
+    log.text.resize(header.log_size);
+    buffer.read(log.text.data(), header.log_size);
+    /// 未定义的句柄（例如连接切换时残留的数据）直接丢弃，rank 保持为 EMPTY。
+    CHECK(header.handle < nodes.size(), return header_size + header.log_size)
+    auto key = nodes[header.handle];
+    log.service = key.service();
+    log.node_init_time = key.init_time();
+    log.node = key.node();
+    log.rank = header.rank;
+    log.time = TimeInterval(key.init_time().nanoseconds + header.time_delta.nanoseconds);
+    return header_size + header.log_size;
 }
@@ -3,7 +3,12 @@
 //
 
 #include "../LinkLogInterpreter.hpp"
+#include <algorithm>
 #include <map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "tinyBackend/Base/GlobalObject.hpp"
 #include "tinyBackend/Base/Detail/FileDir.hpp"
 #include "tinyBackend/LogSystem/linkLog/LinkLogMessage.hpp"
@@ -20,16 +25,13 @@ constexpr char link_index_file_name[] = "link_index.link_index";
 
 constexpr char node_deletion_file_name[] = "node_deletion.deletion_index";
 
-constexpr char link_log_file_suffix[] = ".link_log";
-
-static constexpr uint16 header_offset0 = sizeof(OperationType);
+constexpr char rank_index_file_name_[] = "link_rank.rank_index";
 
-static constexpr uint16 header_offset1 = sizeof(OperationType) + sizeof(uint16);
+constexpr char duration_index_file_name_[] = "link_duration.duration_index";
 
-static constexpr uint16 header_offset2 = sizeof(OperationType) + sizeof(uint16) + sizeof(TimeInterval);
+constexpr char link_log_file_suffix[] = ".link_log";
 
-static constexpr uint16 header_offset3 = sizeof(OperationType) + sizeof(uint16) + sizeof(TimeInterval) + sizeof(
-    uint32);
+constexpr char link_frame_file_suffix[] = ".link_frames";
 
 #define CHECK(expr, error_handle) \
 if (unlikely(!(expr))) { G_ERROR << "LinkLogStorage: " #expr " failed in " << __FUNCTION__; error_handle; }
@@ -46,6 +48,120 @@ static int record_file_filter(const dirent *entry) {
     return 1;
 }
 
+static bool is_compressed_log_file(const iFile& file) {
+    char magic[sizeof(LinkLogStorage::LOG_FILE_MAGIC)];
+    return file.read(sizeof(magic), magic) == sizeof(magic)
+        && std::memcmp(magic, LinkLogStorage::LOG_FILE_MAGIC, sizeof(magic)) == 0;
+}
+
+/// 从 file 的当前位置读取一帧并解压到 dest，end 为帧所在范围的结束位置，
+/// 文件结束时返回 0，数据不完整或损坏时返回 -1。
+static int read_log_frame(const iFile& file, std::string& dest, uint64 end) {
+    uint64 begin = file.pos();
+    Log_Frame_Header header;
+    uint64 read = file.read(Log_Frame_Header::size, &header);
+    if (read == 0) return 0;
+    if (read != Log_Frame_Header::size || begin + Log_Frame_Header::size > end
+        || !header.sizes_valid(end - begin - Log_Frame_Header::size))
+        return -1;
+    std::string stored(header.stored_size(), '\0');
+    if (file.read(stored.size(), stored.data()) != stored.size()
+        || header.compute_checksum(stored.data()) != header.checksum())
+        return -1;
+    if (header.codec() == Log_Frame_Header::Stored) {
+        dest = std::move(stored);
+        return 1;
+    }
+    dest.resize(header.raw_size());
+    if (!lz_decompress(stored.data(), stored.size(), dest.data(), dest.size()))
+        return -1;
+    return 1;
+}
+
+LinkLogFileReader::LinkLogFileReader(const char *path, uint64 limit) : _file(path, true), _limit(limit) {
+    if (!_file.is_open()) return;
+    if (_file.seek_end(0)) _limit = std::min<uint64>(_limit, _file.pos());
+    _file.seek_beg(0);
+    _compressed = is_compressed_log_file(_file);
+    if (!_compressed) _file.seek_beg(0);
+}
+
+int64 LinkLogFileReader::read(const RingBuffer& buf) {
+    if (!_compressed) {
+        int64 read = _file.read(buf.writable_array());
+        if (read > 0) buf.write_advance(read);
+        return read;
+    }
+    if (_frame_pos == _frame.size()) {
+        if (_file.pos() >= _limit) return 0;
+        int ret = read_log_frame(_file, _frame, _limit);
+        if (ret <= 0) return ret;
+        _frame_pos = 0;
+    }
+    uint32 size = std::min<uint64>(buf.writable_len(), _frame.size() - _frame_pos);
+    buf.write(_frame.data() + _frame_pos, size);
+    _frame_pos += size;
+    return size;
+}
+
+LinkLogMappedFile::LinkLogMappedFile(const char *path, uint64 limit) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st {};
+    if (fstat(fd, &st) == 0) {
+        _size = std::min<uint64>(st.st_size, limit);
+        _open = true;
+    }
+    if (_open && _size > 0) {
+        void *ptr = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr != MAP_FAILED) {
+            _map = (const char *) ptr;
+            madvise(ptr, _size, MADV_SEQUENTIAL);
+        } else {
+            _open = false;
+        }
+    }
+    ::close(fd);
+    constexpr uint64 magic_size = sizeof(LinkLogStorage::LOG_FILE_MAGIC);
+    _compressed = _size >= magic_size
+        && std::memcmp(_map, LinkLogStorage::LOG_FILE_MAGIC, magic_size) == 0;
+    if (_compressed) _pos = magic_size;
+}
+
+LinkLogMappedFile::~LinkLogMappedFile() {
+    if (_map) munmap((void *) _map, _size);
+}
+
+int LinkLogMappedFile::next(const char *& data, uint64& size) {
+    if (_pos == _size) return 0;
+    if (!_compressed) {
+        data = _map + _pos;
+        size = _size - _pos;
+        _pos = _size;
+        return 1;
+    }
+    Log_Frame_Header header;
+    if (_size - _pos < Log_Frame_Header::size) return -1;
+    std::memcpy(&header, _map + _pos, Log_Frame_Header::size);
+    if (!header.sizes_valid(_size - _pos - Log_Frame_Header::size)) return -1;
+    const char *stored = _map + _pos + Log_Frame_Header::size;
+    if (header.compute_checksum(stored) != header.checksum()) return -1;
+    _pos += Log_Frame_Header::size + header.stored_size();
+    if (header.codec() == Log_Frame_Header::Stored) {
+        data = stored;
+        size = header.raw_size();
+        return 1;
+    }
+    /// 缓冲区只增不减，解压时覆盖之前的内容
+    if (_frame.size() < header.raw_size())
+        _frame.resize(header.raw_size());
+    if (!lz_decompress(stored, header.stored_size(), _frame.data(), header.raw_size()))
+        return -1;
+    data = _frame.data();
+    size = header.raw_size();
+    return 1;
+}
+
 LinkLogEncoder::LinkLogEncoder(std::string dictionary_path) :
     _dictionary_path(std::move(dictionary_path)) {
     if (_dictionary_path.back() == '/')
@@ -131,6 +247,83 @@ uint32 LinkLogEncoder::write_to_file(const void *data, uint32 size) {
     return written;
 }
 
+uint32 LinkLogEncoder::encode_for_center(char *data, uint32 size) {
+    static_assert(sizeof(Node_Define) + Compact_Log::max_compact_size <= sizeof(Link_Log_Header),
+                  "Compact log must not be longer than the original one");
+    uint32 read = 0, written = 0;
+    while (read < size) {
+        uint32 record_size;
+        switch ((OperationType) data[read]) {
+            case RegisterLogger:
+                record_size = sizeof(Register_Logger);
+                break;
+            case CreateLogger:
+                record_size = sizeof(Create_Logger);
+                break;
+            case EndLogger: {
+                End_Logger logger;
+                std::memcpy(&logger, data + read, sizeof(End_Logger));
+                auto iter = _center_nodes.find(Index_Key(logger.service(), logger.init_time(), logger.node()));
+                if (iter != _center_nodes.end()) {
+                    _free_handles.push_back(iter->second);
+                    _center_nodes.erase(iter);
+                }
+                record_size = sizeof(End_Logger);
+                break;
+            }
+            case ErrorLogger:
+                record_size = sizeof(Error_Logger);
+                break;
+            case LinkLog: {
+                Link_Log_Header header;
+                std::memcpy(&header, data + read, sizeof(Link_Log_Header));
+                Index_Key& key = *(Index_Key *) &header.service();
+                /// 句柄用尽时保持原格式发送，center 同样可以处理。
+                if (_center_nodes.size() >= Compact_Log::max_handle
+                    && _center_nodes.find(key) == _center_nodes.end()) {
+                    record_size = sizeof(Link_Log_Header) + header.log_size();
+                    break;
+                }
+                auto [iter, success] = _center_nodes.try_emplace(key, _center_nodes.size());
+                if (success) {
+                    if (!_free_handles.empty()) {
+                        iter->second = _free_handles.back();
+                        _free_handles.pop_back();
+                    }
+                    Node_Define define(iter->second, key);
+                    std::memcpy(data + written, &define, sizeof(Node_Define));
+                    written += sizeof(Node_Define);
+                }
+                Compact_Log log;
+                log.handle = iter->second;
+                log.time_delta = TimeInterval(header.time().nanoseconds - header.init_time().nanoseconds);
+                log.rank = header.rank();
+                log.log_size = header.log_size();
+                written += log.encode(data + written);
+                read += sizeof(Link_Log_Header);
+                record_size = header.log_size();
+                break;
+            }
+            case NodeOffline:
+                record_size = sizeof(Node_Offline);
+                break;
+            default:
+                G_ERROR << "LinkLogEncoder: get wrong OperationType "
+                        << getOperationTypeName((OperationType) data[read]) << " in " << __FUNCTION__;
+                return written;
+        }
+        std::memmove(data + written, data + read, record_size);
+        read += record_size;
+        written += record_size;
+    }
+    return written;
+}
+
+void LinkLogEncoder::reset_center_nodes() {
+    _center_nodes.clear();
+    _free_handles.clear();
+}
+
 void LinkLogEncoder::flush() const {
     _record_file.flush_to_disk();
 }
@@ -156,12 +349,20 @@ std::string LinkLogEncoder::get_record_file_name(TimeInterval file_init_time) co
     return path;
 }
 
-LinkLogStorage::LinkLogStorage(std::string dictionary_path, ScheduledThread& scheduled_thread) :
+LinkLogStorage::LinkLogStorage(std::string dictionary_path, ScheduledThread& scheduled_thread,
+                               bool secondary_indexes) :
     _dictionary_path(dictionary_path.back() == '/' ? std::move(dictionary_path) : dictionary_path + '/'),
     _filename_file(scheduled_thread, filename_file_name().c_str(), FILENAME_BUFFER_POOL_SIZE),
     _indexes(scheduled_thread, index_file_name().c_str(), LINK_INDEX_BUFFER_POOL_SIZE),
     _node_deletion(scheduled_thread, deletion_file_name().c_str(), NODE_DELETION_BUFFER_POOL_SIZE),
     _cache(*this) {
+    if (secondary_indexes) {
+        _rank_index = std::make_unique<RankIndexFile>(scheduled_thread, rank_index_file_name().c_str(),
+                                                      RANK_INDEX_BUFFER_POOL_SIZE);
+        _duration_index = std::make_unique<DurationIndexFile>(scheduled_thread,
+                                                              duration_index_file_name().c_str(),
+                                                              DURATION_INDEX_BUFFER_POOL_SIZE);
+    }
     auto [results] = _filename_file.search_from_end(1);
     if (results.empty()) {
         results.emplace_back();
@@ -169,14 +370,19 @@ LinkLogStorage::LinkLogStorage(std::string dictionary_path, ScheduledThread& sch
         bool success = _filename_file.insert(results.back().key, results.back().value);
         assert(success);
     }
-    std::string path = get_log_name(results.back().key);
-    CHECK(_logs.open(path.c_str(), true), return);
-    struct stat s {};
-    CHECK(_logs.get_stat(&s), return)
-    _records.emplace_back();
-    _records.back().file = results.back().key;
-    _records.back().latest_time = TimeInterval { results.back().value };
-    _records.back().written = _records.back().index = s.st_size;
+    _record.file = results.back().key;
+    _record.latest_time = TimeInterval { results.back().value };
+    recover_log_file();
+    _compactor = BPTreeCompactor::start(scheduled_thread, [this] (uint32 max_blocks) {
+        return compact_files(max_blocks);
+    }, COMPACT_BLOCKS_PER_STEP);
+}
+
+LinkLogStorage::~LinkLogStorage() {
+    if (_compactor) _compactor->stop();
+    flush_log_file();
+    Lock l(_mutex);
+    flush_cache();
 }
 
 bool LinkLogStorage::create_logger(const LinkServiceID& service, const LinkNodeID& node,
@@ -220,50 +426,76 @@ bool LinkLogStorage::create_logger(const LinkServiceID& service,
 
 void LinkLogStorage::end_logger(const LinkServiceID& service,
                                 const LinkNodeID& node,
-                                TimeInterval node_init_time) {
+                                TimeInterval node_init_time,
+                                TimeInterval end_time) {
     Index_Key key(service, node_init_time, node);
 
     Lock l(_mutex);
     CHECK(_node_deletion.insert(Unix_to_now(), key),)
+    if (_duration_index)
+        _duration_index->insert(Duration_Key(end_time - node_init_time, key), end_time);
 }
 
-void LinkLogStorage::add_record(uint32 size) {
+void LinkLogStorage::add_record(const void *data, uint32 size) {
     Lock l(_mutex);
-    if (_records.empty() || _records.back().index >= LOG_FILE_LIMIT_SIZE)
-        _records.emplace_back();
-    _records.back().index += size;
+    current_record();
+    append_to_frame(data, size);
+    if (_record.frame.size() >= LOG_FRAME_SIZE)
+        seal_frame();
 }
 
-void LinkLogStorage::handle_a_log(Link_Log_Header& header, const RingBuffer& buf) {
+void LinkLogStorage::add_log(Index_Key key, TimeInterval time, LogRank rank,
+                             const void *text, uint16 size) {
     Lock l(_mutex);
-    Index_Key& key = *(Index_Key *) &header.service();
+    auto& record = current_record();
+    char header[sizeof(Node_Define) + Compact_Log::max_size];
+    uint32 header_size = 0;
+    if (record.nodes.size() >= FILE_NODE_HANDLE_LIMIT)
+        record.nodes.clear();
+    auto [iter, success] = record.nodes.try_emplace(key, record.nodes.size());
+    if (success) {
+        Node_Define define(iter->second, key);
+        std::memcpy(header, &define, sizeof(Node_Define));
+        header_size = sizeof(Node_Define);
+    }
+
     auto val_ptr = _cache.get(key);
-    buf.change_written(header_offset1, &val_ptr->latest_file(), sizeof(TimeInterval));
-    buf.change_written(header_offset2, &val_ptr->latest_index(), sizeof(uint32));
-    val_ptr->latest_file() = _records.back().file;
-    val_ptr->latest_index() = _records.back().index;
+    Compact_Log log;
+    log.ot = StoredLog;
+    log.handle = iter->second;
+    log.time_delta = TimeInterval(time.nanoseconds - key.init_time().nanoseconds);
+    log.rank = rank;
+    log.log_size = size;
+    log.latest_file = val_ptr->latest_file();
+    log.latest_index = val_ptr->latest_index();
+    val_ptr->latest_file() = record.file;
+    val_ptr->latest_index() = record.index + header_size;
     _cache.put(key, true);
+    if (_rank_index) {
+        TimeInterval bucket(time.nanoseconds - time.nanoseconds % RANK_INDEX_BUCKET.nanoseconds);
+        _rank_cache[Rank_Key(rank, bucket, key)] = Log_Location(record.file, record.index + header_size);
+        if (_rank_bucket < bucket) _rank_bucket = bucket;
+    }
+
+    header_size += log.encode(header + header_size, record.file);
+    append_to_frame(header, header_size);
+    append_to_frame(text, size);
+    if (record.frame.size() >= LOG_FRAME_SIZE)
+        seal_frame();
 }
 
-uint32 LinkLogStorage::write_to_file(const RingBuffer& buf, uint32 size) {
-    assert(buf.readable_len() >= size);
+void LinkLogStorage::write_to_file() {
     Lock l(_mutex);
-    flush_cache();
-    uint32 written = 0;
-    for (int i = 0; i < _records.size() && size; ++i) {
-        if (i > 0) open_new_log_file(_records[i], _records[i - 1].latest_time);
-        auto can_write = std::min(_records[i].index - _records[i].written, size);
-        auto arr = buf.read_array(can_write);
-        auto written_ = _logs.write(arr);
-        CHECK(written_ == can_write, return written)
-        buf.read_advance(written_);
-        size -= written_;
-        written += written_;
-        _records[i].written += written_;
-        assert(_records[i].index == _records[i].written);
+    if (_cache.need_update_size())
+        _cache.update_all();
+    /// 同一时间段内的日志在内存中合并，只写入已经过去的时间段，上一个时间段留给晚到的日志。
+    TimeInterval before(_rank_bucket.nanoseconds - RANK_INDEX_BUCKET.nanoseconds);
+    if (_rank_flushed < before) {
+        flush_rank_cache(before);
+        _rank_flushed = before;
     }
-    _logs.flush();
-    return written;
+    if (!_record.frame.empty() && Unix_to_now() - _record.frame_time >= LOG_FRAME_FLUSH_TIME)
+        seal_frame();
 }
 
 void LinkLogStorage::delete_oldest_files(uint32 size) {
@@ -274,14 +506,27 @@ void LinkLogStorage::delete_oldest_files(uint32 size) {
     for (auto [k, v] : results) {
         std::string path = get_log_name(k);
         CHECK(remove(path.c_str()) == 0,)
+        /// 旧版本的日志文件没有帧索引
+        remove(get_frame_index_name(k).c_str());
     }
     _filename_file.erase(results.front().key,
                          TimeInterval { results.back().key.nanoseconds + 1 });
+    _compact_pending = true;
     for (auto [k, v] : results) {
         assert(_filename_file.find(k).key == 0);
     }
     G_INFO << "FileNameIndex erased " << results.size() << " old files.";
 
+    if (_rank_index) {
+        /// 晚到的日志可能保存在之后的文件中，只删除最后一个被删除的文件创建之前的时间段，
+        /// 其余指向已删除文件的位置在查询时跳过。
+        flush_cache();
+        for (uint8 rank = TRACE; rank < EMPTY; ++rank) {
+            _rank_index->erase(Rank_Key((LogRank) rank, TimeInterval(0), Index_Key()),
+                               Rank_Key((LogRank) rank, results.back().key, Index_Key()));
+        }
+    }
+
     TimeInterval end_time(results.back().value);
     results = {};
     uint32 delete_size = 0;
@@ -305,37 +550,122 @@ void LinkLogStorage::delete_oldest_files(uint32 size) {
 
 LinkLogStorage::QuerySet*
 LinkLogStorage::get_query_set(const LinkServiceID& id, const NodeFilter& filter) {
-    Lock l(_mutex);
-    flush_cache();
-    LinkServiceID end(id);
-    char *ptr = end.data() + sizeof(LinkServiceID) - 1;
-    for (; ptr >= end.data(); --ptr) {
-        if (*ptr != (char) 256) {
-            ++*ptr;
-            break;
-        }
-        *ptr = 0;
-    }
-    Index_Key k_begin, k_end;
-    k_begin.service() = id;
-    k_end.service() = end;
-
+    auto [results] = find_service_nodes(id);
     auto point = new QuerySet();
-    auto [results] = ptr >= end.data() ?
-                         _indexes.find(k_begin, k_end) :
-                         _indexes.above_or_equal(k_begin);
     if (results.empty()) {
         destroy_query_set(point);
         return nullptr;
     }
     for (auto& [k, v] : results) {
-        assert((k > k_begin || k == k_begin) && k < k_end);
-        if (filter && !filter(k, v) || v.latest_index() == MAX_UINT) continue;
-        point->_log_location.emplace(v.latest_file(), v.latest_index());
+        if ((filter && !filter(k, v)) || v.latest_index() == MAX_UINT) continue;
+        point->_log_location.emplace(v.latest_file(), v.latest_index(), k);
+    }
+    return point;
+}
+
+LinkLogStorage::QuerySet*
+LinkLogStorage::get_query_set(const std::vector<Index_Key>& nodes, const NodeFilter& filter) {
+    auto point = new QuerySet();
+    Lock l(_mutex);
+    flush_cache();
+    for (auto& key : nodes) {
+        auto [k, v] = _indexes.find(key);
+        if (k != key || (filter && !filter(k, v)) || v.latest_index() == MAX_UINT) continue;
+        point->_log_location.emplace(v.latest_file(), v.latest_index(), k);
     }
     return point;
 }
 
+LinkLogStorage::QuerySet*
+LinkLogStorage::get_rank_query_set(LogRank rank, TimeInterval begin, TimeInterval end) {
+    if (!_rank_index || end < begin) return nullptr;
+    TimeInterval first(begin.nanoseconds - begin.nanoseconds % RANK_INDEX_BUCKET.nanoseconds),
+                 last(end.nanoseconds - end.nanoseconds % RANK_INDEX_BUCKET.nanoseconds + 1);
+
+    /// 每个节点只需要从满足条件的最后一条日志开始沿链向前读取。
+    std::unordered_map<Index_Key, Log_Location> latest;
+    Lock l(_mutex);
+    flush_cache();
+    auto [files] = _filename_file.search_from_begin(1);
+    TimeInterval oldest = files.empty() ? TimeInterval() : files.front().key;
+    for (uint8 r = rank; r < EMPTY; ++r) {
+        auto [results] = _rank_index->find(Rank_Key((LogRank) r, first, Index_Key()),
+                                           Rank_Key((LogRank) r, last, Index_Key()));
+        for (auto& [k, v] : results) {
+            if (v.file() < oldest) continue;
+            auto [iter, success] = latest.try_emplace(k.key(), v);
+            auto& location = iter->second;
+            if (location.file() < v.file()
+                || (location.file() == v.file() && location.index() < v.index()))
+                location = v;
+        }
+    }
+
+    auto point = new QuerySet();
+    point->_min_rank = rank;
+    point->_begin = begin;
+    point->_end = end;
+    for (auto& [k, v] : latest)
+        point->_log_location.emplace(v.file(), v.index(), k);
+    return point;
+}
+
+std::vector<std::pair<Index_Key, TimeInterval>>
+LinkLogStorage::find_slow_nodes(TimeInterval min_duration, uint64 limit) {
+    std::vector<std::pair<Index_Key, TimeInterval>> nodes;
+    if (!_duration_index) return nodes;
+    Lock l(_mutex);
+    auto [results] = _duration_index->above_or_equal(Duration_Key(min_duration, Index_Key()), limit);
+    for (auto& [k, v] : results)
+        nodes.emplace_back(k.key(), k.duration());
+    return nodes;
+}
+
+uint64 LinkLogStorage::rank_cache_size() {
+    Lock l(_mutex);
+    return _rank_cache.size();
+}
+
+LinkLogStorage::SearchPlan
+LinkLogStorage::get_search_plan(const LinkServiceID& id, const NodeFilter& filter) {
+    SearchPlan plan;
+    auto [results] = find_service_nodes(id);
+    TimeInterval first_log, last_file;
+    for (auto& [k, v] : results) {
+        if ((filter && !filter(k, v)) || v.latest_index() == MAX_UINT) continue;
+        if (plan.nodes.empty() || k.init_time() < first_log) first_log = k.init_time();
+        if (plan.nodes.empty() || last_file < v.latest_file()) last_file = v.latest_file();
+        plan.nodes.insert(k);
+    }
+    if (plan.nodes.empty()) return plan;
+
+    /// 节点的第一条日志不早于节点的创建时间，只需要读取在此之后结束的文件。
+    Lock l(_mutex);
+    seal_frame();
+    auto [files] = _filename_file.search_from_begin();
+    for (uint64 i = 0; i < files.size(); ++i) {
+        TimeInterval file = files[i].key;
+        if (last_file < file) break;
+        if (i + 1 < files.size() && files[i + 1].key < first_log) continue;
+        plan.files.emplace_back(get_log_name(file), file == _record.file ? _record.file_size : MAX_ULLONG);
+    }
+    return plan;
+}
+
+std::vector<std::pair<std::string, uint64>> LinkLogStorage::get_log_files(TimeInterval begin) {
+    std::vector<std::pair<std::string, uint64>> result;
+    Lock l(_mutex);
+    seal_frame();
+    /// 文件以创建时间命名，下一个文件创建之前结束的文件不含 begin 之后的日志。
+    auto [files] = _filename_file.search_from_begin();
+    for (uint64 i = 0; i < files.size(); ++i) {
+        TimeInterval file = files[i].key;
+        if (i + 1 < files.size() && files[i + 1].key < begin) continue;
+        result.emplace_back(get_log_name(file), file == _record.file ? _record.file_size : MAX_ULLONG);
+    }
+    return result;
+}
+
 void LinkLogStorage::destroy_query_set(void *set) {
 #ifdef GLOBAL_LOGGER
     Global_Logger.flush();
@@ -390,7 +720,9 @@ LinkLogStorage::query(RingBuffer& buf, QuerySet *point) {
 
 void LinkLogStorage::flush_log_file() {
     Lock l(_mutex);
+    seal_frame();
     _logs.flush_to_disk();
+    _frame_index.flush_to_disk();
 }
 
 void LinkLogStorage::flush_file_name() {
@@ -402,6 +734,8 @@ void LinkLogStorage::flush_index_file() {
     Lock l(_mutex);
     flush_cache();
     _indexes.impl().flush();
+    if (_rank_index) _rank_index->impl().flush();
+    if (_duration_index) _duration_index->impl().flush();
 }
 
 void LinkLogStorage::flush_deletion_file() {
@@ -431,6 +765,162 @@ void LinkLogStorage::CacheHelper::erase(const Key& key) const {
 void LinkLogStorage::flush_cache() {
     if (_cache.need_update_size())
         _cache.update_all();
+    flush_rank_cache(TimeInterval(MAX_LLONG));
+}
+
+void LinkLogStorage::flush_rank_cache(TimeInterval before) {
+    for (auto iter = _rank_cache.begin(); iter != _rank_cache.end();) {
+        auto& [k, v] = *iter;
+        if (!(k.bucket() < before)) {
+            ++iter;
+            continue;
+        }
+        if (!_rank_index->insert(k, v))
+            CHECK(_rank_index->update(k, v),)
+        iter = _rank_cache.erase(iter);
+    }
+}
+
+LinkLogStorage::LinkIndexFile::ResultSet LinkLogStorage::find_service_nodes(const LinkServiceID& id) {
+    LinkServiceID end(id);
+    char *ptr = end.data() + sizeof(LinkServiceID) - 1;
+    for (; ptr >= end.data(); --ptr) {
+        if (*ptr != (char) 256) {
+            ++*ptr;
+            break;
+        }
+        *ptr = 0;
+    }
+    Index_Key k_begin, k_end;
+    k_begin.service() = id;
+    k_end.service() = end;
+
+    /// 只在创建快照时持有锁，之后在快照上查找，不阻塞写入。
+    auto snapshot = [this] {
+        Lock l(_mutex);
+        flush_cache();
+        return _indexes.snapshot();
+    }();
+    auto results = _indexes.read_snapshot(snapshot, [&] (LinkIndexFile& indexes) {
+        return ptr >= end.data() ? indexes.find(k_begin, k_end) : indexes.above_or_equal(k_begin);
+    });
+    snapshot.release();
+    return results;
+}
+
+LinkLogStorage::Record& LinkLogStorage::current_record() {
+    if (_record.index >= LOG_FILE_LIMIT_SIZE) {
+        seal_frame();
+        open_new_log_file(_record.latest_time);
+    }
+    return _record;
+}
+
+void LinkLogStorage::append_to_frame(const void *data, uint32 size) {
+    if (_record.frame.empty())
+        _record.frame_time = Unix_to_now();
+    _record.frame.append((const char *) data, size);
+    _record.index += size;
+}
+
+void LinkLogStorage::seal_frame() {
+    if (_record.frame.empty()) return;
+    std::string data(Log_Frame_Header::size, '\0');
+    Log_Frame_Header header(Log_Frame_Header::LZ, _record.frame.size(), 0);
+    lz_compress(_record.frame.data(), _record.frame.size(), data);
+    if (data.size() - Log_Frame_Header::size >= _record.frame.size()) {
+        header.codec() = Log_Frame_Header::Stored;
+        data.resize(Log_Frame_Header::size);
+        data.append(_record.frame);
+    }
+    header.stored_size() = data.size() - Log_Frame_Header::size;
+    header.checksum() = header.compute_checksum(data.data() + Log_Frame_Header::size);
+    std::memcpy(data.data(), &header, Log_Frame_Header::size);
+    CHECK(_logs.write(data.data(), data.size()) == data.size(), return)
+
+    std::pair<uint32, uint32> entry(_record.frame_begin, _record.file_size);
+    CHECK(_frame_index.write(&entry, sizeof(entry)) == sizeof(entry),)
+    /// 查询可能立即读取刚写入的帧
+    _logs.flush();
+    _frame_index.flush();
+    _record.frames.push_back(entry);
+    _record.file_size += data.size();
+    _record.frame_begin += _record.frame.size();
+    _record.frame.clear();
+}
+
+void LinkLogStorage::recover_log_file() {
+    std::string path = get_log_name(_record.file);
+    uint32 file_size = 0, raw = 0, offset = sizeof(LOG_FILE_MAGIC);
+    LinkLogReadFile file(path.c_str(), true);
+    if (file.is_open() && file.seek_end(0))
+        file_size = file.pos();
+    if (file_size > 0) {
+        file.seek_beg(0);
+        if (!is_compressed_log_file(file)) {
+            /// 旧版本的日志文件不再追加，之后的日志写入新的压缩文件。
+            open_new_log_file(_record.latest_time);
+            return;
+        }
+        LinkLogReadFile index_file(get_frame_index_name(_record.file).c_str(), true);
+        std::pair<uint32, uint32> entry;
+        while (index_file.is_open() && index_file.read(sizeof(entry), &entry) == sizeof(entry))
+            _record.frames.push_back(entry);
+        /// 帧索引可能落后于日志文件，从最后一个索引项开始重新检查之后的帧，丢弃末尾不完整的帧。
+        if (!_record.frames.empty()) {
+            std::tie(raw, offset) = _record.frames.back();
+            _record.frames.pop_back();
+        }
+        Log_Frame_Header header;
+        std::string stored;
+        while (file.seek_beg(offset)
+            && file.read(Log_Frame_Header::size, &header) == Log_Frame_Header::size
+            && offset + Log_Frame_Header::size <= file_size
+            && header.sizes_valid(file_size - offset - Log_Frame_Header::size)) {
+            stored.resize(header.stored_size());
+            if (file.read(stored.size(), stored.data()) != stored.size()
+                || header.compute_checksum(stored.data()) != header.checksum())
+                break;
+            _record.frames.emplace_back(raw, offset);
+            raw += header.raw_size();
+            offset += Log_Frame_Header::size + header.stored_size();
+        }
+    }
+
+    CHECK(_logs.open(path.c_str(), true, true), return)
+    if (file_size == 0) {
+        CHECK(_logs.write(LOG_FILE_MAGIC, sizeof(LOG_FILE_MAGIC)) == sizeof(LOG_FILE_MAGIC), return)
+    } else if (offset < file_size) {
+        CHECK(_logs.resize_file(offset), return)
+    }
+    CHECK(_frame_index.open(get_frame_index_name(_record.file).c_str(), false, true), return)
+    for (auto& entry : _record.frames)
+        _frame_index.write(&entry, sizeof(entry));
+    _logs.flush();
+    _frame_index.flush();
+    _record.index = _record.frame_begin = raw;
+    _record.file_size = offset;
+}
+
+uint32 LinkLogStorage::compact_files(uint32 max_blocks) {
+    uint32 processed = 0;
+    /// 分成多次加锁，写入不需要等待整个步骤。
+    while (processed < max_blocks) {
+        uint32 limit = std::min(COMPACT_BLOCKS_PER_LOCK, max_blocks - processed);
+        Lock l(_mutex);
+        if (!_compact_pending) break;
+        uint32 count = _indexes.compact(limit);
+        if (count < limit) count += _node_deletion.compact(limit - count);
+        if (count < limit) count += _filename_file.compact(limit - count);
+        if (_rank_index && count < limit) count += _rank_index->compact(limit - count);
+        if (_duration_index && count < limit) count += _duration_index->compact(limit - count);
+        if (count == 0) {
+            _compact_pending = false;
+            break;
+        }
+        processed += count;
+    }
+    return processed;
 }
 
 std::string LinkLogStorage::filename_file_name() const {
@@ -445,6 +935,14 @@ std::string LinkLogStorage::deletion_file_name() const {
     return _dictionary_path + node_deletion_file_name;
 }
 
+std::string LinkLogStorage::rank_index_file_name() const {
+    return _dictionary_path + rank_index_file_name_;
+}
+
+std::string LinkLogStorage::duration_index_file_name() const {
+    return _dictionary_path + duration_index_file_name_;
+}
+
 LinkLogStorage::LinkLogReadFile
 LinkLogStorage::get_log_file(TimeInterval file_init_time) const {
     std::string path = get_log_name(file_init_time);
@@ -459,77 +957,174 @@ std::string LinkLogStorage::get_log_name(TimeInterval file_init_time) const {
     return path;
 }
 
-void LinkLogStorage::open_new_log_file(const Record& record, TimeInterval end_time) {
+std::string LinkLogStorage::get_frame_index_name(TimeInterval file_init_time) const {
+    std::string path = _dictionary_path
+        + to_string(file_init_time, true)
+        + link_frame_file_suffix;
+    return path;
+}
+
+void LinkLogStorage::open_new_log_file(TimeInterval end_time) {
     auto [results] = _filename_file.search_from_end(1);
     if (!results.empty()) {
         _filename_file.update(results.front().key, end_time);
     }
-    std::string path = get_log_name(record.file);
+    _record = Record();
+    std::string path = get_log_name(_record.file);
     _logs = LinkLogWriteFile(path.c_str(), true, true);
     CHECK(_logs.is_open(), return)
-    bool success = _filename_file.insert(record.file, record.latest_time);
+    CHECK(_logs.write(LOG_FILE_MAGIC, sizeof(LOG_FILE_MAGIC)) == sizeof(LOG_FILE_MAGIC), return)
+    _record.file_size = sizeof(LOG_FILE_MAGIC);
+    path = get_frame_index_name(_record.file);
+    _frame_index = LinkLogWriteFile(path.c_str(), false, true);
+    CHECK(_frame_index.is_open(), return)
+    bool success = _filename_file.insert(_record.file, _record.latest_time);
     assert(success);
 }
 
-bool LinkLogStorage::prepare_read_a_log(QuerySet *point, char *msg) const {
-    auto [file_name, index] = point->_log_location.top();
-    if (file_name != point->_current_file) {
-        point->_file = get_log_file(file_name);
-        CHECK(point->_file.is_open(),
+bool LinkLogStorage::open_query_file(QuerySet *point, TimeInterval file_name) const {
+    point->_file = get_log_file(file_name);
+    CHECK(point->_file.is_open(),
+          destroy_query_set(point); return false)
+    point->_current_file = file_name;
+    point->_frame_begin = MAX_UINT;
+    point->_frames.clear();
+    point->_file_size = point->_file.seek_end(0) ? point->_file.pos() : 0;
+    point->_file.seek_beg(0);
+    point->_compressed = is_compressed_log_file(point->_file);
+    /// 当前文件的帧索引在内存中
+    if (!point->_compressed || file_name == _record.file) return true;
+
+    LinkLogReadFile index_file(get_frame_index_name(file_name).c_str(), true);
+    std::pair<uint32, uint32> entry;
+    while (index_file.is_open() && index_file.read(sizeof(entry), &entry) == sizeof(entry))
+        point->_frames.push_back(entry);
+    return true;
+}
+
+const char* LinkLogStorage::query_data(QuerySet *point, uint32 index, uint32 size, uint32& got) const {
+    if (!point->_compressed) {
+        point->_frame.resize(size);
+        if (!point->_file.seek_beg(index)) return nullptr;
+        got = point->_file.read(size, point->_frame.data());
+        return point->_frame.data();
+    }
+
+    const std::string *frame = &point->_frame;
+    uint32 frame_begin;
+    if (point->_current_file == _record.file && index >= _record.frame_begin) {
+        frame = &_record.frame;
+        frame_begin = _record.frame_begin;
+    } else {
+        auto& frames = point->_current_file == _record.file ? _record.frames : point->_frames;
+        auto iter = std::upper_bound(frames.begin(), frames.end(), index,
+                                     [] (uint32 target, const std::pair<uint32, uint32>& entry) {
+                                         return target < entry.first;
+                                     });
+        if (iter == frames.begin()) return nullptr;
+        --iter;
+        if (point->_frame_begin != iter->first) {
+            point->_frame_begin = MAX_UINT;
+            /// 帧的范围以下一个索引项为界，最后一帧以文件大小为界
+            uint64 end = iter + 1 != frames.end() ? (iter + 1)->second
+                : point->_current_file == _record.file ? _record.file_size : point->_file_size;
+            if (!point->_file.seek_beg(iter->second) || read_log_frame(point->_file, point->_frame, end) <= 0)
+                return nullptr;
+            point->_frame_begin = iter->first;
+        }
+        frame_begin = iter->first;
+    }
+    if (index - frame_begin >= frame->size()) return nullptr;
+    got = std::min<uint32>(size, frame->size() - (index - frame_begin));
+    return frame->data() + (index - frame_begin);
+}
+
+bool LinkLogStorage::prepare_read_a_log(QuerySet *point, Link_Log_Header& header, const char *& text) const {
+    auto [file_name, index, key] = point->_log_location.top();
+    if (file_name != point->_current_file && !open_query_file(point, file_name))
+        return false;
+
+    uint32 read = 0;
+    const char *msg = query_data(point, index, std::max<uint32>(sizeof(Link_Log_Header), Compact_Log::max_size),
+                                 read);
+    CHECK(msg && read > 0, destroy_query_set(point); return false)
+
+    /// 旧版本的日志文件保存完整的 Link_Log_Header，新版本只保存句柄，节点由查询位置给出。
+    uint32 header_size;
+    if (msg[0] == LinkLog) {
+        CHECK(read >= sizeof(Link_Log_Header),
+              destroy_query_set(point); return false)
+        std::memcpy(&header, msg, sizeof(Link_Log_Header));
+        header_size = sizeof(Link_Log_Header);
+    } else {
+        Compact_Log log;
+        header_size = log.decode(msg, msg + read, file_name);
+        CHECK(header_size > 0 && log.ot == StoredLog,
               destroy_query_set(point); return false)
-        point->_pos = 0;
-        point->_current_file = file_name;
+        header = Link_Log_Header(log.log_size, key.service(), key.init_time(), key.node(),
+                                 TimeInterval(key.init_time().nanoseconds + log.time_delta.nanoseconds),
+                                 log.rank);
+        header.latest_file() = log.latest_file;
+        header.latest_index() = log.latest_index;
     }
 
-    CHECK(point->_file.seek_cur(index - point->_pos),
-          destroy_query_set(point); return false)
-    point->_pos = index;
-    CHECK(point->_file.read(header_offset3, msg) == header_offset3,
+    text = "";
+    if (header.log_size() == 0) return true;
+    text = query_data(point, index + header_size, header.log_size(), read);
+    CHECK(text && read == header.log_size(),
           destroy_query_set(point); return false)
-    point->_pos += header_offset3;
     return true;
 }
 
+void LinkLogStorage::next_location(QuerySet *point, Link_Log_Header& header) {
+    Index_Key key = std::get<2>(point->_log_location.top());
+    point->_log_location.pop();
+    if (header.latest_index() != MAX_UINT && !(header.time() < point->_begin)) {
+        point->_log_location.emplace(header.latest_file(), header.latest_index(), key);
+    }
+}
+
 int LinkLogStorage::querying_a_log(QuerySet *point, char *ptr,
                                    uint32 limit, uint32& written) const {
-    char msg[header_offset3] {};
-    if (!prepare_read_a_log(point, msg)) return -1;
+    Link_Log_Header header;
+    const char *text;
+    if (!prepare_read_a_log(point, header, text)) return -1;
+
+    if (!point->accept(header)) {
+        next_location(point, header);
+        written = 0;
+        return 0;
+    }
 
-    uint16 log_size = *(uint16 *) (msg + header_offset0);
+    uint16 log_size = header.log_size();
     if (log_size + sizeof(Link_Log_Header) > limit) return 1;
 
-    std::memcpy(ptr, msg, header_offset3);
-    uint32 need_write = log_size + sizeof(Link_Log_Header) - header_offset3;
-    CHECK(point->_file.read(need_write, ptr + header_offset3) == need_write,
-          destroy_query_set(point); return -1)
-    point->_pos += need_write;
+    std::memcpy(ptr, &header, sizeof(Link_Log_Header));
+    std::memcpy(ptr + sizeof(Link_Log_Header), text, log_size);
     written = sizeof(Link_Log_Header) + log_size;
 
-    point->_log_location.pop();
-    if (*(uint32 *) (msg + header_offset2) != MAX_UINT) {
-        point->_log_location.emplace(*(TimeInterval *) (msg + header_offset1),
-                                     *(uint32 *) (msg + header_offset2));
-    }
+    next_location(point, header);
     return 0;
 }
 
 int LinkLogStorage::querying_a_log(QuerySet *point, RingBuffer& buf, uint32& written) const {
-    char msg[header_offset3] {};
-    if (!prepare_read_a_log(point, msg)) return -1;
+    Link_Log_Header header;
+    const char *text;
+    if (!prepare_read_a_log(point, header, text)) return -1;
 
-    uint16 log_size = *(uint16 *) (msg + header_offset0);
+    if (!point->accept(header)) {
+        next_location(point, header);
+        written = 0;
+        return 0;
+    }
+
+    uint16 log_size = header.log_size();
     if (log_size + sizeof(Link_Log_Header) > buf.writable_len()) return 1;
 
-    uint32 need_write = log_size + sizeof(Link_Log_Header) - buf.try_write(&msg, header_offset3, 0);
-    CHECK(point->_file.read(buf.write_array(need_write, header_offset3)) == need_write,
-          destroy_query_set(point); return -1)
-    point->_pos += need_write;
+    buf.try_write(&header, sizeof(Link_Log_Header), 0);
+    buf.try_write(text, log_size, sizeof(Link_Log_Header));
     written = sizeof(Link_Log_Header) + log_size;
 
-    point->_log_location.pop();
-    if (*(uint32 *) (msg + header_offset2) != MAX_UINT) {
-        point->_log_location.emplace(*(TimeInterval *) (msg + header_offset1),
-                                     *(uint32 *) (msg + header_offset2));
-    }
+    next_location(point, header);
     return 0;
 }
@@ -25,15 +25,19 @@ using namespace Net;
 LinkLogServer::LinkLogServer(const Address& listen_address,
                              ServerHandlerPtr handler,
                              std::string dictionary_path,
-                             PartitionRank partition_rank) :
+                             PartitionRank partition_rank,
+                             uint64 spill_limit) :
     _pool((1 << partition_rank) * BLOCK_SIZE),
     _acceptor(listen_address),
-    _receiver(Socket(), LOCAL_SOCKET_INPUT_BUFFER_SIZE, 0),
+    _local_queue((2 << partition_rank) + 1),
     _center(Socket(), REMOTE_SOCKET_INPUT_BUFFER_SIZE, REMOTE_SOCKET_OUTPUT_BUFFER_SIZE),
     _buffers(1 << (partition_rank - 1)),
     _handler(std::move(handler)),
-    _encoder(std::move(dictionary_path)) {
+    _encoder(dictionary_path),
+    _spill_file((dictionary_path + '/' + SPILL_FILE_NAME).c_str(), false, true),
+    _spill_limit(spill_limit) {
     assert(_handler);
+    CHECK(_spill_file.is_open(),)
     if (!create_local_link()) {
 #ifdef GLOBAL_LOGGER
         Global_Logger.flush();
@@ -63,12 +67,8 @@ void LinkLogServer::flush() const {
 
 bool LinkLogServer::create_local_link() {
     CHECK(_acceptor.socket(), return false)
-    auto pipe = Socket::create_pipe();
-    CHECK(pipe.read, return false)
-    CHECK(pipe.read.setNonBlock(true), return false)
-    _receiver.reset_socket(std::move(pipe.read));
-    _notifier = std::move(pipe.write);
-    CHECK(_notifier.valid(), return false)
+    _doorbell = Socket::create_eventfd();
+    CHECK(_doorbell.valid(), return false)
 
     start_thread();
     return true;
@@ -86,16 +86,16 @@ void LinkLogServer::accept_center_link(Poller& poller) {
     _handler->center_online(address);
     _center.reset_socket(std::move(socket));
     _center.set_running_thread();
+    _encoder.reset_center_nodes();
     G_INFO << "Accepting center link: " << address.toIpPort();
 }
 
 void LinkLogServer::destroy_local_link(Poller& poller) {
-    assert(_receiver.agent_valid());
-    assert(_receiver.input().readable_len() == 0);
-    poller.remove_fd(_receiver.fd(), false);
+    assert(_local_queue.size() == 0);
+    poller.remove_fd(_doorbell.fd(), false);
     poller.remove_fd(_acceptor.socket().fd(), false);
-    _receiver.close();
-    _notifier.close();
+    _local_queue.stop();
+    _doorbell.close();
     _acceptor.close();
 }
 
@@ -104,35 +104,77 @@ void LinkLogServer::destroy_center_link(Poller& poller) {
     _center.output().clear_output();
     poller.remove_fd(_center.fd(), false);
     _center.close();
+    _encoder.reset_center_nodes();
+    ++_center_link;
     _handler->center_offline();
     if (_acceptor.socket())
         poller.add_fd(Event { _acceptor.socket().fd(), Event::Read });
 }
 
-bool LinkLogServer::safe_notify(const LinkLogMessage& message) const {
-    return ops::write(_notifier.fd(), &message, sizeof(message)) == sizeof(message);
+bool LinkLogServer::safe_notify(const LinkLogMessage& message) {
+    if (!_local_queue.put(message)) return false;
+    if (_doorbell_rung.exchange(true, std::memory_order_seq_cst)) return true;
+    uint64 count = 1;
+    return ops::write(_doorbell.fd(), &count, sizeof(count)) == sizeof(count);
+}
+
+void LinkLogServer::reset_doorbell() {
+    uint64 count;
+    ops::read(_doorbell.fd(), &count, sizeof(count));
+    /// 先复位再取队列，复位之后放入的消息一定会再次唤醒或者被本轮取出
+    _doorbell_rung.store(false, std::memory_order_seq_cst);
 }
 
 void LinkLogServer::safe_write(BufferIter buf_iter, const void *data, uint32 size) {
-    Lock l(buf_iter->mutex);
-    auto rest = buf_iter->buf.size() - buf_iter->index;
-    if (rest < size)
-        submit_buffer(*buf_iter, l);
-    std::memcpy(buf_iter->buf.data() + buf_iter->index, data, size);
-    buf_iter->index += size;
+    std::memcpy(reserve(*buf_iter, size), data, size);
+    commit(*buf_iter, size);
 }
 
 void LinkLogServer::safe_error(BufferIter buf_iter, const ServiceID& service,
                                const NodeID& node, LinkErrorType error) {
-    Lock l(buf_iter->mutex);
     auto now = Unix_to_now();
     Error_Logger logger(service, node, now, error);
-    auto rest = buf_iter->buf.size() - buf_iter->index;
-    if (rest < sizeof(Error_Logger))
-        submit_buffer(*buf_iter, l);
-    std::memcpy(buf_iter->buf.data() + buf_iter->index, &logger, sizeof(Error_Logger));
+    safe_write(buf_iter, &logger, sizeof(Error_Logger));
     _handler->handling_error(service, node, now, error);
-    buf_iter->index += sizeof(Error_Logger);
+}
+
+char* LinkLogServer::reserve(Buffer& buf, uint32 size) {
+    while (true) {
+        uint64 state = buf.reserved.fetch_add(size, std::memory_order_acquire);
+        uint32 generation = state >> 32, pos = (uint32) state;
+        uint32 capacity = generation & 1 ? BLOCK_SIZE : 0;
+        if (pos + size <= capacity) return buf.buf.data() + pos;
+        if (pos <= capacity) {
+            /// 预留跨过了末尾，由当前线程交出缓冲区
+            Lock l(buf.mutex);
+            while (buf.committed.load(std::memory_order_acquire) != pos)
+                CurrentThread::yield_this_thread();
+            buf.index = pos;
+            submit_buffer(buf, l);
+            open_buffer(buf);
+        } else {
+            while (buf.reserved.load(std::memory_order_acquire) >> 32 == generation)
+                CurrentThread::yield_this_thread();
+        }
+    }
+}
+
+uint32 LinkLogServer::seal_buffer(Buffer& buf) {
+    uint64 state = buf.reserved.fetch_add(BLOCK_SIZE + 1, std::memory_order_acquire);
+    uint32 generation = state >> 32, pos = (uint32) state;
+    if (pos > (generation & 1 ? BLOCK_SIZE : 0)) return MAX_UINT;
+    while (buf.committed.load(std::memory_order_acquire) != pos)
+        CurrentThread::yield_this_thread();
+    return pos;
+}
+
+void LinkLogServer::open_buffer(Buffer& buf) {
+    uint64 generation = buf.reserved.load(std::memory_order_relaxed) >> 32;
+    /// 代数为奇数表示缓冲区已打开可以写入，偶数表示没有可用的缓冲区，每次打开前进到下一代
+    generation = ((generation | 1) + 1) | (buf.buf ? 1 : 0);
+    buf.index = 0;
+    buf.committed.store(0, std::memory_order_relaxed);
+    buf.reserved.store(generation << 32, std::memory_order_release);
 }
 
 void LinkLogServer::start_thread() {
@@ -150,6 +192,7 @@ void LinkLogServer::start_thread() {
             handle_remote_message(wait_queue);
             force_flush(flush_order, wait_queue);
             check_timeout(wait_queue);
+            spill_backlog(wait_queue);
             send_center_message(wait_queue, poller, center_can_send);
             update_center_state(poller);
         }
@@ -160,13 +203,12 @@ void LinkLogServer::start_thread() {
 }
 
 void LinkLogServer::init_thread(Poller& poller, std::vector<BufferIter>& flush_order) {
-    Event event { _receiver.fd() };
+    Event event { _doorbell.fd() };
     event.set_read();
     event.set_HangUp();
     event.set_error();
     poller.set_tid(CurrentThread::tid());
     poller.add_fd(event);
-    _receiver.set_running_thread();
     event.fd = _acceptor.socket().fd();
     poller.add_fd(event);
 
@@ -176,20 +218,19 @@ void LinkLogServer::init_thread(Poller& poller, std::vector<BufferIter>& flush_o
 }
 
 bool LinkLogServer::accept_message(Poller& poller, std::vector<Event>& events) {
-    int get = poller.get_aliveEvent(GET_ACTIVE_TIMEOUT_MS, events);
+    int get = poller.get_aliveEvent(std::min(GET_ACTIVE_TIMEOUT_MS, (int32) _flush_interval.to_ms()), events);
     CHECK(get >= 0, return false);
     bool center_can_send = false;
     for (auto event : events) {
         if (event.fd == _acceptor.socket().fd()) {
             accept_center_link(poller);
-        } else if (event.fd == _receiver.fd()) {
+        } else if (event.fd == _doorbell.fd()) {
             assert(!event.hasError() && !event.hasHangUp());
             assert(event.canRead());
-            auto received = _receiver.receive_message();
-            assert(received >= 0);
+            reset_doorbell();
         } else {
             if (event.canRead()) {
-                auto received = _receiver.receive_message();
+                auto received = _center.receive_message();
                 if (unlikely(received <= 0)) {
                     if (_center.socket_event.hasHangUp()) {
                         event.set_HangUp();
@@ -223,12 +264,11 @@ bool LinkLogServer::accept_message(Poller& poller, std::vector<Event>& events) {
 
 bool LinkLogServer::handle_local_message(WaitQueue& wait_queue) {
     LinkLogMessage message;
-    assert(_receiver.agent_valid());
-    while (_receiver.input().fix_read(&message, sizeof(message))) {
+    while (_local_queue.try_take(message)) {
         switch (message.type) {
             case LinkLogMessage::ClearBuffer:
-                if (!clear_buffer(message, wait_queue.empty()))
-                    wait_queue.push(message);
+                if (!_spills.empty() || !clear_buffer(message, wait_queue.empty()))
+                    queue_buffer(message, wait_queue);
                 break;
             case LinkLogMessage::ShutDownServer:
                 return true;
@@ -244,7 +284,7 @@ void LinkLogServer::handle_remote_message(WaitQueue& wait_queue) const {
     while (_center.input().fix_read(&message, sizeof(message))) {
         switch (message.type) {
             case LinkLogMessage::CentralOffline:
-                wait_queue.emplace(LinkLogMessage::NodeOffline);
+                wait_queue.emplace_back(LinkLogMessage::NodeOffline);
                 return;
             default:
                 ASSERT_WRONG_TYPE(message.type)
@@ -259,6 +299,7 @@ void LinkLogServer::send_center_message(WaitQueue& wait_queue, Poller& poller, b
               destroy_center_link(poller);)
     };
 
+    reload_spills(wait_queue);
     while (!wait_queue.empty()) {
         auto& message = wait_queue.front();
         bool pop = true;
@@ -275,9 +316,10 @@ void LinkLogServer::send_center_message(WaitQueue& wait_queue, Poller& poller, b
             default:
                 ASSERT_WRONG_TYPE(message.type)
         }
-        if (pop) wait_queue.pop();
+        if (pop) wait_queue.pop_front();
         else break;
     }
+    update_flush_interval(wait_queue);
 }
 
 void LinkLogServer::update_center_state(Poller& poller) const {
@@ -294,17 +336,22 @@ void LinkLogServer::update_center_state(Poller& poller) const {
 }
 
 void LinkLogServer::save_logs(WaitQueue& wait_queue) {
-    for (auto& [mutex, index, ref_count, buf, last_flush_time] : _buffers) {
-        Lock l(mutex);
-        if (!buf.data() || index == 0) continue;
-        auto written = _encoder.write_to_file(buf.data(), index);
-        CHECK(written > 0,);
-        if (!_center.agent_valid()) continue;
-        LinkLogMessage message(LinkLogMessage::ClearBuffer);
-        message.get<LinkLogMessage::ClearBuffer_>().size = index;
-        message.get<LinkLogMessage::ClearBuffer_>().flushed = true;
-        message.get<LinkLogMessage::ClearBuffer_>().buf_ptr = new BufferPool::Buffer(std::move(buf));
-        wait_queue.push(message);
+    for (auto& buffer : _buffers) {
+        Lock l(buffer.mutex);
+        uint32 index = seal_buffer(buffer);
+        if (index == MAX_UINT) continue;
+        if (buffer.buf && index != 0) {
+            auto written = _encoder.write_to_file(buffer.buf.data(), index);
+            CHECK(written > 0,);
+            if (_center.agent_valid()) {
+                LinkLogMessage message(LinkLogMessage::ClearBuffer);
+                message.get<LinkLogMessage::ClearBuffer_>().size = index;
+                message.get<LinkLogMessage::ClearBuffer_>().flushed = true;
+                message.get<LinkLogMessage::ClearBuffer_>().buf_ptr = new BufferPool::Buffer(std::move(buffer.buf));
+                wait_queue.push_back(message);
+            }
+        }
+        open_buffer(buffer);
     }
 }
 
@@ -314,7 +361,7 @@ void LinkLogServer::close_thread(WaitQueue& wait_queue, Poller& poller, std::vec
     save_logs(wait_queue);
     if (_center.agent_valid()) {
         LinkLogMessage message(LinkLogMessage::NodeOffline);
-        wait_queue.push(message);
+        wait_queue.push_back(message);
     }
     while (!wait_queue.empty() || _center.can_send()) {
         update_center_state(poller);
@@ -322,6 +369,8 @@ void LinkLogServer::close_thread(WaitQueue& wait_queue, Poller& poller, std::vec
     }
 
     assert(!_center.agent_valid());
+    _spills.clear();
+    _spill_file.delete_file();
 }
 
 LinkErrorType LinkLogServer::register_logger(MapIter parent_iter, Type type,
@@ -522,14 +571,11 @@ void LinkLogServer::submit_buffer(Buffer& buf, Lock<Mutex>& lock) {
             message.get<LinkLogMessage::ClearBuffer_>().flushed = true;
             auto written = _encoder.write_to_file(buf.buf.data(), buf.index);
             CHECK(written == buf.index,)
-            if (_center.agent_valid()) {
-                std::swap(buf.buf, *new_buf);
-                CHECK(safe_notify(message),
-                      std::swap(buf.buf, *new_buf);
-                      delete new_buf)
-            } else {
-                delete new_buf;
-            }
+            /// center 不可达时同样交出缓冲区，由服务线程转存到 spill 文件
+            std::swap(buf.buf, *new_buf);
+            CHECK(safe_notify(message),
+                  std::swap(buf.buf, *new_buf);
+                  delete new_buf)
         }
     }
     buf.index = 0;
@@ -543,14 +589,29 @@ void LinkLogServer::submit_buffer(Buffer& buf, Lock<Mutex>& lock) {
 }
 
 bool LinkLogServer::clear_buffer(LinkLogMessage& message, bool can_send) {
-    auto& [size, flushed, begin, buf_ptr] = message.get<LinkLogMessage::ClearBuffer_>();
+    auto& [size, flushed, encoded, begin, link, buf_ptr] = message.get<LinkLogMessage::ClearBuffer_>();
     auto buf = (BufferPool::Buffer *) buf_ptr;
     if (!flushed) {
         _encoder.write_to_file(buf->data(), size);
         flushed = true;
     }
     if (!can_send) return false;
-    if (_center.agent_valid()) {
+    if (!_center.agent_valid() && !encoded && begin == 0) {
+        /// 已转存的数据晚于队列中的缓冲区，不能排在它们之后，等待 center 恢复
+        if (!_spills.empty()) return false;
+        spill_buffer(message);
+        return true;
+    }
+    if (encoded && link != _center_link) {
+        /// 原地编码之后原始数据已经丢失，旧连接的句柄在新连接上无效，只能丢弃，本地文件中仍有完整记录
+        G_WARN << "LinkLogServer: center link is reset, " << size - begin
+               << " encoded bytes are not uploaded to center";
+    } else if (_center.agent_valid()) {
+        if (!encoded) {
+            size = _encoder.encode_for_center(buf->data(), size);
+            encoded = true;
+            link = _center_link;
+        }
         auto written = _center.output().write(buf->data() + begin, size - begin);
         if (written != size - begin) {
             begin += written;
@@ -585,27 +646,133 @@ bool LinkLogServer::node_offline(LinkLogMessage& message, Poller& poller) {
     return false;
 }
 
+void LinkLogServer::spill_buffer(LinkLogMessage& message) {
+    auto& [size, flushed, encoded, begin, link, buf_ptr] = message.get<LinkLogMessage::ClearBuffer_>();
+    assert(flushed && !encoded && begin == 0);
+    auto buf = (BufferPool::Buffer *) buf_ptr;
+    /// 最后写入的块位于队首之前时说明已经回绕，只能写到队首为止
+    uint64 offset = _spills.empty() ? 0 : _spill_end, limit = _spill_limit;
+    if (!_spills.empty()) {
+        bool wrapped = _spills.back().offset < _spills.front().offset;
+        if (!wrapped && offset + size > limit) {
+            offset = 0;
+            wrapped = true;
+        }
+        if (wrapped) limit = _spills.front().offset;
+    }
+    if (offset + size <= limit) {
+        CHECK(_spill_file.seek_beg(offset) && _spill_file.write(buf->data(), size) == size,
+              delete buf;
+              _condition.notify_one();
+              return)
+        _spills.push_back(Spill { offset, size });
+        _spill_end = offset + size;
+    } else {
+        G_WARN << "LinkLogServer: spill file is full, " << size << " bytes are not uploaded to center";
+    }
+    buf_ptr = nullptr;
+    delete buf;
+    _condition.notify_one();
+}
+
+void LinkLogServer::queue_buffer(LinkLogMessage& message, WaitQueue& wait_queue) {
+    if (_spills.empty()) {
+        wait_queue.push_back(message);
+        return;
+    }
+    auto& clear = message.get<LinkLogMessage::ClearBuffer_>();
+    if (!clear.flushed) {
+        _encoder.write_to_file(((BufferPool::Buffer *) clear.buf_ptr)->data(), clear.size);
+        clear.flushed = true;
+    }
+    spill_buffer(message);
+}
+
+void LinkLogServer::spill_backlog(WaitQueue& wait_queue) {
+    /// 队列中的缓冲区早于 spill 文件中的数据，只有文件为空时才能从队尾转存
+    if (!_spills.empty()) return;
+    uint32 limit = std::max<uint32>(_buffers.size() / 2, 1), held = 0;
+    for (auto& message : wait_queue)
+        if (message.type == LinkLogMessage::ClearBuffer) ++held;
+    /// 队首的消息可能已经部分发送，不能转存
+    for (uint64 i = wait_queue.size(); held > limit && i-- > 1;) {
+        auto& message = wait_queue[i];
+        if (message.type != LinkLogMessage::ClearBuffer) continue;
+        auto& clear = message.get<LinkLogMessage::ClearBuffer_>();
+        if (!clear.flushed || clear.encoded || clear.begin != 0) continue;
+        spill_buffer(message);
+        wait_queue.erase(wait_queue.begin() + (int64) i);
+        --held;
+    }
+}
+
+void LinkLogServer::reload_spills(WaitQueue& wait_queue) {
+    if (!_center.agent_valid()) return;
+    uint32 limit = std::max<uint32>(_buffers.size() / 2, 1);
+    while (!_spills.empty() && wait_queue.size() < limit) {
+        auto [offset, size] = _spills.front();
+        auto buf = _pool.get(BLOCK_SIZE);
+        if (!buf) break;
+        _spills.pop_front();
+        CHECK(_spill_file.seek_beg(offset) && _spill_file.read(size, buf.data()) == size, continue)
+        LinkLogMessage message(LinkLogMessage::ClearBuffer);
+        message.get<LinkLogMessage::ClearBuffer_>().size = size;
+        message.get<LinkLogMessage::ClearBuffer_>().flushed = true;
+        message.get<LinkLogMessage::ClearBuffer_>().buf_ptr = new BufferPool::Buffer(std::move(buf));
+        wait_queue.push_back(message);
+    }
+    if (_spills.empty() && _spill_end != 0) {
+        _spill_end = 0;
+        CHECK(_spill_file.resize_file(0),)
+    }
+}
+
+void LinkLogServer::update_flush_interval(const WaitQueue& wait_queue) {
+    if (!_center.agent_valid()) {
+        _drain_begin = TimeInterval();
+        _flush_interval = BUFFER_FLUSH_TIME;
+        return;
+    }
+    auto now = Unix_to_now();
+    if (_center.can_send()) {
+        if (_drain_begin == 0) _drain_begin = now;
+    } else if (_drain_begin != 0) {
+        _upload_latency = TimeInterval((_upload_latency * 3 + (now - _drain_begin)) / 4);
+        _drain_begin = TimeInterval();
+    }
+    /// 刷新间隔取排空时间的若干倍，上传越慢批次越大；积压或有转存数据时使用最长间隔
+    if (!_spills.empty() || wait_queue.size() > 1) {
+        _flush_interval = BUFFER_FLUSH_TIME;
+    } else {
+        _flush_interval = TimeInterval(std::clamp<int64>(_upload_latency * 4, MIN_FLUSH_TIME, BUFFER_FLUSH_TIME));
+    }
+}
+
 void LinkLogServer::force_flush(std::vector<BufferIter>& flush_order, WaitQueue& wait_queue) {
     std::sort(flush_order.begin(), flush_order.end(),
               [] (BufferIter a, BufferIter b) {
                   return a->last_flush_time < b->last_flush_time;
               });
-    TimeInterval threshold = Unix_to_now() - BUFFER_FLUSH_TIME;
+    TimeInterval threshold = Unix_to_now() - _flush_interval;
 
     for (auto it : flush_order) {
         if (it->last_flush_time <= threshold) {
             Lock l(it->mutex);
-            if (!it->buf || it->index == 0) continue;
-            _encoder.write_to_file(it->buf.data(), it->index);
-            if (_center.agent_valid()) {
-                auto new_buf = new BufferPool::Buffer(std::move(it->buf));
-                LinkLogMessage message(LinkLogMessage::ClearBuffer);
-                message.get<LinkLogMessage::ClearBuffer_>().size = it->index;
-                message.get<LinkLogMessage::ClearBuffer_>().flushed = true;
-                message.get<LinkLogMessage::ClearBuffer_>().buf_ptr = new_buf;
-                wait_queue.push(message);
+            /// 只等待已经预留的写入提交，写入线程正在交出缓冲区时跳过
+            uint32 index = seal_buffer(*it);
+            if (index == MAX_UINT) continue;
+            if (!it->buf || index == 0) {
+                open_buffer(*it);
+                continue;
             }
-            it->index = 0;
+            _encoder.write_to_file(it->buf.data(), index);
+            /// center 不可达时同样交出缓冲区，由 clear_buffer 转存到 spill 文件
+            LinkLogMessage message(LinkLogMessage::ClearBuffer);
+            message.get<LinkLogMessage::ClearBuffer_>().size = index;
+            message.get<LinkLogMessage::ClearBuffer_>().flushed = true;
+            message.get<LinkLogMessage::ClearBuffer_>().buf_ptr = new BufferPool::Buffer(std::move(it->buf));
+            queue_buffer(message, wait_queue);
+            open_buffer(*it);
             it->last_flush_time = Unix_to_now();
         }
     }
@@ -629,7 +796,7 @@ void LinkLogServer::check_timeout(WaitQueue& wait_queue) {
                     time_out.node() = iter->first.nodeID();
                     time_out.time() = timer.expire_time;
                     time_out.error_type() = EndTimeOut;
-                    wait_queue.push(msg);
+                    wait_queue.push_back(msg);
                 }
                 _handler->handling_error(iter->first.serviceID(), iter->first.nodeID(),
                                          timer.expire_time, EndTimeOut);
@@ -643,7 +810,7 @@ void LinkLogServer::check_timeout(WaitQueue& wait_queue) {
                         time_out.node() = iter->first.nodeID();
                         time_out.time() = timer.expire_time;
                         time_out.error_type() = CreateTimeOut;
-                        wait_queue.push(msg);
+                        wait_queue.push_back(msg);
                     }
                     _handler->handling_error(iter->first.serviceID(), iter->first.nodeID(),
                                              timer.expire_time, CreateTimeOut);
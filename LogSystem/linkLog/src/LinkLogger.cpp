@@ -67,15 +67,13 @@ LinkLogger::~LinkLogger() {
 void LinkLogger::push(LogRank rank, const void *data, uint16 size) const {
     if (rank < _rank) return;
     auto buf_iter = _iter->second.buf_iter;
-    Lock l(buf_iter->mutex);
-    auto rest = buf_iter->buf.size() - buf_iter->index;
-    if (!LinkLogEncoder::can_write_log(size, rest))
-        _server->submit_buffer(*buf_iter, l);
-    buf_iter->index += LinkLogEncoder::write_log(
-        _iter->first.serviceID(), _iter->second.init_time,
-        _iter->first.nodeID(), Unix_to_now(), rank,
-        data, size,
-        buf_iter->buf.data() + buf_iter->index);
+    if (!LinkLogEncoder::can_write_log(size, LinkLogServer::BLOCK_SIZE))
+        size = MAX_USHORT - sizeof(Link_Log_Header);
+    uint32 record = sizeof(Link_Log_Header) + size;
+    LinkLogEncoder::write_log(_iter->first.serviceID(), _iter->second.init_time,
+                              _iter->first.nodeID(), Unix_to_now(), rank,
+                              data, size, _server->reserve(*buf_iter, record));
+    LinkLogServer::commit(*buf_iter, record);
 }
 
 void LinkLogger::register_child_node(Type type, const NodeID& node_id,
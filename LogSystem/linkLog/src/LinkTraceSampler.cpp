@@ -0,0 +1,223 @@
+//
+// Created by taganyer on 26-10-19.
+//
+
+#include "../LinkTraceSampler.hpp"
+#include <algorithm>
+
+using namespace Base;
+
+using namespace LogSystem;
+
+
+LinkSamplingStats& LinkSamplingStats::operator+=(const LinkSamplingStats& other) {
+    sampled += other.sampled;
+    errored += other.errored;
+    slow += other.slow;
+    expired += other.expired;
+    dropped += other.dropped;
+    dropped_bytes += other.dropped_bytes;
+    return *this;
+}
+
+LinkTraceSampler::Verdict LinkTraceSampler::admit(const Address& address, const RingBufferWrapper& buffer,
+                                                  Released& released) {
+    OperationType type;
+    buffer.try_read(&type, sizeof(OperationType), 0);
+    uint32 size = record_size(type, buffer);
+    if (size == 0) return Keep;
+
+    ServiceID service;
+    LinkNodeID node;
+    bool head = false, error = false;
+    TimeInterval duration;
+    switch (type) {
+        case RegisterLogger: {
+            Register_Logger logger;
+            buffer.try_read(&logger, sizeof(Register_Logger), 0);
+            service = logger.service();
+            break;
+        }
+        case CreateLogger: {
+            Create_Logger logger;
+            buffer.try_read(&logger, sizeof(Create_Logger), 0);
+            service = logger.service();
+            node = logger.node();
+            head = logger.type() == Head;
+            break;
+        }
+        case EndLogger: {
+            End_Logger logger;
+            buffer.try_read(&logger, sizeof(End_Logger), 0);
+            service = logger.service();
+            node = logger.node();
+            duration = logger.end_time() - logger.init_time();
+            break;
+        }
+        case LinkLog: {
+            Link_Log_Header header;
+            buffer.try_read(&header, sizeof(Link_Log_Header), 0);
+            service = header.service();
+            error = header.rank() >= ERROR;
+            break;
+        }
+        default: {
+            Error_Logger logger;
+            buffer.try_read(&logger, sizeof(Error_Logger), 0);
+            service = logger.service();
+            error = true;
+        }
+    }
+
+    auto now = Unix_to_now();
+    auto [iter, success] = _traces.try_emplace(service);
+    auto& trace = iter->second;
+    if (success) set_expire(iter, now + _policy.buffer_timeout);
+    /// 只记录时间，不重新排队，check_timeout 到期时再按 last_admit 推迟
+    if (trace.state != Pending) trace.last_admit = now;
+    if (trace.state == Kept) return Keep;
+    if (trace.state == Pending) {
+        if (head) {
+            trace.has_head = true;
+            trace.head = node;
+            if (sampled(service)) {
+                keep(iter, _sampled, released);
+                return Keep;
+            }
+        } else if (error) {
+            keep(iter, _errored, released);
+            return Keep;
+        } else if (type == EndLogger && trace.has_head && trace.head == node) {
+            if (duration >= _policy.slow_threshold) {
+                keep(iter, _slow, released);
+                return Keep;
+            }
+            drop(iter);
+        }
+    }
+    if (trace.state == Dropped) {
+        _dropped_bytes += size;
+        buffer.read_advance(size);
+        return Drop;
+    }
+    hold(trace, address, buffer, size);
+    if (_buffered > _policy.buffer_limit)
+        shrink(released);
+    return Hold;
+}
+
+void LinkTraceSampler::check_timeout(Released& released) {
+    auto now = Unix_to_now();
+    while (!_expire.empty() && _expire.front().first <= now) {
+        auto [expire_time, service] = _expire.front();
+        _expire.pop_front();
+        auto iter = _traces.find(service);
+        if (iter == _traces.end() || iter->second.expire_time != expire_time)
+            continue;
+        auto& trace = iter->second;
+        if (trace.state == Pending) {
+            keep(iter, _expired, released);
+        } else if (now < trace.last_admit + _policy.buffer_timeout) {
+            /// 不早于队尾，保持 _expire 按时间排列
+            auto refreshed = trace.last_admit + _policy.buffer_timeout;
+            set_expire(iter, _expire.empty() ? refreshed : std::max(refreshed, _expire.back().first));
+        } else {
+            _traces.erase(iter);
+        }
+    }
+}
+
+LinkSamplingStats LinkTraceSampler::stats() const {
+    LinkSamplingStats stats;
+    stats.sampled = _sampled;
+    stats.errored = _errored;
+    stats.slow = _slow;
+    stats.expired = _expired;
+    stats.dropped = _dropped;
+    stats.dropped_bytes = _dropped_bytes;
+    return stats;
+}
+
+bool LinkTraceSampler::sampled(const ServiceID& service) const {
+    /// 取哈希的高 53 位，与按低位选择分区相互独立
+    uint64 hash = std::hash<ServiceID>()(service) >> 11;
+    return (double) hash < _policy.sample_rate * (double) (1ULL << 53);
+}
+
+void LinkTraceSampler::set_expire(TraceIter iter, TimeInterval expire_time) {
+    iter->second.expire_time = expire_time;
+    _expire.emplace_back(expire_time, iter->first);
+}
+
+void LinkTraceSampler::keep(TraceIter iter, std::atomic<uint64>& reason, Released& released) {
+    auto& trace = iter->second;
+    ++reason;
+    for (auto& segment : trace.records)
+        released.push_back(std::move(segment));
+    _buffered -= trace.size;
+    trace.records = Released();
+    trace.size = 0;
+    trace.state = Kept;
+    set_expire(iter, Unix_to_now() + _policy.buffer_timeout);
+}
+
+void LinkTraceSampler::drop(TraceIter iter) {
+    auto& trace = iter->second;
+    ++_dropped;
+    _dropped_bytes += trace.size;
+    _buffered -= trace.size;
+    trace.records = Released();
+    trace.size = 0;
+    trace.state = Dropped;
+    set_expire(iter, Unix_to_now() + _policy.buffer_timeout);
+}
+
+void LinkTraceSampler::hold(Trace& trace, const Address& address, const RingBufferWrapper& buffer, uint32 size) {
+    if (trace.records.empty() || trace.records.back().address != address)
+        trace.records.push_back(Segment { address, std::string() });
+    auto& data = trace.records.back().data;
+    uint64 old_size = data.size();
+    data.resize(old_size + size);
+    buffer.read(data.data() + old_size, size);
+    trace.size += size;
+    _buffered += size;
+}
+
+void LinkTraceSampler::shrink(Released& released) {
+    /// 从最早加入的链路开始保留，keep 追加的项不会在这一轮被访问
+    for (uint64 i = 0, size = _expire.size(); i < size && _buffered > _policy.buffer_limit; ++i) {
+        auto iter = _traces.find(_expire[i].second);
+        if (iter != _traces.end() && iter->second.state == Pending
+            && iter->second.expire_time == _expire[i].first)
+            keep(iter, _expired, released);
+    }
+}
+
+uint32 LinkTraceSampler::record_size(OperationType type, const RingBufferWrapper& buffer) {
+    uint32 size;
+    switch (type) {
+        case RegisterLogger:
+            size = sizeof(Register_Logger);
+            break;
+        case CreateLogger:
+            size = sizeof(Create_Logger);
+            break;
+        case EndLogger:
+            size = sizeof(End_Logger);
+            break;
+        case ErrorLogger:
+            size = sizeof(Error_Logger);
+            break;
+        case LinkLog: {
+            Link_Log_Header header;
+            if (buffer.readable_len() < sizeof(Link_Log_Header)) return 0;
+            buffer.try_read(&header, sizeof(Link_Log_Header), 0);
+            size = sizeof(Link_Log_Header) + header.log_size();
+            break;
+        }
+        default:
+            /// 与链路无关的记录
+            return 0;
+    }
+    return buffer.readable_len() < size ? 0 : size;
+}
@@ -77,6 +77,9 @@ namespace Net {
     public:
         static PipePair create_pipe();
 
+        /// 创建非阻塞的 eventfd，写入计数唤醒等待读的一方。
+        static Socket create_eventfd();
+
     };
 
     struct PipePair {
@@ -4,6 +4,7 @@
 
 #include "../Socket.hpp"
 #include <fcntl.h>
+#include <sys/eventfd.h>
 #include <netinet/tcp.h>
 #include "tinyBackend/Base/GlobalObject.hpp"
 #include "tinyBackend/Net/InetAddress.hpp"
@@ -194,5 +195,12 @@ PipePair Socket::create_pipe() {
     return { Socket(fds[0]), Socket(fds[1]) };
 }
 
+Socket Socket::create_eventfd() {
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+        return Socket();
+    return Socket(fd);
+}
+
 PipePair::PipePair(Socket read, Socket write) :
     read(std::move(read)), write(std::move(write)) {}
@@ -14,12 +14,40 @@ namespace Test {
 
     void LinkedThreadPool_test();
 
+    void WorkStealingPool_test();
+
+    void PriorityThreadPool_test();
+
+    void ParallelAlgorithm_test();
+
+    void MPMCQueue_test();
+
+    void ConcurrentLRUCache_test();
+
     void timer_test();
 
     void BufferPool_test();
 
     void BPTree_test();
 
+    void BPTree_backend_test();
+
+    void DurableBPTree_test();
+
+    void BPTree_bulk_load_test();
+
+    void BPTree_cursor_test();
+
+    void BPTree_search_test();
+
+    void BPTree_prefetch_test();
+
+    void BPTree_compact_test();
+
+    void BPTree_snapshot_test();
+
+    void ConcurrentBPTree_test();
+
 }
 
 #endif //TEST_FUNS_HPP
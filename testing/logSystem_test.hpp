@@ -13,6 +13,20 @@ namespace Test {
 
     void link_log_test();
 
+    void packed_table_test();
+
+    void link_log_format_test();
+
+    void link_log_index_test();
+
+    void link_log_push_test();
+
+    void link_log_partition_test();
+
+    void link_log_sampling_test();
+
+    void link_log_spill_test();
+
 }
 
 #endif
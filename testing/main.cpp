@@ -18,12 +18,34 @@ int main() {
     // BlockFile_test();
     // log_test();
     // BPTree_test();
+    // BPTree_backend_test();
+    // DurableBPTree_test();
+    // BPTree_bulk_load_test();
+    // BPTree_cursor_test();
+    // BPTree_search_test();
+    // BPTree_prefetch_test();
+    // BPTree_compact_test();
+    // BPTree_snapshot_test();
+    // ConcurrentBPTree_test();
     // ThreadPool_test();
+    // WorkStealingPool_test();
+    // PriorityThreadPool_test();
+    // ParallelAlgorithm_test();
+    // MPMCQueue_test();
+    // ConcurrentLRUCache_test();
     // LinkedThreadTest();
     // UDP_test();
     // raft_test();
+    // packed_table_test();
+    // link_log_format_test();
+    // link_log_index_test();
+    // link_log_push_test();
+    // link_log_partition_test();
+    // link_log_sampling_test();
+    // link_log_spill_test();
     link_log_test();
     // TCP_test();
+    // doorbell_test();
 
     return 0;
 }
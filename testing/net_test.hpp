@@ -17,6 +17,8 @@ namespace Test {
 
     void TCP_test();
 
+    void doorbell_test();
+
 }
 
 #endif
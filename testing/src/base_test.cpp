@@ -7,15 +7,32 @@
 #include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <numeric>
 #include <random>
+#include <cmath>
+#include <thread>
 #include <vector>
+#include <fcntl.h>
+#include <csignal>
+#include <sys/wait.h>
 
+#include <tinyBackend/Base/BlockQueue.hpp>
+#include <tinyBackend/Base/LRUCache.hpp>
+#include <tinyBackend/Base/ConcurrentLRUCache.hpp>
+#include <tinyBackend/Base/MPMCQueue.hpp>
 #include <tinyBackend/Base/LinkedThreadPool.hpp>
+#include <tinyBackend/Base/PriorityThreadPool.hpp>
 #include <tinyBackend/Base/GlobalObject.hpp>
+#include <tinyBackend/Base/ParallelAlgorithm.hpp>
 #include <tinyBackend/Base/Thread.hpp>
 #include <tinyBackend/Base/ThreadPool.hpp>
+#include <tinyBackend/Base/WorkStealingPool.hpp>
 #include <tinyBackend/Base/BPTree_impls/BPTree.hpp>
 #include <tinyBackend/Base/BPTree_impls/BPTree_impl.hpp>
+#include <tinyBackend/Base/BPTree_impls/BPTreeCompactor.hpp>
+#include <tinyBackend/Base/BPTree_impls/ConcurrentBPTree.hpp>
+#include <tinyBackend/Base/BPTree_impls/DurableBPTree.hpp>
 #include <tinyBackend/Base/Buffer/BufferPool.hpp>
 #include <tinyBackend/Base/Time/Timer.hpp>
 using namespace std;
@@ -183,6 +200,466 @@ namespace Test {
         cout << "结果: " << T::t.load() << " 拒绝： " << reject.load() << endl;
     }
 
+    void PriorityThreadPool_test() {
+        /// 0: 请求处理  1: 普通任务  2: 批处理（日志刷盘、B+树整理等），批处理最多同时运行一个。
+        PriorityThreadPool pool(4, 100000, 3, 50_ms);
+        pool.set_class_limit(2, 1);
+
+        auto busy = [] (int64 us) {
+            auto end = Unix_to_now() + TimeInterval(us * US_);
+            while (Unix_to_now() < end) {}
+        };
+
+        vector<future<void>> futures;
+        auto start = Unix_to_now();
+        for (int i = 0; i < 200; ++i)
+            futures.push_back(pool.submit_with_future(2, busy, 2000));
+        for (int i = 0; i < 2000; ++i) {
+            if (i % 2 == 0)
+                futures.push_back(pool.submit_with_future(1, busy, 200));
+            futures.push_back(pool.submit_with_deadline_future(0, Unix_to_now() + 5_ms, busy, 50));
+        }
+        for (auto& f : futures) f.get();
+        cout << "执行时间: " << (Unix_to_now() - start).to_ms() << " 毫秒" << endl;
+
+        for (uint32 level = 0; level < pool.get_levels(); ++level) {
+            auto m = pool.get_metrics(level);
+            cout << "level " << level
+                << " submitted: " << m.submitted
+                << " completed: " << m.completed
+                << " depth: " << m.queue_depth
+                << " missed: " << m.missed_deadline
+                << " avg wait: " << m.average_wait().to_ms() << " ms"
+                << " max wait: " << m.max_wait.to_ms() << " ms" << endl;
+        }
+
+        /// 截止时间较晚的任务不在 EDF 的队首，持续有更紧急的同级任务时也应在老化后执行。
+        PriorityThreadPool single(1, 100000, 2, 20_ms);
+        auto submit_time = Unix_to_now();
+        auto late = single.submit_with_deadline_future(1, submit_time + 10_s, [] { return Unix_to_now(); });
+        while (late.wait_for(std::chrono::seconds(0)) != std::future_status::ready
+            && Unix_to_now() - submit_time < 500_ms)
+            single.submit_with_deadline(1, Unix_to_now() + 1_ms, busy, 1000);
+        cout << "老化任务等待 " << (late.get() - submit_time).to_ms() << " 毫秒" << endl;
+    }
+
+    static uint64 serial_fib(uint32 n) {
+        return n < 2 ? n : serial_fib(n - 1) + serial_fib(n - 2);
+    }
+
+    /// 等待子任务时帮助执行池中的其他任务，两种线程池都提供 stolen_a_task。
+    template <typename Pool>
+    static void help_wait(Pool& pool, const atomic<bool>& done) {
+        while (!done.load(memory_order_acquire)) {
+            if (!pool.stolen_a_task())
+                CurrentThread::yield_this_thread();
+        }
+    }
+
+    template <typename Pool>
+    static uint64 fork_join_fib(Pool& pool, uint32 n) {
+        if (n < 22) return serial_fib(n);
+        atomic<bool> done(false);
+        uint64 left = 0;
+        pool.submit([&pool, &left, &done, n] {
+            left = fork_join_fib(pool, n - 1);
+            done.store(true, memory_order_release);
+        });
+        uint64 right = fork_join_fib(pool, n - 2);
+        help_wait(pool, done);
+        return left + right;
+    }
+
+    template <typename Pool>
+    static void fork_join_sort(Pool& pool, int *begin, int *end) {
+        if (end - begin < 1 << 14) {
+            std::sort(begin, end);
+            return;
+        }
+        int pivot = begin[(end - begin) / 2];
+        int *mid1 = std::partition(begin, end, [pivot] (int v) { return v < pivot; });
+        int *mid2 = std::partition(mid1, end, [pivot] (int v) { return v == pivot; });
+        atomic<bool> done(false);
+        pool.submit([&pool, &done, begin, mid1] {
+            fork_join_sort(pool, begin, mid1);
+            done.store(true, memory_order_release);
+        });
+        fork_join_sort(pool, mid2, end);
+        help_wait(pool, done);
+    }
+
+    template <typename Pool>
+    static void fork_join_benchmark(Pool& pool, const char *name) {
+        auto start = Unix_to_now();
+        uint64 result = 0;
+        atomic<bool> done(false);
+        pool.submit([&pool, &result, &done] {
+            result = fork_join_fib(pool, 36);
+            done.store(true, memory_order_release);
+        });
+        help_wait(pool, done);
+        cout << name << " fib(36) = " << result << " 用时: "
+            << (Unix_to_now() - start).to_ms() << " 毫秒" << endl;
+
+        vector<int> data(1 << 24);
+        mt19937 gen(2024);
+        for (auto& v : data) v = (int) gen();
+        start = Unix_to_now();
+        done.store(false);
+        pool.submit([&pool, &data, &done] {
+            fork_join_sort(pool, data.data(), data.data() + data.size());
+            done.store(true, memory_order_release);
+        });
+        help_wait(pool, done);
+        cout << name << " sort(" << data.size() << ") 用时: "
+            << (Unix_to_now() - start).to_ms() << " 毫秒 is_sorted: "
+            << std::is_sorted(data.begin(), data.end()) << endl;
+    }
+
+    void WorkStealingPool_test() {
+        uint32 threads = std::max(2u, std::thread::hardware_concurrency());
+        {
+            ThreadPool pool(threads, 1 << 20);
+            fork_join_benchmark(pool, "ThreadPool");
+        }
+        {
+            WorkStealingPool pool(threads);
+            fork_join_benchmark(pool, "WorkStealingPool");
+        }
+
+        /// 池外提交与 future。
+        WorkStealingPool pool(threads, 1000);
+        vector<future<uint64>> futures;
+        for (uint32 i = 0; i < 10000; ++i)
+            futures.push_back(pool.submit_with_future([] (uint32 n) { return serial_fib(n); }, i % 20));
+        uint64 total = 0;
+        for (auto& f : futures) total += f.get();
+        cout << "future total: " << total << endl;
+
+        /// 抛出异常的任务不会结束工作线程。
+        for (uint32 i = 0; i < threads * 2; ++i)
+            pool.submit([] { throw Exception("task error"); });
+        cout << "after throw: " << pool.submit_with_future([] { return serial_fib(10); }).get() << endl;
+
+        /// 工作线程在 help_until 中等待仍在队列里的子任务时 shutdown 不会卡住。
+        WorkStealingPool single(1);
+        std::atomic<bool> started = false, paused = false;
+        single.submit([&] {
+            auto child = single.submit_with_future([] { return 1; });
+            started = true;
+            while (!paused) CurrentThread::yield_this_thread();
+            single.help_until([&child] {
+                return child.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+            });
+        });
+        while (!started) CurrentThread::yield_this_thread();
+        single.stop();
+        paused = true;
+        this_thread::sleep_for(10ms);
+        single.shutdown();
+        cout << "shutdown during help_until done" << endl;
+    }
+
+    /// 在 parallel_for 执行期间由其他线程丢弃池中的任务，parallel_for 应当抛出异常而不是一直等待。
+    template <typename Pool, typename Stop>
+    static void parallel_interrupt_test(const char *name, Pool& pool, Stop stop) {
+        atomic<uint64> executed = 0;
+        Thread stopper([&pool, &stop] {
+            this_thread::sleep_for(20ms);
+            stop(pool);
+        });
+        stopper.start();
+        bool interrupted = false;
+        try {
+            parallel_for(pool, (uint64) 0, (uint64) 200, [&executed] (uint64) {
+                this_thread::sleep_for(2ms);
+                executed.fetch_add(1);
+            }, 1);
+        } catch (Exception&) {
+            interrupted = true;
+        }
+        stopper.join();
+        cout << "  " << name << " interrupted: " << interrupted
+            << " executed " << executed.load() << "/200" << endl;
+    }
+
+    void ParallelAlgorithm_test() {
+        constexpr uint64 size = 1 << 24;
+        vector<int> source(size);
+        mt19937 gen(2024);
+        for (auto& v : source) v = (int) (gen() % 1000);
+
+        uint32 max_threads = std::max(4u, std::thread::hardware_concurrency());
+        for (uint32 threads = 1; threads <= max_threads; threads <<= 1) {
+            WorkStealingPool pool(threads);
+            cout << "threads: " << threads << endl;
+
+            vector<double> roots(size);
+            auto start = Unix_to_now();
+            parallel_for(pool, (uint64) 0, size, [&] (uint64 i) {
+                roots[i] = std::sqrt((double) source[i]);
+            });
+            cout << "  parallel_for: " << (Unix_to_now() - start).to_ms() << " 毫秒" << endl;
+
+            start = Unix_to_now();
+            int64 sum = parallel_reduce(pool, (uint64) 0, size, (int64) 0,
+                                        [&] (uint64 i) { return (int64) source[i]; },
+                                        std::plus<>());
+            cout << "  parallel_reduce: " << (Unix_to_now() - start).to_ms() << " 毫秒 "
+                << (sum == std::accumulate(source.begin(), source.end(), (int64) 0)) << endl;
+
+            vector<int64> prefix(size);
+            start = Unix_to_now();
+            int64 last = parallel_scan(pool, source.begin(), source.end(), prefix.begin(),
+                                       (int64) 0, std::plus<>());
+            cout << "  parallel_scan: " << (Unix_to_now() - start).to_ms() << " 毫秒 "
+                << (last == sum && prefix[size / 2] == std::accumulate(
+                    source.begin(), source.begin() + size / 2 + 1, (int64) 0)) << endl;
+
+            vector<int> data = source;
+            start = Unix_to_now();
+            parallel_sort(pool, data.begin(), data.end());
+            cout << "  parallel_sort: " << (Unix_to_now() - start).to_ms() << " 毫秒 "
+                << std::is_sorted(data.begin(), data.end()) << endl;
+        }
+
+        cout << "interrupt:" << endl;
+        {
+            ThreadPool pool(1, 1024);
+            parallel_interrupt_test("ThreadPool clear_task", pool, [] (ThreadPool& p) { p.clear_task(); });
+        }
+        {
+            ThreadPool pool(1, 1024);
+            parallel_interrupt_test("ThreadPool shutdown", pool, [] (ThreadPool& p) { p.shutdown(); });
+        }
+        {
+            WorkStealingPool pool(1);
+            parallel_interrupt_test("WorkStealingPool clear_task", pool,
+                                    [] (WorkStealingPool& p) { p.clear_task(); });
+        }
+        {
+            WorkStealingPool pool(1);
+            parallel_interrupt_test("WorkStealingPool shutdown", pool,
+                                    [] (WorkStealingPool& p) { p.shutdown(); });
+        }
+    }
+
+    /// 元素为放入时的时间戳，-1 表示结束。
+    template <typename Queue, typename Take>
+    static void queue_benchmark(const char *name, Queue& queue, Take take,
+                                uint32 producers, uint32 consumers, uint32 per_producer) {
+        atomic<int64> total_latency = 0, received = 0;
+        vector<Thread> threads;
+        auto start = Unix_to_now();
+        for (uint32 i = 0; i < consumers; ++i) {
+            threads.emplace_back([&queue, &take, &total_latency, &received] {
+                int64 latency = 0, count = 0;
+                while (true) {
+                    int64 stamp = take(queue);
+                    if (stamp < 0) break;
+                    latency += Unix_to_now().nanoseconds - stamp;
+                    ++count;
+                }
+                total_latency.fetch_add(latency);
+                received.fetch_add(count);
+            });
+        }
+        for (uint32 i = 0; i < producers; ++i) {
+            threads.emplace_back([&queue, per_producer] {
+                for (uint32 j = 0; j < per_producer; ++j)
+                    queue.put(Unix_to_now().nanoseconds);
+            });
+        }
+        for (uint32 i = consumers; i < threads.size(); ++i) threads[i].start();
+        for (uint32 i = 0; i < consumers; ++i) threads[i].start();
+        for (uint32 i = consumers; i < threads.size(); ++i) threads[i].join();
+        for (uint32 i = 0; i < consumers; ++i) queue.put((int64) -1);
+        for (uint32 i = 0; i < consumers; ++i) threads[i].join();
+
+        double ms = (Unix_to_now() - start).to_ms();
+        cout << name << " " << producers << "P/" << consumers << "C: "
+            << ms << " 毫秒 " << (double) received.load() / ms << " 个/毫秒 平均延迟 "
+            << (double) total_latency.load() / (double) std::max<int64>(1, received.load()) / US_
+            << " 微秒 received " << received.load() << endl;
+    }
+
+    void MPMCQueue_test() {
+        constexpr uint32 per_producer = 200000, capacity = 1 << 12;
+        pair<uint32, uint32> ratios[] { { 1, 1 }, { 1, 4 }, { 4, 1 }, { 4, 4 }, { 8, 8 } };
+        for (auto [producers, consumers] : ratios) {
+            {
+                BlockQueue<int64> queue(capacity);
+                queue_benchmark("BlockQueue", queue, [] (BlockQueue<int64>& q) { return q.take(); },
+                                producers, consumers, per_producer);
+            }
+            {
+                MPMCQueue<int64> queue(capacity);
+                queue_benchmark("MPMCQueue ", queue, [] (MPMCQueue<int64>& q) {
+                    int64 value = -1;
+                    q.take(value);
+                    return value;
+                }, producers, consumers, per_producer);
+            }
+        }
+
+        /// 批量接口与 stop 语义。
+        MPMCQueue<int> queue(1000);
+        vector<int> input(1500), output(1500);
+        std::iota(input.begin(), input.end(), 0);
+        Thread consumer([&queue, &output] {
+            uint32 got = 0;
+            while (got < output.size())
+                got += queue.take_n(output.begin() + got, output.size() - got);
+        });
+        consumer.start();
+        cout << "put_n: " << queue.put_n(input.begin(), input.size()) << endl;
+        consumer.join();
+        cout << "take_n equal: " << (input == output) << endl;
+        queue.stop();
+        int value;
+        cout << "put after stop: " << queue.put(1) << " take after stop: " << queue.take(value) << endl;
+    }
+
+    struct CacheTestHelper {
+        using Key = uint64;
+
+        using Value = uint64;
+
+        uint64 capacity, created = 0;
+
+        explicit CacheTestHelper(uint64 capacity) : capacity(capacity) {};
+
+        bool can_create(const Key&) const { return created < capacity; };
+
+        Value create(const Key& key) {
+            ++created;
+            return key * 2;
+        };
+
+        void update(const Key&, Value&) {};
+
+        void release(const Key&, Value&) { --created; };
+    };
+
+    /// 写回时检查值在 update 期间是否被修改，fail_key 的写回抛出异常。
+    struct WriteBackHelper {
+        using Key = uint64;
+
+        using Value = uint64;
+
+        /// 测试线程通过 ConcurrentLRUCache::helper() 访问
+        mutable atomic<uint64> torn = 0, fail_key = MAX_ULLONG;
+
+        bool can_create(const Key&) const { return true; };
+
+        Value create(const Key&) { return 0; };
+
+        void update(const Key& key, Value& value) {
+            if (key == fail_key) throw Exception("WriteBackHelper: update failed");
+            uint64 before = value;
+            for (int i = 0; i < 16; ++i) CurrentThread::yield_this_thread();
+            if (value != before) ++torn;
+        };
+    };
+
+    template <typename Cache, typename Get>
+    static void cache_benchmark(const char *name, Cache& cache, Get get,
+                                uint32 threads_size, uint64 keys, uint64 per_thread) {
+        atomic<uint64> errors = 0;
+        vector<Thread> threads;
+        for (uint32 i = 0; i < threads_size; ++i) {
+            threads.emplace_back([&, i] {
+                default_random_engine seed(i);
+                uniform_int_distribution<uint64> engine(0, keys - 1);
+                uint64 error = 0;
+                for (uint64 j = 0; j < per_thread; ++j) {
+                    uint64 key = engine(seed);
+                    if (get(cache, key) != key * 2) ++error;
+                }
+                errors.fetch_add(error);
+            });
+        }
+        auto start = Unix_to_now();
+        for (auto& thread : threads) thread.start();
+        for (auto& thread : threads) thread.join();
+        double ms = (Unix_to_now() - start).to_ms();
+        cout << name << " " << threads_size << " 线程: " << ms << " 毫秒 "
+            << (double) threads_size * per_thread / ms << " 次/毫秒 errors " << errors.load() << endl;
+    }
+
+    void ConcurrentLRUCache_test() {
+        /// 缓存容量大于键的数量时测试命中路径，小于时测试淘汰路径。
+        constexpr uint64 per_thread = 200000;
+        pair<uint64, uint64> cases[] { { 1 << 12, 1 << 14 }, { 1 << 14, 1 << 12 } };
+        for (auto [keys, capacity] : cases) {
+            cout << "keys " << keys << " capacity " << capacity << endl;
+            for (uint32 threads : { 1, 2, 4, 8, 16, 32 }) {
+                {
+                    LRUCache<CacheTestHelper> cache(capacity);
+                    Mutex mutex;
+                    cache_benchmark("LRUCache + Mutex  ", cache, [&mutex] (auto& c, uint64 key) {
+                        Lock l(mutex);
+                        uint64 value = *c.get(key);
+                        c.put(key, false);
+                        return value;
+                    }, threads, keys, per_thread);
+                }
+                {
+                    ConcurrentLRUCache<CacheTestHelper> cache(capacity);
+                    cache_benchmark("ConcurrentLRUCache", cache, [] (auto& c, uint64 key) {
+                        uint64 value = *c.get(key);
+                        c.put(key, (key & 7) == 0);
+                        return value;
+                    }, threads, keys, per_thread);
+                    cache.update_all_with_order(std::less<>());
+                    cout << "need_update_size after update: " << cache.need_update_size()
+                        << " total_size " << cache.total_size() << endl;
+                }
+            }
+        }
+
+        /// 写回不持有分片锁，命中正在写回的节点时需要等待，写回期间值不能被修改。
+        ConcurrentLRUCache<WriteBackHelper> cache;
+        atomic<bool> stop = false;
+        vector<Thread> writers;
+        for (uint32 i = 0; i < 4; ++i) {
+            writers.emplace_back([&cache, &stop, i] {
+                default_random_engine seed(i);
+                uniform_int_distribution<uint64> engine(0, 255);
+                while (!stop.load()) {
+                    uint64 key = engine(seed);
+                    auto value = cache.get(key);
+                    ++*value;
+                    cache.put(key, true);
+                }
+            });
+        }
+        for (auto& writer : writers) writer.start();
+        for (auto end = Unix_to_now() + 500_ms; Unix_to_now() < end;)
+            cache.update_all_with_order(std::less<>());
+        stop = true;
+        for (auto& writer : writers) writer.join();
+        cout << "写回期间被修改的值: " << cache.helper().torn.load() << endl;
+
+        /// 写回失败的节点保持脏标记
+        cache.update_all_with_order(std::less<>());
+        auto value = cache.get(7);
+        ++*value;
+        cache.put(7, true);
+        uint32 dirty = cache.need_update_size();
+        cache.helper().fail_key = 7;
+        bool thrown = false;
+        try {
+            cache.update_all_with_order(std::less<>());
+        } catch (const Exception&) {
+            thrown = true;
+        }
+        cout << "写回抛出异常: " << thrown << ", 之后需要写回 " << cache.need_update_size()
+            << " (之前 " << dirty << ")" << endl;
+        cache.helper().fail_key = MAX_ULLONG;
+        cache.update_all_with_order(std::less<>());
+    }
+
     void timer_test() {
         TimeInterval timeout(1500_ms);
         Timer timer(timeout, [&timer] {
@@ -384,6 +861,697 @@ namespace Test {
         }
     }
 
+    void BPTree_backend_test() {
+        using Tree = BPTree<BPTree_impl<int, int>>;
+        constexpr int total = 1 << 21, lookups = 1 << 17;
+        const char *path = GLOBAL_LOG_PATH "/table_backend";
+        remove(path);
+        {
+            Tree tree(Global_ScheduledThread, BPTree_impl<int, int>::open_file(path, BlockFile::Positional), 1 << 24);
+            for (int i = 0; i < total; ++i)
+                tree.insert(i, i);
+        }
+
+        pair<const char *, BlockFile::Backend> backends[] {
+            { "Stdio     ", BlockFile::Stdio }, { "Positional", BlockFile::Positional },
+            { "Direct    ", BlockFile::Direct }, { "Mmap      ", BlockFile::Mmap }
+        };
+        for (auto [name, backend] : backends) {
+            /// 丢弃文件的页缓存，使每个后端都从冷数据开始（Direct 本身不经过页缓存）。
+            int fd = ::open(path, O_RDONLY);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            ::close(fd);
+
+            /// 缓存只有 256 个块，绝大多数查找都需要读取文件。
+            Tree tree(Global_ScheduledThread, BPTree_impl<int, int>::open_file(path, backend), 1 << 20);
+            default_random_engine seed(0);
+            uniform_int_distribution engine(0, total - 1);
+            uint64 errors = 0;
+            auto start = Unix_to_now();
+            for (int i = 0; i < lookups; ++i) {
+                int key = engine(seed);
+                auto [k, v] = tree.find(key);
+                if (v != key) ++errors;
+            }
+            double ms = (Unix_to_now() - start).to_ms();
+            cout << name << ": " << ms << " 毫秒 " << (double) lookups / ms
+                << " 次/毫秒 errors " << errors << endl;
+        }
+        remove(path);
+    }
+
+    void DurableBPTree_test() {
+        using Durable = DurableBPTree<int, int>;
+        const string path = GLOBAL_LOG_PATH "/table_durable";
+        auto clear = [&path] {
+            remove(path.c_str());
+            remove((path + ".wal").c_str());
+            remove((path + ".wal.dwb").c_str());
+        };
+
+        /// 1. 每次修改都要求持久化时的吞吐：逐块刷盘 / 单线程提交 / 多线程组提交 / 批量提交。
+        constexpr int ops = 2000;
+        clear();
+        {
+            BPTree<BPTree_impl<int, int>> tree(Global_ScheduledThread, path.c_str(), 1 << 22);
+            auto start = Unix_to_now();
+            for (int i = 0; i < ops; ++i) {
+                tree.insert(i, i);
+                tree.impl().flush();
+            }
+            double ms = (Unix_to_now() - start).to_ms();
+            cout << "BPTree + flush      : " << (double) ops / ms << " 次/毫秒" << endl;
+        }
+        for (int threads : { 1, 8 }) {
+            clear();
+            Durable tree(Global_ScheduledThread, path.c_str(), 1 << 22);
+            vector<Thread> workers;
+            for (int t = 0; t < threads; ++t) {
+                workers.emplace_back([&tree, t, threads] {
+                    for (int i = t; i < ops; i += threads)
+                        tree.insert(i, i);
+                });
+            }
+            auto start = Unix_to_now();
+            for (auto& worker : workers) worker.start();
+            for (auto& worker : workers) worker.join();
+            double ms = (Unix_to_now() - start).to_ms();
+            cout << "DurableBPTree " << threads << " 线程: " << (double) ops / ms << " 次/毫秒" << endl;
+        }
+        {
+            clear();
+            Durable tree(Global_ScheduledThread, path.c_str(), 1 << 22);
+            auto start = Unix_to_now();
+            for (int i = 0; i < ops * 100; ++i)
+                tree.insert(i, i, false);
+            tree.sync();
+            double ms = (Unix_to_now() - start).to_ms();
+            cout << "DurableBPTree 批量  : " << (double) ops * 100 / ms << " 次/毫秒" << endl;
+        }
+
+        /// 2. 子进程在写入过程中被 SIGKILL，已确认的修改在重新打开后必须存在。
+        clear();
+        int fds[2];
+        if (pipe(fds) != 0) return;
+        pid_t pid = fork();
+        if (pid == 0) {
+            ::close(fds[0]);
+            ScheduledThread thread(10_ms);
+            /// 较小的日志上限使检查点与后台的原地写回都会发生。
+            Durable tree(thread, path.c_str(), 1 << 20, BlockFile::Stdio, 1 << 16);
+            for (int i = 0;; ++i) {
+                tree.insert(i, i * 3);
+                if (i % 7 == 0) tree.update(i, i * 5);
+                if (write(fds[1], &i, sizeof(i)) != sizeof(i)) _exit(1);
+            }
+        }
+        ::close(fds[1]);
+        int acked = -1, value;
+        auto deadline = Unix_to_now() + TimeInterval(2 * SEC_);
+        while (Unix_to_now() < deadline && read(fds[0], &value, sizeof(value)) == sizeof(value))
+            acked = value;
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        while (read(fds[0], &value, sizeof(value)) == sizeof(value))
+            acked = value;
+        ::close(fds[0]);
+
+        auto count_lost = [&path, acked] {
+            Durable tree(Global_ScheduledThread, path.c_str(), 1 << 22);
+            int lost = 0;
+            for (int i = 0; i <= acked; ++i) {
+                auto [k, v] = tree.find(i);
+                if (v != (i % 7 == 0 ? i * 5 : i * 3)) ++lost;
+            }
+            cout << "acked " << acked + 1 << " replayed " << tree.replayed_records()
+                << " lost " << lost << endl;
+        };
+        count_lost();
+
+        /// 3. 日志末尾的记录头损坏，其中的长度远超文件大小时视为日志结束，不会按该长度分配内存。
+        if (FILE *file = fopen((path + ".wal").c_str(), "ab")) {
+            uint32 garbage[4] = { 0xFFFFFFF0, 0, 1, 0 };
+            fwrite(garbage, sizeof(garbage), 1, file);
+            fclose(file);
+        }
+        count_lost();
+        clear();
+    }
+
+    void BPTree_bulk_load_test() {
+        using Tree = BPTree<BPTree_impl<int, int>>;
+        constexpr int total = 1 << 21;
+        const char *path = GLOBAL_LOG_PATH "/table_bulk_load";
+        vector<pair<int, int>> data(total);
+        for (int i = 0; i < total; ++i)
+            data[i] = { i * 2, i };
+
+        remove(path);
+        {
+            Tree tree(Global_ScheduledThread, path, 1 << 22);
+            auto start = Unix_to_now();
+            for (auto [k, v] : data)
+                tree.insert(k, v);
+            tree.impl().flush();
+            double ms = (Unix_to_now() - start).to_ms();
+            cout << "insert       : " << ms << " 毫秒 " << (double) total / ms << " 次/毫秒" << endl;
+        }
+        {
+            remove(path);
+            Tree tree(Global_ScheduledThread, path, 1 << 22);
+            auto start = Unix_to_now();
+            uint64 inserted = tree.insert_batch(data.begin(), data.end());
+            tree.impl().flush();
+            double ms = (Unix_to_now() - start).to_ms();
+            cout << "insert_batch : " << ms << " 毫秒 " << (double) total / ms << " 次/毫秒" << endl;
+
+            /// 无序的输入与重复的键。
+            vector<pair<int, int>> odd;
+            for (int i = 0; i < total; i += 5)
+                odd.emplace_back(i * 2 + 1, -i);
+            std::shuffle(odd.begin(), odd.end(), mt19937(7));
+            odd.push_back(odd.front());
+            uint64 errors = inserted != total || tree.insert_batch(odd.begin(), odd.end()) != odd.size() - 1;
+            for (int i = 0; i < total; i += 97) {
+                auto [k, v] = tree.find(i * 2);
+                errors += v != i;
+            }
+            for (auto [k, v] : odd) {
+                auto [fk, fv] = tree.find(k);
+                errors += fv != v;
+            }
+            auto [results] = tree.search_from_begin();
+            bool sorted = std::is_sorted(results.begin(), results.end(),
+                                         [] (const Result_Impl<int, int>& l, const Result_Impl<int, int>& r) {
+                                             return l.key < r.key;
+                                         });
+            cout << "insert_batch errors " << errors << " sorted " << sorted << " size " << results.size()
+                << " expect " << total + odd.size() - 1 << endl;
+        }
+        for (double fill : { 1.0, 0.7 }) {
+            remove(path);
+            Tree tree(Global_ScheduledThread, path, 1 << 22);
+            auto start = Unix_to_now();
+            uint64 loaded = tree.bulk_load(data.begin(), data.end(), fill);
+            tree.impl().flush();
+            double ms = (Unix_to_now() - start).to_ms();
+            cout << "bulk_load " << fill << ": " << ms << " 毫秒 " << (double) total / ms << " 次/毫秒 blocks "
+                << tree.impl().file_blocks() << endl;
+
+            /// 载入后的树需要能够正常查找、插入与删除。
+            uint64 errors = loaded != total;
+            for (int i = 0; i < total; i += 97) {
+                auto [k, v] = tree.find(i * 2);
+                if (v != i) ++errors;
+                auto [lk, lv] = tree.lower_bound(i * 2 - 1);
+                if (lk != i * 2) ++errors;
+            }
+            for (int i = 0; i < total; i += 3)
+                errors += !tree.insert(i * 2 + 1, -i);
+            for (int i = 0; i < total; i += 2)
+                errors += !tree.erase(i * 2);
+            auto [results] = tree.search_from_begin();
+            bool sorted = std::is_sorted(results.begin(), results.end(),
+                                         [] (const Result_Impl<int, int>& l, const Result_Impl<int, int>& r) {
+                                             return l.key < r.key;
+                                         });
+            uint64 expect = total - (total + 1) / 2 + (total + 2) / 3;
+            cout << "errors " << errors << " sorted " << sorted << " size " << results.size()
+                << " expect " << expect << endl;
+        }
+        remove(path);
+    }
+
+    void BPTree_cursor_test() {
+        using Tree = BPTree<BPTree_impl<int, int>>;
+        constexpr int total = 1 << 21;
+        const char *path = GLOBAL_LOG_PATH "/table_cursor";
+        remove(path);
+        Tree tree(Global_ScheduledThread, path, 1 << 22);
+        vector<pair<int, int>> data(total);
+        for (int i = 0; i < total; ++i)
+            data[i] = { i * 2, i };
+        tree.bulk_load(data.begin(), data.end());
+
+        uint64 errors = 0;
+        {
+            int expect = 0;
+            for (auto cursor = tree.seek_first(); cursor.valid(); cursor.next(), ++expect)
+                errors += cursor.key() != expect * 2;
+            errors += expect != total;
+            for (auto cursor = tree.seek_last(); cursor.valid(); cursor.prev())
+                errors += cursor.key() != --expect * 2;
+            errors += expect != 0;
+            auto cursor = tree.seek(101);
+            errors += !cursor.valid() || cursor.key() != 102;
+            errors += tree.seek(total * 2).valid();
+        }
+        {
+            /// 扫描的键值数量与结束位置都与 ResultSet 一致。
+            auto [results] = tree.find(1000, 5000);
+            int index = 0;
+            uint64 count = tree.scan(1000, 5000, [] (int, int) { return true; }, [&] (int k, int v) {
+                errors += results[index].key != k || results[index].value != v;
+                return ++index < 100;
+            });
+            errors += count != 100;
+            count = tree.reverse_scan(1000, 5000, [] (int k, int) { return k % 3 == 0; }, [&] (int k, int) {
+                errors += k >= 5000 || k < 1000 || k % 3 != 0;
+                return true;
+            });
+            errors += count != 667;
+        }
+        cout << "errors " << errors << endl;
+
+        /// 全表扫描并过滤：ResultSet 需要复制所有的键值，scan 只复制满足条件的。
+        auto start = Unix_to_now();
+        auto [results] = tree.search_from_begin();
+        uint64 matched = std::count_if(results.begin(), results.end(),
+                                       [] (const Result_Impl<int, int>& r) { return r.value % 100 == 0; });
+        double result_ms = (Unix_to_now() - start).to_ms();
+        start = Unix_to_now();
+        uint64 scanned = tree.scan(0, total * 2, [] (int, int v) { return v % 100 == 0; },
+                                   [] (int, int) { return true; });
+        double scan_ms = (Unix_to_now() - start).to_ms();
+        cout << "ResultSet: " << result_ms << " 毫秒 " << results.size() * sizeof(Result_Impl<int, int>)
+            << " 字节 matched " << matched << endl;
+        cout << "scan     : " << scan_ms << " 毫秒 matched " << scanned << endl;
+        remove(path);
+    }
+
+    void BPTree_search_test() {
+        /// 1. 块内查找：一个装满 (int, int) 的数据块，逐步比较的二分查找与 Interpreter::lower_bound。
+        constexpr uint32 stride = 8, count = (Interpreter::BLOCK_SIZE - 11) / stride, searches = 1 << 24;
+        vector<char> block(Interpreter::BLOCK_SIZE);
+        for (uint32 i = 0; i < count; ++i)
+            *(int *) (block.data() + i * stride) = (int) i * 2;
+        auto scalar = [&block] (int key) {
+            uint32 begin = 0, end = count * stride;
+            for (auto size = (end - begin) / stride; size > 0; size = (end - begin) / stride) {
+                auto mid = begin + (size / 2) * stride;
+                if (*(int *) (block.data() + mid) < key) {
+                    begin = mid + stride;
+                    continue;
+                }
+                end = mid;
+                if (*(int *) (block.data() + mid) == key) break;
+            }
+            return end / stride;
+        };
+        vector<int> keys(1 << 16);
+        default_random_engine seed(0);
+        uniform_int_distribution engine(0, (int) count * 2);
+        for (auto& key : keys) key = engine(seed);
+
+        uint64 check = 0, errors = 0;
+        auto start = Unix_to_now();
+        for (uint32 i = 0; i < searches; ++i)
+            check += scalar(keys[i & (keys.size() - 1)]);
+        double scalar_ms = (Unix_to_now() - start).to_ms();
+        start = Unix_to_now();
+        for (uint32 i = 0; i < searches; ++i)
+            check -= Interpreter::lower_bound(block.data(), count, stride, keys[i & (keys.size() - 1)]);
+        double branchless_ms = (Unix_to_now() - start).to_ms();
+        for (auto key : keys)
+            errors += scalar(key) != Interpreter::lower_bound(block.data(), count, stride, key);
+        cout << "block scalar    : " << searches / scalar_ms << " 次/毫秒" << endl;
+        cout << "block branchless: " << searches / branchless_ms << " 次/毫秒 errors " << errors + (check != 0) << endl;
+
+        /// 2. 整棵树的点查找（所有块都在缓存中）。
+        using Tree = BPTree<BPTree_impl<int, int>>;
+        constexpr int total = 1 << 21, lookups = 1 << 21;
+        const char *path = GLOBAL_LOG_PATH "/table_search";
+        remove(path);
+        Tree tree(Global_ScheduledThread, path, 1 << 26);
+        vector<pair<int, int>> data(total);
+        for (int i = 0; i < total; ++i)
+            data[i] = { i, i };
+        tree.bulk_load(data.begin(), data.end());
+        uniform_int_distribution tree_engine(0, total - 1);
+        errors = 0;
+        start = Unix_to_now();
+        for (int i = 0; i < lookups; ++i) {
+            int key = tree_engine(seed);
+            auto [k, v] = tree.find(key);
+            errors += v != key;
+        }
+        double ms = (Unix_to_now() - start).to_ms();
+        cout << "tree find       : " << lookups / ms << " 次/毫秒 errors " << errors << endl;
+        remove(path);
+    }
+
+    void BPTree_prefetch_test() {
+        using Tree = BPTree<BPTree_impl<int, int>>;
+        constexpr int total = 1 << 23;
+        const char *path = GLOBAL_LOG_PATH "/table_prefetch";
+        remove(path);
+        {
+            Tree tree(Global_ScheduledThread, BPTree_impl<int, int>::open_file(path, BlockFile::Positional), 1 << 24);
+            vector<pair<int, int>> data(total);
+            for (int i = 0; i < total; ++i)
+                data[i] = { i, i };
+            tree.bulk_load(data.begin(), data.end());
+        }
+
+        pair<const char *, BlockFile::Backend> backends[] {
+            { "Positional", BlockFile::Positional }, { "Direct    ", BlockFile::Direct }
+        };
+        for (auto [name, backend] : backends) {
+            for (uint32 depth : { 0, 8, 32 }) {
+                int fd = ::open(path, O_RDONLY);
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                ::close(fd);
+
+                /// 缓存只有 256 个块，全表扫描时每个数据块都需要从文件中读取。
+                Tree tree(Global_ScheduledThread, BPTree_impl<int, int>::open_file(path, backend), 1 << 20);
+                tree.impl().set_prefetch(depth);
+                uint64 errors = 0;
+                int expect = 0;
+                auto start = Unix_to_now();
+                uint64 count = tree.scan(0, total, [] (int, int) { return true; }, [&] (int k, int v) {
+                    errors += k != expect++ || v != k;
+                    return true;
+                });
+                double ms = (Unix_to_now() - start).to_ms();
+                errors += count != total;
+                cout << name << " 预读 " << depth << "\t: " << ms << " 毫秒 "
+                    << (double) tree.impl().file_blocks() * Interpreter::BLOCK_SIZE / 1024 / ms
+                    << " MB/s errors " << errors << endl;
+            }
+        }
+        remove(path);
+    }
+
+    void BPTree_compact_test() {
+        using Tree = ConcurrentBPTree<BPTree_impl<int, int>>;
+        constexpr int total = 1 << 21, keep = total / 10, lookups = 1 << 16;
+        const char *path = GLOBAL_LOG_PATH "/table_compact";
+        remove(path);
+        auto check = [] (Tree& tree, int from, int to) {
+            uint64 errors = 0;
+            int expect = from;
+            tree.scan(from, to, [] (int, int) { return true; }, [&] (int k, int v) {
+                errors += k != expect++ || v != k;
+                return true;
+            });
+            return errors + (expect != to);
+        };
+        {
+            Tree tree(Global_ScheduledThread, path, 1 << 22);
+            for (int i = 0; i < total; ++i)
+                tree.insert(i, i);
+            /// 与删除最旧的日志文件相同，删除最早插入的 90% 的键，剩余的节点都位于文件尾部。
+            tree.erase(0, total - keep);
+            uint64 before = tree.read([] (auto& t) { return t.impl().file_blocks(); });
+
+            /// 每次最多处理 64 个块，记录每次的耗时（前台操作最多等待这么久）。
+            uint32 steps = 0, processed = 0;
+            double max_ms = 0;
+            auto start = Unix_to_now();
+            for (uint32 n = 1; n > 0; ++steps) {
+                auto step_start = Unix_to_now();
+                n = tree.compact(64);
+                processed += n;
+                max_ms = std::max(max_ms, (Unix_to_now() - step_start).to_ms());
+            }
+            double ms = (Unix_to_now() - start).to_ms();
+            uint64 after = tree.read([] (auto& t) { return t.impl().file_blocks(); });
+            cout << "compact: " << before << " -> " << after << " 块, 处理 " << processed << " 个块, "
+                << steps << " 次共 " << ms << " 毫秒, 单次最多 " << max_ms << " 毫秒 errors "
+                << check(tree, total - keep, total) << endl;
+
+            /// 整理之后继续插入。
+            for (int i = 0; i < keep; ++i)
+                tree.insert(i, i);
+            tree.write([] (auto& t) { t.impl().flush(); return 0; });
+            cout << "reinsert: " << tree.read([] (auto& t) { return t.impl().file_blocks(); }) << " 块" << endl;
+        }
+        {
+            /// 重新打开之后数据与空闲块链表完整。
+            Tree tree(Global_ScheduledThread, path, 1 << 22);
+            cout << "reopen errors " << check(tree, 0, keep) + check(tree, total - keep, total) << endl;
+            tree.erase(total - keep, total);
+        }
+        {
+            /// 剩余的节点又都位于文件尾部，在 ScheduledThread 上整理的同时进行查找。
+            Tree tree(Global_ScheduledThread, path, 1 << 22);
+            uint64 before = tree.read([] (auto& t) { return t.impl().file_blocks(); });
+            auto compactor = BPTreeCompactor::start(Global_ScheduledThread, [&tree] (uint32 n) {
+                return tree.compact(n);
+            }, 256);
+            default_random_engine seed(0);
+            uniform_int_distribution engine(0, keep - 1);
+            uint64 errors = 0;
+            double max_us = 0;
+            auto start = Unix_to_now();
+            for (int i = 0; i < lookups; ++i) {
+                int key = engine(seed);
+                auto lookup_start = Unix_to_now();
+                errors += tree.find(key).value != key;
+                max_us = std::max(max_us, (Unix_to_now() - lookup_start).to_us());
+            }
+            while (tree.read([] (auto& t) { return t.impl().file_blocks() > t.impl().live_blocks(); })
+                   && (Unix_to_now() - start).to_ms() < 60000)
+                this_thread::sleep_for(100ms);
+            compactor->stop();
+            cout << "BPTreeCompactor: " << before << " -> " << tree.read([] (auto& t) { return t.impl().file_blocks(); })
+                << " 块, 处理 " << compactor->processed_blocks() << " 个块, 查找最长 " << max_us
+                << " 微秒 errors " << errors + check(tree, 0, keep) << endl;
+        }
+        remove(path);
+    }
+
+    void BPTree_snapshot_test() {
+        using Tree = ConcurrentBPTree<BPTree_impl<int, int>>;
+        constexpr int total = 1 << 20;
+        const char *path = GLOBAL_LOG_PATH "/table_snapshot";
+        remove(path);
+        Tree tree(Global_ScheduledThread, path, 1 << 24);
+        for (int i = 0; i < total; i += 2)
+            tree.insert(i, i);
+
+        /// 快照中只有偶数键，值与键相同。
+        auto check = [&] (const auto& snapshot) {
+            return tree.read(snapshot, [&] (auto& t) {
+                uint64 errors = 0;
+                int expect = 0;
+                t.scan(0, total, [] (int, int) { return true; }, [&] (int k, int v) {
+                    errors += k != expect || v != k;
+                    expect += 2;
+                    return true;
+                });
+                return errors + (expect != total) + (t.find(total / 2).value != total / 2);
+            });
+        };
+
+        auto snapshot = tree.snapshot();
+        /// 写线程插入奇数键、删除 3 的倍数并修改其余的值，节点会分裂、合并并被重新使用；
+        /// 同时在快照上反复完整扫描。
+        atomic<bool> writing = true;
+        double write_ms = 0;
+        Thread writer(string("snapshot_writer"), [&] {
+            auto start = Unix_to_now();
+            for (int i = 1; i < total; i += 2)
+                tree.insert(i, i);
+            for (int i = 0; i < total; i += 3)
+                tree.erase(i);
+            for (int i = 1; i < total; i += 3)
+                tree.update(i, -i);
+            write_ms = (Unix_to_now() - start).to_ms();
+            writing = false;
+        });
+        writer.start();
+        uint64 errors = 0, scans = 0;
+        double max_ms = 0;
+        while (writing) {
+            auto start = Unix_to_now();
+            errors += check(snapshot);
+            max_ms = std::max(max_ms, (Unix_to_now() - start).to_ms());
+            ++scans;
+        }
+        writer.join();
+        errors += check(snapshot);
+        cout << "写入 " << write_ms << " 毫秒, 同时在快照上扫描 " << scans << " 次, 单次最长 "
+            << max_ms << " 毫秒 errors " << errors << endl;
+
+        /// 有快照时 compact 只移动节点，不截断文件。
+        auto newer = tree.snapshot();
+        uint64 blocks = tree.read([] (auto& t) { return t.impl().file_blocks(); });
+        tree.erase(0, total / 2);
+        tree.compact();
+        uint64 errors2 = check(snapshot);
+        errors2 += tree.read(newer, [&] (auto& t) {
+            auto [results] = t.find(0, total);
+            uint64 errors = 0;
+            for (auto [k, v] : results)
+                errors += k % 3 == 0 || v != (k % 3 == 1 ? -k : k);
+            return errors + (results.size() != total - (total + 2) / 3);
+        });
+        snapshot.release();
+        newer.release();
+        tree.compact();
+        tree.write([] (auto& t) { t.impl().flush(); return 0; });
+        cout << "compact: " << blocks << " -> " << tree.read([] (auto& t) { return t.impl().file_blocks(); })
+            << " 块 errors " << errors2 << endl;
+        remove(path);
+    }
+
+    void ConcurrentBPTree_test() {
+        using Impl = BPTree_impl<int, int>;
+        constexpr int total = 1 << 20, ops = 1 << 17;
+        const char *path = GLOBAL_LOG_PATH "/table_concurrent";
+
+        /// 90% 的操作为点查找、lower_bound 与短范围查找，10% 为更新。
+        auto workload = [] (auto& tree, int t) {
+            default_random_engine seed(t);
+            uniform_int_distribution engine(0, total - 1);
+            uint64 errors = 0;
+            for (int i = 0; i < ops; ++i) {
+                int key = engine(seed), choice = i % 10;
+                if (choice == 0) {
+                    tree.update(key, key);
+                } else if (choice < 7) {
+                    auto [k, v] = tree.find(key);
+                    if (k != key) ++errors;
+                } else if (choice < 9) {
+                    auto [k, v] = tree.lower_bound(key);
+                    if (k != key) ++errors;
+                } else {
+                    auto [results] = tree.find(key, key + 16);
+                    if (results.empty()) ++errors;
+                }
+            }
+            return errors;
+        };
+
+        auto run = [&] (const char *name, int threads, auto& tree) {
+            vector<Thread> workers;
+            atomic<uint64> errors = 0;
+            for (int t = 0; t < threads; ++t) {
+                workers.emplace_back([&, t] {
+                    errors += workload(tree, t);
+                });
+            }
+            auto start = Unix_to_now();
+            for (auto& worker : workers) worker.start();
+            for (auto& worker : workers) worker.join();
+            double ms = (Unix_to_now() - start).to_ms();
+            cout << name << threads << " 线程: " << (double) ops * threads / ms
+                << " 次/毫秒 errors " << errors << endl;
+        };
+
+        remove(path);
+        {
+            BPTree<Impl> tree(Global_ScheduledThread, path, 1 << 26);
+            for (int i = 0; i < total; ++i)
+                tree.insert(i, i);
+        }
+        for (int threads : { 1, 2, 4, 8 }) {
+            BPTree<Impl> tree(Global_ScheduledThread, path, 1 << 26);
+            Mutex mutex;
+            /// 对照组：整棵树由一把互斥锁保护。
+            struct Locked {
+                BPTree<Impl>& tree;
+                Mutex& mutex;
+
+                auto find(int key) {
+                    Lock l(mutex);
+                    return tree.find(key);
+                };
+
+                auto lower_bound(int key) {
+                    Lock l(mutex);
+                    return tree.lower_bound(key);
+                };
+
+                auto find(int begin, int end) {
+                    Lock l(mutex);
+                    return tree.find(begin, end);
+                };
+
+                void update(int key, int value) {
+                    Lock l(mutex);
+                    tree.update(key, value);
+                };
+            } locked { tree, mutex };
+            run("BPTree + Mutex    ", threads, locked);
+        }
+        for (int threads : { 1, 2, 4, 8 }) {
+            ConcurrentBPTree<Impl> tree(Global_ScheduledThread, path, 1 << 26);
+            run("ConcurrentBPTree  ", threads, tree);
+        }
+        remove(path);
+
+        /// 每个线程只修改自己的键（key % threads == t），各线程的键交错分布在同一批数据块中，
+        /// 插入与删除不断引起分裂与合并，同时进行点查找与范围查找。结束后与每个线程记录的键值比较。
+        constexpr int mixed_keys = 1 << 18, mixed_ops = 1 << 16;
+        for (int threads : { 1, 2, 4, 8 }) {
+            ConcurrentBPTree<Impl> tree(Global_ScheduledThread, path, 1 << 24);
+            vector<map<int, int>> expect(threads);
+            vector<pair<int, int>> initial;
+            for (int key = 1; key <= mixed_keys; key += 2) {
+                initial.emplace_back(key, key);
+                expect[(key - 1) % threads].emplace(key, key);
+            }
+            tree.insert_batch(initial.begin(), initial.end());
+
+            atomic<uint64> errors = 0;
+            vector<Thread> workers;
+            for (int t = 0; t < threads; ++t) {
+                workers.emplace_back([&, t] {
+                    default_random_engine seed(t);
+                    uniform_int_distribution engine(0, mixed_keys / threads - 1);
+                    auto& mine = expect[t];
+                    uint64 error = 0;
+                    for (int i = 0; i < mixed_ops; ++i) {
+                        int key = engine(seed) * threads + t + 1, choice = i % 8;
+                        auto iter = mine.find(key);
+                        bool exists = iter != mine.end();
+                        if (choice < 2) {
+                            error += tree.insert(key, key) == exists;
+                            mine.emplace(key, key);
+                        } else if (choice < 4) {
+                            error += tree.erase(key) != exists;
+                            if (exists) mine.erase(iter);
+                        } else if (choice == 4) {
+                            error += tree.update(key, -key) != exists;
+                            if (exists) iter->second = -key;
+                        } else if (choice < 7) {
+                            auto [k, v] = tree.find(key);
+                            error += exists ? k != key || v != iter->second : k == key;
+                        } else {
+                            auto [results] = tree.find(key, key + 64);
+                            for (uint64 j = 0; j < results.size(); ++j) {
+                                error += results[j].key < key || results[j].key >= key + 64
+                                    || (j > 0 && results[j].key <= results[j - 1].key);
+                            }
+                        }
+                    }
+                    errors += error;
+                });
+            }
+            auto start = Unix_to_now();
+            for (auto& worker : workers) worker.start();
+            for (auto& worker : workers) worker.join();
+            double ms = (Unix_to_now() - start).to_ms();
+
+            map<int, int> all;
+            for (auto& mine : expect) all.insert(mine.begin(), mine.end());
+            auto expect_iter = all.begin();
+            uint64 scanned = tree.scan(0, mixed_keys + 1, [] (int, int) { return true; }, [&] (int k, int v) {
+                errors += expect_iter == all.end() || expect_iter->first != k || expect_iter->second != v;
+                if (expect_iter != all.end()) ++expect_iter;
+                return true;
+            });
+            uint64 reversed = tree.reverse_scan(0, mixed_keys + 1, [] (int, int) { return true; },
+                                                [] (int, int) { return true; });
+            errors += scanned != all.size() || reversed != all.size();
+            cout << "ConcurrentBPTree 混合读写 " << threads << " 线程: " << (double) mixed_ops * threads / ms
+                << " 次/毫秒 键 " << all.size() << " errors " << errors << endl;
+            remove(path);
+        }
+    }
+
     void BPTree_test() {
         BPTree<BPTree_impl<int, int>> tree(Global_ScheduledThread,
                                            GLOBAL_LOG_PATH "/table_int_int",
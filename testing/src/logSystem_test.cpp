@@ -4,18 +4,33 @@
 
 #include "../logSystem_test.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <memory>
+#include <random>
+#include <set>
+#include <tuple>
+#include <unordered_set>
 #include <vector>
+#include <sys/stat.h>
 #include <tinyBackend/Base/GlobalObject.hpp>
 #include <tinyBackend/Base/Thread.hpp>
+#include <tinyBackend/Base/WorkStealingPool.hpp>
 #include <tinyBackend/Base/Time/TimeInterval.hpp>
+#include <tinyBackend/Base/Detail/FileDir.hpp>
+#include <tinyBackend/Base/Detail/oFile.hpp>
+#include <tinyBackend/Base/BPTree_impls/BPTree.hpp>
+#include <tinyBackend/Base/BPTree_impls/BPTree_impl.hpp>
+#include <tinyBackend/Base/BPTree_impls/PackedTable.hpp>
 #include <tinyBackend/LogSystem/linkLog/Identification.hpp>
 #include <tinyBackend/LogSystem/linkLog/LinkLogCenter.hpp>
 #include <tinyBackend/LogSystem/linkLog/LinkLogger.hpp>
 #include <tinyBackend/LogSystem/linkLog/LinkLogHandler.hpp>
+#include <tinyBackend/LogSystem/linkLog/LinkLogInterpreter.hpp>
 #include <tinyBackend/LogSystem/linkLog/LinkLogOperation.hpp>
 #include <tinyBackend/LogSystem/linkLog/LinkLogServer.hpp>
+#include <tinyBackend/LogSystem/linkLog/LinkTraceSampler.hpp>
 #include <tinyBackend/Net/InetAddress.hpp>
 #include <tinyBackend/Net/error/error_mark.hpp>
 
@@ -375,4 +390,827 @@ namespace Test {
 
     }
 
+
+    /// 比较 LinkLogStorage 的两种索引以 BPTree（逐个插入 / bulk_load）与 PackedTable 保存时的层数、文件大小与查找延迟。
+    template <typename Key, typename Value>
+    static void packed_table_report(const char *name, vector<pair<Key, Value>>& data) {
+        sort(data.begin(), data.end(), [] (const auto& l, const auto& r) { return l.first < r.first; });
+        data.erase(unique(data.begin(), data.end(), [] (const auto& l, const auto& r) {
+            return l.first == r.first;
+        }), data.end());
+        const string tree_path = string(GLOBAL_LOG_PATH "/packed_tree_") + name,
+                     packed_path = string(GLOBAL_LOG_PATH "/packed_table_") + name;
+        constexpr int lookups = 1 << 16;
+        default_random_engine seed(0);
+        uniform_int_distribution<size_t> engine(0, data.size() - 1);
+        vector<size_t> targets(lookups);
+        for (auto& target : targets) target = engine(seed);
+
+        cout << name << ": " << data.size() << " 条" << endl;
+        for (bool bulk : { false, true }) {
+            remove(tree_path.c_str());
+            BPTree<BPTree_impl<Key, Value>> tree(Global_ScheduledThread, tree_path.c_str(), 1 << 22);
+            auto start = Unix_to_now();
+            if (bulk) tree.bulk_load(data.begin(), data.end());
+            else for (auto& [k, v] : data) tree.insert(k, v);
+            tree.impl().flush();
+            double build_ms = (Unix_to_now() - start).to_ms();
+            uint64 errors = 0;
+            start = Unix_to_now();
+            for (auto target : targets) {
+                auto [k, v] = tree.find(data[target].first);
+                errors += !(k == data[target].first);
+            }
+            double find_us = (Unix_to_now() - start).to_us() / lookups;
+            cout << (bulk ? "  BPTree bulk_load: " : "  BPTree insert   : ") << "构建 " << build_ms
+                << " 毫秒 层数 " << tree.height() << " 文件 " << tree.impl().file_blocks() * Interpreter::BLOCK_SIZE
+                << " 字节 查找 " << find_us << " 微秒 errors " << errors << endl;
+        }
+        remove(tree_path.c_str());
+
+        auto start = Unix_to_now();
+        PackedTable<Key, Value>::build(packed_path, data.begin(), data.end());
+        double build_ms = (Unix_to_now() - start).to_ms();
+        PackedTable<Key, Value> table(packed_path);
+        uint64 errors = table.size() != data.size();
+        start = Unix_to_now();
+        for (auto target : targets) {
+            auto [k, v] = table.find(data[target].first);
+            errors += !(k == data[target].first);
+        }
+        double find_us = (Unix_to_now() - start).to_us() / lookups;
+        uint64 scanned = 0;
+        for (auto cursor = table.seek_first(); cursor.valid(); cursor.next())
+            errors += !(cursor.key() == data[scanned++].first);
+        if (data.size() > 2) {
+            /// 复制后原 Cursor 被销毁，副本需要能继续扫描。
+            auto copy = [&table, &data] {
+                auto cursor = table.seek(data[1].first);
+                return decltype(cursor)(cursor);
+            }();
+            copy.next();
+            errors += !(copy.valid() && copy.key() == data[2].first);
+            vector<pair<Key, Value>> unsorted { data[1], data[0] };
+            try {
+                PackedTable<Key, Value>::build(packed_path + ".bad", unsorted.begin(), unsorted.end());
+                ++errors;
+            } catch (const BPTreeRuntimeError&) {}
+            remove((packed_path + ".bad").c_str());
+        }
+        cout << "  PackedTable     : 构建 " << build_ms << " 毫秒 层数 2 (" << table.blocks() << " 块) 文件 "
+            << table.file_size() << " 字节 查找 " << find_us << " 微秒 errors " << errors + (scanned != data.size())
+            << endl;
+        remove(packed_path.c_str());
+    }
+
+    void packed_table_test() {
+        constexpr int services = 8, nodes_per_service = 1 << 16;
+        default_random_engine seed(1);
+        uniform_int_distribution<int64> jitter(0, 2 * MS_);
+        vector<pair<Index_Key, Index_Value>> link_index;
+        vector<pair<TimeInterval, uint32>> filenames;
+        TimeInterval now = Unix_to_now();
+        for (int s = 0; s < services; ++s) {
+            TimeInterval time = now;
+            for (int n = 0; n < nodes_per_service; ++n) {
+                time = TimeInterval(time.nanoseconds + jitter(seed));
+                LinkNodeID node = get_node_id(n / 100 % 100, n % 100);
+                LinkNodeID parent = get_node_id(n / 200 % 100, n / 2 % 100);
+                link_index.emplace_back(Index_Key(get_service_id(s, n / 10000), time, node),
+                                        Index_Value(time, parent, Fork, TimeInterval(now.nanoseconds + n / 1000 * SEC_),
+                                                    n % 4096));
+            }
+        }
+        for (int i = 0; i < services * nodes_per_service; ++i)
+            filenames.emplace_back(TimeInterval(now.nanoseconds + i * 10 * SEC_ + jitter(seed)), i);
+        packed_table_report("link_index", link_index);
+        packed_table_report("filename", filenames);
+    }
+
+    /// 清空目录中的文件，目录不存在时创建。
+    static void reset_dictionary(const string& path) {
+        mkdir(path.c_str(), 0755);
+        DirentArray array(path.c_str());
+        for (int i = 0; i < array.size(); ++i) {
+            if (array[i]->d_name[0] == '.') continue;
+            remove((path + '/' + array[i]->d_name).c_str());
+        }
+    }
+
+    /// 日志内容为 "log <i> ..."，时间为节点创建时间之后 i * 10 微秒，用于检查解码结果。
+    static bool check_format_log(const Link_Log& log) {
+        uint64 i = strtoull(log.text.c_str() + 4, nullptr, 10);
+        return log.rank == INFO && log.time.nanoseconds == log.node_init_time.nanoseconds + (int64) i * 10 * US_;
+    }
+
+    class FormatReplay : public LinkLogReplayHandler {
+    public:
+        uint64 logs = 0, errors = 0;
+
+        void create_head_logger(LinkServiceID, LinkNodeID, TimeInterval) override {};
+
+        void register_logger(LinkServiceID, LinkNodeID, LinkNodeID, LinkNodeType,
+                             TimeInterval, TimeInterval) override {};
+
+        void create_logger(LinkServiceID, LinkNodeID, TimeInterval) override {};
+
+        void logger_end(LinkServiceID, LinkNodeID, TimeInterval) override {};
+
+        void receive_log(Link_Log log) override {
+            ++logs;
+            errors += !check_format_log(log);
+        };
+
+        void handling_error(LinkServiceID, LinkNodeID, TimeInterval, LinkErrorType) override {};
+    };
+
+    /// 并行回放时在多个线程上调用，只通过视图检查日志，不复制正文。
+    class FormatViewReplay : public LinkLogReplayHandler {
+    public:
+        std::atomic<uint64> logs { 0 }, errors { 0 };
+
+        TimeInterval begin;
+
+        void create_head_logger(LinkServiceID, LinkNodeID, TimeInterval) override {};
+
+        void register_logger(LinkServiceID, LinkNodeID, LinkNodeID, LinkNodeType,
+                             TimeInterval, TimeInterval) override {};
+
+        void create_logger(LinkServiceID, LinkNodeID, TimeInterval) override {};
+
+        void logger_end(LinkServiceID, LinkNodeID, TimeInterval) override {};
+
+        void receive_log(Link_Log) override { ++errors; };
+
+        void receive_log_view(const Link_Log_View& log) override {
+            uint64 i = strtoull(log.text.data() + 4, nullptr, 10);
+            ++logs;
+            errors += log.time < begin
+                || log.time.nanoseconds != log.node_init_time.nanoseconds + (int64) i * 10 * US_;
+        };
+
+        void handling_error(LinkServiceID, LinkNodeID, TimeInterval, LinkErrorType) override {};
+    };
+
+    class FormatSearch : public LinkLogSearchHandler {
+    public:
+        uint64 logs = 0, errors = 0;
+
+        TimeInterval last;
+
+        void receive_log(Link_Log log) override {
+            /// 单个文件内按时间排序
+            errors += !check_format_log(log) || log.time < last;
+            last = log.time;
+            ++logs;
+        };
+
+        bool node_filter(Index_Key, Index_Value) override { return true; };
+    };
+
+    /// 比较完整日志头（v1）与节点句柄加时间差（v2）两种格式每条日志的字节数，压缩后 center 文件的大小，
+    /// 以及 center 解码、保存、查询单个节点与全部节点的速度。
+    void link_log_format_test() {
+        constexpr int nodes = 256, logs = 1 << 18;
+        const string dic(GLOBAL_LOG_PATH "/link_log_format");
+        reset_dictionary(dic);
+
+        LinkServiceID service = get_service_id(0, 0);
+        TimeInterval now = Unix_to_now();
+        vector<Index_Key> keys;
+        for (int n = 0; n < nodes; ++n)
+            keys.emplace_back(service, TimeInterval(now.nanoseconds + n * US_), get_node_id(n / 100, n % 100));
+
+        string buffer(logs * (sizeof(Link_Log_Header) + 64), '\0');
+        uint32 v1_size = 0;
+        for (int i = 0; i < logs; ++i) {
+            auto& key = keys[i % nodes];
+            string text = "log " + to_string(i) + " handled request from " + to_string(i * 7 % 1000);
+            v1_size += LinkLogEncoder::write_log(key.service(), key.init_time(), key.node(),
+                                                 TimeInterval(key.init_time().nanoseconds + i * 10 * US_),
+                                                 INFO, text.data(), text.size(), buffer.data() + v1_size);
+        }
+        string v1(buffer.data(), v1_size);
+
+        LinkLogEncoder encoder(dic);
+        auto start = Unix_to_now();
+        uint32 v2_size = encoder.encode_for_center(buffer.data(), v1_size);
+        double encode_ms = (Unix_to_now() - start).to_ms();
+
+        uint64 stored = 0, errors = 0;
+        double ingest_ms;
+        {
+            LinkLogStorage storage(dic, Global_ScheduledThread);
+            for (auto& key : keys)
+                storage.create_logger(key.service(), key.node(), key.init_time());
+
+            /// 与 LinkLogCenter::handle_read 相同：按 Node_Define 维护句柄，解码 CompactLog 后保存。
+            start = Unix_to_now();
+            vector<Index_Key> handles;
+            uint64 received = 0;
+            const char *ptr = buffer.data(), *end = ptr + v2_size;
+            while (ptr < end) {
+                if (*ptr == NodeDefine) {
+                    Node_Define define;
+                    std::memcpy(&define, ptr, sizeof(Node_Define));
+                    if (define.handle() >= handles.size()) handles.resize(define.handle() + 1);
+                    handles[define.handle()] = define.key();
+                    ptr += sizeof(Node_Define);
+                    continue;
+                }
+                Compact_Log log;
+                uint32 header_size = log.decode(ptr, end);
+                if (header_size == 0 || log.handle >= handles.size()) {
+                    ++errors;
+                    break;
+                }
+                auto& key = handles[log.handle];
+                storage.add_log(key, TimeInterval(key.init_time().nanoseconds + log.time_delta.nanoseconds),
+                                log.rank, ptr + header_size, log.log_size);
+                ptr += header_size + log.log_size;
+                if (++received % 1024 == 0)
+                    storage.write_to_file();
+            }
+            storage.write_to_file();
+            ingest_ms = (Unix_to_now() - start).to_ms();
+
+            auto point = storage.get_query_set(service);
+            vector<char> result(1 << 16);
+            uint64 found = 0;
+            start = Unix_to_now();
+            while (point) {
+                auto [written, next] = storage.query(result.data(), result.size(), point);
+                point = next;
+                for (uint32 offset = 0; offset < written;) {
+                    auto header = reinterpret_cast<Link_Log_Header *>(result.data() + offset);
+                    Link_Log log(*header, string(result.data() + offset + sizeof(Link_Log_Header),
+                                                 header->log_size()));
+                    errors += !check_format_log(log);
+                    offset += sizeof(Link_Log_Header) + header->log_size();
+                    ++found;
+                }
+            }
+            cout << "查询 " << found << " 条 " << (Unix_to_now() - start).to_ms() << " 毫秒" << endl;
+            errors += found != logs;
+
+            /// 单个节点的日志分散在各个帧中，每条日志只需要解压所在的帧。
+            start = Unix_to_now();
+            for (int n = 0; n < 16; ++n) {
+                const Index_Key& target = keys[n * 37 % nodes];
+                point = storage.get_query_set(service, [&target] (const Index_Key& key, const Index_Value&) {
+                    return key == target;
+                });
+                found = 0;
+                while (point) {
+                    auto [written, next] = storage.query(result.data(), result.size(), point);
+                    point = next;
+                    for (uint32 offset = 0; offset < written; ++found) {
+                        auto header = reinterpret_cast<Link_Log_Header *>(result.data() + offset);
+                        offset += sizeof(Link_Log_Header) + header->log_size();
+                    }
+                }
+                errors += found != logs / nodes;
+            }
+            cout << "查询单个节点 " << logs / nodes << " 条平均 " << (Unix_to_now() - start).to_ms() / 16
+                << " 毫秒" << endl;
+        }
+
+        uint64 raw_stored = 0;
+        DirentArray files(dic.c_str(), [] (const dirent *entry) {
+            string name(entry->d_name);
+            return (int) (name.find(".link_log") != string::npos || name.find(".link_frames") != string::npos);
+        });
+        for (int i = 0; i < files.size(); ++i) {
+            string path = dic + '/' + files[i]->d_name;
+            iFile file(path.c_str(), true);
+            file.seek_end(0);
+            stored += file.pos();
+            if (path.find(".link_frames") != string::npos) continue;
+            /// 解压之后的大小
+            LinkLogFileReader reader(path.c_str());
+            RingBuffer ring(1 << 16);
+            int64 read;
+            while ((read = reader.read(ring)) > 0) {
+                raw_stored += read;
+                ring.read_advance(read);
+            }
+        }
+
+        cout << "v1 每条日志 " << (double) v1_size / logs << " 字节, 发送格式 v2 每条日志 "
+            << (double) v2_size / logs << " 字节 (转换 " << encode_ms << " 毫秒), center 文件每条日志 "
+            << (double) stored / logs << " 字节 (压缩前 " << (double) raw_stored / logs << " 字节)" << endl;
+        cout << "center 解码并保存 " << logs / ingest_ms * 1000 << " 条/秒" << endl;
+
+        {
+            LinkLogCenter center(make_shared<CenterHandler>(), dic, Global_ScheduledThread);
+            FormatSearch serial;
+            start = Unix_to_now();
+            center.search_link(service, serial);
+            cout << "search_link 逐条查找 " << serial.logs << " 条 " << (Unix_to_now() - start).to_ms()
+                << " 毫秒" << endl;
+            errors += serial.logs != logs;
+
+            WorkStealingPool pool(4);
+            FormatSearch parallel;
+            start = Unix_to_now();
+            uint64 found = center.search_link(pool, service, parallel);
+            cout << "search_link 并行扫描 " << found << " 条 " << (Unix_to_now() - start).to_ms()
+                << " 毫秒" << endl;
+            errors += found != logs || parallel.logs != logs || parallel.errors;
+
+            FormatSearch limited;
+            errors += center.search_link(pool, service, limited, 1000) != 1000 || limited.logs != 1000;
+
+            FormatViewReplay all;
+            start = Unix_to_now();
+            center.replay_history(pool, all, TimeInterval(0));
+            cout << "并行回放 " << all.logs << " 条 " << (Unix_to_now() - start).to_ms() << " 毫秒" << endl;
+            errors += all.logs != logs || all.errors;
+
+            /// 从中间的时间开始回放，只应收到不早于该时间的日志。
+            FormatViewReplay half;
+            half.begin = TimeInterval(now.nanoseconds + (int64) logs / 2 * 10 * US_);
+            uint64 expect = 0;
+            for (int i = 0; i < logs; ++i)
+                expect += !(keys[i % nodes].init_time().nanoseconds + i * 10 * US_ < half.begin.nanoseconds);
+            center.replay_history(pool, half, half.begin);
+            cout << "从中间时间回放 " << half.logs << " 条, 应为 " << expect << " 条" << endl;
+            errors += half.logs != expect || half.errors;
+        }
+
+        DirentArray array(dic.c_str(), [] (const dirent *entry) {
+            string name(entry->d_name);
+            return (int) (name.size() > 9 && name.substr(name.size() - 9) == ".link_log");
+        });
+        for (int i = 0; i < array.size(); ++i) {
+            FormatReplay replay;
+            start = Unix_to_now();
+            LinkLogCenter::replay_history(replay, (dic + '/' + array[i]->d_name).c_str());
+            cout << "回放 v2 文件 " << replay.logs << " 条 " << (Unix_to_now() - start).to_ms() << " 毫秒" << endl;
+            errors += replay.logs != logs || replay.errors;
+        }
+
+        string v1_path = dic + "/v1.record";
+        {
+            oFile file(v1_path.c_str(), false, true);
+            file.write(v1.data(), v1.size());
+        }
+        FormatReplay replay;
+        LinkLogCenter::replay_history(replay, v1_path.c_str());
+        cout << "回放 v1 文件 " << replay.logs << " 条" << endl;
+        errors += replay.logs != logs || replay.errors;
+
+        /// 帧的数据或大小字段被破坏之后读取应当报错，而不是解压出错误的记录或按损坏的大小分配内存。
+        if (array.size() > 0) {
+            string content = iFile((dic + '/' + array[0]->d_name).c_str(), true).getAll();
+            string corrupt_path = dic + "/corrupt.data";
+            auto corrupt_read = [&] (uint64 offset, char value) {
+                string data = content;
+                data[offset] = value;
+                {
+                    oFile file(corrupt_path.c_str(), false, true);
+                    file.write(data.data(), data.size());
+                }
+                LinkLogFileReader reader(corrupt_path.c_str());
+                RingBuffer ring(1 << 16);
+                int64 read;
+                while ((read = reader.read(ring)) > 0)
+                    ring.read_advance(read);
+                return read;
+            };
+            /// 第一帧的数据从文件头与帧头之后开始，帧头中 raw_size 的最高字节位于偏移 4
+            constexpr uint64 frame = sizeof(LinkLogStorage::LOG_FILE_MAGIC), data = frame + Log_Frame_Header::size;
+            int64 bad_data = corrupt_read(data + 1, (char) ~content[data + 1]);
+            int64 bad_size = corrupt_read(frame + 4, (char) 0x7F);
+            cout << "损坏的帧数据读取返回 " << bad_data << ", 损坏的帧大小读取返回 " << bad_size << endl;
+            errors += bad_data != -1 || bad_size != -1;
+            remove(corrupt_path.c_str());
+        }
+        cout << "errors " << errors << endl;
+        reset_dictionary(dic);
+    }
+
+    /// 统计 query 返回的日志中满足 pred 的数量。
+    template <typename Pred>
+    static uint64 count_query(LinkLogStorage& storage, LinkLogStorage::QuerySet *point, Pred pred) {
+        vector<char> result(1 << 16);
+        uint64 found = 0;
+        while (point) {
+            auto [written, next] = storage.query(result.data(), result.size(), point);
+            point = next;
+            for (uint32 offset = 0; offset < written;) {
+                auto header = reinterpret_cast<Link_Log_Header *>(result.data() + offset);
+                found += pred(*header);
+                offset += sizeof(Link_Log_Header) + header->log_size();
+            }
+        }
+        return found;
+    }
+
+    /// 比较通过等级索引、持续时间索引查找与逐个服务读取全部日志再过滤的速度。
+    void link_log_index_test() {
+        constexpr int services = 16, nodes = 4096, logs = 1 << 20;
+        const string dic(GLOBAL_LOG_PATH "/link_log_index");
+        reset_dictionary(dic);
+
+        TimeInterval now = Unix_to_now();
+        vector<Index_Key> keys;
+        for (int n = 0; n < nodes; ++n)
+            keys.emplace_back(get_service_id(n % services, 0), TimeInterval(now.nanoseconds + n * US_),
+                              get_node_id(n / 100, n % 100));
+        auto rank_of = [] (int i) {
+            return i % 997 == 0 ? ERROR : i % 101 == 0 ? WARN : INFO;
+        };
+        auto time_of = [&now] (int i) {
+            return TimeInterval(now.nanoseconds + 10 * MS_ + (int64) i * 10 * US_);
+        };
+        /// 查找第 2 秒到第 4 秒之间的 ERROR 日志，以及持续时间不少于 95 毫秒的节点的日志
+        TimeInterval begin(now.nanoseconds + 2 * SEC_), end(now.nanoseconds + 4 * SEC_);
+        TimeInterval slow(95 * MS_);
+        uint64 errors = 0, expect_rank = 0, expect_slow = 0;
+
+        LinkLogStorage storage(dic, Global_ScheduledThread, true);
+        for (auto& key : keys)
+            storage.create_logger(key.service(), key.node(), key.init_time());
+        auto start = Unix_to_now();
+        for (int i = 0; i < logs; ++i) {
+            string text = "log " + to_string(i);
+            LogRank rank = rank_of(i);
+            TimeInterval time = time_of(i);
+            storage.add_log(keys[i % nodes], time, rank, text.data(), text.size());
+            expect_rank += rank >= ERROR && !(time < begin) && !(end < time);
+            expect_slow += i % nodes % 100 >= 95;
+            if (i % 1024 == 0) storage.write_to_file();
+        }
+        for (int n = 0; n < nodes; ++n) {
+            auto& key = keys[n];
+            storage.end_logger(key.service(), key.node(), key.init_time(),
+                               TimeInterval(key.init_time().nanoseconds + n % 100 * MS_));
+        }
+        storage.write_to_file();
+        cout << "保存 " << logs << " 条 " << (Unix_to_now() - start).to_ms() << " 毫秒" << endl;
+
+        start = Unix_to_now();
+        uint64 found = count_query(storage, storage.get_rank_query_set(ERROR, begin, end),
+                                   [] (Link_Log_Header&) { return true; });
+        double index_ms = (Unix_to_now() - start).to_ms();
+        start = Unix_to_now();
+        uint64 scanned = 0;
+        for (int s = 0; s < services; ++s) {
+            scanned += count_query(storage, storage.get_query_set(get_service_id(s, 0)),
+                                   [&] (Link_Log_Header& header) {
+                                       return header.rank() >= ERROR && !(header.time() < begin)
+                                           && !(end < header.time());
+                                   });
+        }
+        double scan_ms = (Unix_to_now() - start).to_ms();
+        cout << "ERROR 日志 " << found << " 条: 等级索引 " << index_ms << " 毫秒, 全部读取 " << scan_ms
+            << " 毫秒, 加速 " << scan_ms / index_ms << " 倍" << endl;
+        errors += found != expect_rank || scanned != expect_rank;
+
+        start = Unix_to_now();
+        auto slow_nodes = storage.find_slow_nodes(slow);
+        vector<Index_Key> slow_keys;
+        for (auto& [key, duration] : slow_nodes) {
+            errors += duration < slow;
+            slow_keys.push_back(key);
+        }
+        found = count_query(storage, storage.get_query_set(slow_keys), [] (Link_Log_Header&) { return true; });
+        index_ms = (Unix_to_now() - start).to_ms();
+        unordered_set<Index_Key> slow_set(slow_keys.begin(), slow_keys.end());
+        start = Unix_to_now();
+        scanned = 0;
+        for (int s = 0; s < services; ++s) {
+            scanned += count_query(storage, storage.get_query_set(get_service_id(s, 0)),
+                                   [&] (Link_Log_Header& header) {
+                                       return (bool) slow_set.count(*(Index_Key *) &header.service());
+                                   });
+        }
+        scan_ms = (Unix_to_now() - start).to_ms();
+        cout << "慢节点 " << slow_keys.size() << " 个, 日志 " << found << " 条: 持续时间索引 " << index_ms
+            << " 毫秒, 全部读取 " << scan_ms << " 毫秒, 加速 " << scan_ms / index_ms << " 倍" << endl;
+        errors += found != expect_slow || scanned != expect_slow;
+
+        /// 查询会把等级缓存全部写入索引，之后写入的日志仍应随时间段推进写入，而不是一直留在内存中。
+        set<tuple<LogRank, int64, Index_Key>> postings;
+        int64 last_bucket = 0;
+        for (int i = logs; i < logs + logs / 8; ++i) {
+            string text = "log " + to_string(i);
+            TimeInterval time(time_of(logs).nanoseconds + (int64) (i - logs) * 100 * US_);
+            storage.add_log(keys[i % nodes], time, rank_of(i), text.data(), text.size());
+            int64 bucket = time.nanoseconds / LinkLogStorage::RANK_INDEX_BUCKET.nanoseconds;
+            postings.emplace(rank_of(i), bucket, keys[i % nodes]);
+            last_bucket = max(last_bucket, bucket);
+            if (i % 1024 == 0) storage.write_to_file();
+        }
+        storage.write_to_file();
+        uint64 recent = 0;
+        for (auto& posting : postings)
+            recent += get<1>(posting) >= last_bucket - 1;
+        uint64 cached = storage.rank_cache_size();
+        cout << "查询之后写入 " << postings.size() << " 个等级索引条目, 仍在内存中 " << cached
+            << " 个, 最近两个时间段 " << recent << " 个" << endl;
+        errors += cached > recent;
+        cout << "errors " << errors << endl;
+    }
+
+    /// 多个线程同时向同一个 LinkLogger 写入日志（共享同一个缓冲区），统计每秒写入的日志条数。
+    void link_log_push_test() {
+        constexpr int lines = 1 << 18;
+        const string dic(GLOBAL_LOG_PATH "/link_log_push");
+        const string text(64, 'x');
+        reset_dictionary(dic);
+        {
+            LinkLogServer server(InetAddress(true, "127.0.0.1", 8900), make_shared<ServerHandler>(), dic);
+            LinkLogger logger(TRACE, get_service_id(0, 0), get_node_id(0, 0), false, 1_min, server);
+            for (int threads : { 1, 2, 4, 8, 16, 32, 64 }) {
+                vector<Thread> workers;
+                for (int t = 0; t < threads; ++t) {
+                    workers.emplace_back([&logger, &text, threads] {
+                        for (int i = 0; i < lines / threads; ++i)
+                            logger.push(INFO, text.data(), text.size());
+                    });
+                }
+                auto start = Unix_to_now();
+                for (auto& worker : workers) worker.start();
+                for (auto& worker : workers) worker.join();
+                double ms = (Unix_to_now() - start).to_ms();
+                cout << threads << " 线程: " << lines / ms * 1000 << " 条/秒" << endl;
+            }
+        }
+        reset_dictionary(dic);
+    }
+
+    class CountingCenter : public CenterHandler {
+    public:
+        /// 多个分区线程同时调用 receive_log
+        atomic<uint64> logs { 0 }, bytes { 0 };
+
+        void receive_log(const Address& address, Link_Log log) override {
+            bytes += log.text.size();
+            ++logs;
+        };
+
+    };
+
+    class LogCounter : public LinkLogSearchHandler {
+    public:
+        uint64 logs = 0;
+
+        void receive_log(Link_Log log) override { ++logs; };
+
+        bool node_filter(Index_Key, Index_Value) override { return true; };
+    };
+
+    /// 先在没有 center 时写入日志，再让 center 连接，统计不同分区数量下 center 每秒接收的日志字节数。
+    void link_log_partition_test() {
+        constexpr int services = 32, lines = 4096;
+        const string server_dic(GLOBAL_LOG_PATH "/link_log_partition_server");
+        const string center_dic(GLOBAL_LOG_PATH "/link_log_partition_center");
+        const string text(200, 'x');
+        uint64 errors = 0;
+        /// 多个分区时日志保存在 center_dic/partition_<i> 中
+        auto reset_center = [&center_dic] {
+            reset_dictionary(center_dic);
+            for (int i = 0; i < 8; ++i)
+                reset_dictionary(center_dic + "/partition_" + to_string(i));
+        };
+        for (uint32 partitions : { 1, 2, 4, 8 }) {
+            reset_dictionary(server_dic);
+            reset_center();
+            auto handler = make_shared<CountingCenter>();
+            LinkLogCenter center(handler, center_dic, Global_ScheduledThread, true, partitions);
+            InetAddress address(true, "127.0.0.1", 8910 + partitions);
+            {
+                LinkLogServer server(address, make_shared<ServerHandler>(), server_dic);
+                vector<unique_ptr<LinkLogger>> loggers;
+                for (int i = 0; i < services; ++i)
+                    loggers.emplace_back(new LinkLogger(TRACE, get_service_id(i, 0), get_node_id(0, 0),
+                                                        false, 10_min, server));
+                for (int i = 0; i < lines; ++i) {
+                    for (auto& logger : loggers)
+                        logger->push(INFO, text.data(), text.size());
+                }
+                sleep(2);
+
+                auto start = Unix_to_now();
+                center.add_server(address);
+                while (handler->logs < services * lines && (Unix_to_now() - start).to_ms() < 60000)
+                    usleep(1000);
+                double ms = (Unix_to_now() - start).to_ms();
+                cout << partitions << " 个分区: 接收 " << handler->logs << " 条 " << ms << " 毫秒, "
+                    << handler->bytes / ms * 1000 / (1 << 20) << " MB/s" << endl;
+                errors += handler->logs != services * lines;
+            }
+            center.flush();
+            LogCounter counter;
+            center.search_logs(INFO, TimeInterval(0), Unix_to_now(), counter);
+            errors += counter.logs != services * lines;
+        }
+        cout << "errors " << errors << endl;
+        reset_dictionary(server_dic);
+        reset_center();
+    }
+
+    /// 日志内容以写入的序号开头，检查 center 按写入顺序收到每一条日志。paused 期间阻塞接收线程。
+    class OrderedCenter : public CenterHandler {
+    public:
+        atomic<bool> paused { false };
+
+        atomic<uint64> logs { 0 }, disorder { 0 };
+
+        void receive_log(const Address& address, Link_Log log) override {
+            while (paused) usleep(1000);
+            uint64 seq = strtoull(log.text.c_str(), nullptr, 10);
+            disorder += seq != logs;
+            ++logs;
+        };
+
+    };
+
+    static uint64 file_bytes(const string& path) {
+        struct stat st {};
+        return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+    }
+
+    /*
+     * 先在没有 center 时写入日志，缓冲区转存到 spill 文件。center 连接后暂停接收，
+     * 输出缓冲区与 socket 被填满，spill 文件的开头已经读回，之后写入的日志追加到文件末尾，超过上限时回绕到开头。
+     * 恢复接收后检查 center 按写入顺序收到每一条日志，spill 文件始终不超过上限。
+     */
+    void link_log_spill_test() {
+        constexpr uint64 limit = 32 << 20, line = 1000;
+        const string server_dic(GLOBAL_LOG_PATH "/link_log_spill_server");
+        const string center_dic(GLOBAL_LOG_PATH "/link_log_spill_center");
+        const string spill_path = server_dic + '/' + LinkLogServer::SPILL_FILE_NAME;
+        reset_dictionary(server_dic);
+        reset_dictionary(center_dic);
+        auto handler = make_shared<OrderedCenter>();
+        LinkLogCenter center(handler, center_dic, Global_ScheduledThread);
+        InetAddress address(true, "127.0.0.1", 8930);
+        uint64 pushed = 0, errors = 0;
+        {
+            LinkLogServer server(address, make_shared<ServerHandler>(), server_dic,
+                                 LinkLogServer::Level2, limit);
+            LinkLogger logger(TRACE, get_service_id(0, 0), get_node_id(0, 0), false, 10_min, server);
+            auto push = [&] (uint64 bytes) {
+                for (uint64 end = pushed + bytes / line; pushed < end;) {
+                    string text = to_string(pushed++);
+                    text.resize(line, ' ');
+                    logger.push(INFO, text.data(), text.size());
+                }
+            };
+            push(limit * 3 / 4);
+            sleep(2);
+            uint64 spilled = file_bytes(spill_path);
+
+            handler->paused = true;
+            center.add_server(address);
+            sleep(2);
+            /// 输出缓冲区（4 MB）中的数据已经从 spill 文件读回，写入的数据超出上限的部分回绕到开头。
+            push(limit / 4 + (2 << 20));
+            sleep(2);
+            uint64 wrapped = file_bytes(spill_path);
+            handler->paused = false;
+
+            auto start = Unix_to_now();
+            while (handler->logs < pushed && (Unix_to_now() - start).to_ms() < 60000)
+                usleep(1000);
+            cout << "转存 " << spilled << " 字节, 回绕后文件 " << wrapped << " 字节 (上限 " << limit
+                << "), 接收 " << handler->logs << " / " << pushed << " 条, 乱序 " << handler->disorder << endl;
+            errors += spilled == 0 || wrapped > limit;
+            errors += handler->logs != pushed || handler->disorder != 0;
+        }
+        cout << "errors " << errors << endl;
+        reset_dictionary(server_dic);
+        reset_dictionary(center_dic);
+    }
+
+    /// 一部分链路包含 ERROR 日志或持续时间较长，其余链路按 10% 采样，检查写入 center 的链路与保留比例。
+    /// 将一条记录交给 sampler，Keep 时记录留给调用者处理，这里直接丢弃。
+    static LinkTraceSampler::Verdict sampler_admit(LinkTraceSampler& sampler, const void *record, uint32 size,
+                                                   LinkTraceSampler::Released& released) {
+        string data((const char *) record, size);
+        RingBufferWrapper buffer(data.data(), data.size());
+        buffer.write_advance(data.size());
+        return sampler.admit(InetAddress(true, "127.0.0.1", 8929), buffer, released);
+    }
+
+    /*
+     * 一条链路因 ERROR 日志保留，另一条因头节点很快结束而丢弃。决定之后持续到达的日志
+     * 跨过多个 buffer_timeout 仍沿用原来的决定；空闲不足 buffer_timeout 时决定还在，
+     * 空闲超过 buffer_timeout 后链路被遗忘，新的日志重新缓存，到期时按超时保留。
+     */
+    static uint64 sampler_lifetime_test() {
+        LinkSamplingPolicy policy;
+        policy.sample_rate = 0;
+        policy.buffer_timeout = 500_ms;
+        LinkTraceSampler sampler(policy);
+        LinkTraceSampler::Released released;
+        auto kept = get_service_id(0, 90), dropped = get_service_id(1, 90);
+        auto node = get_node_id(0, 0);
+        auto now = Unix_to_now();
+        auto create = [&] (const LinkServiceID& service) {
+            Create_Logger logger(Head, service, node, node, now, now);
+            return sampler_admit(sampler, &logger, sizeof(Create_Logger), released);
+        };
+        auto log = [&] (const LinkServiceID& service, LogRank rank) {
+            Link_Log_Header header(0, service, now, node, Unix_to_now(), rank);
+            return sampler_admit(sampler, &header, sizeof(Link_Log_Header), released);
+        };
+
+        uint64 errors = 0;
+        errors += create(kept) != LinkTraceSampler::Hold || create(dropped) != LinkTraceSampler::Hold;
+        errors += log(kept, ERROR) != LinkTraceSampler::Keep;
+        End_Logger end(dropped, node, now, now);
+        errors += sampler_admit(sampler, &end, sizeof(End_Logger), released) != LinkTraceSampler::Drop;
+        released.clear();
+
+        /// 4 个 buffer_timeout 内每 50 ms 到达一条日志
+        for (int i = 0; i < 40; ++i) {
+            usleep(50000);
+            sampler.check_timeout(released);
+            errors += log(kept, INFO) != LinkTraceSampler::Keep;
+            errors += log(dropped, INFO) != LinkTraceSampler::Drop;
+        }
+        usleep(250000);
+        sampler.check_timeout(released);
+        errors += log(kept, INFO) != LinkTraceSampler::Keep;
+        errors += log(dropped, INFO) != LinkTraceSampler::Drop;
+        errors += !released.empty();
+        auto stats = sampler.stats();
+        errors += stats.errored != 1 || stats.dropped != 1 || stats.expired != 0;
+
+        usleep(700000);
+        sampler.check_timeout(released);
+        errors += log(kept, INFO) != LinkTraceSampler::Hold;
+        errors += log(dropped, INFO) != LinkTraceSampler::Hold;
+        usleep(700000);
+        sampler.check_timeout(released);
+        stats = sampler.stats();
+        errors += released.size() != 2 || stats.expired != 2;
+        cout << "采样决定: 错误 " << stats.errored << " 丢弃 " << stats.dropped
+            << " 遗忘后超时 " << stats.expired << endl;
+        return errors;
+    }
+
+    void link_log_sampling_test() {
+        constexpr int traces = 400, lines = 8;
+        const string server_dic(GLOBAL_LOG_PATH "/link_log_sampling_server");
+        const string center_dic(GLOBAL_LOG_PATH "/link_log_sampling_center");
+        const string text(100, 'x');
+        LinkSamplingPolicy policy;
+        policy.sample_rate = 0.1;
+        policy.slow_threshold = 50_ms;
+        auto is_error = [] (int i) { return i % 20 == 0; };
+        auto is_slow = [] (int i) { return i % 50 == 1; };
+        uint64 errors = 0;
+        for (uint32 partitions : { 1, 2 }) {
+            reset_dictionary(server_dic);
+            reset_dictionary(center_dic);
+            for (uint32 i = 0; i < partitions; ++i)
+                reset_dictionary(center_dic + "/partition_" + to_string(i));
+            auto handler = make_shared<CountingCenter>();
+            LinkLogCenter center(handler, center_dic, Global_ScheduledThread, true, partitions, policy);
+            InetAddress address(true, "127.0.0.1", 8920 + partitions);
+            {
+                LinkLogServer server(address, make_shared<ServerHandler>(), server_dic);
+                center.add_server(address);
+                for (int i = 0; i < traces; ++i) {
+                    LinkLogger logger(TRACE, get_service_id(i % 100, i / 100), get_node_id(0, 0),
+                                      false, 1_min, server);
+                    for (int j = 0; j < lines; ++j)
+                        logger.push(INFO, text.data(), text.size());
+                    if (is_error(i)) logger.push(ERROR, text.data(), text.size());
+                    if (is_slow(i)) usleep(60000);
+                }
+                sleep(2);
+            }
+            center.flush();
+
+            uint64 kept = 0, logs = 0;
+            for (int i = 0; i < traces; ++i) {
+                LogCounter counter;
+                center.search_link(get_service_id(i % 100, i / 100), counter);
+                uint64 expect = lines + is_error(i);
+                kept += counter.logs != 0;
+                logs += counter.logs;
+                errors += counter.logs != 0 && counter.logs != expect;
+                errors += (is_error(i) || is_slow(i)) && counter.logs != expect;
+            }
+            auto stats = center.sampling_stats();
+            cout << partitions << " 个分区: 采样 " << stats.sampled << " 错误 " << stats.errored
+                << " 慢链路 " << stats.slow << " 超时 " << stats.expired << " 丢弃 " << stats.dropped
+                << ", 保留比例 " << stats.keep_ratio() << ", 丢弃 " << stats.dropped_bytes << " 字节" << endl;
+            errors += stats.kept() != kept || stats.kept() + stats.dropped != traces;
+            errors += handler->logs != logs;
+        }
+        errors += sampler_lifetime_test();
+        cout << "errors " << errors << endl;
+        reset_dictionary(server_dic);
+        reset_dictionary(center_dic);
+        for (int i = 0; i < 2; ++i)
+            reset_dictionary(center_dic + "/partition_" + to_string(i));
+    }
+
 }
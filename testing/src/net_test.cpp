@@ -5,10 +5,13 @@
 #include "../net_test.hpp"
 
 #include <iostream>
+#include <poll.h>
+#include <sys/resource.h>
 
 #include <tinyBackend/Base/Condition.hpp>
 #include <tinyBackend/Base/File.hpp>
 #include <tinyBackend/Base/GlobalObject.hpp>
+#include <tinyBackend/Base/MPMCQueue.hpp>
 #include <tinyBackend/Base/Thread.hpp>
 #include <tinyBackend/Net/Acceptor.hpp>
 #include <tinyBackend/Net/Channel.hpp>
@@ -246,3 +249,83 @@ void Test::TCP_test() {
     client.join();
     unordered_map<string, string> map;
 }
+
+/// 进程消耗的用户态与内核态 CPU 时间，单位纳秒。
+static int64 cpu_time_ns() {
+    rusage usage {};
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ll
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ll;
+}
+
+/*
+ * 比较 LinkLogServer 发往服务线程的本地消息的两种传递方式：
+ * 每条消息写入 pipe 再由服务线程读出；或者放入进程内的 MPMCQueue，
+ * 只在门铃未响时写 eventfd，服务线程复位门铃后取空队列。
+ * 输出每条消息从放入到取出的平均延迟、进程 CPU 时间与墙钟时间。
+ */
+void Test::doorbell_test() {
+    struct Message {
+        int64 time;
+        char data[24];
+    };
+    constexpr int64 total = 200000;
+
+    for (bool use_doorbell : { false, true }) {
+        PipePair pipe = Socket::create_pipe();
+        Socket doorbell = Socket::create_eventfd();
+        assert(pipe.read.valid() && doorbell.valid());
+        MPMCQueue<Message> queue(1024);
+        atomic<bool> rung { false };
+        int64 latency = 0, received = 0, wakeups = 0;
+
+        Thread consumer([&] {
+            pollfd fd { use_doorbell ? doorbell.fd() : pipe.read.fd(), POLLIN, 0 };
+            while (received < total) {
+                if (::poll(&fd, 1, 500) <= 0) continue;
+                ++wakeups;
+                Message message;
+                if (!use_doorbell) {
+                    /// pipe 中的消息都是完整的，一次最多读出 16 条
+                    Message messages[16];
+                    int64 size = ops::read(pipe.read.fd(), messages, sizeof(messages));
+                    for (int64 i = 0; i < size / (int64) sizeof(Message); ++i, ++received)
+                        latency += Unix_to_now().nanoseconds - messages[i].time;
+                    continue;
+                }
+                uint64 count;
+                ops::read(doorbell.fd(), &count, sizeof(count));
+                rung.store(false, std::memory_order_seq_cst);
+                while (queue.try_take(message)) {
+                    latency += Unix_to_now().nanoseconds - message.time;
+                    ++received;
+                }
+            }
+        });
+
+        int64 cpu_begin = cpu_time_ns();
+        TimeInterval begin = Unix_to_now();
+        consumer.start();
+        for (int64 i = 0; i < total; ++i) {
+            Message message {};
+            message.time = Unix_to_now().nanoseconds;
+            if (!use_doorbell) {
+                ops::write(pipe.write.fd(), &message, sizeof(Message));
+            } else {
+                queue.put(message);
+                if (!rung.exchange(true, std::memory_order_seq_cst)) {
+                    uint64 count = 1;
+                    ops::write(doorbell.fd(), &count, sizeof(count));
+                }
+            }
+            /// 模拟生产者在写日志之间的间隔，让消费者有机会被唤醒
+            if (i % 64 == 0) CurrentThread::yield_this_thread();
+        }
+        consumer.join();
+        int64 wall = (Unix_to_now() - begin).nanoseconds, cpu = cpu_time_ns() - cpu_begin;
+
+        cout << (use_doorbell ? "queue + eventfd" : "pipe") << ": 延迟 " << latency / total
+            << " ns/条, CPU " << cpu / total << " ns/条, 墙钟 " << wall / total
+            << " ns/条, 唤醒 " << wakeups << " 次" << endl;
+    }
+}